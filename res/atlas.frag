@@ -1,17 +1,39 @@
 #version 450
 #extension GL_ARB_separate_shader_objects: enable
 
-layout(binding = 0) uniform sampler2D tex_sampler;
+// Size must match MAX_TEXTURES in api.h
+layout(binding = 0) uniform sampler2D textures[256];
 
 layout(location = 0) in vec2 frag_offset;
 layout(location = 1) in vec2 frag_size;
 layout(location = 2) in vec2 frag_tex_coord;
 layout(location = 3) in vec3 frag_color;
+layout(location = 4) flat in uint frag_texture_index;
+layout(location = 5) flat in uint frag_flags;
+
+// Must match ATLAS_FLAG_* in src/include/shared/atlas_flags.h
+const uint ATLAS_FLAG_SDF  = 1u;
+const uint ATLAS_FLAG_RGBA = 2u;
 
 layout(location = 0) out vec4 out_color;
 
 void main() {
     vec2 v = frag_offset + frag_size*frag_tex_coord;
-    float s = texture(tex_sampler, v).r;
+    vec4 texel = texture(textures[frag_texture_index], v);
+
+    // Sprites, RGBA tinted by the color
+    if ((frag_flags & ATLAS_FLAG_RGBA) != 0u) {
+        out_color = vec4(texel.rgb*frag_color, texel.a);
+        return;
+    }
+
+    float s = texel.r;
+
+    // Distance field, the edge is at 0.5 and is kept about a pixel wide at any scale.
+    // Glyph atlases are sampled bilinear, so the distance is interpolated between texels.
+    float w = max(0.5*fwidth(s), 1e-4);
+    if ((frag_flags & ATLAS_FLAG_SDF) != 0u) {
+        s = smoothstep(0.5 - w, 0.5 + w, s);
+    }
     out_color = vec4(s*frag_color, s);
 }
@@ -11,17 +11,24 @@ layout(push_constant) uniform Constants {
     vec2 offset;
     vec2 size;
     vec3 color;
+    uint texture_index;
+    uint flags;
+    float depth;
 } push;
 
 layout(location = 0) out vec2 frag_offset;
 layout(location = 1) out vec2 frag_size;
 layout(location = 2) out vec2 frag_tex_coord;
 layout(location = 3) out vec3 frag_color;
+layout(location = 4) flat out uint frag_texture_index;
+layout(location = 5) flat out uint frag_flags;
 
 void main() {
-    gl_Position = vec4(push.pos + push.scale * pos, 0.0, 1.0);
+    gl_Position = vec4(push.pos + push.scale * pos, push.depth, 1.0);
     frag_offset = push.offset;
     frag_size = push.size;
     frag_tex_coord = tex_coord;
     frag_color = push.color;
+    frag_texture_index = push.texture_index;
+    frag_flags = push.flags;
 }
@@ -7,6 +7,7 @@ layout(push_constant) uniform Constants {
     vec2 pos;
     vec2 scale;
     vec3 col;
+    float depth;
     vec2 offset;
     vec2 size;
 } push;
@@ -14,6 +15,6 @@ layout(push_constant) uniform Constants {
 layout(location = 0) out vec3 frag_col;
 
 void main() {
-    gl_Position = vec4(push.pos + push.scale * pos, 0.0, 1.0);
+    gl_Position = vec4(push.pos + push.scale * pos, push.depth, 1.0);
     frag_col = push.col;
 }
@@ -0,0 +1,37 @@
+#version 450
+#extension GL_ARB_separate_shader_objects: enable
+
+layout(location = 0) in vec2 pos;
+layout(location = 1) in vec2 tex_coord;
+
+// One quad of a static layer per instance, see LayerInstance
+layout(location = 2) in vec2 instance_pos;
+layout(location = 3) in vec2 instance_scale;
+layout(location = 4) in vec2 instance_offset;
+layout(location = 5) in vec2 instance_size;
+layout(location = 6) in vec3 instance_color;
+layout(location = 7) in uint instance_flags;
+
+// The texture is the same for every instance of a draw, see LayerRun
+layout(push_constant) uniform Constants {
+    vec2 offset;
+    float depth;
+    uint texture_index;
+} push;
+
+layout(location = 0) out vec2 frag_offset;
+layout(location = 1) out vec2 frag_size;
+layout(location = 2) out vec2 frag_tex_coord;
+layout(location = 3) out vec3 frag_color;
+layout(location = 4) flat out uint frag_texture_index;
+layout(location = 5) flat out uint frag_flags;
+
+void main() {
+    gl_Position = vec4(push.offset + instance_pos + instance_scale * pos, push.depth, 1.0);
+    frag_offset = instance_offset;
+    frag_size = instance_size;
+    frag_tex_coord = tex_coord;
+    frag_color = instance_color;
+    frag_texture_index = push.texture_index;
+    frag_flags = instance_flags;
+}
@@ -4,9 +4,11 @@
 layout(location = 0) out vec4 out_color;
 layout(location = 0) in vec3 frag_col;
 layout(location = 1) in vec2 frag_tex_coord;
+layout(location = 2) flat in uint frag_texture_index;
 
-layout(binding = 0) uniform sampler2D tex_sampler;
+// Size must match MAX_TEXTURES in api.h
+layout(binding = 0) uniform sampler2D textures[256];
 
 void main() {
-    out_color = texture(tex_sampler, frag_tex_coord);// vec4(frag_col, 1.0);
+    out_color = texture(textures[frag_texture_index], frag_tex_coord);// vec4(frag_col, 1.0);
 }
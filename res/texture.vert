@@ -8,15 +8,17 @@ layout(push_constant) uniform Constants {
     vec2 pos;
     vec2 scale;
     vec3 col;
-    vec2 offset;
-    vec2 size;
+    uint texture_index;
+    float depth;
 } push;
 
 layout(location = 0) out vec3 frag_col;
 layout(location = 1) out vec2 frag_tex_coord;
+layout(location = 2) flat out uint frag_texture_index;
 
 void main() {
-    gl_Position = vec4(push.pos + push.scale * pos, 0.0, 1.0);
+    gl_Position = vec4(push.pos + push.scale * pos, push.depth, 1.0);
     frag_col = push.col;
     frag_tex_coord = tex_coord;
+    frag_texture_index = push.texture_index;
 }
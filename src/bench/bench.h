@@ -0,0 +1,25 @@
+#pragma once
+
+#include <shared/types.h>
+
+#include <time.h>
+
+/*
+ * Helpers shared by the benchmarks, a fixed seed xorshift so every run
+ * sees the same input, and a monotonic clock.
+ */
+
+static u64 rng_state = 0x9e3779b97f4a7c15ull;
+
+static u32 rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (u32) rng_state;
+}
+
+static f64 now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
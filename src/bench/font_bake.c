@@ -0,0 +1,98 @@
+/*
+ * Times font_bake() on one thread against one per core, baking the
+ * ASCII atlases of a handful of faces at several sizes, as coverage
+ * and as distance fields, with the font cache off. Build with make
+ * bench, run from the repository root or the build directory so
+ * res/fonts is found.
+ */
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <shared/types.h>
+#include <shared/api.h>
+#include <shared/sdf.h>
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "../loader/platform/unix.c"
+#include "../loader/font_baker.c"
+
+#define RUNS 3
+
+static const char *fonts[] = {
+    "res/fonts/lmmono12-regular.otf",
+    "res/fonts/lmroman12-regular.otf",
+    "res/fonts/lmroman12-italic.otf",
+    "res/fonts/lmsans12-regular.otf",
+};
+static const u32 sizes[] = {16, 32, 60};
+static const u32 spreads[] = {0, 4};
+
+#define NUM_BAKES (ARRLEN(fonts)*ARRLEN(sizes)*ARRLEN(spreads))
+
+static void setup_bakes(FontBake *bakes) {
+    u32 b = 0;
+    for (u32 f = 0; f < ARRLEN(fonts); ++f) {
+        for (u32 s = 0; s < ARRLEN(sizes); ++s) {
+            for (u32 d = 0; d < ARRLEN(spreads); ++d) {
+                bakes[b++] = (FontBake) {
+                    .path = fonts[f],
+                    .pixel_size = sizes[s],
+                    .sdf_spread = spreads[d],
+                    .no_cache = true,
+                };
+            }
+        }
+    }
+}
+
+/* Best time over RUNS in ms, or a negative number if a bake failed */
+static f64 time_bakes(u32 thread_count) {
+    FontBake bakes[NUM_BAKES];
+    f64 best = 1e30;
+    for (u32 run = 0; run < RUNS; ++run) {
+        /* font_bake_release() clears the input along with the output */
+        setup_bakes(bakes);
+
+        const Time start = platformTimeCurrent();
+        const bool ok = font_bake(bakes, NUM_BAKES, thread_count);
+        const u64 ns = platformTimeToNanoseconds(platformTimeSubtract(platformTimeCurrent(), start));
+        for (u32 b = 0; b < NUM_BAKES; ++b) {
+            font_bake_release(&bakes[b]);
+        }
+        if (!ok) {
+            return -1.0;
+        }
+        best = MIN(best, ns/1e6);
+    }
+    return best;
+}
+
+int main() {
+    platformFileSetSearchDir(sdsnew("."));
+    const u32 cores = MAX(platformProcessorCount(), 1);
+
+    printf("%u atlases (%u faces, %u sizes, coverage and distance field), %u cores, best of %u runs\n\n",
+           (u32) NUM_BAKES, (u32) ARRLEN(fonts), (u32) ARRLEN(sizes), cores, RUNS);
+
+    f64 single = 0.0;
+    for (u32 threads = 1;; threads = MIN(2*threads, cores)) {
+        const f64 ms = time_bakes(threads);
+        if (ms < 0.0) {
+            printf("bake failed on %u threads\n", threads);
+            return 1;
+        }
+        if (threads == 1) {
+            single = ms;
+        }
+        printf("%2u threads %10.2f ms  %5.2fx\n", threads, ms, single/ms);
+
+        if (threads == cores) {
+            break;
+        }
+    }
+
+    return 0;
+}
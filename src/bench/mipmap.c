@@ -0,0 +1,106 @@
+/*
+ * Throughput of the mipmap kernels, scalar against SSE2 and AVX2, for
+ * the box and Kaiser filters on R8 and RGBA8 with and without gamma
+ * correction. Every SIMD result is checked against the scalar one.
+ * Build with make bench.
+ */
+
+#include <shared/types.h>
+#include <shared/mipmap.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#define IMAGE_SIZE 2048
+#define RUNS       5
+
+static bool isa_supported(MipmapIsa isa) {
+#if MIPMAP_X86
+    return isa == MIPMAP_ISA_SCALAR ||
+           (isa == MIPMAP_ISA_SSE2 && __builtin_cpu_supports("sse2")) ||
+           (isa == MIPMAP_ISA_AVX2 && __builtin_cpu_supports("avx2"));
+#else
+    return isa == MIPMAP_ISA_SCALAR;
+#endif
+}
+
+/* Largest difference between two results, the box filter has to match exactly */
+static u32 max_difference(const u8 *a, const u8 *b, u64 size) {
+    u32 diff = 0;
+    for (u64 i = 0; i < size; ++i) {
+        diff = MAX(diff, (u32) abs(a[i] - b[i]));
+    }
+    return diff;
+}
+
+int main(void) {
+    static const char *isa_names[] = {"scalar", "sse2", "avx2"};
+    static const char *filter_names[] = {"box", "kaiser"};
+
+    mipmap_init();
+
+    /* Odd sizes so the scalar tails are exercised too */
+    const u32 width = IMAGE_SIZE + 3;
+    const u32 height = IMAGE_SIZE + 1;
+    const u64 src_size = (u64) width*height*4;
+    u8 *src = malloc(src_size);
+    /* Smooth gradients with noise, closer to a real image than pure noise */
+    for (u32 y = 0; y < height; ++y) {
+        for (u32 x = 0; x < width*4; ++x) {
+            src[(u64) y*width*4 + x] = (u8) ((x/4 + y + (x % 4)*64 + (rng_next() & 15)) & 0xff);
+        }
+    }
+
+    const u64 dst_size = (u64) image_mip_extent(width, 1)*image_mip_extent(height, 1)*4;
+    u8 *reference = malloc(dst_size);
+    u8 *dst = malloc(dst_size);
+    void *scratch = malloc(mipmap_scratch_size(width, height, 4, MIPMAP_FILTER_KAISER));
+
+    printf("%ux%u source, best of %u runs\n", width, height, RUNS);
+    printf("%-7s %-8s %-7s %-7s %10s %10s\n", "filter", "format", "gamma", "isa", "ms", "MB/s");
+
+    bool ok = true;
+    for (u32 filter = MIPMAP_FILTER_BOX; filter <= MIPMAP_FILTER_KAISER; ++filter) {
+        for (u32 channels = 1; channels <= 4; channels += 3) {
+            for (u32 flags = 0; flags <= MIPMAP_SRGB; ++flags) {
+                for (u32 isa = MIPMAP_ISA_SCALAR; isa <= MIPMAP_ISA_AVX2; ++isa) {
+                    if (!isa_supported(isa)) {
+                        continue;
+                    }
+                    /* The sRGB box filter has no SSE2 kernel, that would just time scalar again */
+                    if (filter == MIPMAP_FILTER_BOX && mipmap_box_isa(isa, flags & MIPMAP_SRGB) != isa) {
+                        continue;
+                    }
+
+                    f64 best = 1e9;
+                    for (u32 run = 0; run < RUNS; ++run) {
+                        const f64 start = now_seconds();
+                        mipmap_downsample_isa(src, width, height, dst, channels, filter, flags, scratch, isa);
+                        best = MIN(best, now_seconds() - start);
+                    }
+
+                    const u64 size = dst_size/4*channels;
+                    if (isa == MIPMAP_ISA_SCALAR) {
+                        memcpy(reference, dst, size);
+                    }
+                    const u32 diff = max_difference(reference, dst, size);
+                    const u32 tolerance = (filter == MIPMAP_FILTER_BOX) ? 0 : 1;
+
+                    const f64 megabytes = (f64) width*height*channels/(1024.0*1024.0);
+                    printf("%-7s %-8s %-7s %-7s %10.2f %10.0f%s\n", filter_names[filter], (channels == 1) ? "r8" : "rgba8",
+                           (flags & MIPMAP_SRGB) ? "srgb" : "linear", isa_names[isa], best*1e3, megabytes/best,
+                           (diff > tolerance) ? "  MISMATCH" : "");
+                    ok = ok && diff <= tolerance;
+                }
+            }
+        }
+    }
+
+    free(scratch);
+    free(dst);
+    free(reference);
+    free(src);
+    return (ok) ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+/*
+ * Compares pack_rectangles() against the online skyline packer on 10k
+ * random rectangles, packing time and occupancy (packed area over the
+ * area of the atlas up to the highest rectangle). Build with make bench.
+ */
+
+#include <shared/types.h>
+#include <shared/pack_rectangles.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#define NUM_RECTS    10000
+#define ATLAS_WIDTH  1024
+#define ATLAS_HEIGHT (1 << 20)
+#define RUNS         5
+
+static void generate_rects(PackRect *rects, u32 count) {
+    for (u32 i = 0; i < count; ++i) {
+        rects[i] = (PackRect) {
+            .width = 8 + rng_next() % 57,
+            .height = 8 + rng_next() % 57,
+            .user_id = i,
+        };
+    }
+}
+
+static f64 occupancy(PackRect *rects, u32 count) {
+    u64 area = 0;
+    u32 top = 0;
+    for (u32 i = 0; i < count; ++i) {
+        area += (u64) rects[i].width*rects[i].height;
+        top = MAX(top, rects[i].y + rects[i].height);
+    }
+    return (top > 0) ? (f64) area/((f64) ATLAS_WIDTH*top) : 0.0;
+}
+
+/* Fails loudly if two rectangles overlap, sorted by x and swept */
+static int compare_x(const void *a, const void *b) {
+    const PackRect *ra = a, *rb = b;
+    return (ra->x > rb->x) - (ra->x < rb->x);
+}
+
+static bool check_overlaps(PackRect *rects, u32 count) {
+    PackRect *sorted = malloc(count*sizeof(PackRect));
+    memcpy(sorted, rects, count*sizeof(PackRect));
+    qsort(sorted, count, sizeof(PackRect), compare_x);
+    for (u32 i = 0; i < count; ++i) {
+        for (u32 j = i + 1; j < count && sorted[j].x < sorted[i].x + sorted[i].width; ++j) {
+            if (sorted[j].y < sorted[i].y + sorted[i].height && sorted[i].y < sorted[j].y + sorted[j].height) {
+                free(sorted);
+                return false;
+            }
+        }
+    }
+    free(sorted);
+    return true;
+}
+
+static void report(const char *name, f64 seconds, PackRect *rects, u32 count) {
+    printf("%-28s %8.3f ms  occupancy %5.1f%%  %s\n", name, seconds*1e3,
+           100.0*occupancy(rects, count), check_overlaps(rects, count) ? "ok" : "OVERLAP");
+}
+
+static f64 bench_batch(const PackRect *input, PackRect *rects) {
+    static PackNode nodes[NUM_RECTS + 2];
+    f64 best = 1e9;
+    for (u32 run = 0; run < RUNS; ++run) {
+        memcpy(rects, input, NUM_RECTS*sizeof(PackRect));
+        PackContext context = {
+            .width = ATLAS_WIDTH,
+            .height = ATLAS_HEIGHT,
+            .num_nodes = NUM_RECTS + 2,
+            .nodes = nodes,
+        };
+        f64 start = now_seconds();
+        pack_rectangles(&context, rects, NUM_RECTS);
+        best = MIN(best, now_seconds() - start);
+    }
+    return best;
+}
+
+static PackSkylineNode skyline_nodes[2*NUM_RECTS + 1];
+static PackFreeRect free_rects[4*NUM_RECTS];
+
+static f64 bench_skyline(const PackRect *input, PackRect *rects, bool sort) {
+    f64 best = 1e9;
+    for (u32 run = 0; run < RUNS; ++run) {
+        memcpy(rects, input, NUM_RECTS*sizeof(PackRect));
+        PackSkyline packer;
+        f64 start = now_seconds();
+        if (sort) {
+            quicksort(rects, sizeof(PackRect), NUM_RECTS, compare_pack_rects);
+        }
+        pack_skyline_init(&packer, ATLAS_WIDTH, ATLAS_HEIGHT,
+                          skyline_nodes, ARRLEN(skyline_nodes), free_rects, ARRLEN(free_rects), 8);
+        for (u32 i = 0; i < NUM_RECTS; ++i) {
+            if (!pack_skyline_insert(&packer, &rects[i])) {
+                printf("skyline: failed to pack %u\n", i);
+                exit(1);
+            }
+        }
+        best = MIN(best, now_seconds() - start);
+    }
+    return best;
+}
+
+/* Removes and reinserts random rectangles, as a glyph atlas would under eviction */
+static f64 bench_churn(const PackRect *input, PackRect *rects) {
+    PackSkyline packer;
+    memcpy(rects, input, NUM_RECTS*sizeof(PackRect));
+    pack_skyline_init(&packer, ATLAS_WIDTH, ATLAS_HEIGHT,
+                      skyline_nodes, ARRLEN(skyline_nodes), free_rects, ARRLEN(free_rects), 8);
+    for (u32 i = 0; i < NUM_RECTS; ++i) {
+        pack_skyline_insert(&packer, &rects[i]);
+    }
+
+    f64 start = now_seconds();
+    for (u32 i = 0; i < NUM_RECTS; ++i) {
+        PackRect *rect = &rects[rng_next() % NUM_RECTS];
+        pack_skyline_remove(&packer, rect);
+        rect->width = 8 + rng_next() % 57;
+        rect->height = 8 + rng_next() % 57;
+        if (!pack_skyline_insert(&packer, rect)) {
+            printf("churn: failed to pack %u\n", i);
+            exit(1);
+        }
+    }
+    return now_seconds() - start;
+}
+
+int main(void) {
+    static PackRect input[NUM_RECTS];
+    static PackRect rects[NUM_RECTS];
+    generate_rects(input, NUM_RECTS);
+
+    printf("%u rectangles, 8-64 px, atlas %u px wide, best of %u runs\n\n", NUM_RECTS, ATLAS_WIDTH, RUNS);
+
+    report("pack_rectangles (batch)", bench_batch(input, rects), rects, NUM_RECTS);
+    report("skyline, sorted by height", bench_skyline(input, rects, true), rects, NUM_RECTS);
+    report("skyline, unsorted", bench_skyline(input, rects, false), rects, NUM_RECTS);
+    report("skyline, 10k remove+insert", bench_churn(input, rects), rects, NUM_RECTS);
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Texture cooker
+ *
+ * Decodes a source image (anything stb_image reads) once, offline, and
+ * writes it in the cooked format of shared/texture_file.h with a full
+ * mip chain, so the game only has to map the file at runtime.
+ *
+ *   cooker [--linear] [--no-mips] [--kaiser] <input> <output>
+ *
+ * Grey images are cooked to 1 channel, everything else to RGBA. Colors
+ * are treated as sRGB unless --linear is given, mips of sRGB images are
+ * averaged in linear space. Alpha is always linear. Mips are box
+ * filtered, --kaiser trades cooking time for sharper, less aliased mips
+ * (see shared/mipmap.h).
+ */
+
+#include <shared/types.h>
+#include <shared/texture_file.h>
+#include <shared/mipmap.h>
+
+/* libc */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../game/stb_image.h"
+
+int main(int argc, char **argv) {
+    bool is_linear = false;
+    bool mips = true;
+    MipmapFilter filter = MIPMAP_FILTER_BOX;
+    const char *paths[2];
+    u32 path_count = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--linear") == 0) {
+            is_linear = true;
+        } else if (strcmp(argv[i], "--no-mips") == 0) {
+            mips = false;
+        } else if (strcmp(argv[i], "--kaiser") == 0) {
+            filter = MIPMAP_FILTER_KAISER;
+        } else if (path_count < 2) {
+            paths[path_count++] = argv[i];
+        } else {
+            path_count = 0;
+            break;
+        }
+    }
+    if (path_count != 2) {
+        fprintf(stderr, "usage: %s [--linear] [--no-mips] [--kaiser] <input> <output>\n", argv[0]);
+        return 1;
+    }
+
+    int width, height, file_channels;
+    if (!stbi_info(paths[0], &width, &height, &file_channels)) {
+        fprintf(stderr, "%s: %s\n", paths[0], stbi_failure_reason());
+        return 1;
+    }
+    const u32 channels = (file_channels == 1) ? 1 : 4;
+    u8 *pixels = stbi_load(paths[0], &width, &height, &file_channels, channels);
+    if (!pixels) {
+        fprintf(stderr, "%s: %s\n", paths[0], stbi_failure_reason());
+        return 1;
+    }
+
+    Image image = {
+        .width = width,
+        .height = height,
+        .channels = channels,
+        .mip_count = (mips) ? mipmap_full_count(width, height) : 1,
+        .is_linear = is_linear,
+    };
+    const u64 data_size = image_size(&image);
+    image.pixels = malloc(data_size);
+    if (!image.pixels) {
+        fprintf(stderr, "%s: out of memory for %llu bytes\n", paths[0], (unsigned long long) data_size);
+        stbi_image_free(pixels);
+        return 1;
+    }
+    memcpy(image.pixels, pixels, image_mip_size(&image, 0));
+    stbi_image_free(pixels);
+
+    const u64 scratch_size = mipmap_scratch_size(image.width, image.height, channels, filter) + 1;
+    void *scratch = malloc(scratch_size);
+    if (!scratch) {
+        fprintf(stderr, "%s: out of memory for %llu bytes\n", paths[0], (unsigned long long) scratch_size);
+        free(image.pixels);
+        return 1;
+    }
+    mipmap_generate(&image, filter, scratch);
+    free(scratch);
+
+    TextureFileHeader header = {
+        .magic = TEXTURE_FILE_MAGIC,
+        .version = TEXTURE_FILE_VERSION,
+        .width = image.width,
+        .height = image.height,
+        .channels = image.channels,
+        .mip_count = image.mip_count,
+        .flags = (is_linear) ? TEXTURE_FILE_LINEAR : 0,
+        .data_offset = (sizeof(TextureFileHeader) + 15) & ~15u,
+        .data_size = data_size,
+    };
+    const u8 padding[16] = {0};
+
+    FILE *out = fopen(paths[1], "wb");
+    if (!out) {
+        perror(paths[1]);
+        return 1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(padding, header.data_offset - sizeof(header), 1, out) <= 1 &&
+              fwrite(image.pixels, data_size, 1, out) == 1;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok) {
+        perror(paths[1]);
+        remove(paths[1]);
+        return 1;
+    }
+
+    printf("%s: %ux%u, %u channels, %u mips, %s, %llu bytes\n", paths[1], image.width, image.height,
+           image.channels, image.mip_count, (is_linear) ? "linear" : "sRGB", (unsigned long long) data_size);
+
+    free(image.pixels);
+    return 0;
+}
@@ -31,6 +31,52 @@ void pre_update(f32 t, DebugMemory *memory, Input *input, RenderCommands *frame)
         }
     }
 
+    /* Cycle latency modes, once per press */
+    const bool is_latency_key_down = input->active[DEBUG_INPUT_LATENCY_NEXT];
+    if (is_latency_key_down && !memory->was_latency_key_down && memory->render_settings) {
+        RenderSettings *settings = memory->render_settings;
+        settings->latency_mode = (settings->latency_mode + 1) % LATENCY_MODE_COUNT;
+        memory->platform.log(LOG_INFO, "Latency mode: %s", latency_mode_names[settings->latency_mode]);
+    }
+    memory->was_latency_key_down = is_latency_key_down;
+
+    /* Cycle renderer backends, the loader swaps modules after the frame */
+    const bool is_renderer_key_down = input->active[DEBUG_INPUT_RENDERER_NEXT];
+    if (is_renderer_key_down && !memory->was_renderer_key_down && memory->render_settings) {
+        RenderSettings *settings = memory->render_settings;
+        settings->backend = (settings->backend + 1) % RENDERER_BACKEND_COUNT;
+        memory->platform.log(LOG_INFO, "Renderer: %s", renderer_backend_names[settings->backend]);
+    }
+    memory->was_renderer_key_down = is_renderer_key_down;
+
+    /*
+     * Pause the game, the overlay stops drawing per frame values too so
+     * frames stay the same and the renderer can submit them as is. How
+     * often it did is logged on resume.
+     */
+    const bool is_pause_key_down = input->active[DEBUG_INPUT_PAUSE];
+    GameMemory *game = memory->active_game_memory;
+    if (is_pause_key_down && !memory->was_pause_key_down && game) {
+        game->paused = !game->paused;
+    }
+    memory->was_pause_key_down = is_pause_key_down;
+
+    /* The game may start out paused too */
+    const bool is_paused = game && game->paused;
+    FrameProfile *profile = memory->profile;
+    if (is_paused && !memory->was_paused) {
+        memory->platform.log(LOG_INFO, "Paused (7 to resume)");
+        memory->paused_frame = memory->frame_info->total_frame_count;
+        memory->paused_reused_count = (profile) ? profile->reused_count : 0;
+        memory->paused_record_saved_ns = (profile) ? profile->record_saved_ns : 0;
+    } else if (!is_paused && memory->was_paused && profile) {
+        memory->platform.log(LOG_INFO, "Resumed after %llu frames, %llu submitted without recording (%.2f ms of recording saved)",
+                             (unsigned long long) (memory->frame_info->total_frame_count - memory->paused_frame),
+                             (unsigned long long) (profile->reused_count - memory->paused_reused_count),
+                             (profile->record_saved_ns - memory->paused_record_saved_ns)/1e6);
+    }
+    memory->was_paused = is_paused;
+
     /* Handle recording of input */
     if (!memory->is_record_file_open && (memory->record_state == RECORDING ||
                                          memory->record_state == REPLAYING)) {
@@ -73,7 +119,58 @@ void pre_update(f32 t, DebugMemory *memory, Input *input, RenderCommands *frame)
     }
 }
 
+static inline f64 ms(u64 ns) {
+    return ns/1000000.0;
+}
+
+/*
+ * CPU phases of the last frame next to the GPU passes of the latest
+ * frame the GPU finished. Whichever side is busier is the bottleneck,
+ * the time the renderer spent waiting on fences isn't CPU work.
+ */
+static void draw_profile(FrameProfile *profile, RenderCommands *frame) {
+    u64 cpu_total = 0;
+    for (u32 i = 0; i < PROFILE_CPU_COUNT; ++i) {
+        cpu_total += profile->cpu_ns[i];
+    }
+    const u64 cpu_busy = cpu_total - MIN(profile->cpu_wait_ns, cpu_total);
+
+    pushTextFmt(frame, VEC2(-0.9f, -0.7f), RGB(0,0,0), "cpu %.2f ms: input %.2f debug %.2f update %.2f render %.2f (wait %.2f)",
+                ms(cpu_total), ms(profile->cpu_ns[PROFILE_CPU_INPUT]), ms(profile->cpu_ns[PROFILE_CPU_DEBUG]),
+                ms(profile->cpu_ns[PROFILE_CPU_UPDATE]), ms(profile->cpu_ns[PROFILE_CPU_RENDER]), ms(profile->cpu_wait_ns));
+
+    pushTextFmt(frame, VEC2(-0.9f, -0.4f), RGB(0,0,0), "latency %.2f ms (avg %.2f), %u drawn, %u culled",
+                ms(profile->latency_ns), ms(profile->latency_average_ns), profile->drawn_count, profile->culled_count);
+    pushTextFmt(frame, VEC2(-0.9f, -0.1f), RGB(0,0,0), "record %.2f ms, %llu frames reused (%.2f ms saved)",
+                ms(profile->record_ns), (unsigned long long) profile->reused_count, ms(profile->record_saved_ns));
+
+    if (!profile->gpu_available) {
+        pushText(frame, VEC2(-0.9f, -0.6f), RGB(0,0,0), "gpu n/a");
+        return;
+    }
+    const u64 *gpu = profile->gpu_ns;
+    pushTextFmt(frame, VEC2(-0.9f, -0.6f), RGB(0,0,0), "gpu %.2f ms: upload %.2f pass %.2f (color %.2f texture %.2f atlas %.2f layer %.2f) %llu late",
+                ms(gpu[PROFILE_GPU_FRAME]), ms(gpu[PROFILE_GPU_UPLOAD]), ms(gpu[PROFILE_GPU_RENDER_PASS]),
+                ms(gpu[PROFILE_GPU_COLOR]), ms(gpu[PROFILE_GPU_TEXTURE]), ms(gpu[PROFILE_GPU_ATLAS]), ms(gpu[PROFILE_GPU_LAYER]),
+                (unsigned long long) (profile->cpu_frame - profile->gpu_frame));
+    pushText(frame, VEC2(-0.9f, -0.5f), RGB(0,0,0), (gpu[PROFILE_GPU_FRAME] > cpu_busy) ? "gpu-bound" : "cpu-bound");
+}
+
 void post_update(f32 t, DebugMemory *memory, Input *input, RenderCommands *frame) {
     pushText(frame, VEC2(0,0), RGB(0,0,0), "wow!!!! :)");
-    pushText(frame, VEC2(-0.9f,-0.8f), RGB(0,0,0), "wow!!!! :)");
+    if (memory->active_game_memory && memory->active_game_memory->paused) {
+        pushText(frame, VEC2(-0.9f,-0.8f), RGB(0,0,0), "paused (7 to resume)");
+    } else {
+        pushTextFmt(frame, VEC2(-0.9f,-0.8f), RGB(0,0,0), "frame %llu dt %.4f (7 to pause)",
+                    (unsigned long long) memory->frame_info->total_frame_count, t);
+        if (memory->profile) {
+            draw_profile(memory->profile, frame);
+        }
+    }
+    if (memory->render_settings) {
+        pushTextFmt(frame, VEC2(-0.9f, -0.3f), RGB(0,0,0), "latency mode %s (5 to change)",
+                    latency_mode_names[memory->render_settings->latency_mode]);
+        pushTextFmt(frame, VEC2(-0.9f, -0.2f), RGB(0,0,0), "renderer %s (6 to change)",
+                    renderer_backend_names[memory->render_settings->backend]);
+    }
 }
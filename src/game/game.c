@@ -1,6 +1,8 @@
 #include <shared/api.h>
 #include <shared/types.h>
 #include <shared/input.h>
+#include <shared/sprite_atlas.h>
+#include <shared/texture_file.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -11,29 +13,110 @@ static void load_image(GameMemory *memory, const char *file, Image *image) {
         memory->platform.log(LOG_ERROR, "stb_image: failed to load %s!", file);
         return;
     }
-    // WARNING: not freeing
-    //stbi_image_free(pixels);
+    /* stbi_load reports the channels in the file, not the ones we asked for */
+    image->channels = 4;
 }
 
-void update(f32 t, GameMemory *memory, Input *input, RenderCommands *frame) {
-    memory->col.h += 100.f*t;
-    memory->col.s = 0.9f;
-    memory->col.l = 0.2f;
-    wrapHSL(&memory->col);
+/*
+ * Loads an image straight into the sprite atlas. The cooked .tex next
+ * to the source image (see src/cooker) is used if there is one, it only
+ * has to be mapped instead of decoded.
+ */
+static bool load_sprite(GameMemory *memory, const char *file, Sprite *sprite) {
+    char cooked_path[256];
+    const char *extension = strrchr(file, '.');
+    const int stem_length = (extension) ? (int) (extension - file) : (int) strlen(file);
+    format_string(cooked_path, sizeof(cooked_path), "%.*s.tex", stem_length, file);
+
+    u64 size = 0;
+    u8 *cooked = memory->platform.file_map(cooked_path, &size);
+    if (cooked) {
+        Image image;
+        if (!texture_file_image(cooked, size, &image)) {
+            memory->platform.log(LOG_WARNING, "%s is not a valid cooked texture", cooked_path);
+        } else if (image.mip_count > 1 && sprite_atlas_add_texture(memory->sprites, &image, sprite)) {
+            /* Uploaded straight from the mapping with the cooked mips, it stays mapped */
+            return true;
+        } else if (sprite_atlas_add(memory->sprites, &memory->platform, &image, sprite)) {
+            memory->platform.file_unmap(cooked, size);
+            return true;
+        }
+        memory->platform.file_unmap(cooked, size);
+    }
+
+    Image image = {0};
+    load_image(memory, file, &image);
+    if (!image.pixels) {
+        return false;
+    }
+    bool ok = sprite_atlas_add(memory->sprites, &memory->platform, &image, sprite);
+    stbi_image_free(image.pixels);
+    return ok;
+}
+
+static void load_sprites(GameMemory *memory) {
+    memory->sprites = memory->platform.allocate_memory(sizeof(SpriteAtlas));
+    sprite_atlas_init(memory->sprites, 1024, 4);
+
+    load_sprite(memory, "res/textures/head.jpg", &memory->head);
+
+    sprite_atlas_commit(memory->sprites, memory->textures);
+}
 
-    if (input->active[INPUT_MOVE_LEFT]) {
-        memory->pos.x -= 0.01f;
+#define BACKGROUND_TILES_X 16
+#define BACKGROUND_TILES_Y 12
+
+/* The checkered background never changes, it's built once as a layer */
+static void build_background(GameMemory *memory) {
+    if (!memory->layers) {
+        return;
+    }
+    const u32 size = BACKGROUND_TILES_X*BACKGROUND_TILES_Y*sizeof(RenderEntryQuad);
+    RenderCommands layer = layerBegin(memory->platform.allocate_memory(size), size);
+
+    const Vec2 tile = VEC2(2.0f/BACKGROUND_TILES_X, 2.0f/BACKGROUND_TILES_Y);
+    for (u32 y = 0; y < BACKGROUND_TILES_Y; ++y) {
+        for (u32 x = 0; x < BACKGROUND_TILES_X; ++x) {
+            const f32 shade = ((x + y) % 2 == 0) ? 0.92f : 0.85f;
+            pushQuad(&layer, VEC2(-1.0f + x*tile.x, -1.0f + y*tile.y), tile, RGB(shade, shade, shade));
+        }
     }
-    if (input->active[INPUT_MOVE_RIGHT]) {
-        memory->pos.x += 0.01f;
+
+    memory->background = layerRegister(memory->layers, &layer);
+    if (memory->background == LAYER_HANDLE_NONE) {
+        memory->platform.log(LOG_WARNING, "No free layer slot for the background");
+        memory->platform.free_memory(layer.memory_base);
     }
-    if (input->active[INPUT_MOVE_UP]) {
-        memory->pos.y -= 0.01f;
+}
+
+void update(f32 t, GameMemory *memory, Input *input, RenderCommands *frame) {
+    if (!memory->sprites) {
+        load_sprites(memory);
+        build_background(memory);
     }
-    if (input->active[INPUT_MOVE_DOWN]) {
-        memory->pos.y += 0.01f;
+
+    memory->col.s = 0.9f;
+    memory->col.l = 0.2f;
+    if (!memory->paused) {
+        memory->col.h += 100.f*t;
+        wrapHSL(&memory->col);
+
+        if (input->active[INPUT_MOVE_LEFT]) {
+            memory->pos.x -= 0.01f;
+        }
+        if (input->active[INPUT_MOVE_RIGHT]) {
+            memory->pos.x += 0.01f;
+        }
+        if (input->active[INPUT_MOVE_UP]) {
+            memory->pos.y -= 0.01f;
+        }
+        if (input->active[INPUT_MOVE_DOWN]) {
+            memory->pos.y += 0.01f;
+        }
     }
 
+    pushLayer(frame, memory->background, VEC2(0.0f, 0.0f));
     pushQuad(frame, VEC2(0,0), VEC2(1.0f, 0.05f), convertHSLToRGB(memory->col));
     pushQuad(frame, memory->pos, VEC2(0.25f, 0.2f), convertHSLToRGB(memory->col));
+    pushSprite(frame, memory->sprites, VEC2(0.6f, -0.9f), VEC2(0.3f, 0.4f), memory->head, RGB(1, 1, 1));
 }
@@ -4,6 +4,7 @@
 #include <shared/math.h>
 #include <shared/color.h>
 #include <shared/pack_rectangles.h>
+#include <shared/format.h>
 #include <third_party/sds.h>
 
 //#include <ft2build.h>
@@ -28,6 +29,125 @@ typedef struct FrameInfo {
     Time desired_time;
 } FrameInfo;
 
+/*
+ * Frame profile
+ *
+ * Owned by the loader, which times the CPU phases of every frame. The
+ * renderer adds GPU pass times read from timestamp queries, those only
+ * arrive once the GPU is done with a frame, so gpu_frame lags behind
+ * cpu_frame by a frame or two. Times are in nanoseconds.
+ */
+
+typedef enum ProfileCpuPhase {
+    PROFILE_CPU_INPUT,
+    PROFILE_CPU_DEBUG,
+    PROFILE_CPU_UPDATE,
+    PROFILE_CPU_RENDER,
+    PROFILE_CPU_COUNT,
+} ProfileCpuPhase;
+
+typedef enum ProfileGpuPass {
+    PROFILE_GPU_FRAME,       /* the whole command buffer */
+    PROFILE_GPU_UPLOAD,      /* glyph uploads ahead of the render pass */
+    PROFILE_GPU_RENDER_PASS,
+    /* Pipeline batches within the render pass */
+    PROFILE_GPU_COLOR,
+    PROFILE_GPU_TEXTURE,
+    PROFILE_GPU_ATLAS,
+    PROFILE_GPU_LAYER,
+    PROFILE_GPU_COUNT,
+} ProfileGpuPass;
+
+typedef struct FrameProfile {
+    u64 cpu_frame;
+    u64 cpu_ns[PROFILE_CPU_COUNT];
+    /* Part of PROFILE_CPU_RENDER spent waiting on the GPU for a free frame */
+    u64 cpu_wait_ns;
+
+    /*
+     * From the start of a frame on the CPU until it's rendered and ready
+     * to present, the last one measured and a running average. Time
+     * spent queued for scanout isn't visible to us.
+     */
+    u64 latency_ns;
+    u64 latency_average_ns;
+
+    /* Entries recorded and entries dropped by culling last frame */
+    u32 drawn_count;
+    u32 culled_count;
+
+    /*
+     * Time spent recording command buffers last frame, 0 if an unchanged
+     * frame's commands were submitted again. reused_count and
+     * record_saved_ns add up the frames that were, and what recording
+     * them took the last time.
+     */
+    u64 record_ns;
+    u64 reused_count;
+    u64 record_saved_ns;
+
+    /* False if the device can't write timestamps */
+    bool gpu_available;
+    u64 gpu_frame;
+    u64 gpu_ns[PROFILE_GPU_COUNT];
+} FrameProfile;
+
+/*
+ * Latency modes trade input to display latency against throughput
+ *
+ *   balanced      2 frames in flight, MAILBOX or FIFO
+ *   low latency   1 frame in flight, MAILBOX or IMMEDIATE or FIFO
+ *   throughput    3 frames in flight, MAILBOX or FIFO
+ *   power saving  2 frames in flight, FIFO, renders at most at the refresh rate
+ *
+ * Present modes are tried in order, FIFO is always supported. The mode
+ * can be changed at any time, the renderer picks it up on the next
+ * frame at the cost of a GPU idle and a new swapchain.
+ */
+
+typedef enum LatencyMode {
+    LATENCY_BALANCED = 0,
+    LATENCY_LOW,
+    LATENCY_THROUGHPUT,
+    LATENCY_POWER_SAVING,
+    LATENCY_MODE_COUNT,
+} LatencyMode;
+
+static const char *const latency_mode_names[LATENCY_MODE_COUNT] = {
+    [LATENCY_BALANCED]     = "balanced",
+    [LATENCY_LOW]          = "low",
+    [LATENCY_THROUGHPUT]   = "throughput",
+    [LATENCY_POWER_SAVING] = "power-saving",
+};
+
+/*
+ * Renderer modules, all load the same RenderCommands. The loader swaps
+ * modules between frames when RenderSettings.backend changes, textures
+ * are handed to the new module as if they had just been registered.
+ */
+
+typedef enum RendererBackend {
+    RENDERER_VULKAN = 0,
+    RENDERER_SOFT,
+    RENDERER_BACKEND_COUNT,
+} RendererBackend;
+
+static const char *const renderer_backend_names[RENDERER_BACKEND_COUNT] = {
+    [RENDERER_VULKAN] = "vulkan",
+    [RENDERER_SOFT]   = "soft",
+};
+
+typedef struct RenderSettings {
+    LatencyMode latency_mode;
+    /* Read by the loader after every frame */
+    RendererBackend backend;
+    /*
+     * Opaque entries are drawn front to back against a depth buffer so
+     * covered pixels aren't shaded, see end_frame(). Read at startup.
+     */
+    bool depth_buffer;
+} RenderSettings;
+
 typedef enum LogType {
     LOG_ERROR = 0,
     LOG_WARNING,
@@ -39,15 +159,167 @@ typedef struct Image {
     u32 width;
     u32 height;
     u32 channels;
+    /*
+     * Mip levels stored back to back in pixels, level 0 first, 0 counts
+     * as 1. Each level is half the size of the previous, rounded down
+     * and at least 1.
+     */
+    u32 mip_count;
+    /* Pixels hold linear values instead of sRGB encoded ones */
+    bool is_linear;
+    /* Sampled bilinear and clamped to the edge, nearest and repeating (pixel art) otherwise */
+    bool is_filtered;
 } Image;
 
+static inline u32 image_mip_count(const Image *image) {
+    return (image->mip_count > 0) ? image->mip_count : 1;
+}
+
+static inline u32 image_mip_extent(u32 size, u32 level) {
+    size >>= level;
+    return (size > 0) ? size : 1;
+}
+
+static inline u64 image_mip_size(const Image *image, u32 level) {
+    return (u64) image_mip_extent(image->width, level)*image_mip_extent(image->height, level)*image->channels;
+}
+
+/* Bytes of every mip level together */
+static inline u64 image_size(const Image *image) {
+    u64 size = 0;
+    for (u32 level = 0; level < image_mip_count(image); ++level) {
+        size += image_mip_size(image, level);
+    }
+    return size;
+}
+
+/*
+ * Texture registry
+ *
+ * Owned by the loader and shared with the game and renderer. Images are
+ * registered up front and referenced by handle in render entries, the
+ * renderer uploads pending slots before it starts recording a frame.
+ * The pixels of a registered image are owned by the caller and have to
+ * stay alive while it is registered (render captures copy them).
+ *
+ * A handle is the slot index in the low 16 bits and the slot generation
+ * in the high 16 bits, so handles to unregistered images go stale.
+ * Slot 0 is never handed out, the renderer uses it for a white default
+ * texture which is also drawn for invalid or not yet uploaded handles.
+ */
+
+#define MAX_TEXTURES 256 /* Must match the texture arrays in the shaders */
+
+typedef u32 TextureHandle;
+
+#define TEXTURE_HANDLE_NONE 0
+#define TEXTURE_HANDLE_SLOT(handle)       ((handle) & 0xffff)
+#define TEXTURE_HANDLE_GENERATION(handle) ((handle) >> 16)
+
+typedef enum TextureState {
+    TEXTURE_FREE = 0,
+    TEXTURE_PENDING,  /* registered, waiting to be uploaded */
+    TEXTURE_RESIDENT, /* uploaded */
+    TEXTURE_RELEASED, /* unregistered, waiting for the renderer to free it */
+} TextureState;
+
+typedef struct TextureSlot {
+    Image image;
+    u16 generation;
+    u8 state;
+    /* Bumped every time the slot goes pending, with the handle it identifies the pixels */
+    u32 upload_generation;
+} TextureSlot;
+
+typedef struct TextureRegistry {
+    TextureSlot slots[MAX_TEXTURES];
+} TextureRegistry;
+
+static inline TextureHandle textureRegister(TextureRegistry *registry, Image image) {
+    for (u32 i = 1; i < MAX_TEXTURES; ++i) {
+        TextureSlot *slot = &registry->slots[i];
+        if (slot->state != TEXTURE_FREE) {
+            continue;
+        }
+
+        slot->image = image;
+        slot->generation++;
+        if (slot->generation == 0) {
+            slot->generation = 1;
+        }
+        slot->state = TEXTURE_PENDING;
+        slot->upload_generation++;
+
+        return ((u32) slot->generation << 16) | i;
+    }
+
+    return TEXTURE_HANDLE_NONE;
+}
+
+static inline TextureSlot *textureLookup(TextureRegistry *registry, TextureHandle handle) {
+    u32 index = TEXTURE_HANDLE_SLOT(handle);
+    if (index == 0 || index >= MAX_TEXTURES) {
+        return NULL;
+    }
+
+    TextureSlot *slot = &registry->slots[index];
+    if (slot->generation != TEXTURE_HANDLE_GENERATION(handle) ||
+        slot->state == TEXTURE_FREE || slot->state == TEXTURE_RELEASED) {
+        return NULL;
+    }
+
+    return slot;
+}
+
+/* Static render layers, see layerRegister() */
+typedef struct LayerRegistry LayerRegistry;
+typedef u32 LayerHandle;
+
+static inline void textureUnregister(TextureRegistry *registry, TextureHandle handle) {
+    TextureSlot *slot = textureLookup(registry, handle);
+    if (slot) {
+        slot->state = TEXTURE_RELEASED;
+    }
+}
+
+/*
+ * A sprite packed into a page of a SpriteAtlas, see shared/sprite_atlas.h.
+ * The UV rect excludes the padding around it.
+ */
+typedef struct Sprite {
+    u32 page;
+    u32 width;
+    u32 height;
+    Vec2 uv_offset;
+    Vec2 uv_size;
+} Sprite;
+
+typedef struct SpriteAtlas SpriteAtlas;
+
 typedef struct FontInfo {
     uint8_t codepoint;
     uint32_t  advance;
-    uint32_t  offset_x;
-    uint32_t  offset_y;
+    /* Bearing of the glyph bitmap, negative for glyphs hanging left or below the baseline */
+    int32_t   offset_x;
+    int32_t   offset_y;
 } FontInfo;
 
+/*
+ * A single rasterized glyph, pixels are single channel and owned by
+ * whoever rasterized it. Distance field fonts hand out the distance
+ * field, padding included.
+ */
+typedef struct GlyphBitmap {
+    u8 *pixels;
+    u32 width;
+    u32 height;
+    u32 stride;
+    int32_t offset_x;
+    int32_t offset_y;
+    /* 26.6 fixed point, like FontInfo */
+    uint32_t advance;
+} GlyphBitmap;
+
 typedef void  PlatformLogFunc(LogType, const char *, ...);
 typedef void *PlatformMemoryAllocateFunc(u64);
 typedef void  PlatformMemoryFreeFunc(void *);
@@ -58,6 +330,19 @@ typedef u64   PlatformFileSizeFunc(File file);
 typedef void  PlatformFileReadToBufferFunc(const char *, u8 **, u64 *);
 typedef void  PlatformFileWriteFunc(File file, void *ptr, u64 size, u64 amount);
 typedef void  PlatformFileReadFunc(File file, void *ptr, u64 size, u64 amount);
+/* Maps a file read only, NULL if it doesn't exist */
+typedef void *PlatformFileMapFunc(const char *path, u64 *size);
+typedef void  PlatformFileUnmapFunc(void *ptr, u64 size);
+
+typedef Time  PlatformTimeCurrentFunc();
+
+/* Rasterizes any codepoint of the loaded font, pixels stay valid until the next call */
+typedef bool  PlatformFontRasterizeGlyphFunc(u32 codepoint, GlyphBitmap *glyph);
+
+/* Runs func(data) on every pool worker and the calling thread, returns once all of them returned */
+typedef void  PlatformWorkFunc(void *data);
+typedef void  PlatformRunWorkersFunc(PlatformWorkFunc *func, void *data);
+typedef u32   PlatformWorkerCountFunc();
 
 typedef void  PlatformAbortFunc();
 
@@ -73,6 +358,17 @@ typedef struct PlatformFunctionTable {
     PlatformFileReadToBufferFunc *read_file_to_buffer;
     PlatformFileWriteFunc *file_write;
     PlatformFileReadFunc *file_read;
+    PlatformFileMapFunc *file_map;
+    PlatformFileUnmapFunc *file_unmap;
+
+    PlatformTimeCurrentFunc *time_current;
+
+    /* NULL if there is no font to rasterize from (replays) */
+    PlatformFontRasterizeGlyphFunc *font_rasterize_glyph;
+
+    /* Threads outside of every module, NULL without a pool */
+    PlatformRunWorkersFunc *run_workers;
+    PlatformWorkerCountFunc *worker_count;
 
     PlatformAbortFunc *abort;
 } PlatformFunctionTable;
@@ -80,9 +376,19 @@ typedef struct PlatformFunctionTable {
 typedef struct GameMemory {
     PlatformFunctionTable platform;
     FrameInfo *frame_info;
+    TextureRegistry *textures;
+    LayerRegistry *layers;
 
     Vec2 pos;
     ColorHSL col;
+
+    SpriteAtlas *sprites;
+    Sprite head;
+
+    LayerHandle background;
+
+    /* Nothing moves or animates, set by the debug module */
+    bool paused;
 } GameMemory;
 
 /*
@@ -103,6 +409,17 @@ typedef struct RecordData {
 typedef struct DebugMemory {
     PlatformFunctionTable platform;
     FrameInfo *frame_info;
+    FrameProfile *profile;
+    RenderSettings *render_settings;
+    bool was_latency_key_down;
+    bool was_renderer_key_down;
+    bool was_pause_key_down;
+    bool was_paused;
+
+    /* Frame and reuse counters of the profile when the game was paused */
+    u64 paused_frame;
+    u64 paused_reused_count;
+    u64 paused_record_saved_ns;
 
     RecordState record_state;
     File record_file;
@@ -124,6 +441,16 @@ typedef struct RenderCommands {
     u8 *memory_base;
     u32 memory_size;
     u32 memory_top;
+
+    /* Pixel size of text pushed from here on, 0 for the font's default size */
+    f32 text_size;
+
+    /* Entries entirely outside are dropped, the whole viewport by default */
+    Vec2 cull_min;
+    Vec2 cull_max;
+
+    /* Depth of entries pushed from here on, see setDepth() */
+    u16 depth;
 } RenderCommands;
 
 typedef enum RenderEntryType {
@@ -131,10 +458,13 @@ typedef enum RenderEntryType {
     ENTRY_TYPE_RenderEntryTexturedQuad,
     ENTRY_TYPE_RenderEntryAtlasQuad,
     ENTRY_TYPE_RenderEntryText,
+    ENTRY_TYPE_RenderEntrySprite,
+    ENTRY_TYPE_RenderEntryLayer,
 } RenderEntryType;
 
 typedef struct RenderEntryHeader {
     u8 type;
+    u16 depth;
 } RenderEntryHeader;
 
 typedef struct RenderEntryQuad {
@@ -148,55 +478,176 @@ typedef struct RenderEntryTexturedQuad {
     RenderEntryHeader header;
     Vec2 pos;
     Vec2 scale;
-    Image image;
+    TextureHandle texture;
 } RenderEntryTexturedQuad;
 
 typedef struct RenderEntryAtlasQuad {
     RenderEntryHeader header;
     Vec2 pos;
     Vec2 scale;
-    Image image;
+    TextureHandle texture;
     Vec2 offset;
     Vec2 size;
     ColorRGB col;
 } RenderEntryAtlasQuad;
 
+/* An RGBA atlas quad, tinted */
+typedef struct RenderEntrySprite {
+    RenderEntryHeader header;
+    Vec2 pos;
+    Vec2 scale;
+    TextureHandle texture;
+    Vec2 offset;
+    Vec2 size;
+    ColorRGB tint;
+} RenderEntrySprite;
+
+/*
+ * Text is stored inline after the entry, zero terminated, so the entry
+ * is variable sized, see render_entry_text_size().
+ */
 typedef struct RenderEntryText {
     RenderEntryHeader header;
     Vec2 pos;
     ColorRGB col;
-    const char *text;
+    f32 size;
+    u32 length;
+    char text[];
 } RenderEntryText;
 
-#define RENDERER_MEMORY_SIZE 1024
+/* Draws a static layer moved by offset, see layerRegister() */
+typedef struct RenderEntryLayer {
+    RenderEntryHeader header;
+    LayerHandle layer;
+    Vec2 offset;
+} RenderEntryLayer;
+
+/* Keeps entries following a text entry as aligned as the fixed size ones */
+#define RENDER_ENTRY_ALIGNMENT 4
+
+/* No entry is smaller, so memory_top/RENDER_ENTRY_MIN_SIZE bounds the entry count */
+#define RENDER_ENTRY_MIN_SIZE 16
+_Static_assert(sizeof(RenderEntryQuad)         >= RENDER_ENTRY_MIN_SIZE, "entry smaller than RENDER_ENTRY_MIN_SIZE");
+_Static_assert(sizeof(RenderEntryTexturedQuad) >= RENDER_ENTRY_MIN_SIZE, "entry smaller than RENDER_ENTRY_MIN_SIZE");
+_Static_assert(sizeof(RenderEntryAtlasQuad)    >= RENDER_ENTRY_MIN_SIZE, "entry smaller than RENDER_ENTRY_MIN_SIZE");
+_Static_assert(sizeof(RenderEntryText)         >= RENDER_ENTRY_MIN_SIZE, "entry smaller than RENDER_ENTRY_MIN_SIZE");
+_Static_assert(sizeof(RenderEntrySprite)       >= RENDER_ENTRY_MIN_SIZE, "entry smaller than RENDER_ENTRY_MIN_SIZE");
+_Static_assert(sizeof(RenderEntryLayer)        >= RENDER_ENTRY_MIN_SIZE, "entry smaller than RENDER_ENTRY_MIN_SIZE");
+
+static inline u32 render_entry_text_size(u32 length) {
+    return (sizeof(RenderEntryText) + length + 1 + RENDER_ENTRY_ALIGNMENT - 1) & ~(RENDER_ENTRY_ALIGNMENT - 1);
+}
+
+/* 0 for unknown types */
+static inline u32 render_entry_size(RenderEntryHeader *header) {
+    switch (header->type) {
+    case ENTRY_TYPE_RenderEntryQuad:         return sizeof(RenderEntryQuad);
+    case ENTRY_TYPE_RenderEntryTexturedQuad: return sizeof(RenderEntryTexturedQuad);
+    case ENTRY_TYPE_RenderEntryAtlasQuad:    return sizeof(RenderEntryAtlasQuad);
+    case ENTRY_TYPE_RenderEntryText:         return render_entry_text_size(((RenderEntryText *) header)->length);
+    case ENTRY_TYPE_RenderEntrySprite:       return sizeof(RenderEntrySprite);
+    case ENTRY_TYPE_RenderEntryLayer:        return sizeof(RenderEntryLayer);
+    }
+    return 0;
+}
+
+/* 0 for unknown types and entries that run past end, for walks over memory that may be corrupt */
+static inline u32 render_entry_size_checked(RenderEntryHeader *header, const u8 *end) {
+    const u64 available = (u64) (end - (u8 *) header);
+    if (header->type == ENTRY_TYPE_RenderEntryText && available < sizeof(RenderEntryText)) {
+        return 0;
+    }
+    const u32 size = render_entry_size(header);
+    return (size <= available) ? size : 0;
+}
+
+#define RENDERER_MEMORY_SIZE (64*1024)
 
 struct GLFWwindow;
 typedef struct GLFWwindow GLFWwindow;
 
 typedef struct RenderContext RenderContext;
 
+/*
+ * Dumps the RenderCommands stream of frames
+ * [first_frame, first_frame + frame_count) to path,
+ * see shared/render_capture.h for the format.
+ */
+typedef struct RenderCapture {
+    const char *path;
+    u64 first_frame;
+    u64 frame_count;
+
+    File file;
+    bool is_file_open;
+
+    /* Handle and upload generation of the texture last written to the file, by slot */
+    TextureHandle written_handles[MAX_TEXTURES];
+    u32 written_generations[MAX_TEXTURES];
+} RenderCapture;
+
+typedef enum ReadbackFormat {
+    READBACK_NONE = 0,
+    READBACK_RAW,
+    READBACK_PNG,
+} ReadbackFormat;
+
+/*
+ * Renders into a ring of offscreen images instead of a window
+ * swapchain. Frames can optionally be read back to
+ * "<readback_prefix><frame index>.png" or ".bgra" (raw BGRA8).
+ */
+typedef struct RenderHeadless {
+    bool enabled;
+    u32 width;
+    u32 height;
+    ReadbackFormat readback_format;
+    const char *readback_prefix;
+} RenderHeadless;
+
 typedef struct Renderer {
     PlatformFunctionTable platform;
     FrameInfo *frame_info;
+    /* NULL if nobody is profiling */
+    FrameProfile *profile;
+    /* Read every frame, NULL for the defaults */
+    RenderSettings *settings;
 
     GLFWwindow *window;
     RenderContext *context;
     RenderCommands cmds;
+    TextureRegistry *textures;
+    LayerRegistry *layers;
 
     FontInfo *font_info;
     PackRect *font_map;
     Image    *font_atlas;
+    TextureHandle font_atlas_texture;
+    /* Default text size and the size the atlas was baked at, in pixels */
+    u32 font_size;
+    u32 font_atlas_size;
+    /* Distance range of a distance field atlas in atlas pixels, 0 for coverage atlases */
+    u32 font_sdf_spread;
+
+    RenderCapture capture;
+    RenderHeadless headless;
 
     u8 memory[RENDERER_MEMORY_SIZE];
 } Renderer;
 
 /* Render API */
 
+/* NULL if the entry doesn't fit, the pushers then drop it like pushText() does */
 static inline void *push_render_entry_impl(RenderCommands *cmds, u32 entry_size, RenderEntryType type) {
+    if (cmds->memory_top + entry_size > cmds->memory_size) {
+        return NULL;
+    }
+
     RenderEntryHeader *header = (RenderEntryHeader *)(cmds->memory_base + cmds->memory_top);
     cmds->memory_top += entry_size;
 
     header->type = (u8) type;
+    header->depth = cmds->depth;
 
     return header;
 }
@@ -206,46 +657,253 @@ static inline void *push_render_entry_impl(RenderCommands *cmds, u32 entry_size,
 
 static inline void pushQuad(RenderCommands *cmds, Vec2 pos, Vec2 scale, ColorRGB col) {
     RenderEntryQuad *quad = PUSH_RENDER_ENTRY(cmds, RenderEntryQuad);
+    if (!quad) {
+        return;
+    }
     quad->pos = v2Add(pos, v2Scale(0.5f, scale));
     quad->scale = scale;
     quad->col = col;
 }
 
-static inline void pushTexturedQuad(RenderCommands *cmds, Vec2 pos, Vec2 scale, Image image) {
+static inline void pushTexturedQuad(RenderCommands *cmds, Vec2 pos, Vec2 scale, TextureHandle texture) {
     RenderEntryTexturedQuad *quad = PUSH_RENDER_ENTRY(cmds, RenderEntryTexturedQuad);
+    if (!quad) {
+        return;
+    }
     quad->pos = v2Add(pos, v2Scale(0.5f, scale));
     quad->scale = scale;
-    quad->image = image;
+    quad->texture = texture;
 }
 
-static inline void pushAtlasQuad(RenderCommands *cmds, Vec2 pos, Vec2 scale, Image image, Vec2 offset, Vec2 size, ColorRGB col) {
+static inline void pushAtlasQuad(RenderCommands *cmds, Vec2 pos, Vec2 scale, TextureHandle texture, Vec2 offset, Vec2 size, ColorRGB col) {
     RenderEntryAtlasQuad *quad = PUSH_RENDER_ENTRY(cmds, RenderEntryAtlasQuad);
+    if (!quad) {
+        return;
+    }
     quad->pos = v2Add(pos, v2Scale(0.5f, scale));
     quad->scale = scale;
-    quad->image = image;
+    quad->texture = texture;
     quad->offset = offset;
     quad->size = size;
     quad->col = col;
 }
 
-static inline void pushText(RenderCommands *cmds, Vec2 pos, ColorRGB col, const char *text) {
-    RenderEntryText *entry = PUSH_RENDER_ENTRY(cmds, RenderEntryText);
-    entry->pos  = pos;
-    entry->text = text;
+static inline void setTextSize(RenderCommands *cmds, f32 size) {
+    cmds->text_size = size;
+}
+
+/*
+ * Entries with a smaller depth are drawn in front, entries of equal
+ * depth in the order they were pushed. Reset to 0 every frame.
+ */
+static inline void setDepth(RenderCommands *cmds, u16 depth) {
+    cmds->depth = depth;
+}
+
+/*
+ * Only entries overlapping the rect at pos of size are drawn, for
+ * cameras that look at part of the screen. Applies to the whole frame,
+ * the viewport still culls what's outside of it.
+ */
+static inline void setCullRect(RenderCommands *cmds, Vec2 pos, Vec2 size) {
+    cmds->cull_min = pos;
+    cmds->cull_max = v2Add(pos, size);
+}
+
+/*
+ * Reserves a text entry at the top of cmds, *capacity is set to the
+ * number of text bytes that fit, excluding the terminator. Returns NULL
+ * if not even an empty string fits.
+ */
+static inline RenderEntryText *push_text_begin(RenderCommands *cmds, Vec2 pos, ColorRGB col, u32 *capacity) {
+    if (cmds->memory_top + render_entry_text_size(0) > cmds->memory_size) {
+        return NULL;
+    }
+
+    RenderEntryText *entry = (RenderEntryText *)(cmds->memory_base + cmds->memory_top);
+    entry->header.type = ENTRY_TYPE_RenderEntryText;
+    entry->header.depth = cmds->depth;
+    entry->pos = pos;
     entry->col = col;
+    entry->size = cmds->text_size;
+    entry->length = 0;
+    *capacity = cmds->memory_size - cmds->memory_top - sizeof(RenderEntryText) - 1;
+    return entry;
 }
 
+static inline void push_text_end(RenderCommands *cmds, RenderEntryText *entry, u32 length) {
+    entry->length = length;
+    entry->text[length] = '\0';
+    cmds->memory_top += render_entry_text_size(length);
+}
+
+/* Copies text into cmds, it doesn't have to outlive the call */
+static inline void pushText(RenderCommands *cmds, Vec2 pos, ColorRGB col, const char *text) {
+    u32 capacity = 0;
+    RenderEntryText *entry = push_text_begin(cmds, pos, col, &capacity);
+    if (!entry) {
+        return;
+    }
+
+    u32 length = 0;
+    while (text[length] && length < capacity) {
+        length++;
+    }
+    memcpy(entry->text, text, length);
+    push_text_end(cmds, entry, length);
+}
+
+/* Formats straight into cmds, see shared/format.h for what fmt supports */
 static inline void pushTextFmt(RenderCommands *cmds, Vec2 pos, ColorRGB col, const char *fmt, ...) {
-    //RenderEntryText *entry = PUSH_RENDER_ENTRY(cmds, RenderEntryText);
-    //entry->pos  = pos;
-    //entry->text = text;
-    //entry->col = col;
-
-    //sds text;
-    //sds sdscatfmt(sds s, char const *fmt, ...);
-
-    //va_list args;
-    //va_start(args, fmt);
-    //vfprintf(fd, fmt, args);
-    //va_end(args);
+    u32 capacity = 0;
+    RenderEntryText *entry = push_text_begin(cmds, pos, col, &capacity);
+    if (!entry) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    u32 length = format_string_v(entry->text, capacity + 1, fmt, args);
+    va_end(args);
+    push_text_end(cmds, entry, length);
+}
+
+/*
+ * Static layers
+ *
+ * Entries that stay the same from frame to frame, like a background or
+ * a tile map, can be pushed once into a layer and drawn every frame
+ * with a single pushLayer(). Renderers keep the layer's quads in memory
+ * of their own, the Vulkan renderer as instances in a device local
+ * buffer, so drawing a layer costs the same as drawing one quad on the
+ * CPU.
+ *
+ * Layers are registered like textures. The memory of the layer's
+ * commands has to stay valid until the layer is unregistered, and a
+ * layer can't be changed in place, register the new one and
+ * unregister the old. Layers hold quads, textured quads, atlas quads
+ * and sprites, anything else is skipped. Entries are drawn in the
+ * order they were pushed at the depth of the pushLayer() entry.
+ * Textures are looked up when the renderer takes in the layer, so
+ * unregister a layer before the textures it uses.
+ */
+
+#define MAX_LAYERS 64
+
+#define LAYER_HANDLE_NONE 0
+#define LAYER_HANDLE_SLOT(handle)       ((handle) & 0xffff)
+#define LAYER_HANDLE_GENERATION(handle) ((handle) >> 16)
+
+typedef struct LayerSlot {
+    RenderCommands commands;
+    /* Of every entry in the layer, before the pushLayer() offset */
+    Vec2 bounds_min;
+    Vec2 bounds_max;
+    u16 generation;
+    /* TextureState, layers go through the same states */
+    u8 state;
+} LayerSlot;
+
+/* Typedef'd above, with the texture registry */
+struct LayerRegistry {
+    LayerSlot slots[MAX_LAYERS];
+};
+
+/* Commands to build a layer in, memory has to outlive the layer */
+static inline RenderCommands layerBegin(u8 *memory, u32 size) {
+    return (RenderCommands) {
+        .memory_base = memory,
+        .memory_size = size,
+        .memory_top = 0,
+        .cull_min = VEC2(-1.0f, -1.0f),
+        .cull_max = VEC2( 1.0f,  1.0f),
+    };
+}
+
+static inline bool layer_entry_bounds(RenderEntryHeader *header, Vec2 *min, Vec2 *max) {
+    Vec2 pos;
+    Vec2 scale;
+    switch (header->type) {
+    case ENTRY_TYPE_RenderEntryQuad:         pos = ((RenderEntryQuad *) header)->pos;         scale = ((RenderEntryQuad *) header)->scale;         break;
+    case ENTRY_TYPE_RenderEntryTexturedQuad: pos = ((RenderEntryTexturedQuad *) header)->pos; scale = ((RenderEntryTexturedQuad *) header)->scale; break;
+    case ENTRY_TYPE_RenderEntryAtlasQuad:    pos = ((RenderEntryAtlasQuad *) header)->pos;    scale = ((RenderEntryAtlasQuad *) header)->scale;    break;
+    case ENTRY_TYPE_RenderEntrySprite:       pos = ((RenderEntrySprite *) header)->pos;       scale = ((RenderEntrySprite *) header)->scale;       break;
+    default: return false;
+    }
+    const Vec2 half = VEC2(0.5f*fabsf(scale.x), 0.5f*fabsf(scale.y));
+    *min = v2Sub(pos, half);
+    *max = v2Add(pos, half);
+    return true;
+}
+
+/* Returns LAYER_HANDLE_NONE if every slot is taken */
+static inline LayerHandle layerRegister(LayerRegistry *registry, RenderCommands *commands) {
+    for (u32 i = 1; i < MAX_LAYERS; ++i) {
+        LayerSlot *slot = &registry->slots[i];
+        if (slot->state != TEXTURE_FREE) {
+            continue;
+        }
+
+        slot->commands = *commands;
+        slot->bounds_min = VEC2(0.0f, 0.0f);
+        slot->bounds_max = VEC2(0.0f, 0.0f);
+        bool is_empty = true;
+        for (u8 *p = commands->memory_base; p < commands->memory_base + commands->memory_top;) {
+            RenderEntryHeader *header = (RenderEntryHeader *) p;
+            Vec2 min, max;
+            if (layer_entry_bounds(header, &min, &max)) {
+                slot->bounds_min = (is_empty) ? min : VEC2(MIN(slot->bounds_min.x, min.x), MIN(slot->bounds_min.y, min.y));
+                slot->bounds_max = (is_empty) ? max : VEC2(MAX(slot->bounds_max.x, max.x), MAX(slot->bounds_max.y, max.y));
+                is_empty = false;
+            }
+
+            const u32 size = render_entry_size(header);
+            if (size == 0) {
+                slot->commands.memory_top = (u32) (p - commands->memory_base);
+                break;
+            }
+            p += size;
+        }
+
+        slot->generation++;
+        if (slot->generation == 0) {
+            slot->generation = 1;
+        }
+        slot->state = TEXTURE_PENDING;
+
+        return ((u32) slot->generation << 16) | i;
+    }
+
+    return LAYER_HANDLE_NONE;
+}
+
+static inline LayerSlot *layerLookup(LayerRegistry *registry, LayerHandle handle) {
+    u32 index = LAYER_HANDLE_SLOT(handle);
+    if (!registry || index == 0 || index >= MAX_LAYERS) {
+        return NULL;
+    }
+
+    LayerSlot *slot = &registry->slots[index];
+    if (slot->generation != LAYER_HANDLE_GENERATION(handle) ||
+        slot->state == TEXTURE_FREE || slot->state == TEXTURE_RELEASED) {
+        return NULL;
+    }
+
+    return slot;
+}
+
+static inline void layerUnregister(LayerRegistry *registry, LayerHandle handle) {
+    LayerSlot *slot = layerLookup(registry, handle);
+    if (slot) {
+        slot->state = TEXTURE_RELEASED;
+    }
+}
+
+static inline void pushLayer(RenderCommands *cmds, LayerHandle layer, Vec2 offset) {
+    RenderEntryLayer *entry = PUSH_RENDER_ENTRY(cmds, RenderEntryLayer);
+    if (!entry) {
+        return;
+    }
+    entry->layer = layer;
+    entry->offset = offset;
 }
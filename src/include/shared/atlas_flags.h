@@ -0,0 +1,9 @@
+#pragma once
+
+/*
+ * Flags of atlas draws, read by atlas.frag and by the software
+ * renderer's rasterizer. The shader has its own copy of the values.
+ */
+
+#define ATLAS_FLAG_SDF  0x1
+#define ATLAS_FLAG_RGBA 0x2
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <shared/types.h>
+#include <shared/math.h>
+#include <stdarg.h>
+#include <string.h>
+
+/*
+ * Small printf-style formatter writing into a caller provided buffer,
+ * it never allocates and never touches the C locale. Supported:
+ *
+ *   flags     - 0 + space
+ *   width     number or *
+ *   precision .number or .*
+ *   length    hh h l ll z
+ *   types     d i u x X o c s p f F %
+ *
+ * %f has no exponent form, digits past what a double can hold come
+ * out as noise and exact ties round away from zero. Output is truncated to size-1 bytes and always zero
+ * terminated (if size > 0), the returned length is what was written,
+ * not what would have been written like snprintf.
+ */
+
+typedef struct FormatBuffer {
+    char *buf;
+    u32 size;
+    u32 length;
+} FormatBuffer;
+
+static inline void format_put_char(FormatBuffer *b, char c) {
+    if (b->length + 1 < b->size) {
+        b->buf[b->length++] = c;
+    }
+}
+
+static inline void format_put_padding(FormatBuffer *b, char c, i32 count) {
+    for (i32 i = 0; i < count; ++i) {
+        format_put_char(b, c);
+    }
+}
+
+/* Writes prefix and digits justified to width, digits are given most significant first */
+static inline void format_put_field(FormatBuffer *b, const char *prefix, u32 prefix_length,
+                                    const char *digits, u32 digit_count,
+                                    i32 width, bool left, bool zero_pad) {
+    i32 padding = width - (i32) (prefix_length + digit_count);
+    if (!left && !zero_pad) {
+        format_put_padding(b, ' ', padding);
+    }
+    for (u32 i = 0; i < prefix_length; ++i) {
+        format_put_char(b, prefix[i]);
+    }
+    if (!left && zero_pad) {
+        format_put_padding(b, '0', padding);
+    }
+    for (u32 i = 0; i < digit_count; ++i) {
+        format_put_char(b, digits[i]);
+    }
+    if (left) {
+        format_put_padding(b, ' ', padding);
+    }
+}
+
+/* Writes value in base into the end of digits (at least 32 bytes), returns the digit count */
+static inline u32 format_u64(char *digits, u64 value, u32 base, bool upper, i32 min_digits) {
+    const char *table = (upper) ? "0123456789ABCDEF" : "0123456789abcdef";
+    char *p = digits + 32;
+    u32 count = 0;
+    while (value > 0) {
+        *--p = table[value % base];
+        value /= base;
+        count++;
+    }
+    while ((i32) count < min_digits && count < 32) {
+        *--p = '0';
+        count++;
+    }
+    return count;
+}
+
+static inline u32 format_f64(char *digits, u32 digits_size, f64 value, i32 precision) {
+    u32 count = 0;
+    if (value != value) {
+        memcpy(digits, "nan", 3);
+        return 3;
+    }
+    if (value > 1.7976931348623157e308) {
+        memcpy(digits, "inf", 3);
+        return 3;
+    }
+
+    /* Round once up front so the digit loops below can truncate */
+    f64 rounding = 0.5;
+    for (i32 i = 0; i < precision; ++i) {
+        rounding /= 10.0;
+    }
+    value += rounding;
+
+    if (value < 18446744073709551616.0) {
+        char integer[32];
+        u64 integer_part = (u64) value;
+        u32 n = format_u64(integer, integer_part, 10, false, 1);
+        memcpy(digits, integer + 32 - n, n);
+        count = n;
+        value -= (f64) integer_part;
+    } else {
+        i32 exponent = 0;
+        f64 scale = 1.0;
+        while (value/scale >= 10.0) {
+            scale *= 10.0;
+            exponent++;
+        }
+        for (i32 i = 0; i <= exponent && count < digits_size; ++i) {
+            i32 digit = (i32) (value/scale);
+            digit = (digit < 0) ? 0 : (digit > 9) ? 9 : digit;
+            digits[count++] = (char) ('0' + digit);
+            value -= digit*scale;
+            scale /= 10.0;
+        }
+        value = 0.0;
+    }
+
+    if (precision > 0 && count < digits_size) {
+        digits[count++] = '.';
+        for (i32 i = 0; i < precision && count < digits_size; ++i) {
+            value *= 10.0;
+            i32 digit = (i32) value;
+            digit = (digit < 0) ? 0 : (digit > 9) ? 9 : digit;
+            digits[count++] = (char) ('0' + digit);
+            value -= digit;
+        }
+    }
+
+    return count;
+}
+
+static inline u32 format_string_v(char *buf, u32 size, const char *fmt, va_list args) {
+    FormatBuffer b = {.buf = buf, .size = size};
+
+    for (const char *f = fmt; *f; ++f) {
+        if (*f != '%') {
+            format_put_char(&b, *f);
+            continue;
+        }
+        ++f;
+
+        bool left = false;
+        bool zero_pad = false;
+        char sign = 0;
+        for (;; ++f) {
+            if      (*f == '-') left = true;
+            else if (*f == '0') zero_pad = true;
+            else if (*f == '+') sign = '+';
+            else if (*f == ' ') sign = (sign) ? sign : ' ';
+            else break;
+        }
+
+        i32 width = 0;
+        if (*f == '*') {
+            width = va_arg(args, int);
+            if (width < 0) {
+                left = true;
+                width = -width;
+            }
+            ++f;
+        } else {
+            while (*f >= '0' && *f <= '9') {
+                width = 10*width + (*f++ - '0');
+            }
+        }
+
+        i32 precision = -1;
+        if (*f == '.') {
+            ++f;
+            precision = 0;
+            if (*f == '*') {
+                precision = va_arg(args, int);
+                ++f;
+            } else {
+                while (*f >= '0' && *f <= '9') {
+                    precision = 10*precision + (*f++ - '0');
+                }
+            }
+        }
+
+        /* Number of 'h's and 'l's, 'z' counts as long */
+        u32 shorts = 0;
+        u32 longs = 0;
+        while (*f == 'h') {
+            shorts++;
+            ++f;
+        }
+        while (*f == 'l' || *f == 'z') {
+            longs += (*f == 'z') ? 2 : 1;
+            ++f;
+        }
+
+        char digits[64];
+        char prefix[2] = {0};
+        u32 prefix_length = 0;
+
+        switch (*f) {
+        case 'd':
+        case 'i': {
+            i64 value = (longs >= 2) ? va_arg(args, long long) :
+                        (longs == 1) ? va_arg(args, long) :
+                                       va_arg(args, int);
+            /* Promoted to int by the call, truncated back like printf does */
+            if (shorts >= 2) {
+                value = (signed char) value;
+            } else if (shorts == 1) {
+                value = (short) value;
+            }
+            u64 magnitude = (value < 0) ? -(u64) value : (u64) value;
+            if (value < 0) {
+                prefix[prefix_length++] = '-';
+            } else if (sign) {
+                prefix[prefix_length++] = sign;
+            }
+            u32 n = format_u64(digits, magnitude, 10, false, (precision < 0) ? 1 : precision);
+            format_put_field(&b, prefix, prefix_length, digits + 32 - n, n, width, left, zero_pad && precision < 0);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'p': {
+            u64 value = (*f == 'p')  ? (u64) (uintptr_t) va_arg(args, void *) :
+                        (longs >= 2) ? va_arg(args, unsigned long long) :
+                        (longs == 1) ? va_arg(args, unsigned long) :
+                                       va_arg(args, unsigned int);
+            if (*f != 'p' && shorts >= 2) {
+                value = (unsigned char) value;
+            } else if (*f != 'p' && shorts == 1) {
+                value = (unsigned short) value;
+            }
+            u32 base = (*f == 'u') ? 10 : (*f == 'o') ? 8 : 16;
+            if (*f == 'p') {
+                prefix[prefix_length++] = '0';
+                prefix[prefix_length++] = 'x';
+            }
+            u32 n = format_u64(digits, value, base, *f == 'X', (precision < 0) ? 1 : precision);
+            format_put_field(&b, prefix, prefix_length, digits + 32 - n, n, width, left, zero_pad && precision < 0);
+            break;
+        }
+        case 'f':
+        case 'F': {
+            f64 value = va_arg(args, double);
+            if (value < 0.0 || (value == 0.0 && 1.0/value < 0.0)) {
+                prefix[prefix_length++] = '-';
+                value = -value;
+            } else if (sign) {
+                prefix[prefix_length++] = sign;
+            }
+            u32 n = format_f64(digits, sizeof(digits), value, (precision < 0) ? 6 : MIN(precision, 32));
+            format_put_field(&b, prefix, prefix_length, digits, n, width, left, zero_pad);
+            break;
+        }
+        case 'c': {
+            digits[0] = (char) va_arg(args, int);
+            format_put_field(&b, NULL, 0, digits, 1, width, left, false);
+            break;
+        }
+        case 's': {
+            const char *str = va_arg(args, const char *);
+            if (!str) {
+                str = "(null)";
+            }
+            u32 n = 0;
+            while (str[n] && (precision < 0 || n < (u32) precision)) {
+                n++;
+            }
+            format_put_field(&b, NULL, 0, str, n, width, left, false);
+            break;
+        }
+        case '%': {
+            format_put_char(&b, '%');
+            break;
+        }
+        case '\0': {
+            --f;
+            break;
+        }
+        default: {
+            /* Unknown conversions are written out as is */
+            format_put_char(&b, '%');
+            format_put_char(&b, *f);
+            break;
+        }
+        }
+    }
+
+    if (b.size > 0) {
+        b.buf[b.length] = '\0';
+    }
+    return b.length;
+}
+
+static inline u32 format_string(char *buf, u32 size, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    u32 length = format_string_v(buf, size, fmt, args);
+    va_end(args);
+    return length;
+}
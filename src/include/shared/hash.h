@@ -0,0 +1,54 @@
+#pragma once
+
+#include <shared/types.h>
+
+#include <string.h>
+
+/*
+ * 64-bit FNV-1a, fast for short keys like strings and small structs.
+ * Pass a previous hash as seed to hash data in several pieces.
+ */
+
+#define HASH_FNV1A_SEED 0xcbf29ce484222325ull
+
+static inline u64 hash_fnv1a(u64 hash, const void *data, u64 size) {
+    const u8 *p = data;
+    for (u64 i = 0; i < size; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/*
+ * FNV-1a like, but 8 bytes at a time with an extra shift to mix the high
+ * bits down. Several times faster than hash_fnv1a() on larger buffers,
+ * for detecting changes rather than hash tables. Not the same hash.
+ */
+static inline u64 hash_fnv1a_wide(u64 hash, const void *data, u64 size) {
+    const u8 *p = data;
+    u64 i = 0;
+    for (; i + 8 <= size; i += 8) {
+        u64 word;
+        memcpy(&word, p + i, sizeof(word));
+        hash ^= word;
+        hash *= 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/* Hashes a zero terminated string, returns its length in *length */
+static inline u64 hash_fnv1a_string(u64 hash, const char *str, u64 *length) {
+    const char *p = str;
+    for (; *p; ++p) {
+        hash ^= (u8) *p;
+        hash *= 0x100000001b3ull;
+    }
+    *length = p - str;
+    return hash;
+}
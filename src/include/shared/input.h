@@ -24,6 +24,9 @@ typedef enum DebugInputType {
     DEBUG_INPUT_RECORD_STOP,
     DEBUG_INPUT_REPLAY_START,
     DEBUG_INPUT_REPLAY_STOP,
+    DEBUG_INPUT_LATENCY_NEXT,
+    DEBUG_INPUT_RENDERER_NEXT,
+    DEBUG_INPUT_PAUSE,
 
     DEBUG_INPUT_LAST
 } DebugInputType;
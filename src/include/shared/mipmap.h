@@ -0,0 +1,559 @@
+#pragma once
+
+#include <shared/api.h>
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIPMAP_X86 1
+#endif
+
+/*
+ * Mipmap generation
+ *
+ * Halves R8 or RGBA8 images with either a 2x2 box filter or an 8 tap
+ * Kaiser windowed sinc, which keeps more detail and aliases less. With
+ * MIPMAP_SRGB the color channels are averaged in linear space, alpha
+ * is always linear.
+ *
+ * Levels are rounded down like Image's (see image_mip_extent()), odd
+ * edges repeat their last pixel. Kernels come as scalar, SSE2 and AVX2,
+ * mipmap_init() picks the best one the CPU runs. Every kernel gives the
+ * same result as the scalar one, bit for bit for the box filter and to
+ * float rounding for the Kaiser filter.
+ *
+ * The Kaiser filter needs mipmap_scratch_size() bytes of scratch.
+ *
+ * The tables below are per module, a hot reloaded library starts over
+ * with them empty. mipmap_downsample() fills them on first use, so
+ * nothing has to remember to.
+ */
+
+#define MIPMAP_SRGB 0x1
+
+typedef enum MipmapFilter {
+    MIPMAP_FILTER_BOX,
+    MIPMAP_FILTER_KAISER,
+} MipmapFilter;
+
+typedef enum MipmapIsa {
+    MIPMAP_ISA_SCALAR,
+    MIPMAP_ISA_SSE2,
+    MIPMAP_ISA_AVX2,
+} MipmapIsa;
+
+#define MIPMAP_KAISER_TAPS  8
+#define MIPMAP_KAISER_ALPHA 4.0
+/* Padding of a decoded row, the taps reach 3 pixels left and 4 right, SIMD loads a bit further */
+#define MIPMAP_ROW_PAD_LEFT  3
+#define MIPMAP_ROW_PAD_RIGHT 16
+
+static f32 mipmap_srgb_to_linear[256];
+static u32 mipmap_srgb_to_linear16[256];
+/* Linear in 16 bits to sRGB, padded as AVX2 gathers 4 bytes at a time */
+static u8  mipmap_linear16_to_srgb[65536 + 4];
+static f32 mipmap_kaiser_weights[MIPMAP_KAISER_TAPS];
+static MipmapIsa mipmap_isa = MIPMAP_ISA_SCALAR;
+static bool mipmap_is_initialized = false;
+
+static inline f64 mipmap_bessel_i0(f64 x) {
+    f64 sum = 1.0;
+    f64 term = 1.0;
+    for (u32 k = 1; k < 32; ++k) {
+        term *= (x/(2.0*k))*(x/(2.0*k));
+        sum += term;
+    }
+    return sum;
+}
+
+/* Fills the tables and picks the kernels, does nothing the second time */
+static inline void mipmap_init(void) {
+    if (mipmap_is_initialized) {
+        return;
+    }
+
+    for (u32 i = 0; i < 256; ++i) {
+        const f64 c = i/255.0;
+        const f64 linear = (c <= 0.04045) ? c/12.92 : pow((c + 0.055)/1.055, 2.4);
+        mipmap_srgb_to_linear[i] = (f32) linear;
+        mipmap_srgb_to_linear16[i] = (u32) (linear*65535.0 + 0.5);
+    }
+    for (u32 i = 0; i < 65536; ++i) {
+        const f64 linear = i/65535.0;
+        const f64 c = (linear <= 0.0031308) ? 12.92*linear : 1.055*pow(linear, 1.0/2.4) - 0.055;
+        mipmap_linear16_to_srgb[i] = (u8) (c*255.0 + 0.5);
+    }
+
+    /* Tap k sits at source pixel 2x - 3 + k, (k - 3.5)/2 destination pixels from the center */
+    f64 weights[MIPMAP_KAISER_TAPS];
+    f64 total = 0.0;
+    for (u32 k = 0; k < MIPMAP_KAISER_TAPS; ++k) {
+        const f64 t = (k - 3.5)/2.0;
+        const f64 sinc = sin(M_PI*t)/(M_PI*t);
+        const f64 r = t/2.0;
+        weights[k] = sinc*mipmap_bessel_i0(MIPMAP_KAISER_ALPHA*sqrt(1.0 - r*r))/mipmap_bessel_i0(MIPMAP_KAISER_ALPHA);
+        total += weights[k];
+    }
+    for (u32 k = 0; k < MIPMAP_KAISER_TAPS; ++k) {
+        mipmap_kaiser_weights[k] = (f32) (weights[k]/total);
+    }
+
+    mipmap_isa = MIPMAP_ISA_SCALAR;
+#if MIPMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        mipmap_isa = MIPMAP_ISA_AVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        mipmap_isa = MIPMAP_ISA_SSE2;
+    }
+#endif
+    mipmap_is_initialized = true;
+}
+
+static inline u32 mipmap_full_count(u32 width, u32 height) {
+    u32 count = 1;
+    while ((width >> count) > 0 || (height >> count) > 0) {
+        count++;
+    }
+    return count;
+}
+
+static inline u64 mipmap_scratch_size(u32 width, u32 height, u32 channels, MipmapFilter filter) {
+    if (filter != MIPMAP_FILTER_KAISER) {
+        return 0;
+    }
+    const u64 dst_row = (u64) image_mip_extent(width, 1)*channels;
+    const u64 src_row = (u64) (MIPMAP_ROW_PAD_LEFT + width + MIPMAP_ROW_PAD_RIGHT)*channels;
+    return (height*dst_row + src_row + dst_row)*sizeof(f32);
+}
+
+/*
+ * Box filter
+ */
+
+/* Destination pixels [first, dst_width) of a row, also handles the odd last column */
+static inline void mipmap_box_row_scalar(const u8 *r0, const u8 *r1, u8 *dst, u32 src_width, u32 dst_width,
+                                         u32 channels, u32 first, bool srgb) {
+    const u32 color_channels = (channels == 4) ? 3 : channels;
+    for (u32 x = first; x < dst_width; ++x) {
+        const u32 x0 = 2*x*channels;
+        const u32 x1 = MIN(2*x + 1, src_width - 1)*channels;
+        for (u32 c = 0; c < channels; ++c) {
+            if (srgb && c < color_channels) {
+                const u32 sum = mipmap_srgb_to_linear16[r0[x0 + c]] + mipmap_srgb_to_linear16[r0[x1 + c]] +
+                                mipmap_srgb_to_linear16[r1[x0 + c]] + mipmap_srgb_to_linear16[r1[x1 + c]];
+                dst[x*channels + c] = mipmap_linear16_to_srgb[(sum + 2) >> 2];
+            } else {
+                dst[x*channels + c] = (u8) ((r0[x0 + c] + r0[x1 + c] + r1[x0 + c] + r1[x1 + c] + 2) >> 2);
+            }
+        }
+    }
+}
+
+#if MIPMAP_X86
+
+/* Sums of horizontal byte pairs as 8 u16 */
+static inline __m128i mipmap_sse2_r8_pairs(__m128i v) {
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    return _mm_add_epi16(_mm_and_si128(v, mask), _mm_srli_epi16(v, 8));
+}
+
+/* Sums of horizontal pixel pairs of 4 RGBA pixels as 2 pixels of u16 */
+static inline __m128i mipmap_sse2_rgba_pairs(__m128i v) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lo = _mm_unpacklo_epi8(v, zero);
+    const __m128i hi = _mm_unpackhi_epi8(v, zero);
+    return _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+}
+
+/* Returns how many destination pixels were done, the rest is left to the scalar kernel */
+__attribute__((target("sse2")))
+static inline u32 mipmap_box_row_sse2(const u8 *r0, const u8 *r1, u8 *dst, u32 src_width, u32 channels) {
+    const u32 pairs = src_width/2;
+    const __m128i two = _mm_set1_epi16(2);
+    u32 x = 0;
+    if (channels == 1) {
+        for (; x + 16 <= pairs; x += 16) {
+            const u8 *a = r0 + 2*x;
+            const u8 *b = r1 + 2*x;
+            __m128i s0 = _mm_add_epi16(mipmap_sse2_r8_pairs(_mm_loadu_si128((const __m128i *) a)),
+                                       mipmap_sse2_r8_pairs(_mm_loadu_si128((const __m128i *) b)));
+            __m128i s1 = _mm_add_epi16(mipmap_sse2_r8_pairs(_mm_loadu_si128((const __m128i *) (a + 16))),
+                                       mipmap_sse2_r8_pairs(_mm_loadu_si128((const __m128i *) (b + 16))));
+            s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+            s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+            _mm_storeu_si128((__m128i *) (dst + x), _mm_packus_epi16(s0, s1));
+        }
+    } else {
+        for (; x + 4 <= pairs; x += 4) {
+            const u8 *a = r0 + 8*x;
+            const u8 *b = r1 + 8*x;
+            __m128i s0 = _mm_add_epi16(mipmap_sse2_rgba_pairs(_mm_loadu_si128((const __m128i *) a)),
+                                       mipmap_sse2_rgba_pairs(_mm_loadu_si128((const __m128i *) b)));
+            __m128i s1 = _mm_add_epi16(mipmap_sse2_rgba_pairs(_mm_loadu_si128((const __m128i *) (a + 16))),
+                                       mipmap_sse2_rgba_pairs(_mm_loadu_si128((const __m128i *) (b + 16))));
+            s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+            s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+            _mm_storeu_si128((__m128i *) (dst + 4*x), _mm_packus_epi16(s0, s1));
+        }
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i mipmap_avx2_r8_pairs(__m256i v) {
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    return _mm256_add_epi16(_mm256_and_si256(v, mask), _mm256_srli_epi16(v, 8));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i mipmap_avx2_rgba_pairs(__m256i v) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i lo = _mm256_unpacklo_epi8(v, zero);
+    const __m256i hi = _mm256_unpackhi_epi8(v, zero);
+    return _mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), _mm256_unpackhi_epi64(lo, hi));
+}
+
+/* Both sides of a row position as i32, for the gathers of the sRGB kernel */
+__attribute__((target("avx2")))
+static inline void mipmap_avx2_r8_split(const u8 *p, __m256i *even, __m256i *odd) {
+    const __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) p));
+    *even = _mm256_and_si256(v, _mm256_set1_epi32(0xffff));
+    *odd = _mm256_srli_epi32(v, 16);
+}
+
+__attribute__((target("avx2")))
+static inline void mipmap_avx2_rgba_split(const u8 *p, __m256i *even, __m256i *odd) {
+    /* Pixels 0 1 | 2 3 as u16, reordered to 0 2 | 1 3 */
+    const __m256i v = _mm256_permute4x64_epi64(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) p)), 0xd8);
+    *even = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+    *odd = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+}
+
+/* Averages 8 values in linear space, lanes set in linear_lanes (alpha) are averaged as they are */
+__attribute__((target("avx2")))
+static inline __m128i mipmap_avx2_srgb_average(__m256i a, __m256i b, __m256i c, __m256i d, int linear_lanes) {
+    const int *table = (const int *) mipmap_srgb_to_linear16;
+    const __m256i two = _mm256_set1_epi32(2);
+    __m256i sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_i32gather_epi32(table, a, 4), _mm256_i32gather_epi32(table, b, 4)),
+                                   _mm256_add_epi32(_mm256_i32gather_epi32(table, c, 4), _mm256_i32gather_epi32(table, d, 4)));
+    sum = _mm256_srli_epi32(_mm256_add_epi32(sum, two), 2);
+    __m256i srgb = _mm256_and_si256(_mm256_i32gather_epi32((const int *) mipmap_linear16_to_srgb, sum, 1), _mm256_set1_epi32(0xff));
+
+    if (linear_lanes) {
+        __m256i linear = _mm256_add_epi32(_mm256_add_epi32(a, b), _mm256_add_epi32(c, d));
+        linear = _mm256_srli_epi32(_mm256_add_epi32(linear, two), 2);
+        srgb = _mm256_blend_epi32(srgb, linear, 0x88);
+    }
+
+    /* 8 i32 to 8 bytes */
+    const __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(srgb), _mm256_extracti128_si256(srgb, 1));
+    return _mm_packus_epi16(packed, packed);
+}
+
+__attribute__((target("avx2")))
+static inline u32 mipmap_box_row_avx2(const u8 *r0, const u8 *r1, u8 *dst, u32 src_width, u32 channels, bool srgb) {
+    const u32 pairs = src_width/2;
+    const __m256i two = _mm256_set1_epi16(2);
+    u32 x = 0;
+    if (srgb && channels == 1) {
+        for (; x + 8 <= pairs; x += 8) {
+            __m256i a0, a1, b0, b1;
+            mipmap_avx2_r8_split(r0 + 2*x, &a0, &a1);
+            mipmap_avx2_r8_split(r1 + 2*x, &b0, &b1);
+            _mm_storel_epi64((__m128i *) (dst + x), mipmap_avx2_srgb_average(a0, a1, b0, b1, 0));
+        }
+    } else if (srgb) {
+        for (; x + 2 <= pairs; x += 2) {
+            __m256i a0, a1, b0, b1;
+            mipmap_avx2_rgba_split(r0 + 8*x, &a0, &a1);
+            mipmap_avx2_rgba_split(r1 + 8*x, &b0, &b1);
+            _mm_storel_epi64((__m128i *) (dst + 4*x), mipmap_avx2_srgb_average(a0, a1, b0, b1, 1));
+        }
+    } else if (channels == 1) {
+        for (; x + 32 <= pairs; x += 32) {
+            const u8 *a = r0 + 2*x;
+            const u8 *b = r1 + 2*x;
+            __m256i s0 = _mm256_add_epi16(mipmap_avx2_r8_pairs(_mm256_loadu_si256((const __m256i *) a)),
+                                          mipmap_avx2_r8_pairs(_mm256_loadu_si256((const __m256i *) b)));
+            __m256i s1 = _mm256_add_epi16(mipmap_avx2_r8_pairs(_mm256_loadu_si256((const __m256i *) (a + 32))),
+                                          mipmap_avx2_r8_pairs(_mm256_loadu_si256((const __m256i *) (b + 32))));
+            s0 = _mm256_srli_epi16(_mm256_add_epi16(s0, two), 2);
+            s1 = _mm256_srli_epi16(_mm256_add_epi16(s1, two), 2);
+            /* packus works per 128 bit lane, the permute puts the 64 bit halves back in order */
+            _mm256_storeu_si256((__m256i *) (dst + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(s0, s1), 0xd8));
+        }
+    } else {
+        for (; x + 8 <= pairs; x += 8) {
+            const u8 *a = r0 + 8*x;
+            const u8 *b = r1 + 8*x;
+            __m256i s0 = _mm256_add_epi16(mipmap_avx2_rgba_pairs(_mm256_loadu_si256((const __m256i *) a)),
+                                          mipmap_avx2_rgba_pairs(_mm256_loadu_si256((const __m256i *) b)));
+            __m256i s1 = _mm256_add_epi16(mipmap_avx2_rgba_pairs(_mm256_loadu_si256((const __m256i *) (a + 32))),
+                                          mipmap_avx2_rgba_pairs(_mm256_loadu_si256((const __m256i *) (b + 32))));
+            s0 = _mm256_srli_epi16(_mm256_add_epi16(s0, two), 2);
+            s1 = _mm256_srli_epi16(_mm256_add_epi16(s1, two), 2);
+            _mm256_storeu_si256((__m256i *) (dst + 4*x), _mm256_permute4x64_epi64(_mm256_packus_epi16(s0, s1), 0xd8));
+        }
+    }
+    return x;
+}
+
+#endif
+
+/* The kernel mipmap_box() runs for isa, there is no SSE2 one with gamma */
+static inline MipmapIsa mipmap_box_isa(MipmapIsa isa, bool srgb) {
+    return (isa == MIPMAP_ISA_SSE2 && srgb) ? MIPMAP_ISA_SCALAR : isa;
+}
+
+static inline void mipmap_box(const u8 *src, u32 src_width, u32 src_height, u8 *dst,
+                              u32 channels, bool srgb, MipmapIsa isa) {
+    isa = mipmap_box_isa(isa, srgb);
+    const u32 dst_width = image_mip_extent(src_width, 1);
+    const u32 dst_height = image_mip_extent(src_height, 1);
+    for (u32 y = 0; y < dst_height; ++y) {
+        const u8 *r0 = src + (u64) MIN(2*y, src_height - 1)*src_width*channels;
+        const u8 *r1 = src + (u64) MIN(2*y + 1, src_height - 1)*src_width*channels;
+        u8 *row = dst + (u64) y*dst_width*channels;
+
+        u32 done = 0;
+#if MIPMAP_X86
+        if (isa == MIPMAP_ISA_AVX2) {
+            done = mipmap_box_row_avx2(r0, r1, row, src_width, channels, srgb);
+        } else if (isa == MIPMAP_ISA_SSE2) {
+            done = mipmap_box_row_sse2(r0, r1, row, src_width, channels);
+        }
+#endif
+        mipmap_box_row_scalar(r0, r1, row, src_width, dst_width, channels, done, srgb);
+    }
+}
+
+/*
+ * Kaiser filter, separable: every source row is decoded to linear
+ * floats and filtered horizontally into scratch, then the columns are
+ * filtered into the destination rows.
+ */
+
+static inline void mipmap_kaiser_decode_row(const u8 *src, f32 *row, u32 width, u32 channels, bool srgb) {
+    const u32 color_channels = (channels == 4) ? 3 : channels;
+    f32 *out = row + MIPMAP_ROW_PAD_LEFT*channels;
+    for (u32 x = 0; x < width; ++x) {
+        for (u32 c = 0; c < channels; ++c) {
+            const u8 v = src[x*channels + c];
+            out[x*channels + c] = (srgb && c < color_channels) ? mipmap_srgb_to_linear[v] : v*(1.0f/255.0f);
+        }
+    }
+    /* Edges repeat, so the taps never need clamping */
+    for (u32 x = 0; x < MIPMAP_ROW_PAD_LEFT; ++x) {
+        memcpy(row + x*channels, out, channels*sizeof(f32));
+    }
+    for (u32 x = 0; x < MIPMAP_ROW_PAD_RIGHT; ++x) {
+        memcpy(out + (width + x)*channels, out + (width - 1)*channels, channels*sizeof(f32));
+    }
+}
+
+static inline void mipmap_kaiser_horizontal_scalar(const f32 *row, f32 *out, u32 dst_width, u32 channels, u32 first) {
+    const f32 *w = mipmap_kaiser_weights;
+    for (u32 x = first; x < dst_width; ++x) {
+        /* Tap 0 is source pixel 2x - 3, which is row pixel 2x with the padding */
+        const f32 *p = row + 2*x*channels;
+        for (u32 c = 0; c < channels; ++c) {
+            f32 sum = 0.0f;
+            for (u32 k = 0; k < MIPMAP_KAISER_TAPS; ++k) {
+                sum += w[k]*p[k*channels + c];
+            }
+            out[x*channels + c] = sum;
+        }
+    }
+}
+
+static inline void mipmap_kaiser_vertical_scalar(const f32 **rows, f32 *out, u32 count, u32 first) {
+    const f32 *w = mipmap_kaiser_weights;
+    for (u32 i = first; i < count; ++i) {
+        f32 sum = 0.0f;
+        for (u32 k = 0; k < MIPMAP_KAISER_TAPS; ++k) {
+            sum += w[k]*rows[k][i];
+        }
+        out[i] = sum;
+    }
+}
+
+#if MIPMAP_X86
+
+__attribute__((target("sse2")))
+static inline u32 mipmap_kaiser_horizontal_sse2(const f32 *row, f32 *out, u32 dst_width, u32 channels) {
+    const f32 *w = mipmap_kaiser_weights;
+    u32 x = 0;
+    if (channels == 1) {
+        for (; x + 4 <= dst_width; x += 4) {
+            __m128 sum = _mm_setzero_ps();
+            for (u32 k = 0; k < MIPMAP_KAISER_TAPS; ++k) {
+                /* Every other float from 2x + k */
+                const __m128 a = _mm_loadu_ps(row + 2*x + k);
+                const __m128 b = _mm_loadu_ps(row + 2*x + k + 4);
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))));
+            }
+            _mm_storeu_ps(out + x, sum);
+        }
+    } else {
+        for (; x < dst_width; ++x) {
+            const f32 *p = row + 8*x;
+            __m128 sum = _mm_setzero_ps();
+            for (u32 k = 0; k < MIPMAP_KAISER_TAPS; ++k) {
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(p + 4*k)));
+            }
+            _mm_storeu_ps(out + 4*x, sum);
+        }
+    }
+    return x;
+}
+
+__attribute__((target("sse2")))
+static inline u32 mipmap_kaiser_vertical_sse2(const f32 **rows, f32 *out, u32 count) {
+    const f32 *w = mipmap_kaiser_weights;
+    u32 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 sum = _mm_setzero_ps();
+        for (u32 k = 0; k < MIPMAP_KAISER_TAPS; ++k) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(rows[k] + i)));
+        }
+        _mm_storeu_ps(out + i, sum);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline u32 mipmap_kaiser_horizontal_avx2(const f32 *row, f32 *out, u32 dst_width, u32 channels) {
+    const f32 *w = mipmap_kaiser_weights;
+    u32 x = 0;
+    if (channels == 1) {
+        for (; x + 8 <= dst_width; x += 8) {
+            __m256 sum = _mm256_setzero_ps();
+            for (u32 k = 0; k < MIPMAP_KAISER_TAPS; ++k) {
+                const __m256 a = _mm256_loadu_ps(row + 2*x + k);
+                const __m256 b = _mm256_loadu_ps(row + 2*x + k + 8);
+                /* Evens per 128 bit lane, then the lanes back in order */
+                __m256 even = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+                even = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(even), 0xd8));
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(w[k]), even));
+            }
+            _mm256_storeu_ps(out + x, sum);
+        }
+    } else {
+        /* Two destination pixels at a time, 8 source pixels apart */
+        for (; x + 2 <= dst_width; x += 2) {
+            const f32 *p = row + 8*x;
+            __m256 sum = _mm256_setzero_ps();
+            for (u32 k = 0; k < MIPMAP_KAISER_TAPS; ++k) {
+                const __m256 v = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4*k)), _mm_loadu_ps(p + 4*k + 8), 1);
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(w[k]), v));
+            }
+            _mm256_storeu_ps(out + 4*x, sum);
+        }
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static inline u32 mipmap_kaiser_vertical_avx2(const f32 **rows, f32 *out, u32 count) {
+    const f32 *w = mipmap_kaiser_weights;
+    u32 i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 sum = _mm256_setzero_ps();
+        for (u32 k = 0; k < MIPMAP_KAISER_TAPS; ++k) {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(w[k]), _mm256_loadu_ps(rows[k] + i)));
+        }
+        _mm256_storeu_ps(out + i, sum);
+    }
+    return i;
+}
+
+#endif
+
+static inline void mipmap_kaiser(const u8 *src, u32 src_width, u32 src_height, u8 *dst,
+                                 u32 channels, bool srgb, MipmapIsa isa, void *scratch) {
+    const u32 dst_width = image_mip_extent(src_width, 1);
+    const u32 dst_height = image_mip_extent(src_height, 1);
+    const u32 dst_row = dst_width*channels;
+    const u32 color_channels = (channels == 4) ? 3 : channels;
+
+    f32 *filtered = scratch;
+    f32 *row = filtered + (u64) src_height*dst_row;
+    f32 *out = row + (MIPMAP_ROW_PAD_LEFT + src_width + MIPMAP_ROW_PAD_RIGHT)*channels;
+
+    for (u32 y = 0; y < src_height; ++y) {
+        mipmap_kaiser_decode_row(src + (u64) y*src_width*channels, row, src_width, channels, srgb);
+        f32 *line = filtered + (u64) y*dst_row;
+        u32 done = 0;
+#if MIPMAP_X86
+        if (isa == MIPMAP_ISA_AVX2) {
+            done = mipmap_kaiser_horizontal_avx2(row, line, dst_width, channels);
+        } else if (isa == MIPMAP_ISA_SSE2) {
+            done = mipmap_kaiser_horizontal_sse2(row, line, dst_width, channels);
+        }
+#endif
+        mipmap_kaiser_horizontal_scalar(row, line, dst_width, channels, done);
+    }
+
+    for (u32 y = 0; y < dst_height; ++y) {
+        const f32 *rows[MIPMAP_KAISER_TAPS];
+        for (u32 k = 0; k < MIPMAP_KAISER_TAPS; ++k) {
+            const i32 sy = CLAMP((i32) (2*y + k) - 3, 0, (i32) src_height - 1);
+            rows[k] = filtered + (u64) sy*dst_row;
+        }
+
+        u32 done = 0;
+#if MIPMAP_X86
+        if (isa == MIPMAP_ISA_AVX2) {
+            done = mipmap_kaiser_vertical_avx2(rows, out, dst_row);
+        } else if (isa == MIPMAP_ISA_SSE2) {
+            done = mipmap_kaiser_vertical_sse2(rows, out, dst_row);
+        }
+#endif
+        mipmap_kaiser_vertical_scalar(rows, out, dst_row, done);
+
+        u8 *line = dst + (u64) y*dst_row;
+        for (u32 i = 0; i < dst_row; ++i) {
+            /* The negative lobes can overshoot */
+            const f32 v = CLAMP(out[i], 0.0f, 1.0f);
+            line[i] = (srgb && (i % channels) < color_channels)
+                ? mipmap_linear16_to_srgb[(u32) (v*65535.0f + 0.5f)]
+                : (u8) (v*255.0f + 0.5f);
+        }
+    }
+}
+
+/* Halves src into dst with the given kernels, see mipmap_downsample() */
+static inline void mipmap_downsample_isa(const u8 *src, u32 src_width, u32 src_height, u8 *dst, u32 channels,
+                                         MipmapFilter filter, u32 flags, void *scratch, MipmapIsa isa) {
+    mipmap_init();
+    const bool srgb = (flags & MIPMAP_SRGB) != 0;
+    if (filter == MIPMAP_FILTER_KAISER) {
+        mipmap_kaiser(src, src_width, src_height, dst, channels, srgb, isa, scratch);
+    } else {
+        mipmap_box(src, src_width, src_height, dst, channels, srgb, isa);
+    }
+}
+
+/* Halves a 1 or 4 channel src into dst, image_mip_extent(size, 1) pixels on each side */
+static inline void mipmap_downsample(const u8 *src, u32 src_width, u32 src_height, u8 *dst, u32 channels,
+                                     MipmapFilter filter, u32 flags, void *scratch) {
+    mipmap_init();
+    mipmap_downsample_isa(src, src_width, src_height, dst, channels, filter, flags, scratch, mipmap_isa);
+}
+
+/*
+ * Fills levels 1 to mip_count - 1 of image from level 0, pixels has to
+ * hold image_size(image) bytes. Gamma correct unless image is linear.
+ */
+static inline void mipmap_generate(Image *image, MipmapFilter filter, void *scratch) {
+    const u32 flags = (image->is_linear) ? 0 : MIPMAP_SRGB;
+    u8 *level = image->pixels;
+    for (u32 i = 1; i < image_mip_count(image); ++i) {
+        u8 *next = level + image_mip_size(image, i - 1);
+        mipmap_downsample(level, image_mip_extent(image->width, i - 1), image_mip_extent(image->height, i - 1),
+                          next, image->channels, filter, flags, scratch);
+        level = next;
+    }
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <shared/quicksort.h>
+#include <shared/math.h>
 #include <assert.h>
 
 typedef struct PackRect {
@@ -63,7 +64,27 @@ static inline PackNode **find_best_pack_pos(PackContext *context, u32 width, u32
     return best;
 }
 
-static bool compare_pack_rects(const void *a, const void *b) {
+/* Walks both node lists, O(n) so only done in debug builds */
+static inline void pack_validate(PackContext *context) {
+    PackNode *n = context->active_list;
+    while (n->x < context->width) {
+        assert(n->x < n->next->x);
+        n = n->next;
+    }
+    assert(n->next == NULL);
+
+    u32 count = 0;
+    for (n = context->active_list; n; n = n->next) {
+        count++;
+    }
+    for (n = context->free_list; n; n = n->next) {
+        count++;
+    }
+    assert(count == context->num_nodes);
+}
+
+/* Tallest first, the order both packers should get rectangles in */
+static inline bool compare_pack_rects(const void *a, const void *b) {
     return ((PackRect *)a)->height > ((PackRect *)b)->height;
 }
 
@@ -121,38 +142,281 @@ static inline void pack_rectangles(PackContext *context, PackRect *rects, u64 re
                 cur->x = x + rects[i].width;
             }
 
-            {
-                PackNode *n = context->active_list;
-                while (n->x < context->width) {
-                    assert(n->x < n->next->x);
-                    n = n->next;
-                }
-                assert(n->next == NULL);
-            }
+#ifndef NDEBUG
+            pack_validate(context);
+#endif
+
+            rects[i].x = x;
+            rects[i].y = y;
+        } else {
+            rects[i].x = 0;
+            rects[i].y = 0;
+        }
+    }
+}
 
-            {
-                PackNode *n = NULL;
-                u32 count = 0;
+/*
+ * Online skyline packer
+ *
+ * Unlike pack_rectangles(), which packs a whole batch from scratch,
+ * rectangles are inserted and removed one at a time. The packed area is
+ * tracked as a skyline, an array of segments sorted by x covering the
+ * whole width, each with the height of the highest rectangle below it.
+ *
+ * A rectangle goes where its top ends up lowest, leftmost on ties (the
+ * area wasted below it as a tie break packed worse in the benchmark in
+ * src/bench). That wasted area, and rectangles removed from
+ * under the skyline, are kept as free rectangles and reused first with
+ * a best area fit. Removing a rectangle that is on top of the skyline
+ * lowers the skyline instead.
+ *
+ * Nodes and free rectangles are provided by the caller. With n
+ * rectangles packed the skyline never has more than 2n + 1 nodes. Free
+ * rectangles narrower or lower than min_free_size, or that don't fit in
+ * the array, are dropped and their space is lost until the skyline over
+ * it is lowered. Set min_free_size to the smallest rectangle expected,
+ * slivers only make the best fit search slower.
+ */
 
-                n = context->active_list;
-                while (n) {
-                    n = n->next;
-                    count++;
-                }
+typedef struct PackSkylineNode {
+    u32 x, y;
+    u32 width;
+} PackSkylineNode;
+
+typedef struct PackFreeRect {
+    u32 x, y;
+    u32 width, height;
+} PackFreeRect;
+
+typedef struct PackSkyline {
+    u32 width;
+    u32 height;
+
+    PackSkylineNode *nodes;
+    u32 node_count;
+    u32 max_nodes;
+
+    PackFreeRect *free_rects;
+    u32 free_count;
+    u32 max_free;
+    u32 min_free_size;
+
+    u64 used_area;
+} PackSkyline;
+
+static inline void pack_skyline_init(PackSkyline *packer, u32 width, u32 height,
+                                     PackSkylineNode *nodes, u32 max_nodes,
+                                     PackFreeRect *free_rects, u32 max_free, u32 min_free_size) {
+    packer->width = width;
+    packer->height = height;
+    packer->nodes = nodes;
+    packer->node_count = 1;
+    packer->max_nodes = max_nodes;
+    packer->free_rects = free_rects;
+    packer->free_count = 0;
+    packer->max_free = max_free;
+    packer->min_free_size = MAX(min_free_size, 1);
+    packer->used_area = 0;
+
+    nodes[0] = (PackSkylineNode) {0, 0, width};
+}
+
+static inline void pack_skyline_add_free(PackSkyline *packer, u32 x, u32 y, u32 width, u32 height) {
+    if (width >= packer->min_free_size && height >= packer->min_free_size && packer->free_count < packer->max_free) {
+        packer->free_rects[packer->free_count++] = (PackFreeRect) {x, y, width, height};
+    }
+}
+
+/* Height of the skyline under [nodes[i].x, nodes[i].x + width) */
+static inline u32 pack_skyline_fit(PackSkyline *packer, u32 i, u32 width) {
+    const u32 x1 = packer->nodes[i].x + width;
+    u32 y = 0;
+    for (u32 j = i; j < packer->node_count && packer->nodes[j].x < x1; ++j) {
+        y = MAX(y, packer->nodes[j].y);
+    }
+    return y;
+}
+
+/* Splits the node containing x so a node starts at x, returns its index */
+static inline u32 pack_skyline_split(PackSkyline *packer, u32 x) {
+    u32 i = 0;
+    while (i < packer->node_count && packer->nodes[i].x + packer->nodes[i].width <= x) {
+        ++i;
+    }
+    if (i == packer->node_count || packer->nodes[i].x == x) {
+        return i;
+    }
+
+    PackSkylineNode *node = &packer->nodes[i];
+    memmove(node + 1, node, (packer->node_count - i)*sizeof(PackSkylineNode));
+    packer->node_count++;
+
+    const u32 left = x - node->x;
+    node[1].x = x;
+    node[1].width = node->width - left;
+    node->width = left;
+    return i + 1;
+}
 
-                n = context->free_list;
-                while (n) {
-                    n = n->next;
-                    count++;
+/* Sets the skyline over [x0, x1) to y, false if there aren't enough nodes */
+static inline bool pack_skyline_set(PackSkyline *packer, u32 x0, u32 x1, u32 y) {
+    if (packer->node_count + 2 > packer->max_nodes) {
+        return false;
+    }
+
+    const u32 first = pack_skyline_split(packer, x0);
+    const u32 end = pack_skyline_split(packer, x1);
+
+    /* Nodes [first, end) become one */
+    packer->nodes[first] = (PackSkylineNode) {x0, y, x1 - x0};
+    memmove(&packer->nodes[first + 1], &packer->nodes[end], (packer->node_count - end)*sizeof(PackSkylineNode));
+    packer->node_count -= end - first - 1;
+
+    /* Merge with neighbours of the same height */
+    u32 i = first;
+    if (i + 1 < packer->node_count && packer->nodes[i + 1].y == y) {
+        packer->nodes[i].width += packer->nodes[i + 1].width;
+        memmove(&packer->nodes[i + 1], &packer->nodes[i + 2], (packer->node_count - i - 2)*sizeof(PackSkylineNode));
+        packer->node_count--;
+    }
+    if (i > 0 && packer->nodes[i - 1].y == y) {
+        packer->nodes[i - 1].width += packer->nodes[i].width;
+        memmove(&packer->nodes[i], &packer->nodes[i + 1], (packer->node_count - i - 1)*sizeof(PackSkylineNode));
+        packer->node_count--;
+    }
+
+    return true;
+}
+
+/* Checks every invariant, O(n) so only done in debug builds */
+static inline void pack_skyline_validate(PackSkyline *packer) {
+    assert(packer->node_count > 0 && packer->node_count <= packer->max_nodes);
+    u32 x = 0;
+    for (u32 i = 0; i < packer->node_count; ++i) {
+        assert(packer->nodes[i].x == x);
+        assert(packer->nodes[i].width > 0);
+        assert(packer->nodes[i].y <= packer->height);
+        assert(i == 0 || packer->nodes[i - 1].y != packer->nodes[i].y);
+        x += packer->nodes[i].width;
+    }
+    assert(x == packer->width);
+
+    for (u32 i = 0; i < packer->free_count; ++i) {
+        assert(packer->free_rects[i].width > 0 && packer->free_rects[i].height > 0);
+        assert(packer->free_rects[i].x + packer->free_rects[i].width <= packer->width);
+        assert(packer->free_rects[i].y + packer->free_rects[i].height <= packer->height);
+    }
+}
+
+/* Places rect, sets its x and y. Returns false if it doesn't fit. */
+static inline bool pack_skyline_insert(PackSkyline *packer, PackRect *rect) {
+    const u32 w = rect->width;
+    const u32 h = rect->height;
+    if (w == 0 || h == 0) {
+        rect->x = 0;
+        rect->y = 0;
+        return true;
+    }
+    if (w > packer->width || h > packer->height) {
+        return false;
+    }
+
+    /* Free space below the skyline first, it doesn't make the skyline grow */
+    u32 best_free = UINT32_MAX;
+    u64 best_leftover = UINT64_MAX;
+    for (u32 i = 0; i < packer->free_count; ++i) {
+        PackFreeRect *f = &packer->free_rects[i];
+        if (f->width >= w && f->height >= h) {
+            u64 leftover = (u64) f->width*f->height - (u64) w*h;
+            if (leftover < best_leftover) {
+                best_free = i;
+                best_leftover = leftover;
+                if (leftover == 0) {
+                    break;
                 }
-                assert(count == context->num_nodes);
             }
+        }
+    }
+    if (best_free != UINT32_MAX) {
+        PackFreeRect f = packer->free_rects[best_free];
+        packer->free_rects[best_free] = packer->free_rects[--packer->free_count];
 
-            rects[i].x = x;
-            rects[i].y = y;
+        rect->x = f.x;
+        rect->y = f.y;
+
+        /* Split the rest along the longer leftover side */
+        if (f.width - w > f.height - h) {
+            pack_skyline_add_free(packer, f.x + w, f.y, f.width - w, f.height);
+            pack_skyline_add_free(packer, f.x, f.y + h, w, f.height - h);
         } else {
-            rects[i].x = 0;
-            rects[i].y = 0;
+            pack_skyline_add_free(packer, f.x + w, f.y, f.width - w, h);
+            pack_skyline_add_free(packer, f.x, f.y + h, f.width, f.height - h);
+        }
+
+        packer->used_area += (u64) w*h;
+#ifndef NDEBUG
+        pack_skyline_validate(packer);
+#endif
+        return true;
+    }
+
+    u32 best = UINT32_MAX;
+    u32 best_top = UINT32_MAX;
+    for (u32 i = 0; i < packer->node_count && packer->nodes[i].x + w <= packer->width; ++i) {
+        const u32 y = pack_skyline_fit(packer, i, w);
+        if (y + h <= packer->height && y + h < best_top) {
+            best = i;
+            best_top = y + h;
         }
     }
+    if (best == UINT32_MAX || packer->node_count + 2 > packer->max_nodes) {
+        return false;
+    }
+
+    const u32 x0 = packer->nodes[best].x;
+    const u32 y = best_top - h;
+    rect->x = x0;
+    rect->y = y;
+
+    /* The gaps under the rectangle become free space */
+    for (u32 j = best; j < packer->node_count && packer->nodes[j].x < x0 + w; ++j) {
+        const u32 end = MIN(packer->nodes[j].x + packer->nodes[j].width, x0 + w);
+        pack_skyline_add_free(packer, packer->nodes[j].x, packer->nodes[j].y, end - packer->nodes[j].x, y - packer->nodes[j].y);
+    }
+
+    pack_skyline_set(packer, x0, x0 + w, best_top);
+
+    packer->used_area += (u64) w*h;
+#ifndef NDEBUG
+    pack_skyline_validate(packer);
+#endif
+    return true;
+}
+
+/* Gives the space of a rectangle placed by pack_skyline_insert() back */
+static inline void pack_skyline_remove(PackSkyline *packer, const PackRect *rect) {
+    if (rect->width == 0 || rect->height == 0) {
+        return;
+    }
+    packer->used_area -= (u64) rect->width*rect->height;
+
+    /* On top of the skyline along its whole width, the skyline drops back down */
+    const u32 x0 = rect->x;
+    const u32 x1 = rect->x + rect->width;
+    const u32 top = rect->y + rect->height;
+    bool is_on_top = true;
+    for (u32 i = 0; i < packer->node_count && packer->nodes[i].x < x1; ++i) {
+        if (packer->nodes[i].x + packer->nodes[i].width > x0 && packer->nodes[i].y != top) {
+            is_on_top = false;
+            break;
+        }
+    }
+
+    if (!is_on_top || !pack_skyline_set(packer, x0, x1, rect->y)) {
+        pack_skyline_add_free(packer, rect->x, rect->y, rect->width, rect->height);
+    }
+
+#ifndef NDEBUG
+    pack_skyline_validate(packer);
+#endif
 }
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <shared/types.h>
+#include <shared/mem.h>
+#include <shared/math.h>
+
+/*
+ * Minimal PNG writer, the image data is stored uncompressed
+ * (deflate "stored" blocks). Meant for debug readbacks where
+ * speed matters more than file size.
+ */
+
+#define PNG_MAX_STORED_BLOCK 65535
+
+static inline u32 png_crc32(u32 crc, const u8 *data, u64 size) {
+    static u32 table[256];
+    static bool table_initialized = false;
+    if (!table_initialized) {
+        for (u32 i = 0; i < 256; ++i) {
+            u32 c = i;
+            for (u32 k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        table_initialized = true;
+    }
+
+    crc = ~crc;
+    for (u64 i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static inline u8 *png_put_u32(u8 *p, u32 v) {
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >>  8) & 0xff;
+    p[3] = (v >>  0) & 0xff;
+    return p + 4;
+}
+
+static inline u64 png_encoded_size(u32 width, u32 height, u32 channels) {
+    u64 raw_size = (u64) height*(1 + (u64) width*channels);
+    u64 num_blocks = (raw_size + PNG_MAX_STORED_BLOCK - 1)/PNG_MAX_STORED_BLOCK;
+    u64 zlib_size = 2 + raw_size + 5*num_blocks + 4;
+    return 8 + (12 + 13) + (12 + zlib_size) + 12;
+}
+
+/*
+ * Encodes 8-bit gray (1), RGB (3) or RGBA (4) pixels into dst,
+ * which has to hold png_encoded_size() bytes. Returns the number
+ * of bytes written, or 0 for unsupported channel counts.
+ */
+static inline u64 png_encode(u8 *dst, const u8 *pixels, u32 width, u32 height, u32 channels) {
+    u8 color_type;
+    switch (channels) {
+    case 1: color_type = 0; break;
+    case 3: color_type = 2; break;
+    case 4: color_type = 6; break;
+    default: return 0;
+    }
+
+    static const u8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    u8 *p = dst;
+    memcpy(p, signature, sizeof(signature));
+    p += sizeof(signature);
+
+    /* IHDR */
+    {
+        u8 *chunk = p;
+        p = png_put_u32(p, 13);
+        memcpy(p, "IHDR", 4); p += 4;
+        p = png_put_u32(p, width);
+        p = png_put_u32(p, height);
+        *p++ = 8;          /* bit depth */
+        *p++ = color_type;
+        *p++ = 0;          /* compression */
+        *p++ = 0;          /* filter */
+        *p++ = 0;          /* interlace */
+        p = png_put_u32(p, png_crc32(0, chunk + 4, p - (chunk + 4)));
+    }
+
+    /* IDAT */
+    {
+        u64 stride = (u64) width*channels;
+        u64 raw_size = height*(1 + stride);
+        u64 num_blocks = (raw_size + PNG_MAX_STORED_BLOCK - 1)/PNG_MAX_STORED_BLOCK;
+        u64 zlib_size = 2 + raw_size + 5*num_blocks + 4;
+
+        u8 *chunk = p;
+        p = png_put_u32(p, zlib_size);
+        memcpy(p, "IDAT", 4); p += 4;
+
+        /* zlib header, deflate with 32K window, no preset dictionary */
+        *p++ = 0x78;
+        *p++ = 0x01;
+
+        u32 adler_a = 1, adler_b = 0;
+        u64 block_left = 0;
+        u64 remaining = raw_size;
+
+        for (u32 y = 0; y < height; ++y) {
+            for (u64 x = 0; x < 1 + stride; ) {
+                if (block_left == 0) {
+                    block_left = MIN(remaining, PNG_MAX_STORED_BLOCK);
+                    remaining -= block_left;
+                    *p++ = (remaining == 0) ? 1 : 0;
+                    *p++ = (block_left >> 0) & 0xff;
+                    *p++ = (block_left >> 8) & 0xff;
+                    *p++ = (~block_left >> 0) & 0xff;
+                    *p++ = (~block_left >> 8) & 0xff;
+                }
+
+                /* Each row starts with the filter type, always 0 (none) */
+                u64 count;
+                if (x == 0) {
+                    *p = 0;
+                    count = 1;
+                } else {
+                    count = MIN(block_left, 1 + stride - x);
+                    memcpy(p, pixels + (u64) y*stride + (x - 1), count);
+                }
+
+                for (u64 i = 0; i < count; ++i) {
+                    adler_a = (adler_a + p[i]) % 65521;
+                    adler_b = (adler_b + adler_a) % 65521;
+                }
+
+                p += count;
+                x += count;
+                block_left -= count;
+            }
+        }
+
+        p = png_put_u32(p, (adler_b << 16) | adler_a);
+        p = png_put_u32(p, png_crc32(0, chunk + 4, p - (chunk + 4)));
+    }
+
+    /* IEND */
+    {
+        u8 *chunk = p;
+        p = png_put_u32(p, 0);
+        memcpy(p, "IEND", 4); p += 4;
+        p = png_put_u32(p, png_crc32(0, chunk + 4, 4));
+    }
+
+    return p - dst;
+}
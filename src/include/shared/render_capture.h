@@ -0,0 +1,147 @@
+#pragma once
+
+#include <shared/api.h>
+
+/*
+ * Render capture file format
+ *
+ *   RenderCaptureHeader
+ *   u8       font_atlas[font_atlas_width*font_atlas_height]
+ *   PackRect font_map[num_chars]
+ *   FontInfo font_info[num_chars]
+ *
+ * followed by any number of frames
+ *
+ *   RenderCaptureFrame
+ *   u8 commands[commands_size]
+ *   texture_count times
+ *     RenderCaptureTexture
+ *     u8 pixels[image_size()], every mip level
+ *
+ * font_map is in packing order, PackRect.user_id and FontInfo.codepoint
+ * hold the codepoint of each glyph (version 2 stored glyph indices).
+ *
+ * Text is stored inline in the commands (version 3 stored it in a data
+ * block after them), version 5 added the text size and the font sizes
+ * and version 6 sprite entries, version 7 mip levels, version 8 entry depths and version 10 texture filtering. Textures are referenced by handle,
+ * a texture is stored after the first frame that uses it, and after a
+ * later one only if it was uploaded again since (version 9, before
+ * every frame stored all of its textures). Replays register them
+ * under the same handles.
+ */
+
+#define RENDER_CAPTURE_MAGIC   0x43525053 /* "SPRC" */
+#define RENDER_CAPTURE_VERSION 10
+
+typedef struct RenderCaptureHeader {
+    u32 magic;
+    u32 version;
+    u32 num_chars;
+    u32 font_atlas_width;
+    u32 font_atlas_height;
+    TextureHandle font_atlas_texture;
+    u32 font_size;
+    u32 font_atlas_size;
+    u32 font_sdf_spread;
+} RenderCaptureHeader;
+
+typedef struct RenderCaptureFrame {
+    u64 frame_index;
+    u32 commands_size;
+    u32 texture_count;
+    u32 textures_size;
+} RenderCaptureFrame;
+
+typedef struct RenderCaptureTexture {
+    TextureHandle handle;
+    u32 width;
+    u32 height;
+    u32 channels;
+    u32 mip_count;
+    u32 is_linear;
+    u32 is_filtered;
+} RenderCaptureTexture;
+
+static inline Image render_capture_texture_image(RenderCaptureTexture *texture, u8 *pixels) {
+    return (Image) {
+        .pixels = pixels,
+        .width = texture->width,
+        .height = texture->height,
+        .channels = texture->channels,
+        .mip_count = texture->mip_count,
+        .is_linear = texture->is_linear != 0,
+        .is_filtered = texture->is_filtered != 0,
+    };
+}
+
+/* Checks that the entries of a captured frame, text included, fit in commands_size */
+static inline bool render_capture_validate_commands(u8 *commands, u32 commands_size) {
+    u8 *p = commands;
+    while (p < commands + commands_size) {
+        RenderEntryHeader *header = (RenderEntryHeader *) p;
+        if (header->type == ENTRY_TYPE_RenderEntryText &&
+            (p + sizeof(RenderEntryText) > commands + commands_size ||
+             ((RenderEntryText *) header)->length >= commands_size)) {
+            return false;
+        }
+
+        u32 size = render_entry_size(header);
+        if (size == 0 || size > (u64) (commands + commands_size - p)) {
+            return false;
+        }
+        if (header->type == ENTRY_TYPE_RenderEntryText) {
+            RenderEntryText *entry = (RenderEntryText *) header;
+            if (entry->text[entry->length] != '\0') {
+                return false;
+            }
+        }
+
+        p += size;
+    }
+
+    return true;
+}
+
+/* Checks that the texture records of a captured frame fit in textures_size */
+static inline bool render_capture_validate_textures(u8 *textures, u32 texture_count, u32 textures_size) {
+    u8 *p = textures;
+    for (u32 i = 0; i < texture_count; ++i) {
+        if (p + sizeof(RenderCaptureTexture) > textures + textures_size) {
+            return false;
+        }
+        RenderCaptureTexture *texture = (RenderCaptureTexture *) p;
+        if (texture->mip_count > 32) {
+            return false;
+        }
+        Image image = render_capture_texture_image(texture, NULL);
+        p += sizeof(RenderCaptureTexture) + image_size(&image);
+        if (p > textures + textures_size || TEXTURE_HANDLE_SLOT(texture->handle) >= MAX_TEXTURES) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Puts the textures stored with a captured frame into the registry under
+ * their captured handles, slots are only re-uploaded when they hold
+ * another record, e.g. one stored by a later frame in the last loop.
+ */
+static inline void render_capture_register_textures(TextureRegistry *registry, u8 *textures, u32 texture_count) {
+    u8 *p = textures;
+    for (u32 i = 0; i < texture_count; ++i) {
+        RenderCaptureTexture *texture = (RenderCaptureTexture *) p;
+        p += sizeof(RenderCaptureTexture);
+
+        TextureSlot *slot = &registry->slots[TEXTURE_HANDLE_SLOT(texture->handle)];
+        Image image = render_capture_texture_image(texture, p);
+        if (!textureLookup(registry, texture->handle) || slot->image.pixels != p) {
+            slot->image = image;
+            slot->generation = TEXTURE_HANDLE_GENERATION(texture->handle);
+            slot->state = TEXTURE_PENDING;
+            slot->upload_generation++;
+        }
+
+        p += image_size(&image);
+    }
+}
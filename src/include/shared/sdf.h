@@ -0,0 +1,128 @@
+#pragma once
+
+#include <shared/types.h>
+#include <math.h>
+
+/*
+ * Signed distance fields from coverage bitmaps
+ *
+ * Uses the exact euclidean distance transform by Felzenszwalb and
+ * Huttenlocher, one 1D pass over the columns followed by one over the
+ * rows, once for the distance to the inside and once to the outside.
+ *
+ * A pixel is inside if its coverage is >= 128. The output is padded by
+ * spread pixels on every side and maps distances in [-spread, spread]
+ * to [0, 255], 128 being the edge and larger values being inside. The
+ * edge is then at alpha 0.5 in a shader, at any scale.
+ */
+
+#define SDF_INF 1e20f
+
+static inline u32 sdf_output_size(u32 size, u32 spread) {
+    return size + 2*spread;
+}
+
+/* Bytes of scratch memory sdf_generate() needs */
+static inline u64 sdf_scratch_size(u32 width, u32 height, u32 spread) {
+    const u64 w = sdf_output_size(width, spread);
+    const u64 h = sdf_output_size(height, spread);
+    const u64 n = (w > h) ? w : h;
+    return (2*w*h + 3*n + 1)*sizeof(f32) + n*sizeof(i32);
+}
+
+/* 1D squared distance transform of f into d, v and z are scratch of n and n+1 elements */
+static inline void sdf_transform_1d(const f32 *f, f32 *d, u32 n, i32 *v, f32 *z) {
+    i32 k = 0;
+    v[0] = 0;
+    z[0] = -SDF_INF;
+    z[1] = SDF_INF;
+    for (i32 q = 1; q < (i32) n; ++q) {
+        /* Intersection with the rightmost parabola of the lower envelope, z[0] stops the loop */
+        f32 s = ((f[q] + q*q) - (f[v[k]] + v[k]*v[k])) / (2.0f*(q - v[k]));
+        while (s <= z[k]) {
+            k--;
+            s = ((f[q] + q*q) - (f[v[k]] + v[k]*v[k])) / (2.0f*(q - v[k]));
+        }
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k+1] = SDF_INF;
+    }
+
+    k = 0;
+    for (i32 q = 0; q < (i32) n; ++q) {
+        while (z[k+1] < q) {
+            k++;
+        }
+        const i32 p = v[k];
+        d[q] = (f32) ((q - p)*(q - p)) + f[p];
+    }
+}
+
+/* In place 2D squared distance transform of a w*h grid */
+static inline void sdf_transform_2d(f32 *grid, u32 w, u32 h, f32 *f, f32 *d, i32 *v, f32 *z) {
+    for (u32 x = 0; x < w; ++x) {
+        for (u32 y = 0; y < h; ++y) {
+            f[y] = grid[y*w + x];
+        }
+        sdf_transform_1d(f, d, h, v, z);
+        for (u32 y = 0; y < h; ++y) {
+            grid[y*w + x] = d[y];
+        }
+    }
+    for (u32 y = 0; y < h; ++y) {
+        sdf_transform_1d(&grid[y*w], d, w, v, z);
+        for (u32 x = 0; x < w; ++x) {
+            grid[y*w + x] = d[x];
+        }
+    }
+}
+
+/*
+ * Writes the distance field of the width*height coverage bitmap to out,
+ * which is sdf_output_size(width, spread)*sdf_output_size(height, spread)
+ * bytes with a row stride of out_stride.
+ */
+static inline void sdf_generate(const u8 *coverage, u32 width, u32 height, u32 coverage_stride,
+                                u32 spread, u8 *out, u32 out_stride, void *scratch) {
+    const u32 w = sdf_output_size(width, spread);
+    const u32 h = sdf_output_size(height, spread);
+    const u32 n = (w > h) ? w : h;
+
+    f32 *to_inside  = scratch;
+    f32 *to_outside = to_inside + w*h;
+    f32 *f = to_outside + w*h;
+    f32 *d = f + n;
+    f32 *z = d + n;
+    i32 *v = (i32 *) (z + n + 1);
+
+    for (u32 y = 0; y < h; ++y) {
+        for (u32 x = 0; x < w; ++x) {
+            bool inside = false;
+            if (x >= spread && x < spread + width && y >= spread && y < spread + height) {
+                inside = coverage[(y - spread)*coverage_stride + (x - spread)] >= 128;
+            }
+            to_inside[y*w + x]  = (inside) ? 0.0f : SDF_INF;
+            to_outside[y*w + x] = (inside) ? SDF_INF : 0.0f;
+        }
+    }
+
+    sdf_transform_2d(to_inside,  w, h, f, d, v, z);
+    sdf_transform_2d(to_outside, w, h, f, d, v, z);
+
+    /*
+     * Distances are measured between pixel centers, the half pixel
+     * moves the edge between the last inside and first outside pixel.
+     */
+    const f32 scale = (spread > 0) ? 0.5f/spread : 0.5f;
+    for (u32 y = 0; y < h; ++y) {
+        for (u32 x = 0; x < w; ++x) {
+            f32 distance = (to_outside[y*w + x] > 0.0f)
+                ? sqrtf(to_outside[y*w + x]) - 0.5f
+                : -(sqrtf(to_inside[y*w + x]) - 0.5f);
+            f32 value = 0.5f + distance*scale;
+            value = (value < 0.0f) ? 0.0f : (value > 1.0f) ? 1.0f : value;
+            out[y*out_stride + x] = (u8) (value*255.0f + 0.5f);
+        }
+    }
+}
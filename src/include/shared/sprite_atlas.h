@@ -0,0 +1,221 @@
+#pragma once
+
+#include <shared/api.h>
+#include <shared/mipmap.h>
+
+/*
+ * Sprite atlas
+ *
+ * Packs images into a few shared RGBA pages with the skyline packer, so
+ * sprites share textures instead of registering one each. Pages are
+ * sampled bilinear (Image.is_filtered), so every sprite is surrounded
+ * by padding pixels filled with its own edge pixels (bleed), filtering
+ * at the edge of a sprite then never picks up its neighbours. The returned Sprite carries its page and the UV
+ * rect of the sprite without the padding.
+ *
+ * Pages are (re)registered with the texture registry by
+ * sprite_atlas_commit(), which uploads whole pages, so images are
+ * best added in bulk at load time. Commit also regenerates the mips of
+ * a page, only as many as the padding covers: every level halves the
+ * bleed, past that sprites would blend into their neighbours.
+ *
+ * Cooked RGBA images that come with a full mip chain can instead get a
+ * page of their own with sprite_atlas_add_texture(), which registers
+ * them as they are.
+ */
+
+#define SPRITE_ATLAS_MAX_PAGES     8
+#define SPRITE_ATLAS_PAGE_SPRITES  512
+#define SPRITE_ATLAS_PAGE_CHANNELS 4
+
+typedef struct SpriteAtlasPage {
+    Image image;
+    TextureHandle texture;
+    /* Changed since the last sprite_atlas_commit() */
+    bool is_dirty;
+    /* A single image registered as is, its pixels aren't owned by the page */
+    bool is_direct;
+
+    PackSkyline packer;
+    PackSkylineNode nodes[2*SPRITE_ATLAS_PAGE_SPRITES + 1];
+    PackFreeRect free_rects[2*SPRITE_ATLAS_PAGE_SPRITES];
+    u32 sprite_count;
+} SpriteAtlasPage;
+
+struct SpriteAtlas {
+    u32 page_size;
+    u32 padding;
+
+    u32 page_count;
+    SpriteAtlasPage pages[SPRITE_ATLAS_MAX_PAGES];
+};
+
+static inline void sprite_atlas_init(SpriteAtlas *atlas, u32 page_size, u32 padding) {
+    memset(atlas, 0, sizeof(SpriteAtlas));
+    atlas->page_size = page_size;
+    atlas->padding = padding;
+}
+
+/* Levels down to the one where the padding is a single pixel */
+static inline u32 sprite_atlas_mip_count(const SpriteAtlas *atlas) {
+    u32 count = 1;
+    while ((atlas->padding >> count) > 0 && (atlas->page_size >> count) > 0) {
+        count++;
+    }
+    return count;
+}
+
+static inline SpriteAtlasPage *sprite_atlas_add_page(SpriteAtlas *atlas, PlatformFunctionTable *platform) {
+    if (atlas->page_count == SPRITE_ATLAS_MAX_PAGES) {
+        return NULL;
+    }
+
+    Image image = {
+        .width = atlas->page_size,
+        .height = atlas->page_size,
+        .channels = SPRITE_ATLAS_PAGE_CHANNELS,
+        .mip_count = sprite_atlas_mip_count(atlas),
+        .is_filtered = true,
+    };
+    const u64 size = image_size(&image);
+    image.pixels = platform->allocate_memory(size);
+    if (!image.pixels) {
+        return NULL;
+    }
+    memset(image.pixels, 0, size);
+
+    SpriteAtlasPage *page = &atlas->pages[atlas->page_count++];
+    page->image = image;
+    page->texture = TEXTURE_HANDLE_NONE;
+    page->is_dirty = true;
+    page->is_direct = false;
+    page->sprite_count = 0;
+    pack_skyline_init(&page->packer, atlas->page_size, atlas->page_size,
+                      page->nodes, ARRLEN(page->nodes), page->free_rects, ARRLEN(page->free_rects), 1);
+    return page;
+}
+
+/* Copies image as RGBA into the page rect at x, y, which includes the padding */
+static inline void sprite_atlas_blit(SpriteAtlasPage *page, const Image *image, u32 x, u32 y, u32 padding) {
+    const i32 w = (i32) image->width;
+    const i32 h = (i32) image->height;
+    const u32 c = image->channels;
+    for (i32 dy = -(i32) padding; dy < h + (i32) padding; ++dy) {
+        const i32 sy = CLAMP(dy, 0, h - 1);
+        u8 *dst = page->image.pixels + ((y + padding + dy)*page->image.width + x) * SPRITE_ATLAS_PAGE_CHANNELS;
+        for (i32 dx = -(i32) padding; dx < w + (i32) padding; ++dx) {
+            const i32 sx = CLAMP(dx, 0, w - 1);
+            const u8 *src = image->pixels + ((u64) sy*w + sx)*c;
+            /* 1 is grey, 2 grey and alpha, 3 RGB */
+            dst[0] = src[0];
+            dst[1] = (c >= 3) ? src[1] : src[0];
+            dst[2] = (c >= 3) ? src[2] : src[0];
+            dst[3] = (c == 4) ? src[3] : (c == 2) ? src[1] : 255;
+            dst += SPRITE_ATLAS_PAGE_CHANNELS;
+        }
+    }
+}
+
+/* Packs a copy of image, false if it doesn't fit in any page */
+static inline bool sprite_atlas_add(SpriteAtlas *atlas, PlatformFunctionTable *platform, const Image *image, Sprite *sprite) {
+    if (!image->pixels || image->width == 0 || image->height == 0 ||
+        image->channels == 0 || image->channels > 4) {
+        return false;
+    }
+
+    PackRect rect = {
+        .width = image->width + 2*atlas->padding,
+        .height = image->height + 2*atlas->padding,
+    };
+
+    SpriteAtlasPage *page = NULL;
+    for (u32 i = 0; i < atlas->page_count && !page; ++i) {
+        if (!atlas->pages[i].is_direct &&
+            atlas->pages[i].sprite_count < SPRITE_ATLAS_PAGE_SPRITES &&
+            pack_skyline_insert(&atlas->pages[i].packer, &rect)) {
+            page = &atlas->pages[i];
+        }
+    }
+    if (!page) {
+        page = sprite_atlas_add_page(atlas, platform);
+        if (!page || !pack_skyline_insert(&page->packer, &rect)) {
+            platform->log(LOG_ERROR, "Sprite atlas: no room for a %ux%u image", image->width, image->height);
+            return false;
+        }
+    }
+
+    sprite_atlas_blit(page, image, rect.x, rect.y, atlas->padding);
+    page->sprite_count++;
+    page->is_dirty = true;
+
+    const f32 texel = 1.0f/atlas->page_size;
+    *sprite = (Sprite) {
+        .page = (u32) (page - atlas->pages),
+        .width = image->width,
+        .height = image->height,
+        .uv_offset = VEC2((rect.x + atlas->padding)*texel, (rect.y + atlas->padding)*texel),
+        .uv_size = VEC2(image->width*texel, image->height*texel),
+    };
+    return true;
+}
+
+/*
+ * Gives image a page of its own, uploaded with the mips it already has
+ * instead of packed and filtered again. Its pixels have to outlive the
+ * atlas, like a mapped cooked file. False for anything but RGBA.
+ */
+static inline bool sprite_atlas_add_texture(SpriteAtlas *atlas, const Image *image, Sprite *sprite) {
+    if (!image->pixels || image->width == 0 || image->height == 0 ||
+        image->channels != SPRITE_ATLAS_PAGE_CHANNELS ||
+        atlas->page_count == SPRITE_ATLAS_MAX_PAGES) {
+        return false;
+    }
+
+    SpriteAtlasPage *page = &atlas->pages[atlas->page_count++];
+    page->image = *image;
+    page->image.is_filtered = true;
+    page->texture = TEXTURE_HANDLE_NONE;
+    page->is_dirty = true;
+    page->is_direct = true;
+    page->sprite_count = 1;
+
+    *sprite = (Sprite) {
+        .page = (u32) (page - atlas->pages),
+        .width = image->width,
+        .height = image->height,
+        .uv_offset = VEC2(0.0f, 0.0f),
+        .uv_size = VEC2(1.0f, 1.0f),
+    };
+    return true;
+}
+
+/* Registers pages that changed with fresh mips, handles of changed pages are replaced */
+static inline void sprite_atlas_commit(SpriteAtlas *atlas, TextureRegistry *textures) {
+    for (u32 i = 0; i < atlas->page_count; ++i) {
+        SpriteAtlasPage *page = &atlas->pages[i];
+        if (!page->is_dirty) {
+            continue;
+        }
+        if (!page->is_direct) {
+            mipmap_generate(&page->image, MIPMAP_FILTER_BOX, NULL);
+        }
+        if (page->texture != TEXTURE_HANDLE_NONE) {
+            textureUnregister(textures, page->texture);
+        }
+        page->texture = textureRegister(textures, page->image);
+        page->is_dirty = false;
+    }
+}
+
+static inline void pushSprite(RenderCommands *cmds, SpriteAtlas *atlas, Vec2 pos, Vec2 scale, Sprite sprite, ColorRGB tint) {
+    RenderEntrySprite *entry = PUSH_RENDER_ENTRY(cmds, RenderEntrySprite);
+    if (!entry) {
+        return;
+    }
+    entry->pos = v2Add(pos, v2Scale(0.5f, scale));
+    entry->scale = scale;
+    entry->texture = (sprite.page < atlas->page_count) ? atlas->pages[sprite.page].texture : TEXTURE_HANDLE_NONE;
+    entry->offset = sprite.uv_offset;
+    entry->size = sprite.uv_size;
+    entry->tint = tint;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <shared/api.h>
+
+/*
+ * Cooked texture file format, written by src/cooker/cooker.c
+ *
+ *   TextureFileHeader
+ *   u8 pixels[data_size]
+ *
+ * pixels start at data_offset and hold every mip level back to back
+ * exactly like Image does, 1 or 4 channels in the layout createTexture()
+ * uploads. Loading is mapping the file and pointing an Image at it.
+ */
+
+#define TEXTURE_FILE_MAGIC   0x58455453 /* "STEX" */
+#define TEXTURE_FILE_VERSION 1
+
+/* Pixels are linear, otherwise sRGB encoded */
+#define TEXTURE_FILE_LINEAR 0x1
+
+typedef struct TextureFileHeader {
+    u32 magic;
+    u32 version;
+    u32 width;
+    u32 height;
+    u32 channels;
+    u32 mip_count;
+    u32 flags;
+    u32 data_offset;
+    u64 data_size;
+} TextureFileHeader;
+
+/* Points image at the pixels of a cooked file in data, false if it's malformed */
+static inline bool texture_file_image(u8 *data, u64 size, Image *image) {
+    const TextureFileHeader *header = (const TextureFileHeader *) data;
+    if (size < sizeof(TextureFileHeader) ||
+        header->magic != TEXTURE_FILE_MAGIC ||
+        header->version != TEXTURE_FILE_VERSION ||
+        header->width == 0 || header->height == 0 ||
+        (header->channels != 1 && header->channels != 4) ||
+        header->mip_count == 0 || header->mip_count > 32 ||
+        header->data_offset < sizeof(TextureFileHeader) ||
+        header->data_offset > size ||
+        header->data_size > size - header->data_offset) {
+        return false;
+    }
+
+    *image = (Image) {
+        .pixels = data + header->data_offset,
+        .width = header->width,
+        .height = header->height,
+        .channels = header->channels,
+        .mip_count = header->mip_count,
+        .is_linear = (header->flags & TEXTURE_FILE_LINEAR) != 0,
+    };
+    return image_size(image) == header->data_size;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <shared/types.h>
+
+/* Decodes the codepoint at *i and moves past it, malformed input decodes to U+FFFD */
+static inline u32 utf8_decode(const char *text, u32 length, u32 *i) {
+    const u8 *p = (const u8 *) text + *i;
+    const u32 remaining = length - *i;
+
+    u32 count = 0;
+    u32 codepoint = 0;
+    if (p[0] < 0x80) {
+        *i += 1;
+        return p[0];
+    } else if ((p[0] & 0xe0) == 0xc0) {
+        count = 2;
+        codepoint = p[0] & 0x1f;
+    } else if ((p[0] & 0xf0) == 0xe0) {
+        count = 3;
+        codepoint = p[0] & 0x0f;
+    } else if ((p[0] & 0xf8) == 0xf0) {
+        count = 4;
+        codepoint = p[0] & 0x07;
+    }
+
+    if (count == 0 || count > remaining) {
+        *i += 1;
+        return 0xfffd;
+    }
+    for (u32 j = 1; j < count; ++j) {
+        if ((p[j] & 0xc0) != 0x80) {
+            *i += j;
+            return 0xfffd;
+        }
+        codepoint = (codepoint << 6) | (p[j] & 0x3f);
+    }
+
+    *i += count;
+    return codepoint;
+}
@@ -0,0 +1,414 @@
+/*
+ * Parallel font atlas baking
+ *
+ * Bakes the ASCII glyphs of any number of faces and sizes at once.
+ * FreeType objects can't be shared between threads, so every worker
+ * has its own FT_Library and opens its own FT_Face of each font it
+ * touches, on top of font files read once up front. Workers take
+ * batches of glyphs from a shared counter, which keeps every core busy
+ * no matter how glyphs are spread over faces.
+ *
+ * Packing and filling the atlases happens afterwards on the calling
+ * thread, it is cheap next to rasterizing. Atlases found in the font
+ * cache (font_cache.c) aren't baked at all.
+ */
+
+#include <shared/pack_rectangles.h>
+#include <stdatomic.h>
+
+/* Glyphs a worker takes at a time */
+#define FONT_BAKE_BATCH 16
+
+typedef struct FontBake {
+    /* Input */
+    const char *path;
+    u32 pixel_size;
+    /* Non-zero to bake distance fields padded by this many pixels, see shared/sdf.h */
+    u32 sdf_spread;
+    /* Always bake, without reading or writing the font cache */
+    bool no_cache;
+
+    /* Output, font_map is in packing order like pack_rectangles() leaves it */
+    bool ok;
+    Image atlas;
+    PackRect *font_map;
+    FontInfo *font_info;
+
+    /* Set if the output points into a mapped cache file, see font_bake_release() */
+    void *cache_map;
+    u64 cache_map_size;
+} FontBake;
+
+#include "font_cache.c"
+
+typedef struct BakedGlyph {
+    u8 *pixels;
+    u32 width;
+    u32 height;
+} BakedGlyph;
+
+typedef struct FontBakeJob {
+    FontBake *bakes;
+    u32 bake_count;
+
+    /* Per bake, mapped, bakes of the same path share the file */
+    u8 **files;
+    u64 *file_sizes;
+
+    /* Indices of the bakes that missed the cache */
+    u32 *work;
+    u32 work_count;
+
+    /* bake_count*NUM_CHARS, bake major */
+    BakedGlyph *glyphs;
+    /* work_count*NUM_CHARS, glyph i is glyph i % NUM_CHARS of bake work[i / NUM_CHARS] */
+    u32 glyph_count;
+    atomic_uint next_glyph;
+    atomic_bool *failed;
+} FontBakeJob;
+
+/*
+ * Renders codepoint of face as coverage, or as a distance field padded
+ * by sdf_spread pixels, see shared/sdf.h. The pixels live in *memory,
+ * grown as needed, until the next call with it. Shared by font_bake()
+ * and the loader's on demand glyphs so both come out the same.
+ */
+static bool font_render_glyph(FT_Face face, u32 codepoint, u32 sdf_spread,
+                              u8 **memory, u64 *memory_size, GlyphBitmap *glyph) {
+    if (FT_Load_Char(face, codepoint, FT_LOAD_RENDER)) {
+        return false;
+    }
+
+    FT_GlyphSlot slot = face->glyph;
+    FT_Bitmap *bitmap = &slot->bitmap;
+    /* Empty glyphs (space) stay empty, there is nothing to pad */
+    const u32 padding = (bitmap->width > 0 && bitmap->rows > 0) ? sdf_spread : 0;
+
+    *glyph = (GlyphBitmap) {
+        .pixels = NULL,
+        .width = bitmap->width + 2*padding,
+        .height = bitmap->rows + 2*padding,
+        .stride = bitmap->width + 2*padding,
+        .offset_x = slot->bitmap_left - (i32) padding,
+        .offset_y = slot->bitmap_top + (i32) padding,
+        .advance = slot->advance.x,
+    };
+    if (bitmap->width == 0 || bitmap->rows == 0) {
+        return true;
+    }
+
+    /* Distance field scratch goes after the pixels, kept float aligned */
+    const u64 scratch_offset = ((u64) glyph->width*glyph->height + 15) & ~15ull;
+    const u64 size = (padding > 0) ? scratch_offset + sdf_scratch_size(bitmap->width, bitmap->rows, padding)
+                                   : (u64) glyph->width*glyph->height;
+    if (size > *memory_size) {
+        platformMemoryFree(*memory);
+        *memory_size = 2*size;
+        *memory = platformMemoryAllocate(*memory_size);
+    }
+    glyph->pixels = *memory;
+
+    if (padding > 0) {
+        sdf_generate(bitmap->buffer, bitmap->width, bitmap->rows, bitmap->pitch, padding,
+                     glyph->pixels, glyph->stride, *memory + scratch_offset);
+    } else {
+        for (u32 y = 0; y < bitmap->rows; ++y) {
+            memcpy(glyph->pixels + y*glyph->stride, bitmap->buffer + y*bitmap->pitch, bitmap->width);
+        }
+    }
+
+    return true;
+}
+
+static void font_bake_glyph(FontBakeJob *job, FT_Face face, u32 bake_index, u32 codepoint,
+                            u8 **memory, u64 *memory_size) {
+    FontBake *bake = &job->bakes[bake_index];
+    BakedGlyph *glyph = &job->glyphs[bake_index*NUM_CHARS + codepoint];
+
+    GlyphBitmap bitmap;
+    if (!font_render_glyph(face, codepoint, bake->sdf_spread, memory, memory_size, &bitmap)) {
+        platformLog(LOG_ERROR, "FreeType: Could not load glyph %u of %s", codepoint, bake->path);
+        atomic_store(&job->failed[bake_index], true);
+        return;
+    }
+
+    /* Every worker writes its own entries, no locking needed */
+    bake->font_info[codepoint] = (FontInfo) {
+        .codepoint = codepoint,
+        .advance   = bitmap.advance,
+        .offset_x  = bitmap.offset_x,
+        .offset_y  = bitmap.offset_y,
+    };
+
+    glyph->width = bitmap.width;
+    glyph->height = bitmap.height;
+    glyph->pixels = NULL;
+    if (!bitmap.pixels) {
+        return;
+    }
+
+    /* The render memory is reused by the next glyph, keep a copy for packing */
+    glyph->pixels = platformMemoryAllocate(glyph->width*glyph->height);
+    memcpy(glyph->pixels, bitmap.pixels, glyph->width*glyph->height);
+}
+
+static void *font_bake_worker(void *data) {
+    FontBakeJob *job = data;
+
+    FT_Library ft;
+    if (FT_Init_FreeType(&ft)) {
+        platformLog(LOG_ERROR, "FreeType: Could not init!");
+        /*
+         * Nothing this worker would have taken gets baked, and it may be
+         * the only one. Fail the bakes rather than pack missing glyphs.
+         */
+        for (u32 i = 0; i < job->work_count; ++i) {
+            atomic_store(&job->failed[job->work[i]], true);
+        }
+        return NULL;
+    }
+
+    /* Opened on first use, a worker may never see some of the bakes */
+    FT_Face faces[job->bake_count];
+    memset(faces, 0, sizeof(faces));
+
+    u8 *memory = NULL;
+    u64 memory_size = 0;
+
+    for (;;) {
+        const u32 first = atomic_fetch_add(&job->next_glyph, FONT_BAKE_BATCH);
+        if (first >= job->glyph_count) {
+            break;
+        }
+
+        const u32 end = MIN(first + FONT_BAKE_BATCH, job->glyph_count);
+        for (u32 i = first; i < end; ++i) {
+            const u32 b = job->work[i / NUM_CHARS];
+            if (atomic_load(&job->failed[b])) {
+                continue;
+            }
+
+            if (!faces[b]) {
+                if (FT_New_Memory_Face(ft, job->files[b], job->file_sizes[b], 0, &faces[b]) ||
+                    FT_Set_Pixel_Sizes(faces[b], 0, job->bakes[b].pixel_size)) {
+                    platformLog(LOG_ERROR, "FreeType: Could not open face %s!", job->bakes[b].path);
+                    atomic_store(&job->failed[b], true);
+                    faces[b] = NULL;
+                    continue;
+                }
+            }
+
+            font_bake_glyph(job, faces[b], b, i % NUM_CHARS, &memory, &memory_size);
+        }
+    }
+
+    platformMemoryFree(memory);
+    for (u32 b = 0; b < job->bake_count; ++b) {
+        if (faces[b]) {
+            FT_Done_Face(faces[b]);
+        }
+    }
+    FT_Done_FreeType(ft);
+
+    return NULL;
+}
+
+/*
+ * Packs the glyphs of a bake into an atlas as wide as a square holding
+ * all of them, and only as high as the packing ends up. False if the
+ * packer ran out of room.
+ */
+static bool font_bake_pack(FontBakeJob *job, u32 bake_index) {
+    FontBake *bake = &job->bakes[bake_index];
+    BakedGlyph *glyphs = &job->glyphs[bake_index*NUM_CHARS];
+
+    u64 area = 0;
+    u32 max_width = 1;
+    u32 total_height = 0;
+    for (u32 i = 0; i < NUM_CHARS; ++i) {
+        bake->font_map[i] = (PackRect) {
+            .width = glyphs[i].width,
+            .height = glyphs[i].height,
+            .user_id = i,
+        };
+        area += (u64) glyphs[i].width*glyphs[i].height;
+        max_width = MAX(max_width, glyphs[i].width);
+        total_height += glyphs[i].height;
+    }
+    quicksort(bake->font_map, sizeof(PackRect), NUM_CHARS, compare_pack_rects);
+
+    const u32 width = MAX(max_width, (u32) ceil(sqrt((f64) area)));
+    PackSkylineNode nodes[2*NUM_CHARS + 1];
+    PackFreeRect free_rects[2*NUM_CHARS];
+    PackSkyline packer;
+    pack_skyline_init(&packer, width, MAX(total_height, 1), nodes, ARRLEN(nodes), free_rects, ARRLEN(free_rects), 1);
+
+    /* Stacking every glyph fits in total_height, so this only fails on a packer bug */
+    u32 height = 1;
+    for (u32 i = 0; i < NUM_CHARS; ++i) {
+        if (!pack_skyline_insert(&packer, &bake->font_map[i])) {
+            platformLog(LOG_ERROR, "Could not pack the glyphs of %s into a %ux%u atlas!", bake->path, width, total_height);
+            return false;
+        }
+        height = MAX(height, bake->font_map[i].y + bake->font_map[i].height);
+    }
+
+    bake->atlas = (Image) {
+        .pixels = platformMemoryAllocate(width*height),
+        .width = width,
+        .height = height,
+        .channels = 1,
+        .is_linear = true,
+        .is_filtered = true,
+    };
+    memset(bake->atlas.pixels, 0, width*height);
+
+    for (u32 i = 0; i < NUM_CHARS; ++i) {
+        PackRect *rect = &bake->font_map[i];
+        BakedGlyph *glyph = &glyphs[rect->user_id];
+        for (u32 y = 0; y < glyph->height; ++y) {
+            memcpy(bake->atlas.pixels + (rect->y + y)*width + rect->x, glyph->pixels + y*glyph->width, glyph->width);
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Bakes every request in bakes, with up to thread_count threads (0 for
+ * one per core) including the calling one. Returns false if any of them
+ * failed, see FontBake.ok.
+ */
+static bool font_bake(FontBake *bakes, u32 bake_count, u32 thread_count) {
+    const Time start = platformTimeCurrent();
+
+    FontBakeJob job = {
+        .bakes = bakes,
+        .bake_count = bake_count,
+        .files = platformMemoryAllocate(bake_count*sizeof(u8 *)),
+        .file_sizes = platformMemoryAllocate(bake_count*sizeof(u64)),
+        .work = platformMemoryAllocate(bake_count*sizeof(u32)),
+        .glyphs = platformMemoryAllocate(bake_count*NUM_CHARS*sizeof(BakedGlyph)),
+        .failed = platformMemoryAllocate(bake_count*sizeof(atomic_bool)),
+    };
+    atomic_init(&job.next_glyph, 0);
+    memset(job.glyphs, 0, bake_count*NUM_CHARS*sizeof(BakedGlyph));
+
+    u64 *keys = platformMemoryAllocate(bake_count*sizeof(u64));
+    u32 cached_count = 0;
+    for (u32 b = 0; b < bake_count; ++b) {
+        bakes[b].ok = false;
+        bakes[b].atlas = (Image) {0};
+        bakes[b].cache_map = NULL;
+        bakes[b].cache_map_size = 0;
+        atomic_init(&job.failed[b], false);
+
+        job.files[b] = NULL;
+        job.file_sizes[b] = 0;
+        bool is_shared = false;
+        for (u32 other = 0; other < b; ++other) {
+            if (strcmp(bakes[other].path, bakes[b].path) == 0) {
+                job.files[b] = job.files[other];
+                job.file_sizes[b] = job.file_sizes[other];
+                is_shared = true;
+                break;
+            }
+        }
+        if (!is_shared) {
+            job.files[b] = platformFileMap(bakes[b].path, &job.file_sizes[b]);
+        }
+        if (!job.files[b]) {
+            platformLog(LOG_ERROR, "Could not read font %s!", bakes[b].path);
+            bakes[b].font_map = NULL;
+            bakes[b].font_info = NULL;
+            atomic_store(&job.failed[b], true);
+            continue;
+        }
+
+        keys[b] = font_cache_key(job.files[b], job.file_sizes[b], bakes[b].pixel_size, bakes[b].sdf_spread);
+        if (!bakes[b].no_cache && font_cache_load(&bakes[b], keys[b])) {
+            cached_count++;
+            continue;
+        }
+
+        bakes[b].font_map = platformMemoryAllocate(NUM_CHARS*sizeof(PackRect));
+        bakes[b].font_info = platformMemoryAllocate(NUM_CHARS*sizeof(FontInfo));
+        memset(bakes[b].font_info, 0, NUM_CHARS*sizeof(FontInfo));
+        job.work[job.work_count++] = b;
+    }
+    job.glyph_count = job.work_count*NUM_CHARS;
+
+    if (thread_count == 0) {
+        thread_count = platformProcessorCount();
+    }
+    /* No threads and no FreeType at all if everything was cached */
+    const u32 batch_count = (job.glyph_count + FONT_BAKE_BATCH - 1) / FONT_BAKE_BATCH;
+    thread_count = MIN(thread_count, batch_count);
+
+    if (thread_count > 0) {
+        PlatformThread *threads[thread_count];
+        for (u32 i = 1; i < thread_count; ++i) {
+            threads[i] = platformThreadCreate(font_bake_worker, &job);
+        }
+        font_bake_worker(&job);
+        for (u32 i = 1; i < thread_count; ++i) {
+            if (threads[i]) {
+                platformThreadJoin(threads[i]);
+            }
+        }
+    }
+
+    for (u32 b = 0; b < bake_count; ++b) {
+        bakes[b].ok = !atomic_load(&job.failed[b]);
+    }
+    for (u32 i = 0; i < job.work_count; ++i) {
+        const u32 b = job.work[i];
+        if (bakes[b].ok) {
+            bakes[b].ok = font_bake_pack(&job, b);
+            if (bakes[b].ok && !bakes[b].no_cache) {
+                font_cache_store(&bakes[b], keys[b]);
+            }
+        }
+    }
+    bool ok = true;
+    for (u32 b = 0; b < bake_count; ++b) {
+        ok = ok && bakes[b].ok;
+    }
+
+    for (u32 i = 0; i < bake_count*NUM_CHARS; ++i) {
+        platformMemoryFree(job.glyphs[i].pixels);
+    }
+    for (u32 b = 0; b < bake_count; ++b) {
+        bool is_shared = false;
+        for (u32 other = 0; other < b; ++other) {
+            is_shared = is_shared || job.files[other] == job.files[b];
+        }
+        if (!is_shared) {
+            platformFileUnmap(job.files[b], job.file_sizes[b]);
+        }
+    }
+    platformMemoryFree(keys);
+    platformMemoryFree(job.files);
+    platformMemoryFree(job.file_sizes);
+    platformMemoryFree(job.work);
+    platformMemoryFree(job.glyphs);
+    platformMemoryFree(job.failed);
+
+    const u64 ns = platformTimeToNanoseconds(platformTimeSubtract(platformTimeCurrent(), start));
+    platformLog(LOG_INFO, "Baked %u font atlases (%u cached) on %u threads in %.2f ms",
+                bake_count, cached_count, thread_count, ns/1e6);
+
+    return ok;
+}
+
+/* Frees the output of a bake, or unmaps it if it came from the cache */
+static void font_bake_release(FontBake *bake) {
+    if (bake->cache_map) {
+        platformFileUnmap(bake->cache_map, bake->cache_map_size);
+    } else {
+        platformMemoryFree(bake->font_map);
+        platformMemoryFree(bake->font_info);
+        platformMemoryFree(bake->atlas.pixels);
+    }
+    *bake = (FontBake) {0};
+}
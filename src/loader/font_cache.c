@@ -0,0 +1,133 @@
+/*
+ * Baked font atlas cache
+ *
+ * A baked atlas is written next to the executable as a single file
+ *
+ *   FontCacheHeader header
+ *   PackRect        font_map[num_chars]
+ *   FontInfo        font_info[num_chars]
+ *   u8              pixels[atlas_width*atlas_height]
+ *
+ * named after a key hashed from the font file contents, pixel size,
+ * distance field spread and glyph set. A later bake of the same font
+ * maps the file and points font_map, font_info and the atlas straight
+ * into the mapping, FreeType isn't touched. Anything that doesn't
+ * match, a file of the wrong size or a glyph rectangle outside the
+ * atlas counts as a miss and is rebaked and rewritten.
+ */
+
+#include <shared/hash.h>
+
+#define FONT_CACHE_MAGIC   0x43544e46 /* "FNTC" */
+#define FONT_CACHE_VERSION 1
+
+typedef struct FontCacheHeader {
+    u32 magic;
+    u32 version;
+    u64 key;
+
+    u32 pixel_size;
+    u32 sdf_spread;
+    /* Glyph set, codepoints [0, num_chars) */
+    u32 num_chars;
+
+    u32 atlas_width;
+    u32 atlas_height;
+    u32 reserved;
+} FontCacheHeader;
+
+static u64 font_cache_key(const u8 *font_file, u64 font_file_size, u32 pixel_size, u32 sdf_spread) {
+    const u32 params[] = {FONT_CACHE_VERSION, pixel_size, sdf_spread, NUM_CHARS};
+    u64 key = hash_fnv1a(HASH_FNV1A_SEED, font_file, font_file_size);
+    return hash_fnv1a(key, params, sizeof(params));
+}
+
+static void font_cache_path(char *path, u32 size, u64 key) {
+    snprintf(path, size, "fontcache-%016llx.bin", (unsigned long long) key);
+}
+
+static u64 font_cache_file_size(u32 atlas_width, u32 atlas_height) {
+    return sizeof(FontCacheHeader) + NUM_CHARS*(sizeof(PackRect) + sizeof(FontInfo)) + (u64) atlas_width*atlas_height;
+}
+
+/* Points bake at a cached atlas for key, false on a miss */
+static bool font_cache_load(FontBake *bake, u64 key) {
+    char path[64];
+    font_cache_path(path, sizeof(path), key);
+
+    u64 size = 0;
+    u8 *map = platformFileMap(path, &size);
+    if (!map) {
+        return false;
+    }
+
+    const FontCacheHeader *header = (const FontCacheHeader *) map;
+    if (size < sizeof(FontCacheHeader) ||
+        header->magic != FONT_CACHE_MAGIC ||
+        header->version != FONT_CACHE_VERSION ||
+        header->key != key ||
+        header->pixel_size != bake->pixel_size ||
+        header->sdf_spread != bake->sdf_spread ||
+        header->num_chars != NUM_CHARS ||
+        size != font_cache_file_size(header->atlas_width, header->atlas_height)) {
+        platformLog(LOG_WARNING, "Font cache %s is stale, rebaking", path);
+        platformFileUnmap(map, size);
+        return false;
+    }
+
+    /* The renderer copies glyphs out of the atlas by these, a bad one would read past it */
+    const PackRect *rects = (const PackRect *) (map + sizeof(FontCacheHeader));
+    for (u32 i = 0; i < NUM_CHARS; ++i) {
+        if (rects[i].user_id >= NUM_CHARS ||
+            (u64) rects[i].x + rects[i].width > header->atlas_width ||
+            (u64) rects[i].y + rects[i].height > header->atlas_height) {
+            platformLog(LOG_WARNING, "Font cache %s has a glyph outside the atlas, rebaking", path);
+            platformFileUnmap(map, size);
+            return false;
+        }
+    }
+
+    u8 *p = map + sizeof(FontCacheHeader);
+    bake->font_map = (PackRect *) p;
+    p += NUM_CHARS*sizeof(PackRect);
+    bake->font_info = (FontInfo *) p;
+    p += NUM_CHARS*sizeof(FontInfo);
+    bake->atlas = (Image) {
+        .pixels = p,
+        .width = header->atlas_width,
+        .height = header->atlas_height,
+        .channels = 1,
+        .is_linear = true,
+        .is_filtered = true,
+    };
+
+    bake->cache_map = map;
+    bake->cache_map_size = size;
+    return true;
+}
+
+static void font_cache_store(const FontBake *bake, u64 key) {
+    char path[64];
+    font_cache_path(path, sizeof(path), key);
+
+    File file = platformFileOpen(path, "wb");
+    if (!file.fd) {
+        return;
+    }
+
+    FontCacheHeader header = {
+        .magic = FONT_CACHE_MAGIC,
+        .version = FONT_CACHE_VERSION,
+        .key = key,
+        .pixel_size = bake->pixel_size,
+        .sdf_spread = bake->sdf_spread,
+        .num_chars = NUM_CHARS,
+        .atlas_width = bake->atlas.width,
+        .atlas_height = bake->atlas.height,
+    };
+    platformFileWrite(file, &header, sizeof(header), 1);
+    platformFileWrite(file, bake->font_map, sizeof(PackRect), NUM_CHARS);
+    platformFileWrite(file, bake->font_info, sizeof(FontInfo), NUM_CHARS);
+    platformFileWrite(file, bake->atlas.pixels, (u64) bake->atlas.width*bake->atlas.height, 1);
+    platformFileClose(file);
+}
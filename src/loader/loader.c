@@ -9,6 +9,7 @@
 #include <shared/types.h>
 #include <shared/api.h>
 #include <shared/input.h>
+#include <shared/sdf.h>
 
 /* libc */
 #include <stdbool.h>
@@ -65,6 +66,12 @@ static char *renderer_function_names[] = {
     "end_frame"
 };
 
+/* Module of each RendererBackend, next to the loader */
+static const char *const renderer_module_names[RENDERER_BACKEND_COUNT] = {
+    [RENDERER_VULKAN] = "/librenderer",
+    [RENDERER_SOFT]   = "/librenderer_soft",
+};
+
 /*
  * Frame input
  */
@@ -84,6 +91,9 @@ static DebugInputType global_debug_key_map[GLFW_KEY_LAST] = {
     [GLFW_KEY_2] = DEBUG_INPUT_RECORD_STOP,
     [GLFW_KEY_3] = DEBUG_INPUT_REPLAY_START,
     [GLFW_KEY_4] = DEBUG_INPUT_REPLAY_STOP,
+    [GLFW_KEY_5] = DEBUG_INPUT_LATENCY_NEXT,
+    [GLFW_KEY_6] = DEBUG_INPUT_RENDERER_NEXT,
+    [GLFW_KEY_7] = DEBUG_INPUT_PAUSE,
 };
 
 #include "glfw_input.c"
@@ -119,6 +129,18 @@ static inline void unloadCodeModule(CodeModule *module) {
     platformDynamicLibClose(module->handle);
 }
 
+static inline bool isCodeModuleComplete(CodeModule *module) {
+    if (!module->handle) {
+        return false;
+    }
+    for (u8 i = 0; i < module->function_count; ++i) {
+        if (!module->functions[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static inline void reloadCodeModuleIfNeeded(CodeModule *module) {
     u64 new_modify_time = platformFileLastModify(module->path);
     if (new_modify_time > module->last_modify_time) {
@@ -150,63 +172,208 @@ static inline void endFrame(FrameInfo *frame_info) {
     frame_info->total_frame_count++;
 }
 
-static void load_font_atlas(FT_Face face, uint32_t font_size, Image *image, PackRect **font_map, FontInfo **font_info) {
-
-    *font_map = platformMemoryAllocate(NUM_CHARS*sizeof(PackRect));
-    *font_info = platformMemoryAllocate(NUM_CHARS*sizeof(FontInfo));
-
-    /* Load font rects */
-    for (u8 i = 0; i < NUM_CHARS; ++i) {
-        FT_UInt glyph_index = FT_Get_Char_Index(face, i);
-        if (FT_Load_Char(face, glyph_index, FT_LOAD_BITMAP_METRICS_ONLY)) {
-            platformLog(LOG_ERROR, "FreeType: Could not load glyph for character: %c", i);
-            return;
+static bool parseLatencyMode(const char *name, LatencyMode *mode) {
+    for (u32 i = 0; i < LATENCY_MODE_COUNT; ++i) {
+        if (strcmp(name, latency_mode_names[i]) == 0) {
+            *mode = (LatencyMode) i;
+            return true;
         }
+    }
+    return false;
+}
 
-        (*font_map)[i].width = face->glyph->bitmap.width;
-        (*font_map)[i].height = face->glyph->bitmap.rows;
-        (*font_map)[i].user_id = glyph_index;
+static bool parseRendererBackend(const char *name, RendererBackend *backend) {
+    for (u32 i = 0; i < RENDERER_BACKEND_COUNT; ++i) {
+        if (strcmp(name, renderer_backend_names[i]) == 0) {
+            *backend = (RendererBackend) i;
+            return true;
+        }
+    }
+    return false;
+}
 
-        (*font_info)[i].codepoint = glyph_index;
-        (*font_info)[i].advance   = face->glyph->advance.x;
-        (*font_info)[i].offset_x  = face->glyph->bitmap_left;
-        (*font_info)[i].offset_y  = face->glyph->bitmap_top;
+/*
+ * Replaces the running renderer module with the one of
+ * renderer->settings->backend, between frames. The Renderer, and with
+ * it the render memory, fonts and texture registry, stays the same.
+ * Textures the old module made resident are marked pending so the new
+ * one uploads them, and a capture in progress carries over. If the new
+ * module doesn't load the old one keeps running.
+ */
+static void swapRendererModule(Renderer *renderer, CodeModule *modules, RendererBackend *active) {
+    const RendererBackend next = renderer->settings->backend;
+    CodeModule *old_module = &modules[*active];
+    CodeModule *new_module = &modules[next];
+
+    new_module->last_modify_time = platformFileLastModify(new_module->path);
+    loadCodeModule(new_module);
+    if (!isCodeModuleComplete(new_module)) {
+        platformLog(LOG_ERROR, "Renderer: can't switch to %s, staying on %s",
+                    renderer_backend_names[next], renderer_backend_names[*active]);
+        if (new_module->handle) {
+            unloadCodeModule(new_module);
+            new_module->handle = NULL;
+        }
+        renderer->settings->backend = *active;
+        return;
     }
 
-    const u32 pack_width = sqrt(font_size*font_size*NUM_CHARS);
-    const u32 pack_height = pack_width;
-    PackNode nodes[pack_width+2];
-    PackContext pack_context = {
-        .width = pack_width,
-        .height = pack_height,
-        .num_nodes = pack_width + 2,
-        .nodes = nodes,
-    };
-    pack_rectangles(&pack_context, *font_map, NUM_CHARS);
-
-    u8 pack_pixels[pack_width*pack_height];
-    memset(pack_pixels, 0, pack_width*pack_height*sizeof(u8));
-    for (u8 i = 0; i < NUM_CHARS; ++i) {
-        u8 index = (*font_map)[i].user_id;
-        if (FT_Load_Char(face, index, FT_LOAD_RENDER)) {
-            platformLog(LOG_ERROR, "FreeType: Could not load glyph for character: %c", i);
-            return;
+    /* Shutting down closes the capture file, the new module keeps writing to it */
+    RenderCapture capture = renderer->capture;
+    renderer->capture = (RenderCapture) {0};
+    ((RendererFunctionTable *) old_module->functions)->shutdown(renderer);
+    unloadCodeModule(old_module);
+    old_module->handle = NULL;
+
+    if (renderer->textures) {
+        for (u32 i = 1; i < MAX_TEXTURES; ++i) {
+            TextureSlot *slot = &renderer->textures->slots[i];
+            if (slot->state == TEXTURE_RESIDENT) {
+                slot->state = TEXTURE_PENDING;
+                slot->upload_generation++;
+            }
         }
-        if ((*font_map)[i].width > 0 && (*font_map)[i].height > 0) {
-            for (u32 y = 0; y < (*font_map)[i].height; ++y) {
-                for (u32 x = 0; x < (*font_map)[i].width; ++x) {
-                    pack_pixels[((*font_map)[i].y + y)*pack_width + (*font_map)[i].x + x] = face->glyph->bitmap.buffer[y*(*font_map)[i].width + x];
-                }
+    }
+    if (renderer->layers) {
+        for (u32 i = 1; i < MAX_LAYERS; ++i) {
+            LayerSlot *slot = &renderer->layers->slots[i];
+            if (slot->state == TEXTURE_RESIDENT) {
+                slot->state = TEXTURE_PENDING;
             }
         }
     }
 
-    image->pixels = platformMemoryAllocate(pack_width*pack_height*sizeof(u8));
-    image->width = pack_width;
-    image->height = pack_height;
-    image->channels = 1;
+    /* Latency and GPU times of the old module don't carry over */
+    if (renderer->profile) {
+        renderer->profile->latency_ns = 0;
+        renderer->profile->latency_average_ns = 0;
+        renderer->profile->gpu_available = false;
+    }
+
+    renderer->context = NULL;
+    ((RendererFunctionTable *) new_module->functions)->startup(renderer);
+    renderer->capture = capture;
+
+    platformLog(LOG_INFO, "Renderer: switched from %s to %s", renderer_backend_names[*active], renderer_backend_names[next]);
+    *active = next;
+}
+
+/* Adds the time since *start to phase and restarts *start */
+static inline void profilePhase(u64 *cpu_ns, ProfileCpuPhase phase, Time *start) {
+    Time now = platformTimeCurrent();
+    cpu_ns[phase] += platformTimeToNanoseconds(platformTimeSubtract(now, *start));
+    *start = now;
+}
+
+/* Pixel size and distance range, in atlas pixels, of distance field atlases */
+#define FONT_SDF_ATLAS_SIZE 32
+#define FONT_SDF_SPREAD     4
+
+#define FONT_PATH "res/fonts/lmmono12-regular.otf"
+
+#include "font_baker.c"
+
+/*
+ * ASCII glyphs come out of the baked atlas, which is mapped straight
+ * from the font cache when it hits. FreeType is only opened for the
+ * first glyph outside of it, so a cached start never touches it.
+ */
+static const Image *global_baked_atlas = NULL;
+static const FontInfo *global_baked_info = NULL;
+static const PackRect *global_baked_rects[NUM_CHARS];
+
+static const char *global_font_path = NULL;
+static u32 global_font_pixel_size = 0;
+static u32 global_font_sdf_spread = 0;
+static bool global_font_failed = false;
+static FT_Library global_ft = NULL;
+static FT_Face global_font_face = NULL;
+static u8 *global_font_file = NULL;
+static u64 global_font_file_size = 0;
+static u8 *global_glyph_memory = NULL;
+static u64 global_glyph_memory_size = 0;
+
+static void use_baked_font(const FontBake *bake) {
+    global_baked_atlas = &bake->atlas;
+    global_baked_info = bake->font_info;
+    memset(global_baked_rects, 0, sizeof(global_baked_rects));
+    for (u32 i = 0; i < NUM_CHARS; ++i) {
+        global_baked_rects[bake->font_map[i].user_id] = &bake->font_map[i];
+    }
+}
+
+static bool open_font_face(void) {
+    if (global_font_face) {
+        return true;
+    }
+    /* Don't retry every glyph if the font is broken */
+    if (global_font_failed) {
+        return false;
+    }
+    global_font_failed = true;
+
+    if (FT_Init_FreeType(&global_ft)) {
+        platformLog(LOG_ERROR, "FreeType: Could not init!");
+        global_ft = NULL;
+        return false;
+    }
+
+    global_font_file = platformFileMap(global_font_path, &global_font_file_size);
+    if (!global_font_file) {
+        platformLog(LOG_ERROR, "Could not read font %s!", global_font_path);
+        return false;
+    }
+
+    if (FT_New_Memory_Face(global_ft, global_font_file, global_font_file_size, 0, &global_font_face) ||
+        FT_Set_Pixel_Sizes(global_font_face, 0, global_font_pixel_size)) {
+        platformLog(LOG_ERROR, "FreeType: Could not open face %s!", global_font_path);
+        global_font_face = NULL;
+        return false;
+    }
+
+    global_font_failed = false;
+    return true;
+}
+
+static void close_font_face(void) {
+    /* The face reads from the mapped file for as long as it's open */
+    if (global_font_face) {
+        FT_Done_Face(global_font_face);
+    }
+    if (global_ft) {
+        FT_Done_FreeType(global_ft);
+    }
+    if (global_font_file) {
+        platformFileUnmap(global_font_file, global_font_file_size);
+    }
+    global_font_face = NULL;
+    global_ft = NULL;
+    global_font_file = NULL;
+}
 
-    memcpy(image->pixels, pack_pixels, pack_width*pack_height*sizeof(u8));
+/* Renders a single glyph for the renderer's glyph cache, like font_bake() does */
+static bool rasterize_glyph(u32 codepoint, GlyphBitmap *glyph) {
+    if (codepoint < NUM_CHARS && global_baked_atlas && global_baked_rects[codepoint]) {
+        const PackRect *rect = global_baked_rects[codepoint];
+        const FontInfo *info = &global_baked_info[codepoint];
+        *glyph = (GlyphBitmap) {
+            .pixels = global_baked_atlas->pixels + rect->y*global_baked_atlas->width + rect->x,
+            .width = rect->width,
+            .height = rect->height,
+            .stride = global_baked_atlas->width,
+            .offset_x = info->offset_x,
+            .offset_y = info->offset_y,
+            .advance = info->advance,
+        };
+        return true;
+    }
+
+    if (!open_font_face() || FT_Get_Char_Index(global_font_face, codepoint) == 0) {
+        return false;
+    }
+
+    return font_render_glyph(global_font_face, codepoint, global_font_sdf_spread,
+                             &global_glyph_memory, &global_glyph_memory_size, glyph);
 }
 
 /*
@@ -214,7 +381,54 @@ static void load_font_atlas(FT_Face face, uint32_t font_size, Image *image, Pack
  */
 
 int main(int argc, char **argv) {
-    (void)argc;
+    RenderCapture capture = {0};
+    RenderHeadless headless = {0};
+    u64 headless_frame_count = 0;
+    bool font_sdf = false;
+    bool paused = false;
+    RenderSettings render_settings = {
+        .latency_mode = LATENCY_BALANCED,
+    };
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--capture") == 0 && i + 3 < argc) {
+            capture.path = argv[i+1];
+            capture.first_frame = strtoull(argv[i+2], NULL, 10);
+            capture.frame_count = strtoull(argv[i+3], NULL, 10);
+            i += 3;
+        } else if (strcmp(argv[i], "--headless") == 0 && i + 3 < argc) {
+            headless.enabled = true;
+            headless.width = strtoul(argv[i+1], NULL, 10);
+            headless.height = strtoul(argv[i+2], NULL, 10);
+            headless_frame_count = strtoull(argv[i+3], NULL, 10);
+            i += 3;
+        } else if (strcmp(argv[i], "--readback") == 0 && i + 2 < argc &&
+                   (strcmp(argv[i+1], "png") == 0 || strcmp(argv[i+1], "raw") == 0)) {
+            headless.readback_format = (strcmp(argv[i+1], "png") == 0) ? READBACK_PNG : READBACK_RAW;
+            headless.readback_prefix = argv[i+2];
+            i += 2;
+        } else if (strcmp(argv[i], "--font-sdf") == 0) {
+            font_sdf = true;
+        } else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc && parseLatencyMode(argv[i+1], &render_settings.latency_mode)) {
+            i += 1;
+        } else if (strcmp(argv[i], "--depth") == 0) {
+            render_settings.depth_buffer = true;
+        } else if (strcmp(argv[i], "--renderer") == 0 && i + 1 < argc && parseRendererBackend(argv[i+1], &render_settings.backend)) {
+            i += 1;
+        } else if (strcmp(argv[i], "--paused") == 0) {
+            paused = true;
+        } else {
+            platformLog(LOG_ERROR, "usage: %s [--capture <file> <first frame> <frame count>] [--headless <width> <height> <frame count> [--readback png|raw <prefix>]] [--font-sdf] [--latency balanced|low|throughput|power-saving] [--depth] [--renderer vulkan|soft] [--paused]", argv[0]);
+            return 1;
+        }
+    }
+    if (headless.readback_format != READBACK_NONE && !headless.enabled) {
+        platformLog(LOG_ERROR, "--readback requires --headless");
+        return 1;
+    }
+    if (headless.enabled && (headless.width == 0 || headless.height == 0)) {
+        platformLog(LOG_ERROR, "--headless requires a non-zero width and height");
+        return 1;
+    }
 
     sds dir = sdsnew(argv[0]);
     /* Remove the executable name */
@@ -236,8 +450,11 @@ int main(int argc, char **argv) {
     sds debug_path = sdsnew(dir);
     debug_path = sdscat(debug_path, "/libdebug");
 
-    sds renderer_path = sdsnew(dir);
-    renderer_path = sdscat(renderer_path, "/librenderer");
+    sds renderer_paths[RENDERER_BACKEND_COUNT];
+    for (u32 i = 0; i < RENDERER_BACKEND_COUNT; ++i) {
+        renderer_paths[i] = sdsnew(dir);
+        renderer_paths[i] = sdscat(renderer_paths[i], renderer_module_names[i]);
+    }
 
     /* Frame info */
     FrameInfo frame_info = {
@@ -250,6 +467,12 @@ int main(int argc, char **argv) {
             .nanoseconds = (1.0f/60.0f) * 1000000000.0f,
         },
     };
+    /* Headless runs as fast as possible */
+    if (headless.enabled) {
+        frame_info.desired_time.nanoseconds = 0;
+    }
+
+    FrameProfile frame_profile = {0};
 
     /* Code Module */
     GameFunctionTable game_functions = {0};
@@ -272,15 +495,23 @@ int main(int argc, char **argv) {
     };
     loadCodeModule(&debug_module);
 
-    RendererFunctionTable renderer_functions = {0};
-    CodeModule renderer_module = {
-        .path = renderer_path,
-        .last_modify_time = platformFileLastModify(renderer_path),
-        .function_count = ARRLEN(renderer_function_names),
-        .functions = (void **) &renderer_functions,
-        .function_names = renderer_function_names,
-    };
-    loadCodeModule(&renderer_module);
+    /* Only the module of the active backend is loaded, the others might not load on this machine */
+    RendererFunctionTable renderer_function_tables[RENDERER_BACKEND_COUNT] = {0};
+    CodeModule renderer_modules[RENDERER_BACKEND_COUNT];
+    for (u32 i = 0; i < RENDERER_BACKEND_COUNT; ++i) {
+        renderer_modules[i] = (CodeModule) {
+            .path = renderer_paths[i],
+            .function_count = ARRLEN(renderer_function_names),
+            .functions = (void **) &renderer_function_tables[i],
+            .function_names = renderer_function_names,
+        };
+    }
+    RendererBackend renderer_backend = render_settings.backend;
+    renderer_modules[renderer_backend].last_modify_time = platformFileLastModify(renderer_paths[renderer_backend]);
+    loadCodeModule(&renderer_modules[renderer_backend]);
+
+    /* The calling thread is the last worker */
+    platformWorkersStart(platformProcessorCount() - 1);
 
     PlatformFunctionTable platform_functions = {
         .log = platformLog,
@@ -294,18 +525,38 @@ int main(int argc, char **argv) {
         .read_file_to_buffer = platformFileReadToBuffer,
         .file_write = platformFileWrite,
         .file_read = platformFileRead,
+        .file_map = platformFileMap,
+        .file_unmap = platformFileUnmap,
+
+        .time_current = platformTimeCurrent,
+
+        .run_workers = platformWorkersRun,
+        .worker_count = platformWorkerCount,
+
+        .font_rasterize_glyph = rasterize_glyph,
 
         .abort = platformAbort,
     };
 
+    /* Textures, shared between the game and renderer */
+    TextureRegistry *textures = platformMemoryAllocate(sizeof(TextureRegistry));
+    memset(textures, 0, sizeof(TextureRegistry));
+    LayerRegistry *layers = platformMemoryAllocate(sizeof(LayerRegistry));
+    memset(layers, 0, sizeof(LayerRegistry));
+
     GameMemory game_memory = {
         .platform = platform_functions,
         .frame_info = &frame_info,
+        .textures = textures,
+        .layers = layers,
+        .paused = paused,
     };
 
     DebugMemory debug_memory = {
         .platform = platform_functions,
         .frame_info = &frame_info,
+        .profile = &frame_profile,
+        .render_settings = &render_settings,
         .active_game_memory = &game_memory,
         .active_game_input = &global_frame_input,
     };
@@ -313,94 +564,118 @@ int main(int argc, char **argv) {
     Renderer renderer = {
         .platform = platform_functions,
         .frame_info = &frame_info,
+        .profile = &frame_profile,
+        .settings = &render_settings,
+        .textures = textures,
+        .layers = layers,
+        .capture = capture,
+        .headless = headless,
     };
 
     RenderCommands *frame = NULL;
 
     /* Load font */
 
-    FT_Library ft;
-    if (FT_Init_FreeType(&ft)) {
-        platformLog(LOG_ERROR, "FreeType: Could not init!");
-        return 1;
-    }
-
-    u8 *font = NULL;
-    u64 file_size = 0;
-    platformFileReadToBuffer("res/fonts/lmmono12-regular.otf", &font, &file_size);
-
-    FT_Open_Args args = {
-        .flags = FT_OPEN_MEMORY,
-        .memory_base = font,
-        .memory_size = file_size,
-        .pathname = NULL,
-        .stream = 0,
-        .driver = NULL,
-        .num_params = 0,
-        .params = NULL,
+    /* A distance field font is rasterized small and scaled to any text size */
+    const uint32_t font_size = 60;
+    const uint32_t atlas_size = (font_sdf) ? FONT_SDF_ATLAS_SIZE : font_size;
+    const uint32_t sdf_spread = (font_sdf) ? FONT_SDF_SPREAD : 0;
+
+    global_font_path = FONT_PATH;
+    global_font_pixel_size = atlas_size;
+    global_font_sdf_spread = sdf_spread;
+
+    /*
+     * The ASCII atlas is loaded from the font cache, or baked on every
+     * core on a miss, other glyphs are rasterized on demand by the
+     * renderer. Captures need the atlas too since replays have no
+     * FreeType.
+     */
+    FontBake baked_font = {
+        .path = FONT_PATH,
+        .pixel_size = atlas_size,
+        .sdf_spread = sdf_spread,
     };
-
-    FT_Face face;
-    if (FT_Open_Face(ft, &args, 0, &face)) {
-        platformLog(LOG_ERROR, "FreeType: Could not open face!");
+    if (!font_bake(&baked_font, 1, 0)) {
+        platformLog(LOG_ERROR, "Failed to bake font atlas!");
         return 2;
     }
 
-    platformMemoryFree(font);
-
-    uint32_t font_size = 60;
-    FT_Set_Pixel_Sizes(face, 0, font_size);
-
-    Image font_atlas;
-    PackRect *font_map;
-    FontInfo *font_info;
-    load_font_atlas(face, font_size, &font_atlas, &font_map, &font_info);
-    assert(font_map);
-
-    renderer.font_map = font_map;
-    renderer.font_atlas = &font_atlas;
-    renderer.font_info = font_info;
+    use_baked_font(&baked_font);
+    renderer.font_map = baked_font.font_map;
+    renderer.font_atlas = &baked_font.atlas;
+    renderer.font_info = baked_font.font_info;
+    /* Text draws from the glyph cache, only a replay samples the atlas itself */
+    if (capture.path) {
+        renderer.font_atlas_texture = textureRegister(textures, baked_font.atlas);
+    }
+    renderer.font_size = font_size;
+    renderer.font_atlas_size = atlas_size;
+    renderer.font_sdf_spread = sdf_spread;
 
     /* glfw init */
 
-    glfwInit();
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    //glfwWindowHint(GLFW_RESIZABLE, false);
-    renderer.window = glfwCreateWindow(800, 600, "spel", 0, 0);
-    glfwMakeContextCurrent(renderer.window);
+    if (!headless.enabled) {
+        glfwInit();
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+        //glfwWindowHint(GLFW_RESIZABLE, false);
+        renderer.window = glfwCreateWindow(800, 600, "spel", 0, 0);
+        glfwMakeContextCurrent(renderer.window);
 
-    set_glfw_input_callbacks(renderer.window);
+        set_glfw_input_callbacks(renderer.window);
+    }
 
     /* startup modules */
 
+    RendererFunctionTable renderer_functions = renderer_function_tables[renderer_backend];
     if (renderer_functions.startup) {
         renderer_functions.startup(&renderer);
     }
 
-    while (!glfwWindowShouldClose(renderer.window)) {
+    while ((headless.enabled) ? frame_info.total_frame_count < headless_frame_count : !glfwWindowShouldClose(renderer.window)) {
         beginFrame(&frame_info);
-        glfwPollEvents();
+        /* Phases of the previous frame stay readable to this frame's debug overlay */
+        u64 cpu_ns[PROFILE_CPU_COUNT] = {0};
+        Time phase_start = frame_info.start_time;
+
+        if (!headless.enabled) {
+            glfwPollEvents();
+        }
+        profilePhase(cpu_ns, PROFILE_CPU_INPUT, &phase_start);
 
         /* Call out to game modules */
         if (renderer_functions.begin_frame) {
             frame = renderer_functions.begin_frame(&renderer);
         }
+        profilePhase(cpu_ns, PROFILE_CPU_RENDER, &phase_start);
         if (debug_functions.pre_update) {
             debug_functions.pre_update((1.0f/60.0f), &debug_memory, &global_debug_frame_input, frame);
         }
+        profilePhase(cpu_ns, PROFILE_CPU_DEBUG, &phase_start);
         if (game_functions.update) {
             game_functions.update((1.0f/60.0f), &game_memory, &global_frame_input, frame);
         }
+        profilePhase(cpu_ns, PROFILE_CPU_UPDATE, &phase_start);
         if (debug_functions.post_update) {
             debug_functions.post_update((1.0f/60.0f), &debug_memory, &global_debug_frame_input, frame);
         }
+        profilePhase(cpu_ns, PROFILE_CPU_DEBUG, &phase_start);
         if (renderer_functions.end_frame) {
             renderer_functions.end_frame(&renderer, frame);
         }
+        profilePhase(cpu_ns, PROFILE_CPU_RENDER, &phase_start);
+
+        frame_profile.cpu_frame = frame_info.total_frame_count;
+        memcpy(frame_profile.cpu_ns, cpu_ns, sizeof(cpu_ns));
+
+        if (render_settings.backend != renderer_backend && render_settings.backend < RENDERER_BACKEND_COUNT) {
+            swapRendererModule(&renderer, renderer_modules, &renderer_backend);
+        }
 
         reloadCodeModuleIfNeeded(&debug_module);
         reloadCodeModuleIfNeeded(&game_module);
-        reloadCodeModuleIfNeeded(&renderer_module);
+        reloadCodeModuleIfNeeded(&renderer_modules[renderer_backend]);
+        renderer_functions = renderer_function_tables[renderer_backend];
 
         endFrame(&frame_info);
     }
@@ -408,19 +683,35 @@ int main(int argc, char **argv) {
     if (renderer_functions.shutdown) {
         renderer_functions.shutdown(&renderer);
     }
+    platformWorkersStop();
+
+    platformLog(LOG_INFO, "%llu frames, %llu submitted without recording (%.2f ms of recording saved)",
+                (unsigned long long) frame_info.total_frame_count, (unsigned long long) frame_profile.reused_count,
+                frame_profile.record_saved_ns/1e6);
+
+    global_baked_atlas = NULL;
+    font_bake_release(&baked_font);
+    platformMemoryFree(textures);
+    platformMemoryFree(layers);
 
-    platformMemoryFree(font_map);
-    platformMemoryFree(font_atlas.pixels);
+    close_font_face();
+    platformMemoryFree(global_glyph_memory);
 
-    glfwDestroyWindow(renderer.window);
-    glfwTerminate();
+    if (!headless.enabled) {
+        glfwDestroyWindow(renderer.window);
+        glfwTerminate();
+    }
 
     unloadCodeModule(&debug_module);
     unloadCodeModule(&game_module);
-    unloadCodeModule(&renderer_module);
+    if (renderer_modules[renderer_backend].handle) {
+        unloadCodeModule(&renderer_modules[renderer_backend]);
+    }
 
     sdsfree(game_path);
-    sdsfree(renderer_path);
+    for (u32 i = 0; i < RENDERER_BACKEND_COUNT; ++i) {
+        sdsfree(renderer_paths[i]);
+    }
     sdsfree(dir);
 
     return 0;
@@ -25,6 +25,8 @@ void  platformFileReadToBuffer(const char *path, u8 **buffer, u64 *size);
 void  platformFileWrite(File file, void *ptr, u64 size, u64 amount);
 void  platformFileRead(File file, void *ptr, u64 size, u64 amount);
 u64   platformFileLastModify(const char *path);
+void *platformFileMap(const char *path, u64 *size);
+void  platformFileUnmap(void *ptr, u64 size);
 
 Time platformTimeCurrent();
 Time platformTimeSubtract(Time t0, Time t1);
@@ -34,5 +36,19 @@ bool platformTimeEarlierThan(Time t0, Time t1);
 /* Sleep */
 void platformSleepNanoseconds(Time t);
 
+/* Threads */
+typedef struct PlatformThread PlatformThread;
+typedef void *PlatformThreadFunc(void *data);
+
+u32             platformProcessorCount();
+PlatformThread *platformThreadCreate(PlatformThreadFunc *func, void *data);
+void            platformThreadJoin(PlatformThread *thread);
+
+/* Persistent worker pool, see unix.c */
+void platformWorkersStart(u32 count);
+void platformWorkersStop();
+u32  platformWorkerCount();
+void platformWorkersRun(PlatformWorkFunc *func, void *data);
+
 /* debug */
 void  platformAbort();
@@ -12,7 +12,9 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
 
 void platformLog(LogType type, const char *fmt, ...) {
     FILE *fd;
@@ -194,6 +196,44 @@ u64 platformFileLastModify(const char *path) {
     return 0;
 }
 
+/* Maps a file read only, NULL without logging if it doesn't exist */
+void *platformFileMap(const char *path, u64 *size) {
+    sds path_in_dir = sdsnew(file_search_dir);
+    path_in_dir = sdscat(sdscat(path_in_dir, "/"), path);
+    int fd = open(path_in_dir, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            platformLog(LOG_ERROR, "open %s (%s)", path_in_dir, strerror(errno));
+        }
+        sdsfree(path_in_dir);
+        return NULL;
+    }
+
+    struct stat file_info;
+    void *ptr = NULL;
+    if (fstat(fd, &file_info) != 0) {
+        platformLog(LOG_ERROR, "fstat %s (%s)", path_in_dir, strerror(errno));
+    } else if (file_info.st_size > 0) {
+        ptr = mmap(NULL, file_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            platformLog(LOG_ERROR, "mmap %s (%s)", path_in_dir, strerror(errno));
+            ptr = NULL;
+        }
+    }
+    *size = (ptr) ? (u64) file_info.st_size : 0;
+
+    /* The mapping stays valid after closing */
+    close(fd);
+    sdsfree(path_in_dir);
+    return ptr;
+}
+
+void platformFileUnmap(void *ptr, u64 size) {
+    if (ptr && munmap(ptr, size) != 0) {
+        platformLog(LOG_ERROR, "munmap (%s)", strerror(errno));
+    }
+}
+
 /* Time */
 
 Time platformTimeCurrent() {
@@ -234,6 +274,145 @@ void platformSleepNanoseconds(Time t) {
     //}
 }
 
+/* Threads */
+
+struct PlatformThread {
+    pthread_t handle;
+};
+
+u32 platformProcessorCount() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? (u32) count : 1;
+}
+
+PlatformThread *platformThreadCreate(PlatformThreadFunc *func, void *data) {
+    PlatformThread *thread = platformMemoryAllocate(sizeof(PlatformThread));
+    int err = pthread_create(&thread->handle, NULL, func, data);
+    if (err != 0) {
+        platformLog(LOG_ERROR, "pthread_create (%s)", strerror(err));
+        platformMemoryFree(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void platformThreadJoin(PlatformThread *thread) {
+    int err = pthread_join(thread->handle, NULL);
+    if (err != 0) {
+        platformLog(LOG_ERROR, "pthread_join (%s)", strerror(err));
+    }
+    platformMemoryFree(thread);
+}
+
+/*
+ * Worker pool
+ *
+ * Threads are started once and wait here, in the loader, between runs.
+ * Modules only hand them work for the length of platformWorkersRun(),
+ * so reloading a module never unmaps code a worker is in.
+ */
+
+#define PLATFORM_MAX_WORKERS 15
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    PlatformThread *threads[PLATFORM_MAX_WORKERS];
+    u32 count;
+
+    /* Bumped for every run, workers run func once per value */
+    u64 generation;
+    u32 running;
+    PlatformWorkFunc *func;
+    void *data;
+    bool stop;
+} workers = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void *platformWorkerMain(void *data) {
+    (void) data;
+    /* Started before the first run, so every generation after 0 is one to run */
+    u64 seen = 0;
+    pthread_mutex_lock(&workers.mutex);
+    for (;;) {
+        while (!workers.stop && workers.generation == seen) {
+            pthread_cond_wait(&workers.start, &workers.mutex);
+        }
+        if (workers.stop) {
+            break;
+        }
+        seen = workers.generation;
+        PlatformWorkFunc *func = workers.func;
+        void *func_data = workers.data;
+        pthread_mutex_unlock(&workers.mutex);
+
+        func(func_data);
+
+        pthread_mutex_lock(&workers.mutex);
+        if (--workers.running == 0) {
+            pthread_cond_signal(&workers.done);
+        }
+    }
+    pthread_mutex_unlock(&workers.mutex);
+    return NULL;
+}
+
+void platformWorkersStart(u32 count) {
+    count = MIN(count, PLATFORM_MAX_WORKERS);
+    for (u32 i = 0; i < count; ++i) {
+        PlatformThread *thread = platformThreadCreate(platformWorkerMain, NULL);
+        if (!thread) {
+            break;
+        }
+        workers.threads[workers.count++] = thread;
+    }
+}
+
+void platformWorkersStop() {
+    pthread_mutex_lock(&workers.mutex);
+    workers.stop = true;
+    pthread_cond_broadcast(&workers.start);
+    pthread_mutex_unlock(&workers.mutex);
+
+    for (u32 i = 0; i < workers.count; ++i) {
+        platformThreadJoin(workers.threads[i]);
+    }
+    workers.count = 0;
+    workers.stop = false;
+}
+
+u32 platformWorkerCount() {
+    return workers.count;
+}
+
+void platformWorkersRun(PlatformWorkFunc *func, void *data) {
+    if (workers.count == 0) {
+        func(data);
+        return;
+    }
+
+    pthread_mutex_lock(&workers.mutex);
+    workers.func = func;
+    workers.data = data;
+    workers.running = workers.count;
+    workers.generation++;
+    pthread_cond_broadcast(&workers.start);
+    pthread_mutex_unlock(&workers.mutex);
+
+    /* The calling thread takes part too */
+    func(data);
+
+    pthread_mutex_lock(&workers.mutex);
+    while (workers.running > 0) {
+        pthread_cond_wait(&workers.done, &workers.mutex);
+    }
+    pthread_mutex_unlock(&workers.mutex);
+}
+
 /* debug */
 
 void platformAbort() {
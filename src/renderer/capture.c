@@ -0,0 +1,240 @@
+#include <shared/render_capture.h>
+
+/*
+ * Render command capture
+ *
+ * Writes the RenderCommands stream of a range of frames to disk,
+ * textures referenced by entries are copied into the file so the
+ * frames can be replayed without the game or debug modules. A texture
+ * is written after the first frame that uses it and again only when
+ * its handle or upload generation changes.
+ */
+
+static void capture_begin(Renderer *r) {
+    RenderCapture *capture = &r->capture;
+
+    capture->file = platform.file_open(capture->path, "w");
+    if (!capture->file.fd) {
+        platform.log(LOG_ERROR, "Capture: failed to open %s", capture->path);
+        capture->path = NULL;
+        return;
+    }
+    capture->is_file_open = true;
+    memset(capture->written_handles, 0, sizeof(capture->written_handles));
+    memset(capture->written_generations, 0, sizeof(capture->written_generations));
+
+    RenderCaptureHeader header = {
+        .magic = RENDER_CAPTURE_MAGIC,
+        .version = RENDER_CAPTURE_VERSION,
+        .num_chars = (r->font_atlas) ? NUM_CHARS : 0,
+        .font_atlas_width  = (r->font_atlas) ? r->font_atlas->width  : 0,
+        .font_atlas_height = (r->font_atlas) ? r->font_atlas->height : 0,
+        .font_atlas_texture = r->font_atlas_texture,
+        .font_size = r->font_size,
+        .font_atlas_size = r->font_atlas_size,
+        .font_sdf_spread = r->font_sdf_spread,
+    };
+    platform.file_write(capture->file, &header, sizeof(header), 1);
+
+    if (r->font_atlas) {
+        platform.file_write(capture->file, r->font_atlas->pixels, header.font_atlas_width*header.font_atlas_height, 1);
+        platform.file_write(capture->file, r->font_map,  sizeof(PackRect), NUM_CHARS);
+        platform.file_write(capture->file, r->font_info, sizeof(FontInfo), NUM_CHARS);
+    }
+
+    platform.log(LOG_INFO, "Capture: recording frames %llu-%llu to %s",
+                 capture->first_frame, capture->first_frame + capture->frame_count - 1, capture->path);
+}
+
+static void capture_end(RenderCapture *capture) {
+    if (capture->is_file_open) {
+        platform.file_close(capture->file);
+        capture->is_file_open = false;
+        platform.log(LOG_INFO, "Capture: done writing %s", capture->path);
+    }
+    capture->path = NULL;
+}
+
+typedef struct CaptureTextures {
+    TextureSlot *slots[MAX_TEXTURES];
+    TextureHandle handles[MAX_TEXTURES];
+    u32 count;
+    u64 size;
+} CaptureTextures;
+
+static void capture_add_texture(Renderer *r, CaptureTextures *textures, RenderEntryHeader *header) {
+    TextureHandle handle = TEXTURE_HANDLE_NONE;
+    switch (header->type) {
+    case ENTRY_TYPE_RenderEntryTexturedQuad: {
+        handle = ((RenderEntryTexturedQuad *) header)->texture;
+        break;
+    }
+    case ENTRY_TYPE_RenderEntryAtlasQuad: {
+        handle = ((RenderEntryAtlasQuad *) header)->texture;
+        break;
+    }
+    case ENTRY_TYPE_RenderEntrySprite: {
+        handle = ((RenderEntrySprite *) header)->texture;
+        break;
+    }
+    }
+
+    TextureSlot *slot = (r->textures) ? textureLookup(r->textures, handle) : NULL;
+    if (!slot) {
+        return;
+    }
+    const u32 index = TEXTURE_HANDLE_SLOT(handle);
+    if (r->capture.written_handles[index] == handle && r->capture.written_generations[index] == slot->upload_generation) {
+        return;
+    }
+    for (u32 i = 0; i < textures->count; ++i) {
+        if (textures->handles[i] == handle) {
+            return;
+        }
+    }
+    textures->slots[textures->count] = slot;
+    textures->handles[textures->count] = handle;
+    textures->count++;
+    textures->size += sizeof(RenderCaptureTexture) + image_size(&slot->image);
+}
+
+/* Writes the quads of a layer moved by its offset, at the depth of the layer entry */
+static void capture_write_layer(Renderer *r, RenderEntryLayer *entry) {
+    LayerSlot *layer = layerLookup(r->layers, entry->layer);
+    if (!layer) {
+        return;
+    }
+
+    u8 *end = layer->commands.memory_base + layer->commands.memory_top;
+    for (u8 *p = layer->commands.memory_base; p < end;) {
+        RenderEntryHeader *header = (RenderEntryHeader *) p;
+        const u32 size = render_entry_size_checked(header, end);
+        if (size == 0) {
+            platform.log(LOG_ERROR, "Capture: bad entry of type %u in layer %u, dropping the rest of it", header->type, entry->layer);
+            return;
+        }
+        p += size;
+
+        union {
+            RenderEntryHeader header;
+            RenderEntryQuad quad;
+            RenderEntryTexturedQuad textured_quad;
+            RenderEntryAtlasQuad atlas_quad;
+            RenderEntrySprite sprite;
+        } copy;
+        switch (header->type) {
+        case ENTRY_TYPE_RenderEntryQuad:         copy.quad = *(RenderEntryQuad *) header;                 copy.quad.pos = v2Add(copy.quad.pos, entry->offset);                   break;
+        case ENTRY_TYPE_RenderEntryTexturedQuad: copy.textured_quad = *(RenderEntryTexturedQuad *) header; copy.textured_quad.pos = v2Add(copy.textured_quad.pos, entry->offset); break;
+        case ENTRY_TYPE_RenderEntryAtlasQuad:    copy.atlas_quad = *(RenderEntryAtlasQuad *) header;       copy.atlas_quad.pos = v2Add(copy.atlas_quad.pos, entry->offset);       break;
+        case ENTRY_TYPE_RenderEntrySprite:       copy.sprite = *(RenderEntrySprite *) header;              copy.sprite.pos = v2Add(copy.sprite.pos, entry->offset);               break;
+        default: continue;
+        }
+        copy.header.depth = entry->header.depth;
+        platform.file_write(r->capture.file, &copy, size, 1);
+    }
+}
+
+static void capture_frame(Renderer *r, RenderCommands *cmds) {
+    RenderCapture *capture = &r->capture;
+    if (!capture->path) {
+        return;
+    }
+
+    u64 frame_index = r->frame_info->total_frame_count;
+    if (frame_index < capture->first_frame) {
+        return;
+    }
+    if (frame_index >= capture->first_frame + capture->frame_count) {
+        capture_end(capture);
+        return;
+    }
+
+    if (!capture->is_file_open) {
+        capture_begin(r);
+        if (!capture->is_file_open) {
+            return;
+        }
+    }
+
+    /* Registry slots of the textures used by this frame and not yet in the file, a slot has one live handle */
+    CaptureTextures textures = {0};
+
+    /* Layers are written out as the entries they hold, so replays don't need them */
+    u64 commands_size = 0;
+    u8 *p = cmds->memory_base;
+    u8 *end = cmds->memory_base + cmds->memory_top;
+    while (p < end) {
+        RenderEntryHeader *header = (RenderEntryHeader *) p;
+        u32 size = render_entry_size_checked(header, end);
+        if (size == 0) {
+            platform.log(LOG_ERROR, "Capture: bad entry of type %u, skipping frame", header->type);
+            return;
+        }
+
+        if (header->type == ENTRY_TYPE_RenderEntryLayer) {
+            LayerSlot *layer = layerLookup(r->layers, ((RenderEntryLayer *) header)->layer);
+            u8 *layer_end = (layer) ? layer->commands.memory_base + layer->commands.memory_top : NULL;
+            for (u8 *q = (layer) ? layer->commands.memory_base : NULL; layer && q < layer_end;) {
+                RenderEntryHeader *item = (RenderEntryHeader *) q;
+                const u32 item_size = render_entry_size_checked(item, layer_end);
+                if (item_size == 0) {
+                    platform.log(LOG_ERROR, "Capture: bad entry of type %u in layer %u, skipping frame", item->type, ((RenderEntryLayer *) header)->layer);
+                    return;
+                }
+                if (item->type != ENTRY_TYPE_RenderEntryText && item->type != ENTRY_TYPE_RenderEntryLayer) {
+                    capture_add_texture(r, &textures, item);
+                    commands_size += item_size;
+                }
+                q += item_size;
+            }
+        } else {
+            capture_add_texture(r, &textures, header);
+            commands_size += size;
+        }
+
+        p += size;
+    }
+
+    if (commands_size > RENDERER_MEMORY_SIZE) {
+        platform.log(LOG_ERROR, "Capture: frame %llu doesn't fit in render memory with its layers written out, skipping",
+                     (unsigned long long) frame_index);
+        return;
+    }
+
+    RenderCaptureFrame frame = {
+        .frame_index = frame_index,
+        .commands_size = commands_size,
+        .texture_count = textures.count,
+        .textures_size = textures.size,
+    };
+    platform.file_write(capture->file, &frame, sizeof(frame), 1);
+    /* Sizes were checked above */
+    for (p = cmds->memory_base; p < end; p += render_entry_size((RenderEntryHeader *) p)) {
+        RenderEntryHeader *header = (RenderEntryHeader *) p;
+        if (header->type == ENTRY_TYPE_RenderEntryLayer) {
+            capture_write_layer(r, (RenderEntryLayer *) header);
+        } else {
+            platform.file_write(capture->file, header, render_entry_size(header), 1);
+        }
+    }
+    for (u32 i = 0; i < textures.count; ++i) {
+        const u32 index = TEXTURE_HANDLE_SLOT(textures.handles[i]);
+        capture->written_handles[index] = textures.handles[i];
+        capture->written_generations[index] = textures.slots[i]->upload_generation;
+
+        Image *image = &textures.slots[i]->image;
+        RenderCaptureTexture texture = {
+            .handle = textures.handles[i],
+            .width = image->width,
+            .height = image->height,
+            .channels = image->channels,
+            .mip_count = image_mip_count(image),
+            .is_linear = image->is_linear,
+            .is_filtered = image->is_filtered,
+        };
+        platform.file_write(capture->file, &texture, sizeof(texture), 1);
+        if (image_size(image) > 0) {
+            platform.file_write(capture->file, image->pixels, image_size(image), 1);
+        }
+    }
+}
@@ -0,0 +1,211 @@
+/*
+ * Draw list and culling
+ *
+ * Before a frame is recorded its entries are gathered into a draw list,
+ * which keeps the screen space bounds of every entry as separate arrays
+ * of centers and half sizes. Culling then tests four entries at a time
+ * against the cull rect (the viewport, or the part of it set with
+ * setCullRect()) and keeps the indices of the visible ones in
+ * submission order. Only those are recorded.
+ *
+ * The visible entries are then sorted front to back by their depth,
+ * later entries in front of earlier ones of equal depth, and each gets
+ * its own z in that order for the depth buffer. The sorted entries are
+ * what gets recorded, draw_list_hash() tells when they didn't change.
+ *
+ * Text is laid out while gathering, its bounds come from the layout.
+ * Static layers are culled as a whole by the bounds of their entries.
+ * That also gets new glyphs into the glyph cache before the render
+ * pass, see glyph_upload_flush().
+ */
+
+#include <shared/hash.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* One per entry at most, see RENDER_ENTRY_MIN_SIZE */
+#define DRAW_LIST_MAX_ITEMS (RENDERER_MEMORY_SIZE/RENDER_ENTRY_MIN_SIZE)
+
+typedef struct DrawList {
+    u32 count;
+    /* Of each entry in RenderCommands */
+    u32 offsets[DRAW_LIST_MAX_ITEMS];
+    f32 center_x[DRAW_LIST_MAX_ITEMS];
+    f32 center_y[DRAW_LIST_MAX_ITEMS];
+    f32 half_width[DRAW_LIST_MAX_ITEMS];
+    f32 half_height[DRAW_LIST_MAX_ITEMS];
+    u16 depth[DRAW_LIST_MAX_ITEMS];
+    /* Drawn without blending, so they can hide what's behind them */
+    bool is_opaque[DRAW_LIST_MAX_ITEMS];
+
+    /* Indices of the entries that passed culling */
+    u32 visible_count;
+    u32 visible[DRAW_LIST_MAX_ITEMS];
+    /* The visible entries front to back, see draw_list_sort() */
+    u32 order[DRAW_LIST_MAX_ITEMS];
+    u32 sort_scratch[DRAW_LIST_MAX_ITEMS];
+} DrawList;
+
+static inline void draw_list_add(DrawList *list, u32 offset, RenderEntryHeader *header, bool is_opaque, Vec2 center, Vec2 scale) {
+    const u32 i = list->count++;
+    list->offsets[i] = offset;
+    list->depth[i] = header->depth;
+    list->is_opaque[i] = is_opaque;
+    list->center_x[i] = center.x;
+    list->center_y[i] = center.y;
+    /* Negative scales flip, they don't shrink */
+    list->half_width[i] = 0.5f*fabsf(scale.x);
+    list->half_height[i] = 0.5f*fabsf(scale.y);
+}
+
+static void draw_list_build(DrawList *list, TextCache *text, Renderer *r, RenderCommands *cmds) {
+    list->count = 0;
+    list->visible_count = 0;
+
+    u8 *p = cmds->memory_base;
+    while (p < cmds->memory_base + cmds->memory_top && list->count < DRAW_LIST_MAX_ITEMS) {
+        RenderEntryHeader *header = (RenderEntryHeader *) p;
+        const u32 offset = (u32) (p - cmds->memory_base);
+        switch (header->type) {
+        case ENTRY_TYPE_RenderEntryQuad: {
+            RenderEntryQuad *quad = (RenderEntryQuad *) header;
+            draw_list_add(list, offset, header, true, quad->pos, quad->scale);
+            break;
+        }
+        case ENTRY_TYPE_RenderEntryTexturedQuad: {
+            RenderEntryTexturedQuad *quad = (RenderEntryTexturedQuad *) header;
+            draw_list_add(list, offset, header, false, quad->pos, quad->scale);
+            break;
+        }
+        case ENTRY_TYPE_RenderEntryAtlasQuad: {
+            RenderEntryAtlasQuad *quad = (RenderEntryAtlasQuad *) header;
+            draw_list_add(list, offset, header, false, quad->pos, quad->scale);
+            break;
+        }
+        case ENTRY_TYPE_RenderEntrySprite: {
+            RenderEntrySprite *sprite = (RenderEntrySprite *) header;
+            draw_list_add(list, offset, header, false, sprite->pos, sprite->scale);
+            break;
+        }
+        case ENTRY_TYPE_RenderEntryText: {
+            RenderEntryText *entry = (RenderEntryText *) header;
+            TextLayout *layout = text_layout(text, r, entry->text, entry->length);
+            if (layout->quad_count == 0) {
+                break;
+            }
+            const f32 scale = text_scale(r, entry);
+            const Vec2 center = v2Scale(0.5f*scale, v2Add(layout->bounds_min, layout->bounds_max));
+            const Vec2 size = v2Scale(scale, v2Sub(layout->bounds_max, layout->bounds_min));
+            draw_list_add(list, offset, header, false, v2Add(entry->pos, center), size);
+            break;
+        }
+        case ENTRY_TYPE_RenderEntryLayer: {
+            RenderEntryLayer *entry = (RenderEntryLayer *) header;
+            LayerSlot *slot = layerLookup(r->layers, entry->layer);
+            if (!slot) {
+                break;
+            }
+            const Vec2 center = v2Scale(0.5f, v2Add(slot->bounds_min, slot->bounds_max));
+            const Vec2 size = v2Sub(slot->bounds_max, slot->bounds_min);
+            draw_list_add(list, offset, header, false, v2Add(entry->offset, center), size);
+            break;
+        }
+        }
+
+        u32 size = render_entry_size(header);
+        if (size == 0) {
+            break;
+        }
+        p += size;
+    }
+}
+
+/* Keeps the entries overlapping [min, max], returns how many */
+static u32 draw_list_cull(DrawList *list, Vec2 min, Vec2 max) {
+    u32 i = 0;
+    u32 count = 0;
+
+#if defined(__SSE2__)
+    const __m128 min_x = _mm_set1_ps(min.x);
+    const __m128 min_y = _mm_set1_ps(min.y);
+    const __m128 max_x = _mm_set1_ps(max.x);
+    const __m128 max_y = _mm_set1_ps(max.y);
+    for (; i + 4 <= list->count; i += 4) {
+        const __m128 x = _mm_loadu_ps(&list->center_x[i]);
+        const __m128 y = _mm_loadu_ps(&list->center_y[i]);
+        const __m128 w = _mm_loadu_ps(&list->half_width[i]);
+        const __m128 h = _mm_loadu_ps(&list->half_height[i]);
+        const __m128 inside_x = _mm_and_ps(_mm_cmpgt_ps(_mm_add_ps(x, w), min_x), _mm_cmplt_ps(_mm_sub_ps(x, w), max_x));
+        const __m128 inside_y = _mm_and_ps(_mm_cmpgt_ps(_mm_add_ps(y, h), min_y), _mm_cmplt_ps(_mm_sub_ps(y, h), max_y));
+
+        u32 mask = (u32) _mm_movemask_ps(_mm_and_ps(inside_x, inside_y));
+        while (mask) {
+            list->visible[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i < list->count; ++i) {
+        if (list->center_x[i] + list->half_width[i] > min.x && list->center_x[i] - list->half_width[i] < max.x &&
+            list->center_y[i] + list->half_height[i] > min.y && list->center_y[i] - list->half_height[i] < max.y) {
+            list->visible[count++] = i;
+        }
+    }
+
+    list->visible_count = count;
+    return count;
+}
+
+/*
+ * Sorts the visible entries into order, front to back. A stable radix
+ * sort on the depth of the entries in reverse submission order, so
+ * later entries come before earlier ones of equal depth.
+ */
+static void draw_list_sort(DrawList *list) {
+    const u32 count = list->visible_count;
+    u32 offsets[2][256] = {0};
+    for (u32 i = 0; i < count; ++i) {
+        const u16 depth = list->depth[list->visible[i]];
+        offsets[0][depth & 0xff]++;
+        offsets[1][depth >> 8]++;
+    }
+    for (u32 pass = 0; pass < 2; ++pass) {
+        u32 sum = 0;
+        for (u32 i = 0; i < 256; ++i) {
+            const u32 n = offsets[pass][i];
+            offsets[pass][i] = sum;
+            sum += n;
+        }
+    }
+
+    for (u32 i = 0; i < count; ++i) {
+        const u32 item = list->visible[count - 1 - i];
+        list->sort_scratch[offsets[0][list->depth[item] & 0xff]++] = item;
+    }
+    for (u32 i = 0; i < count; ++i) {
+        const u32 item = list->sort_scratch[i];
+        list->order[offsets[1][list->depth[item] >> 8]++] = item;
+    }
+}
+
+/*
+ * Hash of the visible entries in sorted order. z only depends on the
+ * position in that order, so equal hashes record the same commands as
+ * long as nothing the entries refer to changed.
+ */
+static u64 draw_list_hash(DrawList *list, RenderCommands *cmds) {
+    u64 hash = hash_fnv1a_wide(HASH_FNV1A_SEED, &list->visible_count, sizeof(list->visible_count));
+    for (u32 i = 0; i < list->visible_count; ++i) {
+        RenderEntryHeader *header = (RenderEntryHeader *) (cmds->memory_base + list->offsets[list->order[i]]);
+        hash = hash_fnv1a_wide(hash, header, render_entry_size(header));
+    }
+    return hash;
+}
+
+/* Depth buffer value of the entry at index in order, every entry gets its own */
+static inline f32 draw_list_z(DrawList *list, u32 index) {
+    return (index + 0.5f)/(f32) list->visible_count;
+}
@@ -0,0 +1,410 @@
+/*
+ * Glyph cache
+ *
+ * Glyphs are rasterized the first time they are used, through
+ * platform.font_rasterize_glyph (any codepoint), or copied out of the
+ * baked ASCII atlas handed to us when there is no rasterizer (replays).
+ * They are packed into one GLYPH_ATLAS_SIZE^2 texture with a shelf
+ * packer. The region touched since the last flush is tracked for the
+ * Vulkan renderer to upload (see glyph_upload.c), the software renderer
+ * samples the atlas pixels as they are.
+ *
+ * When the atlas or the glyph table is full the least recently used
+ * glyph that isn't used by the current frame is evicted and its space
+ * reused. Every slot has a generation which is bumped when it's reused,
+ * so users holding on to glyph ids (text layouts) can tell they went
+ * stale.
+ */
+
+#define GLYPH_ATLAS_SIZE        1024
+#define GLYPH_CACHE_MAX_GLYPHS  1024
+/* Power of two, at most half full */
+#define GLYPH_CACHE_INDEX_SIZE  2048
+#define GLYPH_CACHE_MAX_SHELVES 256
+#define GLYPH_NONE              0xffff
+
+typedef enum GlyphState {
+    GLYPH_FREE = 0,
+    GLYPH_RESIDENT,
+    /* Not in the font, kept so we don't ask the rasterizer every frame */
+    GLYPH_MISSING,
+} GlyphState;
+
+typedef struct CachedGlyph {
+    u32 codepoint;
+    u8 state;
+    u16 generation;
+
+    /* Rectangle in the atlas, shelf is GLYPH_NONE for empty glyphs */
+    u16 shelf;
+    u16 x;
+    u16 y;
+    u16 width;
+    u16 height;
+
+    /* In pixels of the font's atlas size */
+    i32 offset_x;
+    i32 offset_y;
+    f32 advance;
+
+    /* Frame index + 1 of the last use */
+    u64 last_used;
+} CachedGlyph;
+
+typedef struct GlyphShelf {
+    u16 y;
+    u16 height;
+    /* Start of the unused space at the end of the shelf */
+    u16 top;
+    u16 glyph_count;
+} GlyphShelf;
+
+/* Space freed by evicted glyphs, reused before the end of a shelf */
+typedef struct GlyphFreeRect {
+    u16 shelf;
+    u16 x;
+    u16 width;
+} GlyphFreeRect;
+
+typedef struct GlyphCache {
+    Image atlas;
+    TextureHandle texture;
+
+    CachedGlyph glyphs[GLYPH_CACHE_MAX_GLYPHS];
+    u32 glyph_count;
+    /* Glyph ids by codepoint, linear probing */
+    u16 index[GLYPH_CACHE_INDEX_SIZE];
+
+    GlyphShelf shelves[GLYPH_CACHE_MAX_SHELVES];
+    u32 shelf_count;
+    GlyphFreeRect free_rects[GLYPH_CACHE_MAX_GLYPHS];
+    u32 free_rect_count;
+
+    /* Region written since the last flush, empty if x0 >= x1 */
+    u32 dirty_x0, dirty_y0, dirty_x1, dirty_y1;
+
+    /* Baked atlas rectangles by codepoint, for when there is no rasterizer */
+    const PackRect *baked_font_map;
+    const PackRect *baked_rects[NUM_CHARS];
+    const FontInfo *baked_infos[NUM_CHARS];
+
+    u64 rasterized;
+    u64 evicted;
+} GlyphCache;
+
+static void glyph_cache_init(GlyphCache *cache, Renderer *r) {
+    memset(cache, 0, sizeof(GlyphCache));
+
+    cache->atlas = (Image) {
+        .pixels = platform.allocate_memory(GLYPH_ATLAS_SIZE*GLYPH_ATLAS_SIZE),
+        .width = GLYPH_ATLAS_SIZE,
+        .height = GLYPH_ATLAS_SIZE,
+        .channels = 1,
+        .is_linear = true,
+        .is_filtered = true,
+    };
+    memset(cache->atlas.pixels, 0, GLYPH_ATLAS_SIZE*GLYPH_ATLAS_SIZE);
+    cache->texture = (r->textures) ? textureRegister(r->textures, cache->atlas) : TEXTURE_HANDLE_NONE;
+
+    for (u32 i = 0; i < GLYPH_CACHE_INDEX_SIZE; ++i) {
+        cache->index[i] = GLYPH_NONE;
+    }
+}
+
+static void glyph_cache_shutdown(GlyphCache *cache, Renderer *r) {
+    platform.log(LOG_INFO, "Glyph cache: %u glyphs, %llu rasterized, %llu evicted",
+                 cache->glyph_count,
+                 (unsigned long long) cache->rasterized,
+                 (unsigned long long) cache->evicted);
+
+    if (r->textures) {
+        textureUnregister(r->textures, cache->texture);
+    }
+    platform.free_memory(cache->atlas.pixels);
+}
+
+static inline u32 glyph_hash(u32 codepoint) {
+    return (codepoint * 2654435761u) & (GLYPH_CACHE_INDEX_SIZE - 1);
+}
+
+static void glyph_index_insert(GlyphCache *cache, u32 codepoint, u16 id) {
+    u32 i = glyph_hash(codepoint);
+    while (cache->index[i] != GLYPH_NONE) {
+        i = (i + 1) & (GLYPH_CACHE_INDEX_SIZE - 1);
+    }
+    cache->index[i] = id;
+}
+
+/* Backward shift deletion, keeps probe sequences intact without tombstones */
+static void glyph_index_remove(GlyphCache *cache, u32 codepoint) {
+    u32 i = glyph_hash(codepoint);
+    while (cache->index[i] != GLYPH_NONE && cache->glyphs[cache->index[i]].codepoint != codepoint) {
+        i = (i + 1) & (GLYPH_CACHE_INDEX_SIZE - 1);
+    }
+    if (cache->index[i] == GLYPH_NONE) {
+        return;
+    }
+
+    u32 hole = i;
+    for (u32 j = (i + 1) & (GLYPH_CACHE_INDEX_SIZE - 1); cache->index[j] != GLYPH_NONE; j = (j + 1) & (GLYPH_CACHE_INDEX_SIZE - 1)) {
+        u32 home = glyph_hash(cache->glyphs[cache->index[j]].codepoint);
+        /* Entries whose home lies cyclically in (hole, j] have to stay */
+        bool stays = (hole <= j) ? (hole < home && home <= j) : (hole < home || home <= j);
+        if (!stays) {
+            cache->index[hole] = cache->index[j];
+            hole = j;
+        }
+    }
+    cache->index[hole] = GLYPH_NONE;
+}
+
+static CachedGlyph *glyph_cache_find(GlyphCache *cache, u32 codepoint) {
+    for (u32 i = glyph_hash(codepoint); cache->index[i] != GLYPH_NONE; i = (i + 1) & (GLYPH_CACHE_INDEX_SIZE - 1)) {
+        CachedGlyph *glyph = &cache->glyphs[cache->index[i]];
+        if (glyph->codepoint == codepoint) {
+            return glyph;
+        }
+    }
+    return NULL;
+}
+
+static void glyph_free_rect(GlyphCache *cache, u16 shelf_index, u16 x, u16 width) {
+    GlyphShelf *shelf = &cache->shelves[shelf_index];
+    shelf->glyph_count--;
+
+    if (shelf->glyph_count > 0) {
+        /* With no room to track it the space is only reused once the shelf empties */
+        if (cache->free_rect_count < GLYPH_CACHE_MAX_GLYPHS) {
+            cache->free_rects[cache->free_rect_count++] = (GlyphFreeRect) {shelf_index, x, width};
+        }
+        return;
+    }
+
+    /* Empty shelves start over, the last one gives its height back too */
+    shelf->top = 0;
+    for (u32 i = 0; i < cache->free_rect_count; ) {
+        if (cache->free_rects[i].shelf == shelf_index) {
+            cache->free_rects[i] = cache->free_rects[--cache->free_rect_count];
+        } else {
+            ++i;
+        }
+    }
+    while (cache->shelf_count > 0 &&
+           cache->shelves[cache->shelf_count - 1].glyph_count == 0) {
+        cache->shelf_count--;
+    }
+}
+
+/* Finds room for a width*height rectangle, returns false if the atlas is full */
+static bool glyph_alloc_rect(GlyphCache *cache, u32 width, u32 height, u16 *shelf_index, u16 *x, u16 *y) {
+    /* Freed space first, on the shelf wasting the least height */
+    u32 best = UINT32_MAX;
+    u32 best_waste = UINT32_MAX;
+    for (u32 i = 0; i < cache->free_rect_count; ++i) {
+        GlyphFreeRect *rect = &cache->free_rects[i];
+        GlyphShelf *shelf = &cache->shelves[rect->shelf];
+        if (rect->width >= width && shelf->height >= height && shelf->height - height < best_waste) {
+            best = i;
+            best_waste = shelf->height - height;
+        }
+    }
+    if (best != UINT32_MAX && best_waste <= height/2) {
+        GlyphFreeRect *rect = &cache->free_rects[best];
+        *shelf_index = rect->shelf;
+        *x = rect->x;
+        *y = cache->shelves[rect->shelf].y;
+        cache->shelves[rect->shelf].glyph_count++;
+        if (rect->width > width) {
+            rect->x += width;
+            rect->width -= width;
+        } else {
+            cache->free_rects[best] = cache->free_rects[--cache->free_rect_count];
+        }
+        return true;
+    }
+
+    /* Then the end of an existing shelf that isn't much taller than the glyph */
+    u32 best_shelf = UINT32_MAX;
+    best_waste = UINT32_MAX;
+    for (u32 i = 0; i < cache->shelf_count; ++i) {
+        GlyphShelf *shelf = &cache->shelves[i];
+        if (shelf->height >= height && shelf->top + width <= GLYPH_ATLAS_SIZE && shelf->height - height < best_waste) {
+            best_shelf = i;
+            best_waste = shelf->height - height;
+        }
+    }
+
+    /* Then a new shelf */
+    const u32 bottom = (cache->shelf_count > 0)
+        ? cache->shelves[cache->shelf_count - 1].y + cache->shelves[cache->shelf_count - 1].height
+        : 0;
+    const bool can_add_shelf = cache->shelf_count < GLYPH_CACHE_MAX_SHELVES && bottom + height <= GLYPH_ATLAS_SIZE;
+    if (can_add_shelf && (best_shelf == UINT32_MAX || best_waste > height/2)) {
+        best_shelf = cache->shelf_count++;
+        cache->shelves[best_shelf] = (GlyphShelf) {
+            .y = bottom,
+            .height = height,
+        };
+    }
+
+    if (best_shelf == UINT32_MAX) {
+        return false;
+    }
+
+    GlyphShelf *shelf = &cache->shelves[best_shelf];
+    *shelf_index = best_shelf;
+    *x = shelf->top;
+    *y = shelf->y;
+    shelf->top += width;
+    shelf->glyph_count++;
+    return true;
+}
+
+/* Evicts the least recently used glyph not used this frame, false if there is none */
+static bool glyph_cache_evict(GlyphCache *cache, u64 now) {
+    CachedGlyph *victim = NULL;
+    for (u32 i = 0; i < cache->glyph_count; ++i) {
+        CachedGlyph *glyph = &cache->glyphs[i];
+        if (glyph->state != GLYPH_FREE && glyph->last_used < now &&
+            (!victim || glyph->last_used < victim->last_used)) {
+            victim = glyph;
+        }
+    }
+    if (!victim) {
+        return false;
+    }
+
+    glyph_index_remove(cache, victim->codepoint);
+    if (victim->shelf != GLYPH_NONE) {
+        glyph_free_rect(cache, victim->shelf, victim->x, victim->width);
+    }
+    victim->state = GLYPH_FREE;
+    cache->evicted++;
+    return true;
+}
+
+static bool glyph_cache_rasterize(GlyphCache *cache, Renderer *r, u32 codepoint, GlyphBitmap *bitmap) {
+    if (platform.font_rasterize_glyph) {
+        return platform.font_rasterize_glyph(codepoint, bitmap);
+    }
+
+    if (!r->font_atlas || !r->font_map || !r->font_info || codepoint >= NUM_CHARS) {
+        return false;
+    }
+    if (cache->baked_font_map != r->font_map) {
+        cache->baked_font_map = r->font_map;
+        memset(cache->baked_rects, 0, sizeof(cache->baked_rects));
+        memset(cache->baked_infos, 0, sizeof(cache->baked_infos));
+        for (u32 i = 0; i < NUM_CHARS; ++i) {
+            if (r->font_map[i].user_id < NUM_CHARS) {
+                cache->baked_rects[r->font_map[i].user_id] = &r->font_map[i];
+            }
+            if (r->font_info[i].codepoint < NUM_CHARS) {
+                cache->baked_infos[r->font_info[i].codepoint] = &r->font_info[i];
+            }
+        }
+    }
+
+    const PackRect *rect = cache->baked_rects[codepoint];
+    const FontInfo *info = cache->baked_infos[codepoint];
+    if (!rect || !info) {
+        return false;
+    }
+
+    *bitmap = (GlyphBitmap) {
+        .pixels = r->font_atlas->pixels + rect->y*r->font_atlas->width + rect->x,
+        .width = rect->width,
+        .height = rect->height,
+        .stride = r->font_atlas->width,
+        .offset_x = info->offset_x,
+        .offset_y = info->offset_y,
+        .advance = info->advance,
+    };
+    return true;
+}
+
+/*
+ * Returns the glyph for codepoint, rasterizing and packing it if needed,
+ * or NULL if there was no room for it. Codepoints the font doesn't have
+ * come back as GLYPH_MISSING.
+ */
+static CachedGlyph *glyph_cache_get(GlyphCache *cache, Renderer *r, u32 codepoint, u64 now) {
+    CachedGlyph *glyph = glyph_cache_find(cache, codepoint);
+    if (glyph) {
+        glyph->last_used = now;
+        return glyph;
+    }
+
+    GlyphBitmap bitmap = {0};
+    const bool found = glyph_cache_rasterize(cache, r, codepoint, &bitmap);
+    if (found) {
+        cache->rasterized++;
+    }
+    if (bitmap.width > GLYPH_ATLAS_SIZE || bitmap.height > GLYPH_ATLAS_SIZE) {
+        return NULL;
+    }
+
+    /* A slot in the glyph table */
+    u32 id = 0;
+    while (id < cache->glyph_count && cache->glyphs[id].state != GLYPH_FREE) {
+        ++id;
+    }
+    if (id == GLYPH_CACHE_MAX_GLYPHS) {
+        if (!glyph_cache_evict(cache, now)) {
+            return NULL;
+        }
+        id = 0;
+        while (cache->glyphs[id].state != GLYPH_FREE) {
+            ++id;
+        }
+    }
+
+    /* And one in the atlas */
+    u16 shelf = GLYPH_NONE;
+    u16 x = 0, y = 0;
+    if (found && bitmap.width > 0 && bitmap.height > 0) {
+        while (!glyph_alloc_rect(cache, bitmap.width, bitmap.height, &shelf, &x, &y)) {
+            if (!glyph_cache_evict(cache, now)) {
+                return NULL;
+            }
+        }
+    }
+
+    /* Evicting can't have touched bitmap, it belongs to the rasterizer */
+    glyph = &cache->glyphs[id];
+    cache->glyph_count = MAX(cache->glyph_count, id + 1);
+    *glyph = (CachedGlyph) {
+        .codepoint = codepoint,
+        .state = (found) ? GLYPH_RESIDENT : GLYPH_MISSING,
+        .generation = glyph->generation + 1,
+        .shelf = shelf,
+        .x = x,
+        .y = y,
+        .width = (shelf != GLYPH_NONE) ? bitmap.width : 0,
+        .height = (shelf != GLYPH_NONE) ? bitmap.height : 0,
+        .offset_x = bitmap.offset_x,
+        .offset_y = bitmap.offset_y,
+        .advance = (f32) (bitmap.advance >> 6),
+        .last_used = now,
+    };
+    glyph_index_insert(cache, codepoint, id);
+
+    if (shelf != GLYPH_NONE) {
+        for (u32 row = 0; row < bitmap.height; ++row) {
+            memcpy(cache->atlas.pixels + (y + row)*GLYPH_ATLAS_SIZE + x, bitmap.pixels + row*bitmap.stride, bitmap.width);
+        }
+        if (cache->dirty_x0 >= cache->dirty_x1) {
+            cache->dirty_x0 = x;
+            cache->dirty_y0 = y;
+            cache->dirty_x1 = x + bitmap.width;
+            cache->dirty_y1 = y + bitmap.height;
+        } else {
+            cache->dirty_x0 = MIN(cache->dirty_x0, x);
+            cache->dirty_y0 = MIN(cache->dirty_y0, y);
+            cache->dirty_x1 = MAX(cache->dirty_x1, (u32) x + bitmap.width);
+            cache->dirty_y1 = MAX(cache->dirty_y1, (u32) y + bitmap.height);
+        }
+    }
+
+    return glyph;
+}
@@ -0,0 +1,110 @@
+/*
+ * Glyph atlas upload
+ *
+ * The glyph cache (glyph_cache.c) only tracks the region of its atlas
+ * written since the last flush. That region is copied through a staging
+ * buffer per frame in flight, recorded into the frame's command buffer
+ * before the render pass, on the graphics queue, so it's ordered after
+ * every earlier frame that still samples the old contents.
+ */
+
+typedef struct GlyphUpload {
+    VkBuffer staging_buffers[MAX_FRAMES_IN_FLIGHT];
+    GpuAllocation staging_memory[MAX_FRAMES_IN_FLIGHT];
+
+    u64 uploaded_bytes;
+} GlyphUpload;
+
+static void glyph_upload_init(GlyphUpload *upload) {
+    memset(upload, 0, sizeof(GlyphUpload));
+    for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        create_buffer(context->logical_device.handle, GLYPH_ATLAS_SIZE*GLYPH_ATLAS_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false, &upload->staging_buffers[i], &upload->staging_memory[i]);
+    }
+}
+
+static void glyph_upload_shutdown(GlyphUpload *upload) {
+    platform.log(LOG_INFO, "Glyph upload: %llu bytes uploaded", (unsigned long long) upload->uploaded_bytes);
+    for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        vkDestroyBuffer(context->logical_device.handle, upload->staging_buffers[i], NULL);
+        gpu_free(context->memory, &upload->staging_memory[i]);
+    }
+}
+
+/* Records a copy of the region written since the last flush, outside of a render pass */
+static void glyph_upload_flush(GlyphUpload *upload, GlyphCache *cache, VkCommandBuffer command_buffer, u32 frame_index) {
+    if (cache->dirty_x0 >= cache->dirty_x1) {
+        return;
+    }
+
+    /* Until the first full upload is done it carries everything */
+    GpuTexture *texture = &context->textures[TEXTURE_HANDLE_SLOT(cache->texture)];
+    if (!texture->is_valid || !texture->is_ready) {
+        return;
+    }
+
+    const u32 width = cache->dirty_x1 - cache->dirty_x0;
+    const u32 height = cache->dirty_y1 - cache->dirty_y0;
+    u8 *staging = upload->staging_memory[frame_index].mapped;
+    for (u32 row = 0; row < height; ++row) {
+        memcpy(staging + row*width, cache->atlas.pixels + (cache->dirty_y0 + row)*GLYPH_ATLAS_SIZE + cache->dirty_x0, width);
+    }
+
+    /* Earlier frames sampling the atlas have to be done before it's written */
+    VkImageMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = texture->image,
+        .subresourceRange = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .baseMipLevel = 0,
+            .levelCount = 1,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+        },
+        .srcAccessMask = 0,
+        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    };
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0,
+                         0, NULL,
+                         0, NULL,
+                         1, &barrier);
+
+    VkBufferImageCopy region = {
+        .bufferOffset = 0,
+        .bufferRowLength = width,
+        .bufferImageHeight = height,
+        .imageSubresource = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .mipLevel = 0,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+        },
+        .imageOffset = {(i32) cache->dirty_x0, (i32) cache->dirty_y0, 0},
+        .imageExtent = {
+            .width = width,
+            .height = height,
+            .depth = 1,
+        },
+    };
+    vkCmdCopyBufferToImage(command_buffer, upload->staging_buffers[frame_index], texture->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         0,
+                         0, NULL,
+                         0, NULL,
+                         1, &barrier);
+
+    upload->uploaded_bytes += (u64) width*height;
+    cache->dirty_x0 = cache->dirty_x1 = 0;
+    cache->dirty_y0 = cache->dirty_y1 = 0;
+}
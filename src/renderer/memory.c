@@ -0,0 +1,368 @@
+/*
+ * GPU memory sub-allocator
+ *
+ * Device memory is allocated in large blocks which resources are placed
+ * into with a buddy allocator, so creating a buffer or image no longer
+ * costs a vkAllocateMemory (which is slow and limited by
+ * maxMemoryAllocationCount).
+ *
+ * There is one pool per memory type and resource kind, linear resources
+ * (buffers) and optimal images never share a block so
+ * bufferImageGranularity never has to be considered. Blocks of host
+ * visible memory types are mapped once for their whole lifetime, an
+ * allocation's mapped pointer points into that mapping.
+ *
+ * Resources larger than half a block get a dedicated allocation.
+ */
+
+#define GPU_BLOCK_SIZE          (32*1024*1024)
+#define GPU_MIN_ALLOCATION      256
+/* GPU_BLOCK_SIZE == GPU_MIN_ALLOCATION << GPU_MAX_ORDER */
+#define GPU_MAX_ORDER           17
+#define GPU_MAX_BLOCKS          32
+#define GPU_DEDICATED_THRESHOLD (GPU_BLOCK_SIZE/2)
+#define GPU_POOL_COUNT          (2*VK_MAX_MEMORY_TYPES)
+
+typedef struct GpuBlock {
+    VkDeviceMemory memory;
+    u8 *mapped;
+
+    /*
+     * One bit per node of each order, set if the node is free. Order o
+     * has 1 << (GPU_MAX_ORDER - o) nodes of GPU_MIN_ALLOCATION << o bytes.
+     */
+    u64 *free_bits[GPU_MAX_ORDER + 1];
+    u32 free_counts[GPU_MAX_ORDER + 1];
+
+    u64 used;
+} GpuBlock;
+
+typedef struct GpuPool {
+    u32 block_count;
+    GpuBlock blocks[GPU_MAX_BLOCKS];
+
+    u32 allocation_count;
+    /* Sum of requested sizes, compared to used for internal fragmentation */
+    u64 requested;
+} GpuPool;
+
+typedef struct GpuMemory {
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties properties;
+
+    /* Indexed by memory type*2 + is_linear */
+    GpuPool pools[GPU_POOL_COUNT];
+
+    u32 dedicated_count;
+    u64 dedicated_size;
+} GpuMemory;
+
+typedef struct GpuMemoryStats {
+    u32 device_allocations;
+    u32 block_count;
+    u64 block_size;
+    u64 used;
+    u64 requested;
+    /* Largest free node in any block, and summed over blocks */
+    u64 largest_free;
+    u64 largest_free_total;
+    u32 allocation_count;
+    u32 dedicated_count;
+    u64 dedicated_size;
+} GpuMemoryStats;
+
+static inline u64 gpu_node_size(u32 order) {
+    return (u64) GPU_MIN_ALLOCATION << order;
+}
+
+static inline u32 gpu_order_for_size(u64 size) {
+    u32 order = 0;
+    while (gpu_node_size(order) < size) {
+        order++;
+    }
+    return order;
+}
+
+static inline bool gpu_bit_get(GpuBlock *block, u32 order, u64 index) {
+    return (block->free_bits[order][index / 64] >> (index % 64)) & 1;
+}
+
+static inline void gpu_bit_set(GpuBlock *block, u32 order, u64 index) {
+    block->free_bits[order][index / 64] |= 1ull << (index % 64);
+    block->free_counts[order]++;
+}
+
+static inline void gpu_bit_clear(GpuBlock *block, u32 order, u64 index) {
+    block->free_bits[order][index / 64] &= ~(1ull << (index % 64));
+    block->free_counts[order]--;
+}
+
+static inline u64 gpu_bit_words(u32 order) {
+    u64 nodes = 1ull << (GPU_MAX_ORDER - order);
+    return (nodes + 63) / 64;
+}
+
+static bool gpu_block_create(GpuMemory *memory, GpuBlock *block, u32 memory_type) {
+    VkMemoryAllocateInfo alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = GPU_BLOCK_SIZE,
+        .memoryTypeIndex = memory_type,
+    };
+    if (vkAllocateMemory(memory->device, &alloc_info, NULL, &block->memory) != VK_SUCCESS) {
+        return false;
+    }
+
+    block->mapped = NULL;
+    if (memory->properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        vkMapMemory(memory->device, block->memory, 0, VK_WHOLE_SIZE, 0, (void **) &block->mapped);
+    }
+
+    /* All free bit arrays share one allocation */
+    u64 total_words = 0;
+    for (u32 o = 0; o <= GPU_MAX_ORDER; ++o) {
+        total_words += gpu_bit_words(o);
+    }
+    u64 *words = platform.allocate_memory(sizeof(u64) * total_words);
+    memset(words, 0, sizeof(u64) * total_words);
+    for (u32 o = 0; o <= GPU_MAX_ORDER; ++o) {
+        block->free_bits[o] = words;
+        block->free_counts[o] = 0;
+        words += gpu_bit_words(o);
+    }
+
+    /* The whole block starts out as one free node */
+    gpu_bit_set(block, GPU_MAX_ORDER, 0);
+    block->used = 0;
+
+    return true;
+}
+
+static void gpu_block_destroy(GpuMemory *memory, GpuBlock *block) {
+    if (block->mapped) {
+        vkUnmapMemory(memory->device, block->memory);
+    }
+    vkFreeMemory(memory->device, block->memory, NULL);
+    platform.free_memory(block->free_bits[0]);
+}
+
+static bool gpu_block_alloc(GpuBlock *block, u32 order, u64 *offset) {
+    u32 o = order;
+    while (o <= GPU_MAX_ORDER && block->free_counts[o] == 0) {
+        o++;
+    }
+    if (o > GPU_MAX_ORDER) {
+        return false;
+    }
+
+    u64 index = 0;
+    for (u64 w = 0; w < gpu_bit_words(o); ++w) {
+        if (block->free_bits[o][w]) {
+            index = w*64 + __builtin_ctzll(block->free_bits[o][w]);
+            break;
+        }
+    }
+    gpu_bit_clear(block, o, index);
+
+    /* Split down to the requested order, right halves become free */
+    while (o > order) {
+        o--;
+        index *= 2;
+        gpu_bit_set(block, o, index + 1);
+    }
+
+    *offset = index * gpu_node_size(order);
+    block->used += gpu_node_size(order);
+    return true;
+}
+
+static void gpu_block_free(GpuBlock *block, u32 order, u64 offset) {
+    u64 index = offset / gpu_node_size(order);
+    block->used -= gpu_node_size(order);
+
+    /* Merge with the buddy for as long as it's free */
+    while (order < GPU_MAX_ORDER && gpu_bit_get(block, order, index ^ 1)) {
+        gpu_bit_clear(block, order, index ^ 1);
+        index /= 2;
+        order++;
+    }
+    gpu_bit_set(block, order, index);
+}
+
+static inline u64 gpu_block_largest_free(GpuBlock *block) {
+    for (i32 o = GPU_MAX_ORDER; o >= 0; --o) {
+        if (block->free_counts[o] > 0) {
+            return gpu_node_size(o);
+        }
+    }
+    return 0;
+}
+
+static void gpu_memory_init(GpuMemory *memory, VkPhysicalDevice physical_device, VkDevice device) {
+    memset(memory, 0, sizeof(GpuMemory));
+    memory->device = device;
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &memory->properties);
+}
+
+static bool gpu_allocate_dedicated(GpuMemory *memory, VkMemoryRequirements *req, u32 memory_type, GpuAllocation *allocation) {
+    VkMemoryAllocateInfo alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = req->size,
+        .memoryTypeIndex = memory_type,
+    };
+    if (vkAllocateMemory(memory->device, &alloc_info, NULL, &allocation->memory) != VK_SUCCESS) {
+        return false;
+    }
+
+    allocation->offset = 0;
+    allocation->mapped = NULL;
+    if (memory->properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        vkMapMemory(memory->device, allocation->memory, 0, VK_WHOLE_SIZE, 0, (void **) &allocation->mapped);
+    }
+    allocation->block = GPU_ALLOCATION_DEDICATED;
+
+    memory->dedicated_count++;
+    memory->dedicated_size += req->size;
+    return true;
+}
+
+static GpuAllocation gpu_allocate(GpuMemory *memory, VkMemoryRequirements req, VkMemoryPropertyFlags properties, bool is_linear) {
+    GpuAllocation allocation = {
+        .size = req.size,
+        .memory_type = findMemoryType(req.memoryTypeBits, properties),
+        .is_linear = is_linear,
+    };
+
+    if (req.size > GPU_DEDICATED_THRESHOLD) {
+        VKC_CHECK(gpu_allocate_dedicated(memory, &req, allocation.memory_type, &allocation) ? VK_SUCCESS : VK_ERROR_OUT_OF_DEVICE_MEMORY,
+                  "failed to allocate dedicated device memory");
+        return allocation;
+    }
+
+    /* Buddy nodes are aligned to their size, so this covers the alignment too */
+    allocation.order = gpu_order_for_size(MAX(req.size, req.alignment));
+
+    GpuPool *pool = &memory->pools[allocation.memory_type*2 + is_linear];
+    for (u32 i = 0; i <= pool->block_count; ++i) {
+        if (i == pool->block_count) {
+            if (pool->block_count == GPU_MAX_BLOCKS ||
+                !gpu_block_create(memory, &pool->blocks[i], allocation.memory_type)) {
+                break;
+            }
+            pool->block_count++;
+        }
+
+        GpuBlock *block = &pool->blocks[i];
+        if (gpu_block_alloc(block, allocation.order, &allocation.offset)) {
+            allocation.memory = block->memory;
+            allocation.mapped = (block->mapped) ? block->mapped + allocation.offset : NULL;
+            allocation.block = i;
+            pool->allocation_count++;
+            pool->requested += req.size;
+            return allocation;
+        }
+    }
+
+    /* Out of blocks, fall back to a dedicated allocation rather than failing */
+    platform.log(LOG_WARNING, "GPU memory: pool for memory type %u is full, using a dedicated allocation", allocation.memory_type);
+    VKC_CHECK(gpu_allocate_dedicated(memory, &req, allocation.memory_type, &allocation) ? VK_SUCCESS : VK_ERROR_OUT_OF_DEVICE_MEMORY,
+              "failed to allocate dedicated device memory");
+    return allocation;
+}
+
+static void gpu_free(GpuMemory *memory, GpuAllocation *allocation) {
+    if (allocation->memory == VK_NULL_HANDLE) {
+        return;
+    }
+
+    if (allocation->block == GPU_ALLOCATION_DEDICATED) {
+        if (allocation->mapped) {
+            vkUnmapMemory(memory->device, allocation->memory);
+        }
+        vkFreeMemory(memory->device, allocation->memory, NULL);
+        memory->dedicated_count--;
+        memory->dedicated_size -= allocation->size;
+    } else {
+        GpuPool *pool = &memory->pools[allocation->memory_type*2 + allocation->is_linear];
+        gpu_block_free(&pool->blocks[allocation->block], allocation->order, allocation->offset);
+        pool->allocation_count--;
+        pool->requested -= allocation->size;
+
+        /* Give back trailing empty blocks, the first one is kept around to avoid churn */
+        while (pool->block_count > 1 && pool->blocks[pool->block_count - 1].used == 0) {
+            gpu_block_destroy(memory, &pool->blocks[--pool->block_count]);
+        }
+    }
+
+    memset(allocation, 0, sizeof(GpuAllocation));
+}
+
+/* Pass pool_index -1 for totals over all pools */
+static GpuMemoryStats gpu_memory_stats(GpuMemory *memory, i32 pool_index) {
+    GpuMemoryStats stats = {0};
+    for (u32 p = 0; p < GPU_POOL_COUNT; ++p) {
+        if (pool_index >= 0 && (u32) pool_index != p) {
+            continue;
+        }
+        GpuPool *pool = &memory->pools[p];
+        stats.block_count += pool->block_count;
+        stats.block_size += (u64) pool->block_count * GPU_BLOCK_SIZE;
+        stats.allocation_count += pool->allocation_count;
+        stats.requested += pool->requested;
+        for (u32 i = 0; i < pool->block_count; ++i) {
+            stats.used += pool->blocks[i].used;
+            u64 largest = gpu_block_largest_free(&pool->blocks[i]);
+            stats.largest_free = MAX(stats.largest_free, largest);
+            stats.largest_free_total += largest;
+        }
+    }
+
+    if (pool_index < 0) {
+        stats.dedicated_count = memory->dedicated_count;
+        stats.dedicated_size = memory->dedicated_size;
+    }
+    stats.device_allocations = stats.block_count + stats.dedicated_count;
+
+    return stats;
+}
+
+static void gpu_memory_log_stats(GpuMemory *memory) {
+    for (u32 p = 0; p < GPU_POOL_COUNT; ++p) {
+        if (memory->pools[p].block_count == 0) {
+            continue;
+        }
+
+        GpuMemoryStats stats = gpu_memory_stats(memory, p);
+        u64 free = stats.block_size - stats.used;
+        /*
+         * Internal: lost to rounding up to powers of two, external: free
+         * space outside the largest free node of its block
+         */
+        f64 internal = (stats.used > 0) ? 1.0 - (f64) stats.requested/(f64) stats.used : 0.0;
+        f64 external = (free > 0) ? 1.0 - (f64) stats.largest_free_total/(f64) free : 0.0;
+        platform.log(LOG_INFO, "GPU memory: type %u %s: %u blocks, %u allocations, %llu/%llu KiB used, fragmentation internal %.1f%% external %.1f%%",
+                     p/2, (p % 2) ? "linear" : "optimal",
+                     stats.block_count, stats.allocation_count,
+                     (unsigned long long) stats.used/1024, (unsigned long long) stats.block_size/1024,
+                     100.0*internal, 100.0*external);
+    }
+
+    GpuMemoryStats total = gpu_memory_stats(memory, -1);
+    platform.log(LOG_INFO, "GPU memory: %u device allocations (%u blocks, %u dedicated using %llu KiB)",
+                 total.device_allocations, total.block_count, total.dedicated_count,
+                 (unsigned long long) total.dedicated_size/1024);
+}
+
+static void gpu_memory_shutdown(GpuMemory *memory) {
+    gpu_memory_log_stats(memory);
+
+    for (u32 p = 0; p < GPU_POOL_COUNT; ++p) {
+        GpuPool *pool = &memory->pools[p];
+        if (pool->allocation_count > 0) {
+            platform.log(LOG_WARNING, "GPU memory: %u allocations leaked in memory type %u", pool->allocation_count, p/2);
+        }
+        for (u32 i = 0; i < pool->block_count; ++i) {
+            gpu_block_destroy(memory, &pool->blocks[i]);
+        }
+        pool->block_count = 0;
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * Pipeline cache
+ *
+ * Pipelines are compiled through a VkPipelineCache which is loaded from
+ * PIPELINE_CACHE_PATH at startup and written back at shutdown, so only
+ * the very first run (or a driver update) pays for compiling shaders.
+ * Swapchain recreation hits the in-memory cache.
+ *
+ * The data starts with the header defined by the Vulkan spec, it's
+ * checked against the current device before being handed to the driver
+ * since not every driver rejects foreign data gracefully.
+ */
+
+#define PIPELINE_CACHE_PATH "pipeline_cache"
+
+/* VkPipelineCacheHeaderVersionOne */
+typedef struct PipelineCacheHeader {
+    u32 header_size;
+    u32 header_version;
+    u32 vendor_id;
+    u32 device_id;
+    u8 uuid[VK_UUID_SIZE];
+} PipelineCacheHeader;
+
+static bool pipeline_cache_is_compatible(const u8 *data, u64 size, VkPhysicalDeviceProperties *properties) {
+    if (size < sizeof(PipelineCacheHeader)) {
+        return false;
+    }
+
+    PipelineCacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    return header.header_size >= sizeof(PipelineCacheHeader) &&
+           header.header_size <= size &&
+           header.header_version == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+           header.vendor_id == properties->vendorID &&
+           header.device_id == properties->deviceID &&
+           memcmp(header.uuid, properties->pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+static VkPipelineCache pipeline_cache_load(VkDevice device, VkPhysicalDeviceProperties *properties, bool *is_warm) {
+    u8 *data = NULL;
+    u64 size = 0;
+
+    File file = platform.file_open(PIPELINE_CACHE_PATH, "r");
+    if (file.fd) {
+        size = platform.file_size(file);
+        if (size > 0) {
+            data = platform.allocate_memory(size);
+            platform.file_read(file, data, size, 1);
+        }
+        platform.file_close(file);
+    }
+
+    if (data && !pipeline_cache_is_compatible(data, size, properties)) {
+        platform.log(LOG_INFO, "Pipeline cache: %s was written by another device or driver, ignoring it", PIPELINE_CACHE_PATH);
+        platform.free_memory(data);
+        data = NULL;
+        size = 0;
+    }
+
+    VkPipelineCacheCreateInfo cache_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = (data) ? size : 0,
+        .pInitialData = data,
+    };
+
+    VkPipelineCache cache = VK_NULL_HANDLE;
+    if (vkCreatePipelineCache(device, &cache_info, NULL, &cache) != VK_SUCCESS) {
+        /* Retry without the initial data, a cold cache is better than none */
+        cache_info.initialDataSize = 0;
+        cache_info.pInitialData = NULL;
+        VKC_CHECK(vkCreatePipelineCache(device, &cache_info, NULL, &cache), "failed to create pipeline cache");
+        platform.free_memory(data);
+        data = NULL;
+    }
+
+    *is_warm = data != NULL;
+    if (data) {
+        platform.log(LOG_INFO, "Pipeline cache: loaded %llu bytes from %s", (unsigned long long) size, PIPELINE_CACHE_PATH);
+        platform.free_memory(data);
+    }
+
+    return cache;
+}
+
+static void pipeline_cache_save(VkDevice device, VkPipelineCache cache) {
+    size_t size = 0;
+    if (vkGetPipelineCacheData(device, cache, &size, NULL) != VK_SUCCESS || size == 0) {
+        return;
+    }
+
+    u8 *data = platform.allocate_memory(size);
+    if (vkGetPipelineCacheData(device, cache, &size, data) == VK_SUCCESS) {
+        File file = platform.file_open(PIPELINE_CACHE_PATH, "w");
+        if (file.fd) {
+            platform.file_write(file, data, size, 1);
+            platform.file_close(file);
+        }
+    }
+    platform.free_memory(data);
+}
@@ -0,0 +1,210 @@
+/*
+ * GPU profiler
+ *
+ * Timestamps are written around the glyph uploads, the render pass and
+ * every run of draws that share a pipeline (a batch). Each swapchain
+ * image owns a range of a single query pool, written by that image's
+ * command buffer, so a command buffer submitted again as is still
+ * writes its own range. A range is read back once the fence of the
+ * submission that wrote it is waited on, which end_frame() does anyway,
+ * so results are a frame or two late but never stall. They go to
+ * Renderer.profile.
+ *
+ * A timestamp is tagged with the ProfileGpuPass of the interval it
+ * ends. Timestamps inside the render pass only measure when work
+ * reaches the bottom of the pipe, so batch times are approximate on
+ * tilers and overlapping draws.
+ */
+
+#define GPU_PROFILE_QUERIES 128
+/* Pass end and frame end, always written */
+#define GPU_PROFILE_RESERVED 2
+#define GPU_PROFILE_NONE PROFILE_GPU_COUNT
+
+typedef struct GpuProfileFrame {
+    /* Frame number + 1 of the queries pending in this range, 0 if none. The rest is kept between submissions */
+    u64 frame;
+    u32 count;
+    u32 pass_begin;
+    u32 pass_end;
+    u8 tags[GPU_PROFILE_QUERIES];
+} GpuProfileFrame;
+
+typedef struct GpuProfiler {
+    VkQueryPool pool;
+    bool is_available;
+    /* Nanoseconds per tick and the bits of a timestamp that are valid */
+    f64 period;
+    u64 mask;
+
+    /* Ranges by swapchain image */
+    GpuProfileFrame frames[MAX_SWAPCHAIN_IMAGES];
+    /* Image + 1 of the range submitted by each frame in flight, 0 if none */
+    u32 submitted[MAX_FRAMES_IN_FLIGHT];
+    /* Range being recorded and the pass of the batch being recorded */
+    GpuProfileFrame *current;
+    u8 batch;
+} GpuProfiler;
+
+static void gpu_profile_init(GpuProfiler *profiler, VkDevice device, const VkPhysicalDeviceLimits *limits, u32 valid_bits) {
+    memset(profiler, 0, sizeof(GpuProfiler));
+
+    /* Graphics queues either support timestamps on every queue or report 0 valid bits */
+    profiler->is_available = valid_bits > 0 && limits->timestampPeriod > 0.0f;
+    if (!profiler->is_available) {
+        platform.log(LOG_WARNING, "Vulkan: no timestamp support on the graphics queue, GPU times unavailable");
+        return;
+    }
+    profiler->period = limits->timestampPeriod;
+    profiler->mask = (valid_bits >= 64) ? ~0ull : (1ull << valid_bits) - 1;
+
+    VkQueryPoolCreateInfo pool_info = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = MAX_SWAPCHAIN_IMAGES*GPU_PROFILE_QUERIES,
+    };
+    VKC_CHECK(vkCreateQueryPool(device, &pool_info, NULL, &profiler->pool),
+              "failed to create timestamp query pool");
+}
+
+static void gpu_profile_shutdown(GpuProfiler *profiler, VkDevice device) {
+    if (profiler->is_available) {
+        vkDestroyQueryPool(device, profiler->pool, NULL);
+    }
+}
+
+/*
+ * Reads back the queries pending in the range of image_index, the fence
+ * of the submission that wrote them has to have been waited on. Results
+ * go to profile if there is one.
+ */
+static void gpu_profile_collect_image(GpuProfiler *profiler, VkDevice device, u32 image_index, FrameProfile *profile) {
+    GpuProfileFrame *frame = &profiler->frames[image_index];
+    if (!profiler->is_available || frame->frame == 0) {
+        return;
+    }
+
+    u64 timestamps[GPU_PROFILE_QUERIES];
+    VkResult result = vkGetQueryPoolResults(device, profiler->pool, image_index*GPU_PROFILE_QUERIES, frame->count,
+                                            sizeof(timestamps), timestamps, sizeof(u64), VK_QUERY_RESULT_64_BIT);
+    const u64 frame_number = frame->frame - 1;
+    frame->frame = 0;
+    if (result != VK_SUCCESS || !profile) {
+        return;
+    }
+
+    u64 ticks[PROFILE_GPU_COUNT] = {0};
+    for (u32 i = 1; i < frame->count; ++i) {
+        if (frame->tags[i] != GPU_PROFILE_NONE) {
+            ticks[frame->tags[i]] += (timestamps[i] - timestamps[i - 1]) & profiler->mask;
+        }
+    }
+    ticks[PROFILE_GPU_FRAME] = (timestamps[frame->count - 1] - timestamps[0]) & profiler->mask;
+    ticks[PROFILE_GPU_RENDER_PASS] = (timestamps[frame->pass_end] - timestamps[frame->pass_begin]) & profiler->mask;
+
+    profile->gpu_available = true;
+    profile->gpu_frame = frame_number;
+    for (u32 i = 0; i < PROFILE_GPU_COUNT; ++i) {
+        profile->gpu_ns[i] = (u64) (ticks[i]*profiler->period);
+    }
+}
+
+/* Reads back the range submitted by frame_index, once its fence was waited on */
+static void gpu_profile_collect(GpuProfiler *profiler, VkDevice device, u32 frame_index, FrameProfile *profile) {
+    if (profiler->submitted[frame_index] == 0) {
+        return;
+    }
+    gpu_profile_collect_image(profiler, device, profiler->submitted[frame_index] - 1, profile);
+    profiler->submitted[frame_index] = 0;
+}
+
+static void gpu_profile_timestamp(GpuProfiler *profiler, VkCommandBuffer cmd, VkPipelineStageFlagBits stage, u8 tag) {
+    GpuProfileFrame *frame = profiler->current;
+    if (!frame || frame->count == GPU_PROFILE_QUERIES) {
+        return;
+    }
+    const u32 image_index = (u32) (frame - profiler->frames);
+    vkCmdWriteTimestamp(cmd, stage, profiler->pool, image_index*GPU_PROFILE_QUERIES + frame->count);
+    frame->tags[frame->count++] = tag;
+}
+
+/*
+ * Starts the queries of the command buffer of image_index, outside of
+ * any render pass. Earlier results of the range have to be collected.
+ */
+static void gpu_profile_begin_frame(GpuProfiler *profiler, VkCommandBuffer cmd, u32 image_index) {
+    profiler->current = NULL;
+    if (!profiler->is_available) {
+        return;
+    }
+
+    GpuProfileFrame *frame = &profiler->frames[image_index];
+    vkCmdResetQueryPool(cmd, profiler->pool, image_index*GPU_PROFILE_QUERIES, GPU_PROFILE_QUERIES);
+    frame->frame = 0;
+    frame->count = 0;
+    frame->pass_begin = 0;
+    frame->pass_end = 0;
+    profiler->current = frame;
+    profiler->batch = GPU_PROFILE_NONE;
+
+    gpu_profile_timestamp(profiler, cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, GPU_PROFILE_NONE);
+}
+
+/* The command buffer of image_index is submitted as frame_number by frame_index, freshly recorded or not */
+static void gpu_profile_submit(GpuProfiler *profiler, u32 frame_index, u32 image_index, u64 frame_number) {
+    if (!profiler->is_available) {
+        return;
+    }
+    /* An earlier submission of the image was collected when its command buffer was waited on */
+    for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        if (profiler->submitted[i] == image_index + 1) {
+            profiler->submitted[i] = 0;
+        }
+    }
+    profiler->frames[image_index].frame = frame_number + 1;
+    profiler->submitted[frame_index] = image_index + 1;
+}
+
+static void gpu_profile_uploads_done(GpuProfiler *profiler, VkCommandBuffer cmd) {
+    gpu_profile_timestamp(profiler, cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, PROFILE_GPU_UPLOAD);
+}
+
+/* Right after vkCmdBeginRenderPass */
+static void gpu_profile_begin_pass(GpuProfiler *profiler, VkCommandBuffer cmd) {
+    if (!profiler->current) {
+        return;
+    }
+    profiler->current->pass_begin = profiler->current->count;
+    gpu_profile_timestamp(profiler, cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, GPU_PROFILE_NONE);
+}
+
+/*
+ * Called before every draw, closes the current batch if pass differs.
+ * Once the range runs low the batches left are counted towards the
+ * last one that got a timestamp.
+ */
+static void gpu_profile_batch(GpuProfiler *profiler, VkCommandBuffer cmd, ProfileGpuPass pass) {
+    GpuProfileFrame *frame = profiler->current;
+    if (!frame || profiler->batch == pass || frame->count >= GPU_PROFILE_QUERIES - GPU_PROFILE_RESERVED) {
+        return;
+    }
+    if (profiler->batch != GPU_PROFILE_NONE) {
+        gpu_profile_timestamp(profiler, cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, profiler->batch);
+    }
+    profiler->batch = pass;
+}
+
+/* Right before vkCmdEndRenderPass */
+static void gpu_profile_end_pass(GpuProfiler *profiler, VkCommandBuffer cmd) {
+    if (!profiler->current) {
+        return;
+    }
+    profiler->current->pass_end = profiler->current->count;
+    gpu_profile_timestamp(profiler, cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, profiler->batch);
+    profiler->batch = GPU_PROFILE_NONE;
+}
+
+static void gpu_profile_end_frame(GpuProfiler *profiler, VkCommandBuffer cmd) {
+    gpu_profile_timestamp(profiler, cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, GPU_PROFILE_NONE);
+    profiler->current = NULL;
+}
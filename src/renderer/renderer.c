@@ -7,6 +7,9 @@ PlatformFunctionTable platform;
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
+#include <shared/png.h>
+#include <shared/atlas_flags.h>
+
 #include <stdbool.h>
 
 struct vkc_physical_device {
@@ -17,15 +20,21 @@ struct vkc_physical_device {
 
     i32 graphics_family;
     i32 present_family;
+    i32 transfer_family;
+
+    /* Of the graphics family, 0 if it can't write timestamps */
+    u32 timestamp_valid_bits;
 };
 
 struct vkc_logical_device {
     VkDevice handle;
     VkQueue graphics_queue;
     VkQueue present_queue;
+    VkQueue transfer_queue;
 
     u32 graphics_family;
     u32 present_family;
+    u32 transfer_family;
 };
 
 struct vkc_pipeline {
@@ -33,6 +42,21 @@ struct vkc_pipeline {
     VkPipelineLayout layout;
 };
 
+/* Sub-allocated from memory.c, block is GPU_ALLOCATION_DEDICATED for a VkDeviceMemory of its own */
+#define GPU_ALLOCATION_DEDICATED 0xffff
+
+typedef struct GpuAllocation {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    /* NULL unless the memory type is host visible */
+    u8 *mapped;
+    u16 memory_type;
+    u16 block;
+    u8 order;
+    bool is_linear;
+} GpuAllocation;
+
 typedef struct SwapchainInfo {
     VkSurfaceCapabilitiesKHR capabilities;
     VkSurfaceFormatKHR surface_format;
@@ -49,11 +73,87 @@ typedef struct Swapchain {
     VkImage *images;
     u32 image_view_count;
     VkImageView *image_views;
+
+    /* Headless, images are owned by us rather than a VkSwapchainKHR */
+    bool offscreen;
+    GpuAllocation *image_memory;
+
+    /* Shared by every image, VK_NULL_HANDLE without a depth buffer */
+    VkImage depth_image;
+    GpuAllocation depth_memory;
+    VkImageView depth_view;
 } Swapchain;
 
-#define MAX_FRAMES_IN_FLIGHT 2
+/* Frames in flight are picked at runtime by the latency mode, up to this many */
+#define MAX_FRAMES_IN_FLIGHT 3
+#define HEADLESS_IMAGE_COUNT 3
+#define MAX_SWAPCHAIN_IMAGES 8
+#define MAX_RETIRED_SWAPCHAINS 4
+
+/* Replaced by a resize, destroyed once no frame in flight uses it */
+typedef struct RetiredSwapchain {
+    Swapchain swapchain;
+    VkFramebuffer *framebuffers;
+    u32 framebuffer_count;
+    /* Last frame submitted before retirement */
+    u64 frame_serial;
+} RetiredSwapchain;
+
+typedef struct GpuTexture {
+    VkImage image;
+    GpuAllocation memory;
+    VkImageView view;
+    bool is_valid;
+    /* Sampled only once the upload with this ticket completed */
+    u64 upload_ticket;
+    bool is_ready;
+    /* Sampled with filtered_sampler instead of texture_sampler */
+    bool is_filtered;
+} GpuTexture;
+
+/*
+ * A texture or layer buffer that was replaced or released, destroyed once
+ * no frame in flight draws with it and its upload is done
+ */
+typedef struct RetiredResource {
+    VkImage image;
+    VkImageView view;
+    VkBuffer buffer;
+    GpuAllocation memory;
+    /* Last frame submitted before retirement */
+    u64 frame_serial;
+    u64 upload_ticket;
+} RetiredResource;
+
+#define MAX_RETIRED_RESOURCES 64
+
+/* Consecutive instances of a layer sampling the same texture, drawn in one draw */
+typedef struct LayerRun {
+    u32 first_instance;
+    u32 instance_count;
+    u32 texture;
+} LayerRun;
+
+/* Instances of a static layer, indexed by LayerRegistry slot */
+typedef struct GpuLayer {
+    VkBuffer buffer;
+    GpuAllocation memory;
+    u32 instance_count;
+    LayerRun *runs;
+    u32 run_count;
+    bool is_valid;
+    /* Drawn only once the upload with this ticket completed */
+    u64 upload_ticket;
+    bool is_ready;
+} GpuLayer;
+
+struct GpuMemory;
+struct UploadManager;
+struct TextCache;
+struct GlyphUpload;
+struct GpuProfiler;
+struct DrawList;
 
-/* TODO(anjo): Separate queue for transfer operations? */
 /* NOTE(anjo): typedef'd in api.h */
 struct RenderContext {
     VkInstance instance;
@@ -65,6 +165,8 @@ struct RenderContext {
     Swapchain swapchain;
 
     VkRenderPass renderpass;
+    /* VK_FORMAT_UNDEFINED without a depth buffer */
+    VkFormat depth_format;
 
     VkDescriptorSetLayout descriptor_set_layout;
     VkDescriptorPool descriptor_pool;
@@ -73,22 +175,42 @@ struct RenderContext {
     struct vkc_pipeline color_pipeline;
     struct vkc_pipeline texture_pipeline;
     struct vkc_pipeline atlas_pipeline;
+    struct vkc_pipeline layer_pipeline;
+
+    VkPipelineCache pipeline_cache;
+    bool pipeline_cache_is_warm;
+    /* Pipeline creation time since the last report */
+    u64 pipeline_create_ns;
+    u32 pipeline_create_count;
 
     u32 framebuffer_count;
     VkFramebuffer *framebuffers;
 
+    RetiredSwapchain retired_swapchains[MAX_RETIRED_SWAPCHAINS];
+    u32 retired_swapchain_count;
+
+    RetiredResource retired_resources[MAX_RETIRED_RESOURCES];
+    u32 retired_resource_count;
+
     VkBuffer vertex_buffer;
-    VkDeviceMemory vertex_buffer_memory;
+    GpuAllocation vertex_buffer_memory;
 
     VkBuffer index_buffer;
-    VkDeviceMemory index_buffer_memory;
+    GpuAllocation index_buffer_memory;
 
-    /* One for each swapchain image */
+    /* One for each swapchain image, MAX_SWAPCHAIN_IMAGES */
     VkBuffer *uniform_buffers;
-    VkDeviceMemory *uniform_buffers_memory;
+    GpuAllocation *uniform_buffers_memory;
 
     VkCommandPool command_pool;
     VkCommandBuffer *command_buffers;
+    /*
+     * What each command buffer was last recorded with, see end_frame().
+     * record_version is bumped when something recorded commands refer to
+     * changes outside of the entries and descriptor sets.
+     */
+    struct RecordedFrame *recorded_frames;
+    u64 record_version;
 
     VkSemaphore sem_image_available[MAX_FRAMES_IN_FLIGHT];
     VkSemaphore sem_render_finished[MAX_FRAMES_IN_FLIGHT];
@@ -96,6 +218,20 @@ struct RenderContext {
     VkFence *in_flight_images;
 
     u32 current_frame_index;
+    u32 frames_in_flight;
+    LatencyMode latency_mode;
+    /* CPU start of the frame in each slot, until its fence is seen signalled */
+    u64 in_flight_start_ns[MAX_FRAMES_IN_FLIGHT];
+    bool is_latency_pending[MAX_FRAMES_IN_FLIGHT];
+
+    /*
+     * Frames are numbered as they're submitted, in_flight_serials holds
+     * the frame last submitted with each in flight fence. Frames complete
+     * in order, so waiting on a fence completes every earlier frame too.
+     */
+    u64 submitted_serial;
+    u64 completed_serial;
+    u64 in_flight_serials[MAX_FRAMES_IN_FLIGHT];
 
     VkShaderModule color_vert_module;
     VkShaderModule color_frag_module;
@@ -106,12 +242,41 @@ struct RenderContext {
     VkShaderModule atlas_vert_module;
     VkShaderModule atlas_frag_module;
 
-    VkImage texture_image;
-    VkDeviceMemory texture_image_memory;
-    VkImageView texture_image_view;
-    bool has_texture;
+    /* Layers are drawn with atlas.frag */
+    VkShaderModule layer_vert_module;
+
+    /*
+     * Indexed by TextureRegistry slot, slot 0 is the white default texture.
+     * texture_versions is bumped whenever a slot's image view changes,
+     * descriptor_versions holds the versions last written to the descriptor
+     * set of each swapchain image (image_count*MAX_TEXTURES).
+     */
+    GpuTexture textures[MAX_TEXTURES];
+    u32 texture_versions[MAX_TEXTURES];
+
+    GpuLayer layers[MAX_LAYERS];
+    u32 *descriptor_versions;
 
     VkSampler texture_sampler;
+    /* Bilinear and clamped to the edge, for atlases and distance fields */
+    VkSampler filtered_sampler;
+
+    struct GpuMemory *memory;
+    struct UploadManager *upload;
+    struct TextCache *text;
+    struct GlyphUpload *glyph_upload;
+    struct GpuProfiler *profiler;
+    struct DrawList *draws;
+
+    /* Headless rendering and readback, one buffer per offscreen image */
+    bool headless;
+    u32 next_offscreen_image;
+    VkBuffer *readback_buffers;
+    GpuAllocation *readback_buffers_memory;
+    /* Frame index + 1 of the copy pending in each buffer, 0 if none */
+    u64 *readback_frames;
+    u8 *readback_pixels;
+    u8 *readback_encoded;
 };
 
 /*
@@ -134,16 +299,45 @@ typedef struct ShapePushConstants {
     f32 pos[2];
     f32 scale[2];
     f32 col[3];
+    f32 depth;
 } ShapePushConstants;
 
+typedef struct TexturePushConstants {
+    f32 pos[2];
+    f32 scale[2];
+    f32 col[3];
+    u32 texture;
+    f32 depth;
+} TexturePushConstants;
+
 typedef struct AtlasPushConstants {
     f32 pos[2];
     f32 scale[2];
     f32 offset[2];
     f32 size[2];
     f32 col[3];
+    u32 texture;
+    u32 flags;
+    f32 depth;
 } AtlasPushConstants;
 
+/* Per instance input of layer.vert, one quad of a static layer drawn with atlas.frag */
+typedef struct LayerInstance {
+    f32 pos[2];
+    f32 scale[2];
+    f32 offset[2];
+    f32 size[2];
+    f32 col[3];
+    u32 flags;
+} LayerInstance;
+
+/* The texture is per draw, indexing the texture array per instance would need nonuniformEXT */
+typedef struct LayerPushConstants {
+    f32 offset[2];
+    f32 depth;
+    u32 texture;
+} LayerPushConstants;
+
 /* vertex buffer */
 
 const Vertex vertices[] = {
@@ -301,7 +495,9 @@ static VkInstance vkc_create_instance(const char **extensions, u32 extension_cou
             }
         }
         platform.log(LOG_INFO, "  %-38s%-20s", extensions[i], (found) ? "\033[0;32m[found]\033[0m" : "\033[0;31m[missing]\033[0m");
-        found_extensions[found_extension_count++] = extensions[i];
+        if (found) {
+            found_extensions[found_extension_count++] = extensions[i];
+        }
     }
 
     /* Layers */
@@ -323,7 +519,9 @@ static VkInstance vkc_create_instance(const char **extensions, u32 extension_cou
             }
         }
         platform.log(LOG_INFO, "  %-38s%-20s", layers[i], (found) ? "\033[0;32m[found]\033[0m" : "\033[0;31m[missing]\033[0m");
-        found_layers[found_layer_count++] = layers[i];
+        if (found) {
+            found_layers[found_layer_count++] = layers[i];
+        }
     }
 
     VkApplicationInfo app_info = {
@@ -372,23 +570,38 @@ static bool is_physical_device_suitable(VkSurfaceKHR surface, struct vkc_physica
     if (!physical_device->device_features.samplerAnisotropy) {
         return false;
     }
-
-    u32 vk_extension_count = 0;
-    vkEnumerateDeviceExtensionProperties(physical_device->handle, NULL, &vk_extension_count, NULL);
-    VkExtensionProperties vk_available_extensions[vk_extension_count];
-    vkEnumerateDeviceExtensionProperties(physical_device->handle, NULL, &vk_extension_count, vk_available_extensions);
-    bool found = false;
-    for (u32 i = 0; i < vk_extension_count; ++i) {
-        if(strcmp(vk_available_extensions[i].extensionName, VK_KHR_SWAPCHAIN_EXTENSION_NAME) == 0) {
-            found = true;
-            break;
-        }
+    log_support("Sampled image array dynamic indexing", physical_device->device_features.shaderSampledImageArrayDynamicIndexing);
+    if (!physical_device->device_features.shaderSampledImageArrayDynamicIndexing) {
+        return false;
     }
-    log_support(VK_KHR_SWAPCHAIN_EXTENSION_NAME, found);
-    if (!found) {
+    const bool texture_limits_ok = physical_device->device_properties.limits.maxPerStageDescriptorSamplers >= MAX_TEXTURES &&
+                                   physical_device->device_properties.limits.maxPerStageDescriptorSampledImages >= MAX_TEXTURES;
+    log_support("Texture array size", texture_limits_ok);
+    if (!texture_limits_ok) {
         return false;
     }
 
+    /* Headless rendering has no surface and doesn't need a swapchain */
+    const bool headless = (surface == VK_NULL_HANDLE);
+
+    if (!headless) {
+        u32 vk_extension_count = 0;
+        vkEnumerateDeviceExtensionProperties(physical_device->handle, NULL, &vk_extension_count, NULL);
+        VkExtensionProperties vk_available_extensions[vk_extension_count];
+        vkEnumerateDeviceExtensionProperties(physical_device->handle, NULL, &vk_extension_count, vk_available_extensions);
+        bool found = false;
+        for (u32 i = 0; i < vk_extension_count; ++i) {
+            if(strcmp(vk_available_extensions[i].extensionName, VK_KHR_SWAPCHAIN_EXTENSION_NAME) == 0) {
+                found = true;
+                break;
+            }
+        }
+        log_support(VK_KHR_SWAPCHAIN_EXTENSION_NAME, found);
+        if (!found) {
+            return false;
+        }
+    }
+
     u32 queue_family_count = 0;
     vkGetPhysicalDeviceQueueFamilyProperties(physical_device->handle, &queue_family_count, NULL);
     VkQueueFamilyProperties queue_families[queue_family_count];
@@ -403,7 +616,11 @@ static bool is_physical_device_suitable(VkSurfaceKHR surface, struct vkc_physica
         }
 
         VkBool32 present_support = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(physical_device->handle, i, surface, &present_support);
+        if (headless) {
+            present_support = qf.queueFlags & VK_QUEUE_GRAPHICS_BIT;
+        } else {
+            vkGetPhysicalDeviceSurfaceSupportKHR(physical_device->handle, i, surface, &present_support);
+        }
         if (qf.queueCount > 0 && present_support) {
             physical_device->present_family = i;
         }
@@ -417,6 +634,22 @@ static bool is_physical_device_suitable(VkSurfaceKHR surface, struct vkc_physica
     if (physical_device->graphics_family < 0 || physical_device->present_family < 0) {
         return false;
     }
+    physical_device->timestamp_valid_bits = queue_families[physical_device->graphics_family].timestampValidBits;
+
+    /*
+     * Prefer a transfer only family for uploads, those are usually backed
+     * by dedicated copy engines. Graphics queues always support transfers.
+     */
+    physical_device->transfer_family = physical_device->graphics_family;
+    for (u32 i = 0; i < queue_family_count; ++i) {
+        VkQueueFlags flags = queue_families[i].queueFlags;
+        if (queue_families[i].queueCount > 0 && (flags & VK_QUEUE_TRANSFER_BIT) &&
+            !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            physical_device->transfer_family = i;
+            break;
+        }
+    }
+    log_support("Dedicated transfer family", physical_device->transfer_family != physical_device->graphics_family);
 
     return true;
 }
@@ -442,40 +675,33 @@ static bool vkc_pick_physical_device(VkInstance instance, VkSurfaceKHR surface,
 
 /* Logical Device */
 
-void vkc_create_logical_device(struct vkc_physical_device *physical_device, struct vkc_logical_device *logical_device) {
-    /*
-     * we're only dealing with graphics and present family here, so it's a simple "if",
-     * generally we check for unique queue families
-     */
+void vkc_create_logical_device(struct vkc_physical_device *physical_device, struct vkc_logical_device *logical_device, bool headless) {
+    /* Queue families can overlap, only create one queue per unique family */
+    u32 families[] = {
+        physical_device->graphics_family,
+        physical_device->present_family,
+        physical_device->transfer_family,
+    };
     u32 queue_create_info_count = 0;
-    VkDeviceQueueCreateInfo queue_create_infos[2];
+    VkDeviceQueueCreateInfo queue_create_infos[ARRLEN(families)];
     f32 queue_priority = 1.0f;
-    if (physical_device->graphics_family != physical_device->present_family) {
-        VkDeviceQueueCreateInfo* create_info;
-
-        create_info = &queue_create_infos[queue_create_info_count];
-        create_info->sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        create_info->queueFamilyIndex = physical_device->graphics_family;
-        create_info->queueCount       = 1;
-        create_info->pQueuePriorities = &queue_priority;
-        create_info->flags            = 0;
-        create_info->pNext            = NULL;
-        queue_create_info_count++;
+    for (u32 i = 0; i < ARRLEN(families); ++i) {
+        bool is_unique = true;
+        for (u32 j = 0; j < queue_create_info_count; ++j) {
+            if (queue_create_infos[j].queueFamilyIndex == families[i]) {
+                is_unique = false;
+                break;
+            }
+        }
+        if (!is_unique) {
+            continue;
+        }
 
-        create_info = &queue_create_infos[queue_create_info_count];
-        create_info->sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        create_info->queueFamilyIndex = physical_device->present_family;
-        create_info->queueCount       = 1;
-        create_info->pQueuePriorities = &queue_priority;
-        create_info->flags            = 0;
-        create_info->pNext            = NULL;
-        queue_create_info_count++;
-    } else {
         VkDeviceQueueCreateInfo* create_info;
 
         create_info = &queue_create_infos[queue_create_info_count];
         create_info->sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        create_info->queueFamilyIndex = physical_device->graphics_family;
+        create_info->queueFamilyIndex = families[i];
         create_info->queueCount       = 1;
         create_info->pQueuePriorities = &queue_priority;
         create_info->flags            = 0;
@@ -485,6 +711,7 @@ void vkc_create_logical_device(struct vkc_physical_device *physical_device, stru
 
     VkPhysicalDeviceFeatures device_features = {
         .samplerAnisotropy = VK_TRUE,
+        .shaderSampledImageArrayDynamicIndexing = VK_TRUE,
     };
 
     VkDeviceCreateInfo create_info = {
@@ -502,7 +729,7 @@ void vkc_create_logical_device(struct vkc_physical_device *physical_device, stru
 
     /* TODO(anjo): Isn't this just a copy of the stuff from the physical_device? */
     const char* extension = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
-    create_info.enabledExtensionCount = 1;
+    create_info.enabledExtensionCount = (headless) ? 0 : 1;
     create_info.ppEnabledExtensionNames = &extension;
 
     VKC_CHECK(vkCreateDevice(physical_device->handle, &create_info, NULL, &logical_device->handle),
@@ -510,8 +737,10 @@ void vkc_create_logical_device(struct vkc_physical_device *physical_device, stru
 
     vkGetDeviceQueue(logical_device->handle, physical_device->graphics_family, 0, &logical_device->graphics_queue);
     vkGetDeviceQueue(logical_device->handle, physical_device->present_family,  0, &logical_device->present_queue);
+    vkGetDeviceQueue(logical_device->handle, physical_device->transfer_family, 0, &logical_device->transfer_queue);
     logical_device->graphics_family = physical_device->graphics_family;
     logical_device->present_family = physical_device->present_family;
+    logical_device->transfer_family = physical_device->transfer_family;
 }
 
 /* Command buffers and pools */
@@ -551,44 +780,6 @@ void vkc_destroy_command_buffers(VkDevice device, VkCommandPool pool, VkCommandB
     platform.free_memory(buffers);
 }
 
-static VkCommandBuffer beginSingleTimeCommands(VkDevice device, VkCommandPool command_pool) {
-    /* TODO(anjo): Separate command pool for temporary commands */
-    VkCommandBufferAllocateInfo alloc_info = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandPool = command_pool,
-        .commandBufferCount = 1,
-    };
-
-    VkCommandBuffer command_buffer;
-    vkAllocateCommandBuffers(device, &alloc_info, &command_buffer);
-
-    VkCommandBufferBeginInfo begin_info = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-    };
-    vkBeginCommandBuffer(command_buffer, &begin_info);
-
-    return command_buffer;
-}
-
-static void endSingleTimeCommands(VkDevice device, VkQueue queue, VkCommandPool command_pool, VkCommandBuffer command_buffer) {
-    vkEndCommandBuffer(command_buffer);
-
-    VkSubmitInfo submit_info = {
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .pCommandBuffers = &command_buffer,
-        .commandBufferCount = 1,
-    };
-    vkQueueSubmit(queue, 1, &submit_info, VK_NULL_HANDLE);
-    /*
-     * TODO(anjo): We are performing and waiting for one copy at a time.
-     * We could instead use a fence and perform multiple ones
-     */
-    vkQueueWaitIdle(queue);
-    vkFreeCommandBuffers(device, command_pool, 1, &command_buffer);
-}
-
 /* Buffers and Images */
 
 static inline u32 findMemoryType(u32 type_filter, VkMemoryPropertyFlags properties) {
@@ -603,7 +794,28 @@ static inline u32 findMemoryType(u32 type_filter, VkMemoryPropertyFlags properti
     platform.log(LOG_INFO, "findMemoryType: failed, couldn't find memory type!");
 }
 
-static void createImage(VkDevice device, u32 width, u32 height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage *image, VkDeviceMemory *image_memory) {
+#include "memory.c"
+
+/*
+ * Resources written by the transfer queue and read by the graphics queue
+ * are shared concurrently rather than transferring queue family ownership
+ */
+static inline void set_transfer_sharing(bool shared, VkSharingMode *mode, u32 *family_count, const u32 **families) {
+    static u32 queue_families[2];
+    queue_families[0] = context->logical_device.graphics_family;
+    queue_families[1] = context->logical_device.transfer_family;
+    if (shared && queue_families[0] != queue_families[1]) {
+        *mode = VK_SHARING_MODE_CONCURRENT;
+        *family_count = ARRLEN(queue_families);
+        *families = queue_families;
+    } else {
+        *mode = VK_SHARING_MODE_EXCLUSIVE;
+        *family_count = 0;
+        *families = NULL;
+    }
+}
+
+static void createImage(VkDevice device, u32 width, u32 height, u32 mip_levels, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, bool shared, VkImage *image, GpuAllocation *image_memory) {
     VkImageCreateInfo image_info = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
         .imageType = VK_IMAGE_TYPE_2D,
@@ -612,71 +824,46 @@ static void createImage(VkDevice device, u32 width, u32 height, VkFormat format,
             .height = height,
             .depth = 1,
         },
-        .mipLevels = 1,
+        .mipLevels = mip_levels,
         .arrayLayers = 1,
         .format = format,
         .tiling = tiling,
         .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
         .usage = usage,
-        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
         .samples = VK_SAMPLE_COUNT_1_BIT,
         .flags = 0,
     };
+    set_transfer_sharing(shared, &image_info.sharingMode, &image_info.queueFamilyIndexCount, &image_info.pQueueFamilyIndices);
 
-    VKC_CHECK(vkCreateImage(context->logical_device.handle, &image_info, NULL, image), "Failed to create image!");
+    VKC_CHECK(vkCreateImage(device, &image_info, NULL, image), "Failed to create image!");
 
     VkMemoryRequirements mem_req;
-    vkGetImageMemoryRequirements(context->logical_device.handle, *image, &mem_req);
+    vkGetImageMemoryRequirements(device, *image, &mem_req);
 
-    VkMemoryAllocateInfo alloc_info = {
-        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        .allocationSize = mem_req.size,
-        .memoryTypeIndex = findMemoryType(mem_req.memoryTypeBits, properties),
-    };
-
-    VKC_CHECK(vkAllocateMemory(context->logical_device.handle, &alloc_info, NULL, image_memory), "Failed to allocate image memory");
+    *image_memory = gpu_allocate(context->memory, mem_req, properties, tiling == VK_IMAGE_TILING_LINEAR);
 
-    vkBindImageMemory(context->logical_device.handle, *image, *image_memory, 0);
+    vkBindImageMemory(device, *image, image_memory->memory, image_memory->offset);
 }
 
-static void create_buffer(VkDevice device, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer *buffer, VkDeviceMemory *memory) {
+static void create_buffer(VkDevice device, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, bool shared, VkBuffer *buffer, GpuAllocation *memory) {
     VkBufferCreateInfo buffer_info = {
         .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
         .size = size,
         .usage = usage,
-        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
     };
+    set_transfer_sharing(shared, &buffer_info.sharingMode, &buffer_info.queueFamilyIndexCount, &buffer_info.pQueueFamilyIndices);
 
     VKC_CHECK(vkCreateBuffer(device, &buffer_info, NULL, buffer), "failed to create buffer!");
 
     VkMemoryRequirements mem_req;
     vkGetBufferMemoryRequirements(device, *buffer, &mem_req);
 
-    VkMemoryAllocateInfo alloc_info = {
-        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        .allocationSize = mem_req.size,
-        .memoryTypeIndex = findMemoryType(mem_req.memoryTypeBits, properties),
-    };
-
-    VKC_CHECK(vkAllocateMemory(device, &alloc_info, NULL, memory), "failed to allocate memory for buffer");
+    *memory = gpu_allocate(context->memory, mem_req, properties, true);
 
-    vkBindBufferMemory(device, *buffer, *memory, 0);
+    vkBindBufferMemory(device, *buffer, memory->memory, memory->offset);
 }
 
-static void copyBuffer(VkDevice device, VkQueue queue, VkCommandPool command_pool, VkBuffer src, VkBuffer dst, VkDeviceSize size) {
-    VkCommandBuffer command_buffer = beginSingleTimeCommands(device, command_pool);
-
-    VkBufferCopy copy_region = {
-        .srcOffset = 0,
-        .dstOffset = 0,
-        .size = size,
-    };
-    vkCmdCopyBuffer(command_buffer, src, dst, 1, &copy_region);
-
-    endSingleTimeCommands(device, queue, command_pool, command_buffer);
-}
-
-static inline VkImageView createImageView(VkImage image, VkFormat format) {
+static inline VkImageView createImageView(VkImage image, VkFormat format, u32 mip_levels) {
     VkImageViewCreateInfo view_info = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
         .image = image,
@@ -685,7 +872,7 @@ static inline VkImageView createImageView(VkImage image, VkFormat format) {
         .subresourceRange = {
             .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
             .baseMipLevel = 0,
-            .levelCount = 1,
+            .levelCount = mip_levels,
             .baseArrayLayer = 0,
             .layerCount = 1,
         },
@@ -696,62 +883,18 @@ static inline VkImageView createImageView(VkImage image, VkFormat format) {
     return view;
 }
 
-static void copyBufferToImage(VkDevice device, VkQueue queue, VkCommandPool command_pool, VkBuffer buffer, VkImage image, u32 width, u32 height) {
-    VkCommandBuffer command_buffer = beginSingleTimeCommands(device, command_pool);
-
-    VkBufferImageCopy region = {
-        .bufferOffset = 0,
-        .bufferRowLength = 0,
-        .bufferImageHeight = 0,
-        .imageSubresource = {
-            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .mipLevel = 0,
-            .baseArrayLayer = 0,
-            .layerCount = 1,
-        },
-        .imageOffset = {0, 0, 0},
-        .imageExtent = {
-            .width = width,
-            .height = height,
-            .depth = 1,
-        },
-    };
-
-    vkCmdCopyBufferToImage(command_buffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-
-    endSingleTimeCommands(device, queue, command_pool, command_buffer);
-}
-
-static void transitionImageLayout(VkDevice device, VkQueue queue, VkCommandPool command_pool, VkImage image, VkFormat format, VkImageLayout old_layout, VkImageLayout new_layout, VkPipelineStageFlags src_stage, VkPipelineStageFlags dst_stage, u32 src_access, u32 dst_access) {
-    VkCommandBuffer command_buffer = beginSingleTimeCommands(device, command_pool);
-
-    VkImageMemoryBarrier barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .oldLayout = old_layout,
-        .newLayout = new_layout,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = image,
-        .subresourceRange = {
-            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .baseMipLevel = 0,
-            .levelCount = 1,
-            .baseArrayLayer = 0,
-            .layerCount = 1,
-        },
-        .srcAccessMask = src_access,
-        .dstAccessMask = dst_access,
-    };
-
-    vkCmdPipelineBarrier(command_buffer,
-                         src_stage, dst_stage,
-                         0,
-                         0, NULL,
-                         0, NULL,
-                         1, &barrier);
+#include "upload.c"
+#include "text.c"
+#include "glyph_upload.c"
+#include "cull.c"
+#include "profile.c"
 
-    endSingleTimeCommands(device, queue, command_pool, command_buffer);
-}
+/* A command buffer that can be submitted again while the frame's commands don't change */
+typedef struct RecordedFrame {
+    /* draw_list_hash() mixed with the record version, 0 if nothing is recorded */
+    u64 hash;
+    u64 record_ns;
+} RecordedFrame;
 
 /* Descriptor sets and pools */
 
@@ -764,10 +907,11 @@ static void create_descriptor_set_layout(VkDevice device, VkDescriptorSetLayout
     //    .pImmutableSamplers = NULL,
     //};
 
+    /* One array holding every texture, indexed through push constants */
     VkDescriptorSetLayoutBinding sampler_layout_binding = {
         .binding = 0,
         .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .descriptorCount = 1,
+        .descriptorCount = MAX_TEXTURES,
         .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
         .pImmutableSamplers = NULL,
     };
@@ -794,7 +938,7 @@ static void create_descriptor_pool(VkDevice device, u32 count, VkDescriptorPool
         },
         [1] = {
             .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            .descriptorCount = count,
+            .descriptorCount = count * MAX_TEXTURES,
         },
     };
 
@@ -826,8 +970,16 @@ static void create_descriptor_sets(VkDevice device, u32 count, VkDescriptorPool
 
 /* Swapchain */
 
+static u32 latency_mode_frames(LatencyMode mode) {
+    switch (mode) {
+    case LATENCY_LOW:        return 1;
+    case LATENCY_THROUGHPUT: return 3;
+    default:                 return 2;
+    }
+}
+
 /* TODO(anjo): a lot of this should probably be handled in the selection of a physical device */
-bool getSwapchainInfo(VkSurfaceKHR surface, struct vkc_physical_device *physical_device, SwapchainInfo *info) {
+bool getSwapchainInfo(VkSurfaceKHR surface, struct vkc_physical_device *physical_device, LatencyMode mode, SwapchainInfo *info) {
     platform.log(LOG_INFO, "Vulkan: Getting swapchain info");
 
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device->handle, surface, &info->capabilities);
@@ -856,22 +1008,38 @@ bool getSwapchainInfo(VkSurfaceKHR surface, struct vkc_physical_device *physical
     vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device->handle, surface, &vk_present_mode_count, NULL);
     VkPresentModeKHR vk_present_modes[vk_present_mode_count];
     vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device->handle, surface, &vk_present_mode_count, vk_present_modes);
+
+    /* In order of preference, FIFO is the one mode every device supports */
+    VkPresentModeKHR preferred[3];
+    u32 preferred_count = 0;
+    if (mode != LATENCY_POWER_SAVING) {
+        preferred[preferred_count++] = VK_PRESENT_MODE_MAILBOX_KHR;
+    }
+    if (mode == LATENCY_LOW) {
+        preferred[preferred_count++] = VK_PRESENT_MODE_IMMEDIATE_KHR;
+    }
+    preferred[preferred_count++] = VK_PRESENT_MODE_FIFO_KHR;
+
     bool present_mode_found = false;
-    for (u32 i = 0; i < vk_present_mode_count; ++i) {
-        if (vk_present_modes[i] == VK_PRESENT_MODE_MAILBOX_KHR) {
-            info->present_mode = vk_present_modes[i];
-            present_mode_found = true;
-            break;
+    for (u32 i = 0; i < preferred_count && !present_mode_found; ++i) {
+        for (u32 j = 0; j < vk_present_mode_count; ++j) {
+            if (vk_present_modes[j] == preferred[i]) {
+                info->present_mode = preferred[i];
+                present_mode_found = true;
+                break;
+            }
         }
-        /* TODO(anjo): fallback to VK_PRESENT_MODE_FIFO_KHR? */
     }
     log_support("present mode", present_mode_found);
     if (!present_mode_found) {
         return false;
     }
+    platform.log(LOG_INFO, "Vulkan: present mode %d for %s latency", info->present_mode, latency_mode_names[mode]);
+
+    return true;
 }
 
-void createSwapchain(VkSurfaceKHR surface, struct vkc_logical_device *logical_device, SwapchainInfo *info, u32 width, u32 height, Swapchain *swapchain) {
+void createSwapchain(VkSurfaceKHR surface, struct vkc_logical_device *logical_device, SwapchainInfo *info, u32 width, u32 height, VkSwapchainKHR old_swapchain, Swapchain *swapchain) {
     swapchain->image_format = info->surface_format.format;
     swapchain->image_color_space = info->surface_format.colorSpace;
     if (info->capabilities.currentExtent.width != UINT32_MAX) {
@@ -888,6 +1056,7 @@ void createSwapchain(VkSurfaceKHR surface, struct vkc_logical_device *logical_de
     if (info->capabilities.maxImageCount > 0 && image_count > info->capabilities.maxImageCount) {
         image_count = info->capabilities.maxImageCount;
     }
+    image_count = MIN(image_count, MAX_SWAPCHAIN_IMAGES);
 
     VkSwapchainCreateInfoKHR create_info = {
         .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
@@ -902,7 +1071,7 @@ void createSwapchain(VkSurfaceKHR surface, struct vkc_logical_device *logical_de
         .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
         .presentMode = info->present_mode,
         .clipped = VK_TRUE,
-        .oldSwapchain = VK_NULL_HANDLE,
+        .oldSwapchain = old_swapchain,
     };
     u32 queue_indices[] = {logical_device->graphics_family, logical_device->present_family};
     if (logical_device->graphics_family != logical_device->present_family) {
@@ -919,22 +1088,94 @@ void createSwapchain(VkSurfaceKHR surface, struct vkc_logical_device *logical_de
              "failed to create swapchain");
 
     vkGetSwapchainImagesKHR(logical_device->handle, swapchain->handle, &image_count, NULL);
+    if (image_count > MAX_SWAPCHAIN_IMAGES) {
+        platform.log(LOG_ERROR, "Vulkan: swapchain has %u images, at most %u are supported", image_count, MAX_SWAPCHAIN_IMAGES);
+        platform.abort();
+    }
     swapchain->image_count = image_count;
     swapchain->images = platform.allocate_memory(sizeof(VkImage) * image_count);
     vkGetSwapchainImagesKHR(logical_device->handle, swapchain->handle, &image_count, swapchain->images);
 }
 
+void createOffscreenSwapchain(struct vkc_logical_device *logical_device, u32 width, u32 height, Swapchain *swapchain) {
+    swapchain->offscreen = true;
+    swapchain->handle = VK_NULL_HANDLE;
+    swapchain->image_format = VK_FORMAT_B8G8R8A8_UNORM;
+    swapchain->image_color_space = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+    swapchain->image_extent = (VkExtent2D) {width, height};
+    swapchain->image_count = HEADLESS_IMAGE_COUNT;
+    swapchain->images = platform.allocate_memory(sizeof(VkImage) * swapchain->image_count);
+    swapchain->image_memory = platform.allocate_memory(sizeof(GpuAllocation) * swapchain->image_count);
+
+    for (u32 i = 0; i < swapchain->image_count; ++i) {
+        createImage(logical_device->handle, width, height, 1, swapchain->image_format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, &swapchain->images[i], &swapchain->image_memory[i]);
+    }
+}
+
 void destroySwapchain(struct vkc_logical_device *logical_device, Swapchain *swapchain) {
+    if (swapchain->offscreen) {
+        for (u32 i = 0; i < swapchain->image_count; ++i) {
+            vkDestroyImage(logical_device->handle, swapchain->images[i], NULL);
+            gpu_free(context->memory, &swapchain->image_memory[i]);
+        }
+        platform.free_memory(swapchain->image_memory);
+    } else {
+        vkDestroySwapchainKHR(logical_device->handle, swapchain->handle, NULL);
+    }
     platform.free_memory(swapchain->images);
-    vkDestroySwapchainKHR(logical_device->handle, swapchain->handle, NULL);
 }
 
+/* D16 is always supported as a depth attachment, D32 is preferred when there is one */
+static VkFormat pick_depth_format(VkPhysicalDevice physical_device) {
+    const VkFormat formats[] = {
+        VK_FORMAT_D32_SFLOAT,
+        VK_FORMAT_D16_UNORM,
+    };
+    for (u32 i = 0; i < ARRLEN(formats); ++i) {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(physical_device, formats[i], &properties);
+        if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+            return formats[i];
+        }
+    }
+    return VK_FORMAT_D16_UNORM;
+}
+
+/*
+ * One depth image serves every swapchain image. Render passes run in
+ * submission order on the graphics queue and the render pass makes each
+ * one wait for the depth writes of the last, see vkc_create_renderpass().
+ */
+static void create_depth_buffer(struct vkc_logical_device *logical_device, Swapchain *swapchain, VkFormat format) {
+    createImage(logical_device->handle, swapchain->image_extent.width, swapchain->image_extent.height, 1, format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, &swapchain->depth_image, &swapchain->depth_memory);
+
+    VkImageViewCreateInfo view_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = swapchain->depth_image,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = format,
+        .subresourceRange = {
+            .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
+            .baseMipLevel = 0,
+            .levelCount = 1,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+        },
+    };
+    VKC_CHECK(vkCreateImageView(logical_device->handle, &view_info, NULL, &swapchain->depth_view), "Failed to create depth image view");
+}
+
+/* Image views, and the depth buffer if the renderer has one */
 void createSwapchainImageViews(struct vkc_logical_device *logical_device, Swapchain *swapchain) {
     swapchain->image_view_count = swapchain->image_count;
     swapchain->image_views = platform.allocate_memory(sizeof(VkImageView) * swapchain->image_view_count);
 
     for (u32 i = 0; i < swapchain->image_view_count; ++i) {
-        swapchain->image_views[i] = createImageView(swapchain->images[i], swapchain->image_format);
+        swapchain->image_views[i] = createImageView(swapchain->images[i], swapchain->image_format, 1);
+    }
+
+    if (context->depth_format != VK_FORMAT_UNDEFINED) {
+        create_depth_buffer(logical_device, swapchain, context->depth_format);
     }
 }
 
@@ -943,6 +1184,13 @@ void destroySwapchainImageViews(struct vkc_logical_device *logical_device, Swapc
         vkDestroyImageView(logical_device->handle, swapchain->image_views[i], NULL);
     }
     platform.free_memory(swapchain->image_views);
+
+    if (swapchain->depth_image != VK_NULL_HANDLE) {
+        vkDestroyImageView(logical_device->handle, swapchain->depth_view, NULL);
+        vkDestroyImage(logical_device->handle, swapchain->depth_image, NULL);
+        gpu_free(context->memory, &swapchain->depth_memory);
+        swapchain->depth_image = VK_NULL_HANDLE;
+    }
 }
 
 /* Framebuffer */
@@ -952,13 +1200,14 @@ VkFramebuffer *vkc_create_framebuffers(VkDevice device, VkRenderPass renderpass,
 
     for (u32 i = 0; i < swapchain->image_view_count; ++i) {
         VkImageView attachments[] = {
-            swapchain->image_views[i]
+            swapchain->image_views[i],
+            swapchain->depth_view,
         };
 
         VkFramebufferCreateInfo fb_info = {
             .sType           = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
             .renderPass      = renderpass,
-            .attachmentCount = 1,
+            .attachmentCount = (swapchain->depth_image != VK_NULL_HANDLE) ? 2 : 1,
             .pAttachments    = attachments,
             .width           = swapchain->image_extent.width,
             .height          = swapchain->image_extent.height,
@@ -982,25 +1231,62 @@ void vkc_destroy_framebuffers(VkDevice device, VkFramebuffer *fbs, u32 fb_count)
 
 /* Renderpass */
 
-VkRenderPass vkc_create_renderpass(VkDevice device, Swapchain *swapchain) {
-    VkSubpassDependency dependency = {
-        .srcSubpass    = VK_SUBPASS_EXTERNAL,
-        .dstSubpass    = 0,
-        .srcStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-        .srcAccessMask = 0,
-        .dstStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-        .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+/* With a depth attachment unless depth_format is VK_FORMAT_UNDEFINED */
+VkRenderPass vkc_create_renderpass(VkDevice device, Swapchain *swapchain, VkFormat depth_format) {
+    const bool has_depth = depth_format != VK_FORMAT_UNDEFINED;
+    const VkPipelineStageFlags depth_stages = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+
+    VkSubpassDependency dependencies[] = {
+        [0] = {
+            .srcSubpass    = VK_SUBPASS_EXTERNAL,
+            .dstSubpass    = 0,
+            .srcStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .srcAccessMask = 0,
+            .dstStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        },
+        /* The depth buffer is shared, clearing it waits for the previous frame's depth tests */
+        [1] = {
+            .srcSubpass    = VK_SUBPASS_EXTERNAL,
+            .dstSubpass    = 0,
+            .srcStageMask  = depth_stages,
+            .srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+            .dstStageMask  = depth_stages,
+            .dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        },
+        /* Offscreen images are copied out for readback after the pass */
+        [2] = {
+            .srcSubpass    = 0,
+            .dstSubpass    = VK_SUBPASS_EXTERNAL,
+            .srcStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+            .dstStageMask  = VK_PIPELINE_STAGE_TRANSFER_BIT,
+            .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        },
     };
 
-    VkAttachmentDescription color_attachment = {
-        .format         = swapchain->image_format,
-        .samples        = VK_SAMPLE_COUNT_1_BIT,
-        .loadOp         = VK_ATTACHMENT_LOAD_OP_CLEAR,
-        .storeOp        = VK_ATTACHMENT_STORE_OP_STORE,
-        .stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
-        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-        .initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
-        .finalLayout    = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+    VkAttachmentDescription attachments[] = {
+        [0] = {
+            .format         = swapchain->image_format,
+            .samples        = VK_SAMPLE_COUNT_1_BIT,
+            .loadOp         = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .storeOp        = VK_ATTACHMENT_STORE_OP_STORE,
+            .stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
+            .finalLayout    = (swapchain->offscreen) ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+        },
+        /* Depth only lives for the pass, it's never stored */
+        [1] = {
+            .format         = depth_format,
+            .samples        = VK_SAMPLE_COUNT_1_BIT,
+            .loadOp         = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .storeOp        = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
+            .finalLayout    = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        },
     };
 
     VkAttachmentReference color_attachment_ref = {
@@ -1008,20 +1294,35 @@ VkRenderPass vkc_create_renderpass(VkDevice device, Swapchain *swapchain) {
         .layout     = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
     };
 
+    VkAttachmentReference depth_attachment_ref = {
+        .attachment = 1,
+        .layout     = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    };
+
     VkSubpassDescription subpass = {
-        .pipelineBindPoint    = VK_PIPELINE_BIND_POINT_GRAPHICS,
-        .colorAttachmentCount = 1,
-        .pColorAttachments    = &color_attachment_ref,
+        .pipelineBindPoint       = VK_PIPELINE_BIND_POINT_GRAPHICS,
+        .colorAttachmentCount    = 1,
+        .pColorAttachments       = &color_attachment_ref,
+        .pDepthStencilAttachment = (has_depth) ? &depth_attachment_ref : NULL,
     };
 
+    /* Dependencies that don't apply are moved out of the way */
+    u32 dependency_count = 1;
+    if (has_depth) {
+        dependencies[dependency_count++] = dependencies[1];
+    }
+    if (swapchain->offscreen) {
+        dependencies[dependency_count++] = dependencies[2];
+    }
+
     VkRenderPassCreateInfo render_pass_info = {
         .sType           = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-        .attachmentCount = 1,
-        .pAttachments    = &color_attachment,
+        .attachmentCount = (has_depth) ? 2 : 1,
+        .pAttachments    = attachments,
         .subpassCount    = 1,
         .pSubpasses      = &subpass,
-        .dependencyCount = 1,
-        .pDependencies   = &dependency,
+        .dependencyCount = dependency_count,
+        .pDependencies   = dependencies,
     };
 
     VkRenderPass pass = VK_NULL_HANDLE;
@@ -1033,6 +1334,22 @@ VkRenderPass vkc_create_renderpass(VkDevice device, Swapchain *swapchain) {
 
 /* Pipeline */
 
+#include "pipeline_cache.c"
+
+static inline u64 time_to_ns(Time t) {
+    return t.seconds*1000000000ull + t.nanoseconds;
+}
+
+static void report_pipeline_creation(const char *reason) {
+    platform.log(LOG_INFO, "Pipelines: %s, created %u in %.3f ms (%s cache)",
+                 reason,
+                 context->pipeline_create_count,
+                 (f64) context->pipeline_create_ns/1e6,
+                 (context->pipeline_cache_is_warm) ? "warm" : "cold");
+    context->pipeline_create_ns = 0;
+    context->pipeline_create_count = 0;
+}
+
 VkShaderModule create_shader_module(VkDevice device, const char *code, u64 code_size) {
     VkShaderModuleCreateInfo create_info = {
         .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
@@ -1047,7 +1364,16 @@ VkShaderModule create_shader_module(VkDevice device, const char *code, u64 code_
     return shader_module;
 }
 
-struct vkc_pipeline create_pipeline(VkDevice device, VkRenderPass renderpass, Swapchain *swapchain, VkShaderModule vert_module, VkShaderModule frag_module, VkVertexInputBindingDescription vertex_binding_desc, VkVertexInputAttributeDescription* vertex_attrib_desc, u32 attrib_count, VkDescriptorSetLayout *descriptor_set_layout, VkPushConstantRange *push_constant) {
+/* How a pipeline uses the depth attachment */
+typedef enum PipelineDepth {
+    PIPELINE_DEPTH_NONE,
+    /* Opaque, not blended, tests and writes depth */
+    PIPELINE_DEPTH_WRITE,
+    /* Blended, only tests against what the opaque draws wrote */
+    PIPELINE_DEPTH_TEST,
+} PipelineDepth;
+
+struct vkc_pipeline create_pipeline(VkDevice device, VkRenderPass renderpass, PipelineDepth depth, VkShaderModule vert_module, VkShaderModule frag_module, VkVertexInputBindingDescription *vertex_binding_desc, u32 binding_count, VkVertexInputAttributeDescription* vertex_attrib_desc, u32 attrib_count, VkDescriptorSetLayout *descriptor_set_layout, VkPushConstantRange *push_constant) {
 
     // Create the pipeline layout
 
@@ -1083,8 +1409,8 @@ struct vkc_pipeline create_pipeline(VkDevice device, VkRenderPass renderpass, Sw
     VkPipelineShaderStageCreateInfo shader_stages[] = {vert_create_info, frag_create_info};
     VkPipelineVertexInputStateCreateInfo vertex_input_info = {
         .sType                           = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-        .vertexBindingDescriptionCount   = 1,
-        .pVertexBindingDescriptions      = &vertex_binding_desc,
+        .vertexBindingDescriptionCount   = binding_count,
+        .pVertexBindingDescriptions      = vertex_binding_desc,
         .vertexAttributeDescriptionCount = attrib_count,
         .pVertexAttributeDescriptions    = vertex_attrib_desc,
     };
@@ -1095,26 +1421,24 @@ struct vkc_pipeline create_pipeline(VkDevice device, VkRenderPass renderpass, Sw
         .primitiveRestartEnable = VK_FALSE,
     };
 
-    VkViewport viewport = {
-        .x = 0.0f,
-        .y = 0.0f,
-        .width  = (f32) swapchain->image_extent.width,
-        .height = (f32) swapchain->image_extent.height,
-        .minDepth = 0.0f,
-        .maxDepth = 1.0f,
-    };
-
-    VkRect2D scissor = {
-        .offset = (VkOffset2D) { .x = 0, .y = 0 },
-        .extent = swapchain->image_extent,
-    };
-
+    /* Viewport and scissor are dynamic so pipelines survive swapchain resizes */
     VkPipelineViewportStateCreateInfo viewport_state = {
         .sType         = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
         .viewportCount = 1,
-        .pViewports    = &viewport,
+        .pViewports    = NULL,
         .scissorCount  = 1,
-        .pScissors     = &scissor,
+        .pScissors     = NULL,
+    };
+
+    VkDynamicState dynamic_states[] = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR,
+    };
+
+    VkPipelineDynamicStateCreateInfo dynamic_state = {
+        .sType             = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+        .dynamicStateCount = ARRLEN(dynamic_states),
+        .pDynamicStates    = dynamic_states,
     };
 
     VkPipelineRasterizationStateCreateInfo rasterizer = {
@@ -1146,7 +1470,7 @@ struct vkc_pipeline create_pipeline(VkDevice device, VkRenderPass renderpass, Sw
                              | VK_COLOR_COMPONENT_G_BIT
                              | VK_COLOR_COMPONENT_B_BIT
                              | VK_COLOR_COMPONENT_A_BIT,
-        .blendEnable         = VK_TRUE,
+        .blendEnable         = (depth == PIPELINE_DEPTH_WRITE) ? VK_FALSE : VK_TRUE,
         .srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA,
         .dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
         .colorBlendOp        = VK_BLEND_OP_ADD,
@@ -1167,6 +1491,15 @@ struct vkc_pipeline create_pipeline(VkDevice device, VkRenderPass renderpass, Sw
         .blendConstants[3] = 0.0f,
     };
 
+    VkPipelineDepthStencilStateCreateInfo depth_stencil = {
+        .sType                 = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+        .depthTestEnable       = VK_TRUE,
+        .depthWriteEnable      = (depth == PIPELINE_DEPTH_WRITE) ? VK_TRUE : VK_FALSE,
+        .depthCompareOp        = VK_COMPARE_OP_LESS,
+        .depthBoundsTestEnable = VK_FALSE,
+        .stencilTestEnable     = VK_FALSE,
+    };
+
     VkGraphicsPipelineCreateInfo pipeline_info = {
         .sType               = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
         .stageCount          = 2,
@@ -1176,9 +1509,9 @@ struct vkc_pipeline create_pipeline(VkDevice device, VkRenderPass renderpass, Sw
         .pViewportState      = &viewport_state,
         .pRasterizationState = &rasterizer,
         .pMultisampleState   = &multisampling,
-        .pDepthStencilState  = NULL,
+        .pDepthStencilState  = (depth != PIPELINE_DEPTH_NONE) ? &depth_stencil : NULL,
         .pColorBlendState    = &color_blending,
-        .pDynamicState       = NULL,
+        .pDynamicState       = &dynamic_state,
         .layout              = layout,
         .renderPass          = renderpass,
         .subpass             = 0,
@@ -1187,8 +1520,11 @@ struct vkc_pipeline create_pipeline(VkDevice device, VkRenderPass renderpass, Sw
     };
 
     VkPipeline pipeline = VK_NULL_HANDLE;
-    VKC_CHECK(vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_info, NULL, &pipeline),
+    Time start = platform.time_current();
+    VKC_CHECK(vkCreateGraphicsPipelines(device, context->pipeline_cache, 1, &pipeline_info, NULL, &pipeline),
              "failed to create graphics pipeline");
+    context->pipeline_create_ns += time_to_ns(platform.time_current()) - time_to_ns(start);
+    context->pipeline_create_count++;
 
     return (struct vkc_pipeline) {pipeline, layout};
 }
@@ -1224,113 +1560,352 @@ static void createTextureSampler() {
         .mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
         .mipLodBias = 0.0f,
         .minLod = 0.0f,
-        .maxLod = 0.0f,
+        /* Cooked textures come with mip levels, the rest have one */
+        .maxLod = VK_LOD_CLAMP_NONE,
     };
 
     VKC_CHECK(vkCreateSampler(context->logical_device.handle, &sampler_info, NULL, &context->texture_sampler), "Failed to create texture sampler");
-}
 
-static void createTextureImageView() {
-    context->texture_image_view = createImageView(context->texture_image, VK_FORMAT_R8_SRGB);
+    /* Repeating would filter in the opposite edge of the atlas */
+    sampler_info.magFilter = VK_FILTER_LINEAR;
+    sampler_info.minFilter = VK_FILTER_LINEAR;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    VKC_CHECK(vkCreateSampler(context->logical_device.handle, &sampler_info, NULL, &context->filtered_sampler), "Failed to create filtered texture sampler");
 }
 
-static void createTextureImage(Image *image) {
-    VkDeviceSize size = image->width * image->height * image->channels;
-    VkBuffer staging_buffer;
-    VkDeviceMemory staging_buffer_memory;
+static bool createTexture(GpuTexture *texture, Image *image) {
+    VkFormat format;
+    switch (image->channels) {
+    case 1: format = (image->is_linear) ? VK_FORMAT_R8_UNORM : VK_FORMAT_R8_SRGB; break;
+    case 4: format = (image->is_linear) ? VK_FORMAT_R8G8B8A8_UNORM : VK_FORMAT_R8G8B8A8_SRGB; break;
+    default:
+        platform.log(LOG_ERROR, "Vulkan: unsupported texture channel count %u", image->channels);
+        return false;
+    }
+
+    const u32 mip_levels = MIN(image_mip_count(image), UPLOAD_MAX_MIPS);
+    createImage(context->logical_device.handle, image->width, image->height, mip_levels, format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true, &texture->image, &texture->memory);
+    texture->upload_ticket = upload_image(context->upload, texture->image, image);
+    texture->is_ready = false;
+    texture->is_filtered = image->is_filtered;
 
-    create_buffer(context->logical_device.handle, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging_buffer, &staging_buffer_memory);
+    texture->view = createImageView(texture->image, format, mip_levels);
+    texture->is_valid = true;
 
-    void *data;
-    vkMapMemory(context->logical_device.handle, staging_buffer_memory, 0, size, 0, &data);
-    memcpy(data, image->pixels, size);
-    vkUnmapMemory(context->logical_device.handle, staging_buffer_memory);
+    return true;
+}
 
-    createImage(context->logical_device.handle, image->width, image->height, VK_FORMAT_R8_SRGB, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &context->texture_image, &context->texture_image_memory);
+static void destroyTexture(GpuTexture *texture) {
+    vkDestroyImageView(context->logical_device.handle, texture->view, NULL);
+    vkDestroyImage(context->logical_device.handle, texture->image, NULL);
+    gpu_free(context->memory, &texture->memory);
+    texture->is_valid = false;
+    texture->is_ready = false;
+}
 
-    transitionImageLayout(context->logical_device.handle, context->logical_device.graphics_queue, context->command_pool, context->texture_image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, VK_ACCESS_TRANSFER_WRITE_BIT);
-    copyBufferToImage(context->logical_device.handle, context->logical_device.graphics_queue, context->command_pool, staging_buffer, context->texture_image, image->width, image->height);
-    transitionImageLayout(context->logical_device.handle, context->logical_device.graphics_queue, context->command_pool, context->texture_image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+/* Destroys retired resources no frame in flight or upload uses anymore, or all of them */
+static void destroy_retired_resources(bool all) {
+    u32 kept = 0;
+    for (u32 i = 0; i < context->retired_resource_count; ++i) {
+        RetiredResource *retired = &context->retired_resources[i];
+        if (!all && (retired->frame_serial > context->completed_serial || !upload_is_complete(context->upload, retired->upload_ticket))) {
+            context->retired_resources[kept++] = *retired;
+            continue;
+        }
 
-    vkDestroyBuffer(context->logical_device.handle, staging_buffer, NULL);
-    vkFreeMemory(context->logical_device.handle, staging_buffer_memory, NULL);
+        if (retired->view != VK_NULL_HANDLE) {
+            vkDestroyImageView(context->logical_device.handle, retired->view, NULL);
+        }
+        if (retired->image != VK_NULL_HANDLE) {
+            vkDestroyImage(context->logical_device.handle, retired->image, NULL);
+        }
+        if (retired->buffer != VK_NULL_HANDLE) {
+            vkDestroyBuffer(context->logical_device.handle, retired->buffer, NULL);
+        }
+        gpu_free(context->memory, &retired->memory);
+    }
+    context->retired_resource_count = kept;
 }
 
-static void create_uniform_buffers(VkDevice device, VkDeviceSize size, VkBuffer *buffers, VkDeviceMemory *memory, u32 count) {
-    for (u32 i = 0; i < count; ++i) {
-        create_buffer(device, size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &buffers[i], &memory[i]);
+/* Frames already submitted may still draw with resource, it's destroyed once they complete */
+static void retire_resource(RetiredResource resource) {
+    if (context->retired_resource_count == MAX_RETIRED_RESOURCES) {
+        /* Replaced faster than frames complete, the GPU is far behind anyway */
+        VKC_CHECK(vkDeviceWaitIdle(context->logical_device.handle), "wait idle failed");
+        destroy_retired_resources(true);
     }
+
+    resource.frame_serial = context->submitted_serial;
+    context->retired_resources[context->retired_resource_count++] = resource;
 }
 
-static void cleanup_swapchain() {
-    for (u32 i = 0; i < context->swapchain.image_count; ++i) {
-        vkDestroyBuffer(context->logical_device.handle, context->uniform_buffers[i], NULL);
-        vkFreeMemory(context->logical_device.handle, context->uniform_buffers_memory[i], NULL);
+static void retireTexture(GpuTexture *texture) {
+    retire_resource((RetiredResource) {
+        .image = texture->image,
+        .view = texture->view,
+        .memory = texture->memory,
+        .upload_ticket = texture->upload_ticket,
+    });
+    texture->is_valid = false;
+    texture->is_ready = false;
+}
+
+/* Uploads pending and frees released registry slots, called before recording */
+static void update_textures(Renderer *r) {
+    if (!r->textures) {
+        return;
     }
-    vkDestroyDescriptorPool(context->logical_device.handle, context->descriptor_pool, NULL);
-    vkc_destroy_command_buffers(context->logical_device.handle, context->command_pool, context->command_buffers, context->swapchain.image_count);
 
-    vkc_destroy_framebuffers(context->logical_device.handle, context->framebuffers, context->framebuffer_count);
-    // TODO(anjo): why does cleanup swapchain destroy renderpasses and pipelines? Only our eternal lord knows
-    vkc_destroy_pipeline(context->logical_device.handle, context->color_pipeline);
-    vkc_destroy_pipeline(context->logical_device.handle, context->texture_pipeline);
-    vkc_destroy_pipeline(context->logical_device.handle, context->atlas_pipeline);
-    vkDestroyRenderPass(context->logical_device.handle, context->renderpass, NULL);
-    destroySwapchainImageViews(&context->logical_device, &context->swapchain);
-    destroySwapchain(&context->logical_device, &context->swapchain);
+    /* Frames in flight may still sample the textures replaced here, they're retired instead of destroyed */
+    for (u32 i = 1; i < MAX_TEXTURES; ++i) {
+        TextureSlot *slot = &r->textures->slots[i];
+        GpuTexture *texture = &context->textures[i];
+
+        if (slot->state == TEXTURE_RELEASED) {
+            if (texture->is_valid) {
+                retireTexture(texture);
+                context->texture_versions[i]++;
+            }
+            slot->state = TEXTURE_FREE;
+        } else if (slot->state == TEXTURE_PENDING) {
+            if (texture->is_valid) {
+                retireTexture(texture);
+            }
+            /* Failed uploads are still marked resident and draw the default texture */
+            if (slot->image.pixels) {
+                createTexture(texture, &slot->image);
+            }
+            slot->state = TEXTURE_RESIDENT;
+            context->texture_versions[i]++;
+        }
+    }
+
+    upload_flush(context->upload);
+
+    /* Textures are sampled once their upload is done, until then the default is drawn */
+    for (u32 i = 1; i < MAX_TEXTURES; ++i) {
+        GpuTexture *texture = &context->textures[i];
+        if (texture->is_valid && !texture->is_ready && upload_is_complete(context->upload, texture->upload_ticket)) {
+            texture->is_ready = true;
+            context->texture_versions[i]++;
+        }
+    }
 }
 
-static void populate_descriptor_sets() {
-    for (u32 i = 0; i < context->swapchain.image_count; ++i) {
-        //VkDescriptorBufferInfo buffer_info = {
-        //    .buffer = context->uniform_buffers[i],
-        //    .offset = 0,
-        //    .range = sizeof(struct uniform_buffer_object),
-        //};
+static void destroyLayer(GpuLayer *layer) {
+    vkDestroyBuffer(context->logical_device.handle, layer->buffer, NULL);
+    gpu_free(context->memory, &layer->memory);
+    platform.free_memory(layer->runs);
+    layer->runs = NULL;
+    layer->is_valid = false;
+    layer->is_ready = false;
+    /* Command buffers drawing it can't be submitted again */
+    context->record_version++;
+}
 
-        VkDescriptorImageInfo image_info = {
-            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-            .imageView = context->texture_image_view,
-            .sampler = context->texture_sampler,
+static void retireLayer(GpuLayer *layer) {
+    retire_resource((RetiredResource) {
+        .buffer = layer->buffer,
+        .memory = layer->memory,
+        .upload_ticket = layer->upload_ticket,
+    });
+    platform.free_memory(layer->runs);
+    layer->runs = NULL;
+    layer->is_valid = false;
+    layer->is_ready = false;
+    /* Command buffers drawing it can't be submitted again */
+    context->record_version++;
+}
+
+/*
+ * Turns the quads of a layer into instances, returns how many. Instances
+ * keep the order of the entries and are split into runs by texture.
+ */
+static u32 build_layer_instances(Renderer *r, LayerSlot *slot, LayerInstance *instances, LayerRun *runs, u32 *run_count) {
+    u32 count = 0;
+    *run_count = 0;
+    for (u8 *p = slot->commands.memory_base; p < slot->commands.memory_base + slot->commands.memory_top; p += render_entry_size((RenderEntryHeader *) p)) {
+        RenderEntryHeader *header = (RenderEntryHeader *) p;
+        LayerInstance *instance = &instances[count];
+        *instance = (LayerInstance) {
+            .size = {1.0f, 1.0f},
+            .col = {1.0f, 1.0f, 1.0f},
+            .flags = ATLAS_FLAG_RGBA,
         };
 
-        VkWriteDescriptorSet writes[] = {
-            //[0] = {
-            //    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-            //    .dstSet = context->descriptor_sets[i],
-            //    .dstBinding = 0,
-            //    .dstArrayElement = 0,
-            //    .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-            //    .descriptorCount = 1,
-            //    .pBufferInfo = &buffer_info,
-            //},
-            [0] = {
-                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-                .dstSet = context->descriptor_sets[i],
-                .dstBinding = 0,
-                .dstArrayElement = 0,
-                .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-                .descriptorCount = 1,
-                .pImageInfo = &image_info,
-            },
+        /*
+         * Everything goes through atlas.frag, solid quads as the white
+         * default texture tinted by their color. Textures are resolved to
+         * their slot here, the descriptor set shows the default until
+         * they're uploaded.
+         */
+        TextureHandle texture = TEXTURE_HANDLE_NONE;
+        switch (header->type) {
+        case ENTRY_TYPE_RenderEntryQuad: {
+            RenderEntryQuad *quad = (RenderEntryQuad *) header;
+            v2AssignToArray(instance->pos, quad->pos);
+            v2AssignToArray(instance->scale, quad->scale);
+            colorRGBAssignToArray(instance->col, quad->col);
+            break;
+        }
+        case ENTRY_TYPE_RenderEntryTexturedQuad: {
+            RenderEntryTexturedQuad *quad = (RenderEntryTexturedQuad *) header;
+            v2AssignToArray(instance->pos, quad->pos);
+            v2AssignToArray(instance->scale, quad->scale);
+            texture = quad->texture;
+            break;
+        }
+        case ENTRY_TYPE_RenderEntryAtlasQuad: {
+            RenderEntryAtlasQuad *quad = (RenderEntryAtlasQuad *) header;
+            v2AssignToArray(instance->pos, quad->pos);
+            v2AssignToArray(instance->scale, quad->scale);
+            v2AssignToArray(instance->offset, quad->offset);
+            v2AssignToArray(instance->size, quad->size);
+            colorRGBAssignToArray(instance->col, quad->col);
+            instance->flags = 0;
+            texture = quad->texture;
+            break;
+        }
+        case ENTRY_TYPE_RenderEntrySprite: {
+            RenderEntrySprite *sprite = (RenderEntrySprite *) header;
+            v2AssignToArray(instance->pos, sprite->pos);
+            v2AssignToArray(instance->scale, sprite->scale);
+            v2AssignToArray(instance->offset, sprite->offset);
+            v2AssignToArray(instance->size, sprite->size);
+            colorRGBAssignToArray(instance->col, sprite->tint);
+            texture = sprite->texture;
+            break;
+        }
+        default:
+            continue;
+        }
+
+        const u32 texture_slot = (r->textures && textureLookup(r->textures, texture)) ? TEXTURE_HANDLE_SLOT(texture) : 0;
+        if (*run_count == 0 || runs[*run_count - 1].texture != texture_slot) {
+            runs[(*run_count)++] = (LayerRun) {
+                .first_instance = count,
+                .texture = texture_slot,
+            };
+        }
+        runs[*run_count - 1].instance_count++;
+        count++;
+    }
+    return count;
+}
+
+/* Uploads pending and frees released layers like update_textures(), called after it */
+static void update_layers(Renderer *r) {
+    if (!r->layers) {
+        return;
+    }
+
+    for (u32 i = 1; i < MAX_LAYERS; ++i) {
+        LayerSlot *slot = &r->layers->slots[i];
+        GpuLayer *layer = &context->layers[i];
+
+        if (slot->state == TEXTURE_RELEASED) {
+            if (layer->is_valid) {
+                retireLayer(layer);
+            }
+            slot->state = TEXTURE_FREE;
+        } else if (slot->state == TEXTURE_PENDING) {
+            if (layer->is_valid) {
+                retireLayer(layer);
+            }
+
+            /* At most one instance and one run per entry, see RENDER_ENTRY_MIN_SIZE */
+            const u64 max_count = slot->commands.memory_top/RENDER_ENTRY_MIN_SIZE + 1;
+            LayerInstance *instances = platform.allocate_memory(max_count*sizeof(LayerInstance));
+            layer->runs = platform.allocate_memory(max_count*sizeof(LayerRun));
+            layer->instance_count = build_layer_instances(r, slot, instances, layer->runs, &layer->run_count);
+            if (layer->instance_count == 0) {
+                platform.free_memory(layer->runs);
+                layer->runs = NULL;
+            } else {
+                const u64 size = layer->instance_count*sizeof(LayerInstance);
+                create_buffer(context->logical_device.handle, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true, &layer->buffer, &layer->memory);
+                layer->upload_ticket = upload_buffer(context->upload, layer->buffer, instances, size);
+                layer->is_valid = true;
+            }
+            platform.free_memory(instances);
+            slot->state = TEXTURE_RESIDENT;
+        }
+    }
+
+    upload_flush(context->upload);
+
+    for (u32 i = 1; i < MAX_LAYERS; ++i) {
+        GpuLayer *layer = &context->layers[i];
+        if (layer->is_valid && !layer->is_ready && upload_is_complete(context->upload, layer->upload_ticket)) {
+            layer->is_ready = true;
+            context->record_version++;
+        }
+    }
+}
+
+/*
+ * Brings the texture array of a swapchain image's descriptor set up to
+ * date, true if anything was written. That invalidates the command
+ * buffer of the image.
+ */
+static bool update_descriptor_set(u32 image_index) {
+    u32 *versions = &context->descriptor_versions[image_index * MAX_TEXTURES];
+
+    VkDescriptorImageInfo image_infos[MAX_TEXTURES];
+    VkWriteDescriptorSet writes[MAX_TEXTURES];
+    u32 write_count = 0;
+
+    for (u32 i = 0; i < MAX_TEXTURES; ++i) {
+        if (versions[i] == context->texture_versions[i]) {
+            continue;
+        }
+        versions[i] = context->texture_versions[i];
+
+        GpuTexture *texture = (context->textures[i].is_ready) ? &context->textures[i] : &context->textures[0];
+        image_infos[write_count] = (VkDescriptorImageInfo) {
+            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            .imageView = texture->view,
+            .sampler = (texture->is_filtered) ? context->filtered_sampler : context->texture_sampler,
         };
+        writes[write_count] = (VkWriteDescriptorSet) {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = context->descriptor_sets[image_index],
+            .dstBinding = 0,
+            .dstArrayElement = i,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .pImageInfo = &image_infos[write_count],
+        };
+        write_count++;
+    }
 
-        vkUpdateDescriptorSets(context->logical_device.handle, ARRLEN(writes), writes, 0, NULL);
+    if (write_count > 0) {
+        vkUpdateDescriptorSets(context->logical_device.handle, write_count, writes, 0, NULL);
     }
+    return write_count > 0;
 }
 
-static void recreate_swapchain(Renderer *r) {
-    VKC_CHECK(vkDeviceWaitIdle(context->logical_device.handle), "wait idle failed");
+static inline u32 texture_index(Renderer *r, TextureHandle handle) {
+    TextureSlot *slot = (r->textures) ? textureLookup(r->textures, handle) : NULL;
+    if (!slot || !context->textures[TEXTURE_HANDLE_SLOT(handle)].is_ready) {
+        return 0;
+    }
+    return TEXTURE_HANDLE_SLOT(handle);
+}
 
-    cleanup_swapchain();
+static void create_uniform_buffers(VkDevice device, VkDeviceSize size, VkBuffer *buffers, GpuAllocation *memory, u32 count) {
+    for (u32 i = 0; i < count; ++i) {
+        create_buffer(device, size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false, &buffers[i], &memory[i]);
+    }
+}
 
-    SwapchainInfo swapchain_info = {0};
-    getSwapchainInfo(context->surface, &context->physical_device, &swapchain_info);
-    int width = 0, height = 0;
-    glfwGetFramebufferSize(r->window, &width, &height);
-    createSwapchain(context->surface, &context->logical_device, &swapchain_info, width, height, &context->swapchain);
-    createSwapchainImageViews(&context->logical_device, &context->swapchain);
-    context->renderpass = vkc_create_renderpass(context->logical_device.handle, &context->swapchain);
+static void create_pipelines() {
+    /* Only solid color quads are known to be opaque */
+    const bool has_depth = context->depth_format != VK_FORMAT_UNDEFINED;
+    const PipelineDepth opaque_depth = (has_depth) ? PIPELINE_DEPTH_WRITE : PIPELINE_DEPTH_NONE;
+    const PipelineDepth blended_depth = (has_depth) ? PIPELINE_DEPTH_TEST : PIPELINE_DEPTH_NONE;
 
     {
         VkVertexInputBindingDescription binding_description = {
@@ -1356,22 +1931,18 @@ static void recreate_swapchain(Renderer *r) {
 
         context->color_pipeline = create_pipeline(context->logical_device.handle,
                                                   context->renderpass,
-                                                  &context->swapchain,
+                                                  opaque_depth,
                                                   context->color_vert_module,
                                                   context->color_frag_module,
-                                                  binding_description,
+                                                  &binding_description,
+                                                  1,
                                                   attribute_descriptions,
                                                   ARRLEN(attribute_descriptions),
                                                   NULL,
                                                   &push_constant);
     }
 
-    create_descriptor_pool(context->logical_device.handle, context->swapchain.image_count, &context->descriptor_pool);
-    context->descriptor_sets = platform.allocate_memory(sizeof(VkDescriptorSet) * context->swapchain.image_count);
-    create_descriptor_sets(context->logical_device.handle, context->swapchain.image_count, &context->descriptor_pool, context->descriptor_set_layout, context->descriptor_sets);
-
     {
-
         VkVertexInputBindingDescription binding_description = {
             .binding = 0,
             .stride = sizeof(Vertex),
@@ -1395,16 +1966,17 @@ static void recreate_swapchain(Renderer *r) {
 
         VkPushConstantRange push_constant = {
             .offset = 0,
-            .size = sizeof(ShapePushConstants),
+            .size = sizeof(TexturePushConstants),
             .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
         };
 
         context->texture_pipeline = create_pipeline(context->logical_device.handle,
                                                     context->renderpass,
-                                                    &context->swapchain,
+                                                    blended_depth,
                                                     context->texture_vert_module,
                                                     context->texture_frag_module,
-                                                    binding_description,
+                                                    &binding_description,
+                                                    1,
                                                     attribute_descriptions,
                                                     ARRLEN(attribute_descriptions),
                                                     &context->descriptor_set_layout,
@@ -1440,32 +2012,208 @@ static void recreate_swapchain(Renderer *r) {
         };
 
         context->atlas_pipeline = create_pipeline(context->logical_device.handle,
-                                                    context->renderpass,
-                                                    &context->swapchain,
-                                                    context->atlas_vert_module,
-                                                    context->atlas_frag_module,
-                                                    binding_description,
-                                                    attribute_descriptions,
-                                                    ARRLEN(attribute_descriptions),
-                                                    &context->descriptor_set_layout,
-                                                    &push_constant);
+                                                  context->renderpass,
+                                                  blended_depth,
+                                                  context->atlas_vert_module,
+                                                  context->atlas_frag_module,
+                                                  &binding_description,
+                                                  1,
+                                                  attribute_descriptions,
+                                                  ARRLEN(attribute_descriptions),
+                                                  &context->descriptor_set_layout,
+                                                  &push_constant);
+    }
+
+    {
+        VkVertexInputBindingDescription binding_descriptions[] = {
+            [0] = {
+                .binding = 0,
+                .stride = sizeof(Vertex),
+                .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+            },
+            [1] = {
+                .binding = 1,
+                .stride = sizeof(LayerInstance),
+                .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
+            },
+        };
+
+        VkVertexInputAttributeDescription attribute_descriptions[] = {
+            {.binding = 0, .location = 0, .format = VK_FORMAT_R32G32_SFLOAT,    .offset = offsetof(Vertex, pos)},
+            {.binding = 0, .location = 1, .format = VK_FORMAT_R32G32_SFLOAT,    .offset = offsetof(Vertex, texcoord)},
+            {.binding = 1, .location = 2, .format = VK_FORMAT_R32G32_SFLOAT,    .offset = offsetof(LayerInstance, pos)},
+            {.binding = 1, .location = 3, .format = VK_FORMAT_R32G32_SFLOAT,    .offset = offsetof(LayerInstance, scale)},
+            {.binding = 1, .location = 4, .format = VK_FORMAT_R32G32_SFLOAT,    .offset = offsetof(LayerInstance, offset)},
+            {.binding = 1, .location = 5, .format = VK_FORMAT_R32G32_SFLOAT,    .offset = offsetof(LayerInstance, size)},
+            {.binding = 1, .location = 6, .format = VK_FORMAT_R32G32B32_SFLOAT, .offset = offsetof(LayerInstance, col)},
+            {.binding = 1, .location = 7, .format = VK_FORMAT_R32_UINT,         .offset = offsetof(LayerInstance, flags)},
+        };
+
+        VkPushConstantRange push_constant = {
+            .offset = 0,
+            .size = sizeof(LayerPushConstants),
+            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+        };
+
+        context->layer_pipeline = create_pipeline(context->logical_device.handle,
+                                                  context->renderpass,
+                                                  blended_depth,
+                                                  context->layer_vert_module,
+                                                  context->atlas_frag_module,
+                                                  binding_descriptions,
+                                                  ARRLEN(binding_descriptions),
+                                                  attribute_descriptions,
+                                                  ARRLEN(attribute_descriptions),
+                                                  &context->descriptor_set_layout,
+                                                  &push_constant);
+    }
+}
+
+static void destroy_pipelines() {
+    vkc_destroy_pipeline(context->logical_device.handle, context->color_pipeline);
+    vkc_destroy_pipeline(context->logical_device.handle, context->texture_pipeline);
+    vkc_destroy_pipeline(context->logical_device.handle, context->atlas_pipeline);
+    vkc_destroy_pipeline(context->logical_device.handle, context->layer_pipeline);
+}
+
+/* Destroys retired swapchains no longer used by any frame in flight, or all of them */
+static void destroy_retired_swapchains(bool all) {
+    u32 kept = 0;
+    for (u32 i = 0; i < context->retired_swapchain_count; ++i) {
+        RetiredSwapchain *retired = &context->retired_swapchains[i];
+        /*
+         * A frame submitted after retirement has completed, so it acquired
+         * from the new swapchain and the old images are done being
+         * presented in practice. VK_EXT_swapchain_maintenance1 would make
+         * this exact with present fences.
+         */
+        if (!all && retired->frame_serial >= context->completed_serial) {
+            context->retired_swapchains[kept++] = *retired;
+            continue;
+        }
+
+        vkc_destroy_framebuffers(context->logical_device.handle, retired->framebuffers, retired->framebuffer_count);
+        destroySwapchainImageViews(&context->logical_device, &retired->swapchain);
+        destroySwapchain(&context->logical_device, &retired->swapchain);
+    }
+    context->retired_swapchain_count = kept;
+}
+
+static void cleanup_swapchain() {
+    destroy_retired_swapchains(true);
+
+    for (u32 i = 0; i < MAX_SWAPCHAIN_IMAGES; ++i) {
+        vkDestroyBuffer(context->logical_device.handle, context->uniform_buffers[i], NULL);
+        gpu_free(context->memory, &context->uniform_buffers_memory[i]);
+    }
+    vkDestroyDescriptorPool(context->logical_device.handle, context->descriptor_pool, NULL);
+    vkc_destroy_command_buffers(context->logical_device.handle, context->command_pool, context->command_buffers, MAX_SWAPCHAIN_IMAGES);
+
+    vkc_destroy_framebuffers(context->logical_device.handle, context->framebuffers, context->framebuffer_count);
+    destroy_pipelines();
+    vkDestroyRenderPass(context->logical_device.handle, context->renderpass, NULL);
+    destroySwapchainImageViews(&context->logical_device, &context->swapchain);
+    destroySwapchain(&context->logical_device, &context->swapchain);
+}
+
+/*
+ * Only the swapchain, its image views and framebuffers depend on the
+ * window size. Everything per image is allocated for MAX_SWAPCHAIN_IMAGES
+ * up front and pipelines use dynamic viewports, so a resize doesn't need
+ * to wait for the GPU. The old swapchain is handed to the new one and
+ * destroyed once the frames using it have completed.
+ */
+static void recreate_swapchain(Renderer *r) {
+    SwapchainInfo swapchain_info = {0};
+    getSwapchainInfo(context->surface, &context->physical_device, context->latency_mode, &swapchain_info);
+    int width = 0, height = 0;
+    glfwGetFramebufferSize(r->window, &width, &height);
+
+    /* Minimized, keep the current swapchain until there is something to present to */
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    if (context->retired_swapchain_count == MAX_RETIRED_SWAPCHAINS) {
+        /* Resized faster than frames complete, the GPU is far behind anyway */
+        VKC_CHECK(vkDeviceWaitIdle(context->logical_device.handle), "wait idle failed");
+        destroy_retired_swapchains(true);
+    }
+
+    RetiredSwapchain *retired = &context->retired_swapchains[context->retired_swapchain_count++];
+    retired->swapchain = context->swapchain;
+    retired->framebuffers = context->framebuffers;
+    retired->framebuffer_count = context->framebuffer_count;
+    retired->frame_serial = context->submitted_serial;
+
+    memset(&context->swapchain, 0, sizeof(Swapchain));
+    createSwapchain(context->surface, &context->logical_device, &swapchain_info, width, height, retired->swapchain.handle, &context->swapchain);
+    createSwapchainImageViews(&context->logical_device, &context->swapchain);
+
+    /* The render pass (and so the pipelines) only depends on the format, which rarely changes */
+    if (context->swapchain.image_format != retired->swapchain.image_format) {
+        VKC_CHECK(vkDeviceWaitIdle(context->logical_device.handle), "wait idle failed");
+        destroy_pipelines();
+        vkDestroyRenderPass(context->logical_device.handle, context->renderpass, NULL);
+        context->renderpass = vkc_create_renderpass(context->logical_device.handle, &context->swapchain, context->depth_format);
+        create_pipelines();
+        report_pipeline_creation("surface format changed");
     }
 
-    /* framebuffer */
     context->framebuffers = vkc_create_framebuffers(context->logical_device.handle, context->renderpass, &context->swapchain);
     context->framebuffer_count = context->swapchain.image_view_count;
 
-    create_uniform_buffers(context->logical_device.handle, sizeof(struct uniform_buffer_object), context->uniform_buffers, context->uniform_buffers_memory, context->swapchain.image_count);
+    /* Recorded command buffers draw to the old framebuffers */
+    memset(context->recorded_frames, 0, sizeof(RecordedFrame) * MAX_SWAPCHAIN_IMAGES);
+}
+
+/*
+ * Latency of the frame in slot, once its fence is seen signalled. Only
+ * as precise as how often fences are looked at, which is at least
+ * every begin_frame() and end_frame().
+ */
+static void measure_latency(Renderer *r, u32 slot, bool is_signalled) {
+    if (!context->is_latency_pending[slot]) {
+        return;
+    }
+    if (!is_signalled && vkGetFenceStatus(context->logical_device.handle, context->in_flight_fences[slot]) != VK_SUCCESS) {
+        return;
+    }
+    context->is_latency_pending[slot] = false;
+    if (!r->profile) {
+        return;
+    }
+
+    const u64 latency = time_to_ns(platform.time_current()) - context->in_flight_start_ns[slot];
+    FrameProfile *profile = r->profile;
+    profile->latency_ns = latency;
+    profile->latency_average_ns = (profile->latency_average_ns == 0) ? latency : (15*profile->latency_average_ns + latency)/16;
+}
 
-    if (context->has_texture) {
-        populate_descriptor_sets();
+static void poll_latency(Renderer *r) {
+    for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        measure_latency(r, i, false);
     }
+}
 
-    /* command buffer */
-    context->command_buffers = vkc_create_command_buffers(context->logical_device.handle, context->command_pool, context->swapchain.image_count);
+/* Switches to the latency mode of r->settings, idles the GPU and replaces the swapchain */
+static void apply_latency_mode(Renderer *r) {
+    VKC_CHECK(vkDeviceWaitIdle(context->logical_device.handle), "wait idle failed");
+    for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        measure_latency(r, i, true);
+        gpu_profile_collect(context->profiler, context->logical_device.handle, i, r->profile);
+    }
+    context->completed_serial = context->submitted_serial;
+
+    context->latency_mode = r->settings->latency_mode;
+    context->frames_in_flight = latency_mode_frames(context->latency_mode);
+    context->current_frame_index = 0;
+    /* Every fence is signalled now, images don't have to wait on any */
+    memset(context->in_flight_images, 0, sizeof(VkFence) * MAX_SWAPCHAIN_IMAGES);
 
-    for (u32 i = 0; i < context->swapchain.image_count; ++i) {
-        context->in_flight_images[i] = VK_NULL_HANDLE;
+    platform.log(LOG_INFO, "Renderer: %s latency, %u frames in flight", latency_mode_names[context->latency_mode], context->frames_in_flight);
+    if (!context->headless) {
+        recreate_swapchain(r);
     }
 }
 
@@ -1474,13 +2222,91 @@ static inline void setup_globals(Renderer *r) {
     context = r->context;
 }
 
+static void create_readback_buffers(u32 count, VkExtent2D extent) {
+    VkDeviceSize size = extent.width * extent.height * 4;
+
+    context->readback_buffers = platform.allocate_memory(sizeof(VkBuffer) * count);
+    context->readback_buffers_memory = platform.allocate_memory(sizeof(GpuAllocation) * count);
+    context->readback_frames = platform.allocate_memory(sizeof(u64) * count);
+    memset(context->readback_frames, 0, sizeof(u64) * count);
+
+    for (u32 i = 0; i < count; ++i) {
+        create_buffer(context->logical_device.handle, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false, &context->readback_buffers[i], &context->readback_buffers_memory[i]);
+    }
+
+    /* Scratch space for swizzling and encoding, so writing a frame doesn't allocate */
+    context->readback_pixels = platform.allocate_memory(size);
+    context->readback_encoded = platform.allocate_memory(png_encoded_size(extent.width, extent.height, 4));
+}
+
+static void destroy_readback_buffers(u32 count) {
+    for (u32 i = 0; i < count; ++i) {
+        vkDestroyBuffer(context->logical_device.handle, context->readback_buffers[i], NULL);
+        gpu_free(context->memory, &context->readback_buffers_memory[i]);
+    }
+
+    platform.free_memory(context->readback_buffers);
+    platform.free_memory(context->readback_buffers_memory);
+    platform.free_memory(context->readback_frames);
+    platform.free_memory(context->readback_pixels);
+    platform.free_memory(context->readback_encoded);
+}
+
+/* Writes the readback pending for an offscreen image, its fence must have been waited on */
+static void write_readback(Renderer *r, u32 image_index) {
+    if (!context->readback_frames || context->readback_frames[image_index] == 0) {
+        return;
+    }
+    u64 frame_index = context->readback_frames[image_index] - 1;
+    context->readback_frames[image_index] = 0;
+
+    const u32 width  = context->swapchain.image_extent.width;
+    const u32 height = context->swapchain.image_extent.height;
+    const u8 *bgra = context->readback_buffers_memory[image_index].mapped;
+
+    const bool png = (r->headless.readback_format == READBACK_PNG);
+    char path[256];
+    snprintf(path, sizeof(path), "%s%llu.%s", r->headless.readback_prefix, (unsigned long long) frame_index, (png) ? "png" : "bgra");
+
+    File file = platform.file_open(path, "w");
+    if (!file.fd) {
+        platform.log(LOG_ERROR, "Readback: failed to open %s", path);
+        return;
+    }
+
+    if (png) {
+        u8 *rgba = context->readback_pixels;
+        for (u64 i = 0; i < (u64) width*height; ++i) {
+            rgba[4*i + 0] = bgra[4*i + 2];
+            rgba[4*i + 1] = bgra[4*i + 1];
+            rgba[4*i + 2] = bgra[4*i + 0];
+            rgba[4*i + 3] = bgra[4*i + 3];
+        }
+        u64 size = png_encode(context->readback_encoded, rgba, width, height, 4);
+        platform.file_write(file, context->readback_encoded, size, 1);
+    } else {
+        platform.file_write(file, (void *) bgra, (u64) width*height*4, 1);
+    }
+
+    platform.file_close(file);
+}
+
 static inline void initialize_vulkan(Renderer *r) {
-    /* Extensions */
+    context->headless = r->headless.enabled;
+    context->latency_mode = (r->settings) ? r->settings->latency_mode : LATENCY_BALANCED;
+    context->frames_in_flight = latency_mode_frames(context->latency_mode);
+
+    /* Extensions, a headless instance doesn't need any surface extensions */
     u32 glfw_extension_count = 0;
-    const char **glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+    const char **glfw_extensions = NULL;
+    if (!context->headless) {
+        glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+    }
     const char *extensions[glfw_extension_count + 1];
     extensions[0] = VK_EXT_DEBUG_UTILS_EXTENSION_NAME;
-    memcpy(&extensions[1], glfw_extensions, sizeof(glfw_extensions[0])*glfw_extension_count);
+    if (glfw_extension_count > 0) {
+        memcpy(&extensions[1], glfw_extensions, sizeof(glfw_extensions[0])*glfw_extension_count);
+    }
 
     /* Layers */
     const char *layers[] = {
@@ -1489,121 +2315,63 @@ static inline void initialize_vulkan(Renderer *r) {
 
     context->instance = vkc_create_instance(extensions, ARRLEN(extensions), layers, ARRLEN(layers));
 
-    VKC_CHECK(glfwCreateWindowSurface(context->instance, r->window, NULL, &context->surface), "GLFW: failed to create window surface.");
-
-    vkc_pick_physical_device(context->instance, context->surface, &context->physical_device);
-    vkc_create_logical_device(&context->physical_device, &context->logical_device);
-
-    SwapchainInfo swapchain_info = {0};
-    getSwapchainInfo(context->surface, &context->physical_device, &swapchain_info);
-    int width = 0, height = 0;
-    glfwGetFramebufferSize(r->window, &width, &height);
-    createSwapchain(context->surface, &context->logical_device, &swapchain_info, width, height, &context->swapchain);
-    createSwapchainImageViews(&context->logical_device, &context->swapchain);
-    context->renderpass = vkc_create_renderpass(context->logical_device.handle, &context->swapchain);
-
-    {
-        u8 *vert_code = NULL;
-        u64 vert_code_size = 0;
-        platform.read_file_to_buffer("res/color.vert.spv", &vert_code, &vert_code_size);
-        context->color_vert_module = create_shader_module(context->logical_device.handle, vert_code, vert_code_size);
-        platform.free_memory(vert_code);
-
-        u8 *frag_code = NULL;
-        u64 frag_code_size = 0;
-        platform.read_file_to_buffer("res/color.frag.spv", &frag_code, &frag_code_size);
-        context->color_frag_module = create_shader_module(context->logical_device.handle, frag_code, frag_code_size);
-        platform.free_memory(frag_code);
-
-        VkVertexInputBindingDescription binding_description = {
-            .binding = 0,
-            .stride = sizeof(Vertex),
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
-        };
+    if (!context->headless) {
+        VKC_CHECK(glfwCreateWindowSurface(context->instance, r->window, NULL, &context->surface), "GLFW: failed to create window surface.");
+    }
 
-        VkVertexInputAttributeDescription attribute_descriptions[] = {
-            [0] = {
-                .binding = 0,
-                .location = 0,
-                .format = VK_FORMAT_R32G32_SFLOAT,
-                .offset = offsetof(Vertex, pos),
-            },
-        };
+    if (!vkc_pick_physical_device(context->instance, context->surface, &context->physical_device)) {
+        platform.abort();
+    }
+    vkc_create_logical_device(&context->physical_device, &context->logical_device, context->headless);
+    if (r->settings && r->settings->depth_buffer) {
+        context->depth_format = pick_depth_format(context->physical_device.handle);
+    }
 
+    context->memory = platform.allocate_memory(sizeof(GpuMemory));
+    gpu_memory_init(context->memory, context->physical_device.handle, context->logical_device.handle);
 
-        VkPushConstantRange push_constant = {
-            .offset = 0,
-            .size = sizeof(ShapePushConstants),
-            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
-        };
+    context->pipeline_cache = pipeline_cache_load(context->logical_device.handle,
+                                                  &context->physical_device.device_properties,
+                                                  &context->pipeline_cache_is_warm);
 
-        context->color_pipeline = create_pipeline(context->logical_device.handle,
-                                                  context->renderpass,
-                                                  &context->swapchain,
-                                                  context->color_vert_module,
-                                                  context->color_frag_module,
-                                                  binding_description,
-                                                  attribute_descriptions,
-                                                  ARRLEN(attribute_descriptions),
-                                                  NULL,
-                                                  &push_constant);
+    if (context->headless) {
+        createOffscreenSwapchain(&context->logical_device, r->headless.width, r->headless.height, &context->swapchain);
+    } else {
+        SwapchainInfo swapchain_info = {0};
+        getSwapchainInfo(context->surface, &context->physical_device, context->latency_mode, &swapchain_info);
+        int width = 0, height = 0;
+        glfwGetFramebufferSize(r->window, &width, &height);
+        createSwapchain(context->surface, &context->logical_device, &swapchain_info, width, height, VK_NULL_HANDLE, &context->swapchain);
     }
-
-    create_descriptor_set_layout(context->logical_device.handle, &context->descriptor_set_layout);
-    create_descriptor_pool(context->logical_device.handle, context->swapchain.image_count, &context->descriptor_pool);
-    context->descriptor_sets = platform.allocate_memory(sizeof(VkDescriptorSet) * context->swapchain.image_count);
-    create_descriptor_sets(context->logical_device.handle, context->swapchain.image_count, &context->descriptor_pool, context->descriptor_set_layout, context->descriptor_sets);
+    createSwapchainImageViews(&context->logical_device, &context->swapchain);
+    context->renderpass = vkc_create_renderpass(context->logical_device.handle, &context->swapchain, context->depth_format);
 
     {
         u8 *vert_code = NULL;
         u64 vert_code_size = 0;
-        platform.read_file_to_buffer("res/texture.vert.spv", &vert_code, &vert_code_size);
-        context->texture_vert_module = create_shader_module(context->logical_device.handle, vert_code, vert_code_size);
-        platform.free_memory(vert_code);
-
-        u8 *frag_code = NULL;
-        u64 frag_code_size = 0;
-        platform.read_file_to_buffer("res/texture.frag.spv", &frag_code, &frag_code_size);
-        context->texture_frag_module = create_shader_module(context->logical_device.handle, frag_code, frag_code_size);
-        platform.free_memory(frag_code);
-
-        VkVertexInputBindingDescription binding_description = {
-            .binding = 0,
-            .stride = sizeof(Vertex),
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
-        };
-
-        VkVertexInputAttributeDescription attribute_descriptions[2] = {
-            [0] = {
-                .binding = 0,
-                .location = 0,
-                .format = VK_FORMAT_R32G32_SFLOAT,
-                .offset = offsetof(Vertex, pos),
-            },
-            [1] = {
-                .binding = 0,
-                .location = 1,
-                .format = VK_FORMAT_R32G32_SFLOAT,
-                .offset = offsetof(Vertex, texcoord),
-            },
-        };
+        platform.read_file_to_buffer("res/color.vert.spv", &vert_code, &vert_code_size);
+        context->color_vert_module = create_shader_module(context->logical_device.handle, vert_code, vert_code_size);
+        platform.free_memory(vert_code);
 
-        VkPushConstantRange push_constant = {
-            .offset = 0,
-            .size = sizeof(ShapePushConstants),
-            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
-        };
+        u8 *frag_code = NULL;
+        u64 frag_code_size = 0;
+        platform.read_file_to_buffer("res/color.frag.spv", &frag_code, &frag_code_size);
+        context->color_frag_module = create_shader_module(context->logical_device.handle, frag_code, frag_code_size);
+        platform.free_memory(frag_code);
+    }
 
-        context->texture_pipeline = create_pipeline(context->logical_device.handle,
-                                                    context->renderpass,
-                                                    &context->swapchain,
-                                                    context->texture_vert_module,
-                                                    context->texture_frag_module,
-                                                    binding_description,
-                                                    attribute_descriptions,
-                                                    ARRLEN(attribute_descriptions),
-                                                    &context->descriptor_set_layout,
-                                                    &push_constant);
+    {
+        u8 *vert_code = NULL;
+        u64 vert_code_size = 0;
+        platform.read_file_to_buffer("res/texture.vert.spv", &vert_code, &vert_code_size);
+        context->texture_vert_module = create_shader_module(context->logical_device.handle, vert_code, vert_code_size);
+        platform.free_memory(vert_code);
+
+        u8 *frag_code = NULL;
+        u64 frag_code_size = 0;
+        platform.read_file_to_buffer("res/texture.frag.spv", &frag_code, &frag_code_size);
+        context->texture_frag_module = create_shader_module(context->logical_device.handle, frag_code, frag_code_size);
+        platform.free_memory(frag_code);
     }
 
     {
@@ -1618,45 +2386,27 @@ static inline void initialize_vulkan(Renderer *r) {
         platform.read_file_to_buffer("res/atlas.frag.spv", &frag_code, &frag_code_size);
         context->atlas_frag_module = create_shader_module(context->logical_device.handle, frag_code, frag_code_size);
         platform.free_memory(frag_code);
+    }
 
-        VkVertexInputBindingDescription binding_description = {
-            .binding = 0,
-            .stride = sizeof(Vertex),
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
-        };
-
-        VkVertexInputAttributeDescription attribute_descriptions[2] = {
-            [0] = {
-                .binding = 0,
-                .location = 0,
-                .format = VK_FORMAT_R32G32_SFLOAT,
-                .offset = offsetof(Vertex, pos),
-            },
-            [1] = {
-                .binding = 0,
-                .location = 1,
-                .format = VK_FORMAT_R32G32_SFLOAT,
-                .offset = offsetof(Vertex, texcoord),
-            },
-        };
+    {
+        u8 *vert_code = NULL;
+        u64 vert_code_size = 0;
+        platform.read_file_to_buffer("res/layer.vert.spv", &vert_code, &vert_code_size);
+        context->layer_vert_module = create_shader_module(context->logical_device.handle, vert_code, vert_code_size);
+        platform.free_memory(vert_code);
+    }
 
-        VkPushConstantRange push_constant = {
-            .offset = 0,
-            .size = sizeof(AtlasPushConstants),
-            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
-        };
+    /* Per swapchain image resources are allocated for the largest swapchain we accept */
+    create_descriptor_set_layout(context->logical_device.handle, &context->descriptor_set_layout);
+    create_descriptor_pool(context->logical_device.handle, MAX_SWAPCHAIN_IMAGES, &context->descriptor_pool);
+    context->descriptor_sets = platform.allocate_memory(sizeof(VkDescriptorSet) * MAX_SWAPCHAIN_IMAGES);
+    create_descriptor_sets(context->logical_device.handle, MAX_SWAPCHAIN_IMAGES, &context->descriptor_pool, context->descriptor_set_layout, context->descriptor_sets);
+    /* Versions start at 1, so every descriptor gets written on first use */
+    context->descriptor_versions = platform.allocate_memory(sizeof(u32) * MAX_TEXTURES * MAX_SWAPCHAIN_IMAGES);
+    memset(context->descriptor_versions, 0, sizeof(u32) * MAX_TEXTURES * MAX_SWAPCHAIN_IMAGES);
 
-        context->atlas_pipeline = create_pipeline(context->logical_device.handle,
-                                                  context->renderpass,
-                                                  &context->swapchain,
-                                                  context->atlas_vert_module,
-                                                  context->atlas_frag_module,
-                                                  binding_description,
-                                                  attribute_descriptions,
-                                                  ARRLEN(attribute_descriptions),
-                                                  &context->descriptor_set_layout,
-                                                  &push_constant);
-    }
+    create_pipelines();
+    report_pipeline_creation("startup");
 
     /* framebuffer */
     context->framebuffers = vkc_create_framebuffers(context->logical_device.handle, context->renderpass, &context->swapchain);
@@ -1664,14 +2414,56 @@ static inline void initialize_vulkan(Renderer *r) {
 
     /* command buffer */
     context->command_pool = vkc_create_command_pool(context->logical_device.handle, context->physical_device.graphics_family);
-    context->command_buffers = vkc_create_command_buffers(context->logical_device.handle, context->command_pool, context->swapchain.image_count);
 
-    context->uniform_buffers = platform.allocate_memory(sizeof(VkBuffer) * context->swapchain.image_count);
-    context->uniform_buffers_memory = platform.allocate_memory(sizeof(VkDeviceMemory) * context->swapchain.image_count);
-    create_uniform_buffers(context->logical_device.handle, sizeof(struct uniform_buffer_object), context->uniform_buffers, context->uniform_buffers_memory, context->swapchain.image_count);
+    context->upload = platform.allocate_memory(sizeof(UploadManager));
+    upload_init(context->upload,
+                context->logical_device.handle,
+                context->logical_device.transfer_queue,
+                context->logical_device.transfer_family,
+                context->logical_device.transfer_family == context->logical_device.graphics_family);
+    context->command_buffers = vkc_create_command_buffers(context->logical_device.handle, context->command_pool, MAX_SWAPCHAIN_IMAGES);
+    context->recorded_frames = platform.allocate_memory(sizeof(RecordedFrame) * MAX_SWAPCHAIN_IMAGES);
+    memset(context->recorded_frames, 0, sizeof(RecordedFrame) * MAX_SWAPCHAIN_IMAGES);
+
+    context->uniform_buffers = platform.allocate_memory(sizeof(VkBuffer) * MAX_SWAPCHAIN_IMAGES);
+    context->uniform_buffers_memory = platform.allocate_memory(sizeof(GpuAllocation) * MAX_SWAPCHAIN_IMAGES);
+    create_uniform_buffers(context->logical_device.handle, sizeof(struct uniform_buffer_object), context->uniform_buffers, context->uniform_buffers_memory, MAX_SWAPCHAIN_IMAGES);
 
     createTextureSampler();
 
+    context->text = platform.allocate_memory(sizeof(TextCache));
+    text_init(context->text, r);
+    context->glyph_upload = platform.allocate_memory(sizeof(GlyphUpload));
+    glyph_upload_init(context->glyph_upload);
+
+    context->draws = platform.allocate_memory(sizeof(DrawList));
+
+    context->profiler = platform.allocate_memory(sizeof(GpuProfiler));
+    gpu_profile_init(context->profiler, context->logical_device.handle,
+                     &context->physical_device.device_properties.limits,
+                     context->physical_device.timestamp_valid_bits);
+
+    /* Default texture, drawn in place of missing or not yet uploaded textures */
+    {
+        u8 white[4] = {0xff, 0xff, 0xff, 0xff};
+        Image image = {
+            .pixels = white,
+            .width = 1,
+            .height = 1,
+            .channels = 4,
+        };
+        createTexture(&context->textures[0], &image);
+        upload_wait(context->upload, context->textures[0].upload_ticket);
+        context->textures[0].is_ready = true;
+        for (u32 i = 0; i < MAX_TEXTURES; ++i) {
+            context->texture_versions[i] = 1;
+        }
+    }
+
+    if (context->headless && r->headless.readback_format != READBACK_NONE) {
+        create_readback_buffers(context->swapchain.image_count, context->swapchain.image_extent);
+    }
+
     /* Create sync primitives */
     {
         VkSemaphoreCreateInfo sem_info = {
@@ -1683,8 +2475,8 @@ static inline void initialize_vulkan(Renderer *r) {
             .flags = VK_FENCE_CREATE_SIGNALED_BIT,
         };
 
-        context->in_flight_images = platform.allocate_memory(sizeof(VkFence) * context->swapchain.image_count);
-        memset(context->in_flight_images, 0, sizeof(VkFence) * context->swapchain.image_count);
+        context->in_flight_images = platform.allocate_memory(sizeof(VkFence) * MAX_SWAPCHAIN_IMAGES);
+        memset(context->in_flight_images, 0, sizeof(VkFence) * MAX_SWAPCHAIN_IMAGES);
 
         for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
             VKC_CHECK(vkCreateSemaphore(context->logical_device.handle, &sem_info, NULL, &context->sem_image_available[i]),
@@ -1701,45 +2493,15 @@ static inline void initialize_vulkan(Renderer *r) {
     // NOTE(anjo): we do not have seperate vertices for the textured vs colored case.
     //             The UV coord. are always passed.
 
-    /* Copy buffer to GPU */
-    {
-
-        VkDeviceSize size = sizeof(vertices);
-
-        VkBuffer staging_buffer;
-        VkDeviceMemory staging_buffer_memory;
-        create_buffer(context->logical_device.handle, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging_buffer, &staging_buffer_memory);
-
-        void *data;
-        vkMapMemory(context->logical_device.handle, staging_buffer_memory, 0, size, 0, &data);
-        memcpy(data, vertices, size);
-        vkUnmapMemory(context->logical_device.handle, staging_buffer_memory);
-
-        create_buffer(context->logical_device.handle, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &context->vertex_buffer, &context->vertex_buffer_memory);
-        copyBuffer(context->logical_device.handle, context->logical_device.graphics_queue, context->command_pool, staging_buffer, context->vertex_buffer, size);
-
-        vkDestroyBuffer(context->logical_device.handle, staging_buffer, NULL);
-        vkFreeMemory(context->logical_device.handle, staging_buffer_memory, NULL);
-    }
-
+    /* Copy buffers to GPU, they're needed right away */
     {
+        create_buffer(context->logical_device.handle, sizeof(vertices), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true, &context->vertex_buffer, &context->vertex_buffer_memory);
+        upload_buffer(context->upload, context->vertex_buffer, vertices, sizeof(vertices));
 
-        VkDeviceSize size = sizeof(indices);
+        create_buffer(context->logical_device.handle, sizeof(indices), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true, &context->index_buffer, &context->index_buffer_memory);
+        u64 ticket = upload_buffer(context->upload, context->index_buffer, indices, sizeof(indices));
 
-        VkBuffer staging_buffer;
-        VkDeviceMemory staging_buffer_memory;
-        create_buffer(context->logical_device.handle, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging_buffer, &staging_buffer_memory);
-
-        void *data;
-        vkMapMemory(context->logical_device.handle, staging_buffer_memory, 0, size, 0, &data);
-        memcpy(data, indices, size);
-        vkUnmapMemory(context->logical_device.handle, staging_buffer_memory);
-
-        create_buffer(context->logical_device.handle, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &context->index_buffer, &context->index_buffer_memory);
-        copyBuffer(context->logical_device.handle, context->logical_device.graphics_queue, context->command_pool, staging_buffer, context->index_buffer, size);
-
-        vkDestroyBuffer(context->logical_device.handle, staging_buffer, NULL);
-        vkFreeMemory(context->logical_device.handle, staging_buffer_memory, NULL);
+        upload_wait(context->upload, ticket);
     }
 }
 
@@ -1781,6 +2543,8 @@ static inline void initialize_fonts(Renderer *r) {
     }
 }
 
+#include "capture.c"
+
 /* Interface to loader */
 
 void startup(Renderer *r) {
@@ -1796,8 +2560,31 @@ void shutdown(Renderer *r) {
     setup_globals(r);
     vkDeviceWaitIdle(context->logical_device.handle);
 
+    capture_end(&r->capture);
+
+    upload_shutdown(context->upload);
+    platform.free_memory(context->upload);
+
+    text_shutdown(context->text, r);
+    platform.free_memory(context->text);
+    glyph_upload_shutdown(context->glyph_upload);
+    platform.free_memory(context->glyph_upload);
+
+    gpu_profile_shutdown(context->profiler, context->logical_device.handle);
+    platform.free_memory(context->profiler);
+    platform.free_memory(context->draws);
+
+    if (context->readback_buffers) {
+        /* Flush the readbacks still in flight, oldest first */
+        for (u32 i = 0; i < context->swapchain.image_count; ++i) {
+            write_readback(r, (context->next_offscreen_image + i) % context->swapchain.image_count);
+        }
+        destroy_readback_buffers(context->swapchain.image_count);
+    }
+
     cleanup_swapchain(r);
 
+    vkDestroyShaderModule(context->logical_device.handle, context->layer_vert_module, NULL);
     vkDestroyShaderModule(context->logical_device.handle, context->atlas_vert_module, NULL);
     vkDestroyShaderModule(context->logical_device.handle, context->atlas_frag_module, NULL);
     vkDestroyShaderModule(context->logical_device.handle, context->texture_vert_module, NULL);
@@ -1806,12 +2593,19 @@ void shutdown(Renderer *r) {
     vkDestroyShaderModule(context->logical_device.handle, context->color_frag_module, NULL);
 
     vkDestroySampler(context->logical_device.handle, context->texture_sampler, NULL);
+    vkDestroySampler(context->logical_device.handle, context->filtered_sampler, NULL);
 
-    if (context->has_texture) {
-        vkDestroyImageView(context->logical_device.handle, context->texture_image_view, NULL);
-        vkDestroyImage(context->logical_device.handle, context->texture_image, NULL);
-        vkFreeMemory(context->logical_device.handle, context->texture_image_memory, NULL);
+    for (u32 i = 0; i < MAX_TEXTURES; ++i) {
+        if (context->textures[i].is_valid) {
+            destroyTexture(&context->textures[i]);
+        }
     }
+    for (u32 i = 0; i < MAX_LAYERS; ++i) {
+        if (context->layers[i].is_valid) {
+            destroyLayer(&context->layers[i]);
+        }
+    }
+    destroy_retired_resources(true);
 
     for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
         vkDestroySemaphore(context->logical_device.handle, context->sem_render_finished[i], NULL);
@@ -1824,43 +2618,216 @@ void shutdown(Renderer *r) {
 
     vkDestroyDescriptorSetLayout(context->logical_device.handle, context->descriptor_set_layout, NULL);
     platform.free_memory(context->descriptor_sets);
+    platform.free_memory(context->descriptor_versions);
+    platform.free_memory(context->recorded_frames);
 
     vkDestroyCommandPool(context->logical_device.handle, context->command_pool, NULL);
 
-    vkFreeMemory(context->logical_device.handle, context->vertex_buffer_memory, NULL);
     vkDestroyBuffer(context->logical_device.handle, context->vertex_buffer, NULL);
-    vkFreeMemory(context->logical_device.handle, context->index_buffer_memory, NULL);
+    gpu_free(context->memory, &context->vertex_buffer_memory);
     vkDestroyBuffer(context->logical_device.handle, context->index_buffer, NULL);
+    gpu_free(context->memory, &context->index_buffer_memory);
+
+    gpu_memory_shutdown(context->memory);
+    platform.free_memory(context->memory);
+
+    pipeline_cache_save(context->logical_device.handle, context->pipeline_cache);
+    vkDestroyPipelineCache(context->logical_device.handle, context->pipeline_cache, NULL);
 
     vkDestroyDevice(context->logical_device.handle, NULL);
-    vkDestroySurfaceKHR(context->instance, context->surface, NULL);
+    if (!context->headless) {
+        vkDestroySurfaceKHR(context->instance, context->surface, NULL);
+    }
     vkDestroyInstance(context->instance, NULL);
-}
 
-RenderCommands *begin_frame(Renderer *r) {
-    setup_globals(r);
-    r->cmds.memory_base = &r->memory[0];
-    r->cmds.memory_top  = 0;
-    r->cmds.memory_size = RENDERER_MEMORY_SIZE;
-    return &r->cmds;
+    /* The loader can start another renderer module on the same Renderer */
+    platform.free_memory(context);
+    r->context = NULL;
 }
 
-void end_frame(Renderer *r, RenderCommands *cmds) {
-    vkWaitForFences(context->logical_device.handle, 1, &context->in_flight_fences[context->current_frame_index], VK_TRUE, UINT64_MAX);
+/* Records the draws of one entry at depth z, inside the render pass */
+static void record_entry(Renderer *r, u32 image_index, RenderEntryHeader *header, f32 z) {
+    switch (header->type) {
+    case ENTRY_TYPE_RenderEntryQuad: {
+        RenderEntryQuad *quad = (RenderEntryQuad *) header;
+
+        gpu_profile_batch(context->profiler, context->command_buffers[image_index], PROFILE_GPU_COLOR);
+        vkCmdBindPipeline(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->color_pipeline.handle);
+        VkBuffer vertex_buffers[] = {context->vertex_buffer};
+        VkDeviceSize offsets[] = {0};
+        vkCmdBindVertexBuffers(context->command_buffers[image_index], 0, 1, vertex_buffers, offsets);
+        vkCmdBindIndexBuffer(context->command_buffers[image_index], context->index_buffer, 0, VK_INDEX_TYPE_UINT16);
+
+        /* Draw quad */
+        ShapePushConstants push = {0};
+        push.depth = z;
+        v2AssignToArray(push.pos, quad->pos);
+        v2AssignToArray(push.scale, quad->scale);
+        colorRGBAssignToArray(push.col, quad->col);
+        vkCmdPushConstants(context->command_buffers[image_index], context->color_pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(ShapePushConstants), &push);
+
+        vkCmdDrawIndexed(context->command_buffers[image_index], ARRLEN(indices), 1, 0, 0, 0);
 
-    u32 image_index = 0;
-    {
-        VkResult result = vkAcquireNextImageKHR(context->logical_device.handle, context->swapchain.handle, UINT64_MAX, context->sem_image_available[context->current_frame_index], VK_NULL_HANDLE, &image_index);
-        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
-            recreate_swapchain(r);
-            return;
-        } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
-            platform.log(LOG_ERROR, "Vulkan: failed to acquire next image (%s)", vk_result_to_string(result));
-            return;
+        break;
+    }
+    case ENTRY_TYPE_RenderEntryTexturedQuad: {
+        RenderEntryTexturedQuad *quad = (RenderEntryTexturedQuad *) header;
+
+        gpu_profile_batch(context->profiler, context->command_buffers[image_index], PROFILE_GPU_TEXTURE);
+        vkCmdBindPipeline(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->texture_pipeline.handle);
+        VkBuffer vertex_buffers[] = {context->vertex_buffer};
+        VkDeviceSize offsets[] = {0};
+        vkCmdBindVertexBuffers(context->command_buffers[image_index], 0, 1, vertex_buffers, offsets);
+        vkCmdBindIndexBuffer(context->command_buffers[image_index], context->index_buffer, 0, VK_INDEX_TYPE_UINT16);
+
+        vkCmdBindDescriptorSets(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->texture_pipeline.layout, 0, 1, &context->descriptor_sets[image_index], 0, NULL);
+
+        /* Draw quad */
+        TexturePushConstants push = {0};
+        push.depth = z;
+        v2AssignToArray(push.pos, quad->pos);
+        v2AssignToArray(push.scale, quad->scale);
+        //colorRGBAssignToArray(push.col, quad->col);
+        push.texture = texture_index(r, quad->texture);
+        vkCmdPushConstants(context->command_buffers[image_index], context->texture_pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(TexturePushConstants), &push);
+
+        vkCmdDrawIndexed(context->command_buffers[image_index], ARRLEN(indices), 1, 0, 0, 0);
+
+        break;
+    }
+    case ENTRY_TYPE_RenderEntryAtlasQuad: {
+        RenderEntryAtlasQuad *quad = (RenderEntryAtlasQuad *) header;
+
+        gpu_profile_batch(context->profiler, context->command_buffers[image_index], PROFILE_GPU_ATLAS);
+        vkCmdBindPipeline(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->atlas_pipeline.handle);
+        VkBuffer vertex_buffers[] = {context->vertex_buffer};
+        VkDeviceSize offsets[] = {0};
+        vkCmdBindVertexBuffers(context->command_buffers[image_index], 0, 1, vertex_buffers, offsets);
+        vkCmdBindIndexBuffer(context->command_buffers[image_index], context->index_buffer, 0, VK_INDEX_TYPE_UINT16);
+
+        vkCmdBindDescriptorSets(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->atlas_pipeline.layout, 0, 1, &context->descriptor_sets[image_index], 0, NULL);
+
+        /* Draw quad */
+        AtlasPushConstants push = {0};
+        push.depth = z;
+        v2AssignToArray(push.pos, quad->pos);
+        v2AssignToArray(push.scale, quad->scale);
+        v2AssignToArray(push.offset, quad->offset);
+        v2AssignToArray(push.size, quad->size);
+        colorRGBAssignToArray(push.col, quad->col);
+        push.texture = texture_index(r, quad->texture);
+        vkCmdPushConstants(context->command_buffers[image_index], context->atlas_pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(AtlasPushConstants), &push);
+
+        vkCmdDrawIndexed(context->command_buffers[image_index], ARRLEN(indices), 1, 0, 0, 0);
+
+        break;
+    }
+    case ENTRY_TYPE_RenderEntrySprite: {
+        RenderEntrySprite *sprite = (RenderEntrySprite *) header;
+
+        gpu_profile_batch(context->profiler, context->command_buffers[image_index], PROFILE_GPU_ATLAS);
+        vkCmdBindPipeline(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->atlas_pipeline.handle);
+        VkBuffer vertex_buffers[] = {context->vertex_buffer};
+        VkDeviceSize offsets[] = {0};
+        vkCmdBindVertexBuffers(context->command_buffers[image_index], 0, 1, vertex_buffers, offsets);
+        vkCmdBindIndexBuffer(context->command_buffers[image_index], context->index_buffer, 0, VK_INDEX_TYPE_UINT16);
+
+        vkCmdBindDescriptorSets(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->atlas_pipeline.layout, 0, 1, &context->descriptor_sets[image_index], 0, NULL);
+
+        /* Draw quad */
+        AtlasPushConstants push = {0};
+        push.depth = z;
+        v2AssignToArray(push.pos, sprite->pos);
+        v2AssignToArray(push.scale, sprite->scale);
+        v2AssignToArray(push.offset, sprite->offset);
+        v2AssignToArray(push.size, sprite->size);
+        colorRGBAssignToArray(push.col, sprite->tint);
+        push.texture = texture_index(r, sprite->texture);
+        push.flags = ATLAS_FLAG_RGBA;
+        vkCmdPushConstants(context->command_buffers[image_index], context->atlas_pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(AtlasPushConstants), &push);
+
+        vkCmdDrawIndexed(context->command_buffers[image_index], ARRLEN(indices), 1, 0, 0, 0);
+
+        break;
+    }
+    case ENTRY_TYPE_RenderEntryText: {
+        RenderEntryText *entry = (RenderEntryText *) header;
+
+        TextLayout *layout = text_layout(context->text, r, entry->text, entry->length);
+        if (layout->quad_count == 0) {
+            break;
         }
+
+        gpu_profile_batch(context->profiler, context->command_buffers[image_index], PROFILE_GPU_ATLAS);
+        vkCmdBindPipeline(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->atlas_pipeline.handle);
+        VkBuffer vertex_buffers[] = {context->vertex_buffer};
+        VkDeviceSize offsets[] = {0};
+        vkCmdBindVertexBuffers(context->command_buffers[image_index], 0, 1, vertex_buffers, offsets);
+        vkCmdBindIndexBuffer(context->command_buffers[image_index], context->index_buffer, 0, VK_INDEX_TYPE_UINT16);
+
+        vkCmdBindDescriptorSets(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->atlas_pipeline.layout, 0, 1, &context->descriptor_sets[image_index], 0, NULL);
+
+        /* Glyphs are drawn straight from the cached layout */
+        const f32 scale = text_scale(r, entry);
+        AtlasPushConstants push = {0};
+        push.depth = z;
+        colorRGBAssignToArray(push.col, entry->col);
+        push.texture = texture_index(r, context->text->glyphs.texture);
+        push.flags = (r->font_sdf_spread > 0) ? ATLAS_FLAG_SDF : 0;
+        for (u32 i = 0; i < layout->quad_count; ++i) {
+            GlyphQuad *quad = &layout->quads[i];
+            v2AssignToArray(push.pos, v2Add(entry->pos, v2Scale(scale, quad->pos)));
+            v2AssignToArray(push.scale, v2Scale(scale, quad->scale));
+            v2AssignToArray(push.offset, quad->uv_offset);
+            v2AssignToArray(push.size, quad->uv_size);
+            vkCmdPushConstants(context->command_buffers[image_index], context->atlas_pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(AtlasPushConstants), &push);
+
+            vkCmdDrawIndexed(context->command_buffers[image_index], ARRLEN(indices), 1, 0, 0, 0);
+        }
+
+        break;
+    }
+    case ENTRY_TYPE_RenderEntryLayer: {
+        RenderEntryLayer *entry = (RenderEntryLayer *) header;
+
+        LayerSlot *slot = layerLookup(r->layers, entry->layer);
+        GpuLayer *layer = (slot) ? &context->layers[LAYER_HANDLE_SLOT(entry->layer)] : NULL;
+        if (!layer || !layer->is_ready) {
+            break;
+        }
+
+        gpu_profile_batch(context->profiler, context->command_buffers[image_index], PROFILE_GPU_LAYER);
+        vkCmdBindPipeline(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->layer_pipeline.handle);
+        VkBuffer vertex_buffers[] = {context->vertex_buffer, layer->buffer};
+        VkDeviceSize offsets[] = {0, 0};
+        vkCmdBindVertexBuffers(context->command_buffers[image_index], 0, 2, vertex_buffers, offsets);
+        vkCmdBindIndexBuffer(context->command_buffers[image_index], context->index_buffer, 0, VK_INDEX_TYPE_UINT16);
+
+        vkCmdBindDescriptorSets(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->layer_pipeline.layout, 0, 1, &context->descriptor_sets[image_index], 0, NULL);
+
+        /* One draw per run, so the texture index is uniform within each */
+        LayerPushConstants push = {0};
+        push.depth = z;
+        v2AssignToArray(push.offset, entry->offset);
+        for (u32 i = 0; i < layer->run_count; ++i) {
+            LayerRun *run = &layer->runs[i];
+            push.texture = run->texture;
+            vkCmdPushConstants(context->command_buffers[image_index], context->layer_pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(LayerPushConstants), &push);
+
+            vkCmdDrawIndexed(context->command_buffers[image_index], ARRLEN(indices), run->instance_count, 0, 0, run->first_instance);
+        }
+
+        break;
     }
+    };
+}
 
-    VkClearValue clear_color = {{{1.0f, 1.0f, 1.0f, 1.0f}}};
+/* Records the frame into the command buffer of image_index, draws has to be sorted */
+static void record_frame(Renderer *r, RenderCommands *cmds, u32 image_index) {
+    VkClearValue clear_values[] = {
+        [0] = {.color = {{1.0f, 1.0f, 1.0f, 1.0f}}},
+        [1] = {.depthStencil = {1.0f, 0}},
+    };
 
     VkRenderPassBeginInfo pass_info = {
         .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
@@ -1870,8 +2837,8 @@ void end_frame(Renderer *r, RenderCommands *cmds) {
             .offset = {0, 0},
             .extent = context->swapchain.image_extent,
         },
-        .clearValueCount = 1,
-        .pClearValues = &clear_color,
+        .clearValueCount = (context->depth_format != VK_FORMAT_UNDEFINED) ? 2 : 1,
+        .pClearValues = clear_values,
     };
 
     VkCommandBufferBeginInfo cmd_info = {
@@ -1882,166 +2849,239 @@ void end_frame(Renderer *r, RenderCommands *cmds) {
 
     VKC_CHECK(vkBeginCommandBuffer(context->command_buffers[image_index], &cmd_info),
               "failed to start recording command buffer");
-    pass_info.framebuffer = context->framebuffers[image_index];
-    vkCmdBeginRenderPass(context->command_buffers[image_index], &pass_info, VK_SUBPASS_CONTENTS_INLINE);
+    gpu_profile_begin_frame(context->profiler, context->command_buffers[image_index], image_index);
 
-    // TODO(anjo): Move to separate queues for different pipelines?
-
-    RenderEntryHeader *header = (RenderEntryHeader *) cmds->memory_base;
-    while ((u8 *)header < cmds->memory_base + cmds->memory_top) {
-        switch (header->type) {
-        case ENTRY_TYPE_RenderEntryQuad: {
-            RenderEntryQuad *quad = (RenderEntryQuad *) header;
-            header += sizeof(RenderEntryQuad);
+    glyph_upload_flush(context->glyph_upload, &context->text->glyphs, context->command_buffers[image_index], context->current_frame_index);
+    gpu_profile_uploads_done(context->profiler, context->command_buffers[image_index]);
 
-            vkCmdBindPipeline(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->color_pipeline.handle);
-            VkBuffer vertex_buffers[] = {context->vertex_buffer};
-            VkDeviceSize offsets[] = {0};
-            vkCmdBindVertexBuffers(context->command_buffers[image_index], 0, 1, vertex_buffers, offsets);
-            vkCmdBindIndexBuffer(context->command_buffers[image_index], context->index_buffer, 0, VK_INDEX_TYPE_UINT16);
+    pass_info.framebuffer = context->framebuffers[image_index];
+    vkCmdBeginRenderPass(context->command_buffers[image_index], &pass_info, VK_SUBPASS_CONTENTS_INLINE);
+    gpu_profile_begin_pass(context->profiler, context->command_buffers[image_index]);
 
-            /* Draw quad */
-            ShapePushConstants push = {0};
-            v2AssignToArray(push.pos, quad->pos);
-            v2AssignToArray(push.scale, quad->scale);
-            colorRGBAssignToArray(push.col, quad->col);
-            vkCmdPushConstants(context->command_buffers[image_index], context->color_pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(ShapePushConstants), &push);
+    VkViewport viewport = {
+        .x = 0.0f,
+        .y = 0.0f,
+        .width  = (f32) context->swapchain.image_extent.width,
+        .height = (f32) context->swapchain.image_extent.height,
+        .minDepth = 0.0f,
+        .maxDepth = 1.0f,
+    };
+    vkCmdSetViewport(context->command_buffers[image_index], 0, 1, &viewport);
 
-            vkCmdDrawIndexed(context->command_buffers[image_index], ARRLEN(indices), 1, 0, 0, 0);
+    VkRect2D scissor = {
+        .offset = {0, 0},
+        .extent = context->swapchain.image_extent,
+    };
+    vkCmdSetScissor(context->command_buffers[image_index], 0, 1, &scissor);
 
-            break;
-        }
-        case ENTRY_TYPE_RenderEntryTexturedQuad: {
-            RenderEntryTexturedQuad *quad = (RenderEntryTexturedQuad *) header;
-            header += sizeof(RenderEntryTexturedQuad);
+    // TODO(anjo): Move to separate queues for different pipelines?
 
-            if (!context->has_texture) {
-                createTextureImage(&quad->image);
-                createTextureImageView();
-                populate_descriptor_sets();
-                context->has_texture = true;
+    /*
+     * Back to front, unless there's a depth buffer. Then opaque entries go
+     * first, front to back, so early depth tests skip what they cover, and
+     * blended ones go back to front over them.
+     */
+    DrawList *draws = context->draws;
+    const bool has_depth = context->depth_format != VK_FORMAT_UNDEFINED;
+    if (has_depth) {
+        for (u32 i = 0; i < draws->visible_count; ++i) {
+            const u32 item = draws->order[i];
+            if (draws->is_opaque[item]) {
+                record_entry(r, image_index, (RenderEntryHeader *) (cmds->memory_base + draws->offsets[item]), draw_list_z(draws, i));
             }
+        }
+    }
+    for (u32 i = draws->visible_count; i-- > 0;) {
+        const u32 item = draws->order[i];
+        if (!has_depth || !draws->is_opaque[item]) {
+            record_entry(r, image_index, (RenderEntryHeader *) (cmds->memory_base + draws->offsets[item]), draw_list_z(draws, i));
+        }
+    }
 
-            vkCmdBindPipeline(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->texture_pipeline.handle);
-            VkBuffer vertex_buffers[] = {context->vertex_buffer};
-            VkDeviceSize offsets[] = {0};
-            vkCmdBindVertexBuffers(context->command_buffers[image_index], 0, 1, vertex_buffers, offsets);
-            vkCmdBindIndexBuffer(context->command_buffers[image_index], context->index_buffer, 0, VK_INDEX_TYPE_UINT16);
-
-            vkCmdBindDescriptorSets(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->texture_pipeline.layout, 0, 1, &context->descriptor_sets[image_index], 0, NULL);
+    gpu_profile_end_pass(context->profiler, context->command_buffers[image_index]);
+    vkCmdEndRenderPass(context->command_buffers[image_index]);
 
-            /* Draw quad */
-            ShapePushConstants push = {0};
-            v2AssignToArray(push.pos, quad->pos);
-            v2AssignToArray(push.scale, quad->scale);
-            //colorRGBAssignToArray(push.col, quad->col);
-            vkCmdPushConstants(context->command_buffers[image_index], context->texture_pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(ShapePushConstants), &push);
+    if (context->readback_buffers) {
+        VkBufferImageCopy region = {
+            .bufferOffset = 0,
+            .bufferRowLength = 0,
+            .bufferImageHeight = 0,
+            .imageSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = 0,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+            .imageOffset = {0, 0, 0},
+            .imageExtent = {
+                .width = context->swapchain.image_extent.width,
+                .height = context->swapchain.image_extent.height,
+                .depth = 1,
+            },
+        };
+        vkCmdCopyImageToBuffer(context->command_buffers[image_index], context->swapchain.images[image_index], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, context->readback_buffers[image_index], 1, &region);
+
+        VkBufferMemoryBarrier barrier = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer = context->readback_buffers[image_index],
+            .offset = 0,
+            .size = VK_WHOLE_SIZE,
+        };
+        vkCmdPipelineBarrier(context->command_buffers[image_index],
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                             0,
+                             0, NULL,
+                             1, &barrier,
+                             0, NULL);
+
+        context->readback_frames[image_index] = r->frame_info->total_frame_count + 1;
+    }
 
-            vkCmdDrawIndexed(context->command_buffers[image_index], ARRLEN(indices), 1, 0, 0, 0);
+    gpu_profile_end_frame(context->profiler, context->command_buffers[image_index]);
+    VKC_CHECK(vkEndCommandBuffer(context->command_buffers[image_index]),
+              "failed to end recording command buffer");
+}
 
-            break;
-        }
-        case ENTRY_TYPE_RenderEntryAtlasQuad: {
-            RenderEntryAtlasQuad *quad = (RenderEntryAtlasQuad *) header;
-            header += sizeof(RenderEntryAtlasQuad);
+RenderCommands *begin_frame(Renderer *r) {
+    setup_globals(r);
+    poll_latency(r);
+    r->cmds.memory_base = &r->memory[0];
+    r->cmds.memory_top  = 0;
+    r->cmds.memory_size = RENDERER_MEMORY_SIZE;
+    r->cmds.text_size   = 0.0f;
+    r->cmds.cull_min    = VEC2(-1.0f, -1.0f);
+    r->cmds.cull_max    = VEC2( 1.0f,  1.0f);
+    r->cmds.depth       = 0;
+    return &r->cmds;
+}
 
-            if (!context->has_texture) {
-                createTextureImage(&quad->image);
-                createTextureImageView();
-                populate_descriptor_sets();
-                context->has_texture = true;
-            }
+void end_frame(Renderer *r, RenderCommands *cmds) {
+    capture_frame(r, cmds);
+    update_textures(r);
+    update_layers(r);
 
-            vkCmdBindPipeline(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->atlas_pipeline.handle);
-            VkBuffer vertex_buffers[] = {context->vertex_buffer};
-            VkDeviceSize offsets[] = {0};
-            vkCmdBindVertexBuffers(context->command_buffers[image_index], 0, 1, vertex_buffers, offsets);
-            vkCmdBindIndexBuffer(context->command_buffers[image_index], context->index_buffer, 0, VK_INDEX_TYPE_UINT16);
-
-            vkCmdBindDescriptorSets(context->command_buffers[image_index], VK_PIPELINE_BIND_POINT_GRAPHICS, context->atlas_pipeline.layout, 0, 1, &context->descriptor_sets[image_index], 0, NULL);
-
-            /* Draw quad */
-            AtlasPushConstants push = {0};
-            v2AssignToArray(push.pos, quad->pos);
-            v2AssignToArray(push.scale, quad->scale);
-            v2AssignToArray(push.offset, quad->offset);
-            v2AssignToArray(push.size, quad->size);
-            colorRGBAssignToArray(push.col, quad->col);
-            vkCmdPushConstants(context->command_buffers[image_index], context->atlas_pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(AtlasPushConstants), &push);
+    if (r->settings && r->settings->latency_mode != context->latency_mode && r->settings->latency_mode < LATENCY_MODE_COUNT) {
+        apply_latency_mode(r);
+    }
+    poll_latency(r);
 
-            vkCmdDrawIndexed(context->command_buffers[image_index], ARRLEN(indices), 1, 0, 0, 0);
+    /* Time blocked on the GPU, a CPU-bound frame barely waits here */
+    const Time wait_start = platform.time_current();
 
-            break;
-        }
-        case ENTRY_TYPE_RenderEntryText: {
-            RenderEntryText *entry = (RenderEntryText *) header;
-            header += sizeof(RenderEntryText);
-
-            Vec2 pos = entry->pos;
-
-            for (const char *p = entry->text; *p; ++p) {
-
-                PackRect *rect = NULL;
-                for (u32 i = 0; i < NUM_CHARS; ++i) {
-                    if (r->font_map[i].user_id == *p) {
-                        rect = &r->font_map[i];
-                        break;
-                    }
-                }
-
-                FontInfo *info = NULL;
-                for (u32 i = 0; i < NUM_CHARS; ++i) {
-                    if (r->font_info[i].codepoint == *p) {
-                        info = &r->font_info[i];
-                        break;
-                    }
-                }
-
-                if (rect) {
-                    pushAtlasQuad(cmds,
-                                  VEC2(pos.x + 2.0f*(info->offset_x)/800.0f, pos.y - 2.0f*(info->offset_y)/600.0f),
-                                  VEC2(2.0f*rect->width/800.0f, 2.0f*rect->height/600.0f),
-                                  *r->font_atlas,
-                                  VEC2(rect->x/(f32)r->font_atlas->width,     rect->y/(f32)r->font_atlas->height),
-                                  VEC2(rect->width/(f32)r->font_atlas->width, rect->height/(f32)r->font_atlas->height),
-                                  entry->col
-                                  );
-                    pos.x += 2.0*(f32)(info->advance >> 6)/800.0f;
-                }
-            }
+    vkWaitForFences(context->logical_device.handle, 1, &context->in_flight_fences[context->current_frame_index], VK_TRUE, UINT64_MAX);
+    context->completed_serial = MAX(context->completed_serial, context->in_flight_serials[context->current_frame_index]);
+    measure_latency(r, context->current_frame_index, true);
+    gpu_profile_collect(context->profiler, context->logical_device.handle, context->current_frame_index, r->profile);
+    destroy_retired_swapchains(false);
+    destroy_retired_resources(false);
 
-            break;
+    u32 image_index = 0;
+    if (context->headless) {
+        image_index = context->next_offscreen_image;
+        context->next_offscreen_image = (image_index + 1) % context->swapchain.image_count;
+    } else {
+        VkResult result = vkAcquireNextImageKHR(context->logical_device.handle, context->swapchain.handle, UINT64_MAX, context->sem_image_available[context->current_frame_index], VK_NULL_HANDLE, &image_index);
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+            recreate_swapchain(r);
+            return;
+        } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+            platform.log(LOG_ERROR, "Vulkan: failed to acquire next image (%s)", vk_result_to_string(result));
+            return;
         }
-        };
     }
 
-    vkCmdEndRenderPass(context->command_buffers[image_index]);
-    VKC_CHECK(vkEndCommandBuffer(context->command_buffers[image_index]),
-              "failed to end recording command buffer");
-
+    /* The command buffer for this image can't be re-recorded while still in flight */
     if (context->in_flight_images[image_index] != VK_NULL_HANDLE) {
         vkWaitForFences(context->logical_device.handle, 1, &context->in_flight_images[image_index], VK_TRUE, UINT64_MAX);
     }
+    gpu_profile_collect_image(context->profiler, context->logical_device.handle, image_index, r->profile);
     context->in_flight_images[image_index] = context->in_flight_fences[context->current_frame_index];
 
+    if (r->profile) {
+        r->profile->cpu_wait_ns = time_to_ns(platform.time_current()) - time_to_ns(wait_start);
+    }
+
+    write_readback(r, image_index);
+    const bool descriptors_changed = update_descriptor_set(image_index);
+
+    /* Lays out text too, new glyphs have to reach the atlas outside of the render pass */
+    text_resize(context->text, context->swapchain.image_extent.width, context->swapchain.image_extent.height);
+    DrawList *draws = context->draws;
+    draw_list_build(draws, context->text, r, cmds);
+    draw_list_cull(draws,
+                   VEC2(MAX(cmds->cull_min.x, -1.0f), MAX(cmds->cull_min.y, -1.0f)),
+                   VEC2(MIN(cmds->cull_max.x,  1.0f), MIN(cmds->cull_max.y,  1.0f)));
+    draw_list_sort(draws);
+    if (r->profile) {
+        r->profile->drawn_count = draws->visible_count;
+        r->profile->culled_count = draws->count - draws->visible_count;
+    }
+
+    /* Glyphs may have moved in the atlas, text recorded before would sample the wrong ones */
+    if (context->text->glyphs.dirty_x0 < context->text->glyphs.dirty_x1) {
+        context->record_version++;
+    }
+
+    /*
+     * Idle menus and paused scenes draw the same frame over and over. If
+     * this image's command buffer was recorded from the same sorted
+     * entries and nothing it refers to changed since, it's submitted as
+     * is. Its profiler range is the image's own, see profile.c.
+     */
+    u64 hash = hash_fnv1a_wide(draw_list_hash(draws, cmds), &context->record_version, sizeof(context->record_version));
+    hash = (hash != 0) ? hash : 1;
+    RecordedFrame *recorded = &context->recorded_frames[image_index];
+    if (!descriptors_changed && recorded->hash == hash) {
+        if (context->readback_buffers) {
+            context->readback_frames[image_index] = r->frame_info->total_frame_count + 1;
+        }
+        if (r->profile) {
+            r->profile->record_ns = 0;
+            r->profile->reused_count++;
+            r->profile->record_saved_ns += recorded->record_ns;
+        }
+    } else {
+        const Time record_start = platform.time_current();
+        record_frame(r, cmds, image_index);
+        recorded->hash = hash;
+        recorded->record_ns = time_to_ns(platform.time_current()) - time_to_ns(record_start);
+        if (r->profile) {
+            r->profile->record_ns = recorded->record_ns;
+        }
+    }
+
     VkSemaphore wait_semaphores[] = {context->sem_image_available[context->current_frame_index]};
     VkPipelineStageFlags wait_stages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
     VkSemaphore signal_semaphores[] = {context->sem_render_finished[context->current_frame_index]};
 
+    /* Nothing to acquire or present when headless */
     VkSubmitInfo submit_info = {
         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .waitSemaphoreCount = 1,
+        .waitSemaphoreCount = (context->headless) ? 0 : 1,
         .pWaitSemaphores = wait_semaphores,
         .pWaitDstStageMask = wait_stages,
         .commandBufferCount = 1,
         .pCommandBuffers = &context->command_buffers[image_index],
-        .signalSemaphoreCount = 1,
+        .signalSemaphoreCount = (context->headless) ? 0 : 1,
         .pSignalSemaphores = signal_semaphores,
     };
 
     vkResetFences(context->logical_device.handle, 1, &context->in_flight_fences[context->current_frame_index]);
     VKC_CHECK(vkQueueSubmit(context->logical_device.graphics_queue, 1, &submit_info, context->in_flight_fences[context->current_frame_index]),
               "failed to submit draw command buffer");
+    context->in_flight_serials[context->current_frame_index] = ++context->submitted_serial;
+    gpu_profile_submit(context->profiler, context->current_frame_index, image_index, r->frame_info->total_frame_count);
+    context->in_flight_start_ns[context->current_frame_index] = time_to_ns(r->frame_info->start_time);
+    context->is_latency_pending[context->current_frame_index] = true;
+
+    if (context->headless) {
+        context->current_frame_index = (context->current_frame_index + 1) % context->frames_in_flight;
+        return;
+    }
 
     VkSwapchainKHR swapchains[] = {context->swapchain.handle};
     VkPresentInfoKHR present_info = {
@@ -2064,5 +3104,5 @@ void end_frame(Renderer *r, RenderCommands *cmds) {
         }
     }
 
-    context->current_frame_index = (context->current_frame_index + 1) % MAX_FRAMES_IN_FLIGHT;
+    context->current_frame_index = (context->current_frame_index + 1) % context->frames_in_flight;
 }
@@ -0,0 +1,234 @@
+#include <shared/hash.h>
+#include <shared/utf8.h>
+#include <shared/render_capture.h>
+
+#include "glyph_cache.c"
+
+/*
+ * Text layout
+ *
+ * Text is UTF-8, glyphs come from the glyph cache. Laid out runs are
+ * cached by string hash and font, so text that doesn't change between
+ * frames (most HUD text) only costs hashing the string. A run is stored
+ * relative to the text's position, moving text hits the cache too.
+ *
+ * Fonts are identified by the texture handle of their atlas. Only the
+ * first TEXT_LAYOUT_MAX_LENGTH bytes of a string are drawn.
+ *
+ * Layouts are in the atlas' pixel size and scaled to the entry's size
+ * when drawn, so one layout serves every size of the same string.
+ *
+ * A layout remembers the generation of every glyph it uses and is
+ * redone once one of them was evicted from the glyph cache.
+ *
+ * Shared by both renderers. The software renderer draws tiles from
+ * other threads after every entry was laid out, so a layout used by the
+ * current frame is never evicted. Runs that find no other slot go to a
+ * pool that only lives for the frame.
+ */
+
+#define TEXT_LAYOUT_CACHE_SIZE 64
+#define TEXT_LAYOUT_MAX_LENGTH 128
+/* Slots probed on lookup, the least recently used one is evicted on a miss */
+#define TEXT_LAYOUT_PROBE      8
+#define TEXT_LAYOUT_FRAME_POOL 32
+
+typedef struct GlyphQuad {
+    /* Center relative to the text position */
+    Vec2 pos;
+    Vec2 scale;
+    Vec2 uv_offset;
+    Vec2 uv_size;
+
+    u16 glyph;
+    u16 generation;
+} GlyphQuad;
+
+typedef struct TextLayout {
+    u64 hash;
+    TextureHandle font;
+    /* Full length, only the first TEXT_LAYOUT_MAX_LENGTH bytes are stored */
+    u64 length;
+    char text[TEXT_LAYOUT_MAX_LENGTH];
+
+    /* False if some glyph didn't fit in the glyph cache */
+    bool is_complete;
+    u32 quad_count;
+    GlyphQuad quads[TEXT_LAYOUT_MAX_LENGTH];
+    /* Bounds of the quads relative to the text position, for culling */
+    Vec2 bounds_min;
+    Vec2 bounds_max;
+
+    /* Frame index + 1 of the last use, 0 if the slot is empty */
+    u64 last_used;
+} TextLayout;
+
+typedef struct TextCache {
+    GlyphCache glyphs;
+    TextLayout layouts[TEXT_LAYOUT_CACHE_SIZE];
+    TextLayout frame_pool[TEXT_LAYOUT_FRAME_POOL];
+    u32 frame_pool_count;
+    /* Frame index + 1 the frame pool belongs to */
+    u64 frame_pool_frame;
+    /* Handed out once the frame pool ran out too */
+    TextLayout empty;
+
+    /* Size of a framebuffer pixel in clip space, layouts depend on it */
+    Vec2 pixel;
+
+    u64 hits;
+    u64 misses;
+} TextCache;
+
+static void text_init(TextCache *cache, Renderer *r) {
+    memset(cache, 0, sizeof(TextCache));
+    glyph_cache_init(&cache->glyphs, r);
+}
+
+/* Called with the framebuffer size before text is laid out, drops every layout when it changed */
+static void text_resize(TextCache *cache, u32 width, u32 height) {
+    const Vec2 pixel = VEC2(2.0f/(f32) MAX(width, 1), 2.0f/(f32) MAX(height, 1));
+    if (pixel.x == cache->pixel.x && pixel.y == cache->pixel.y) {
+        return;
+    }
+    cache->pixel = pixel;
+    memset(cache->layouts, 0, sizeof(cache->layouts));
+    cache->frame_pool_count = 0;
+}
+
+static void text_shutdown(TextCache *cache, Renderer *r) {
+    platform.log(LOG_INFO, "Text: layout cache %llu hits, %llu misses",
+                 (unsigned long long) cache->hits, (unsigned long long) cache->misses);
+    glyph_cache_shutdown(&cache->glyphs, r);
+}
+
+static void text_layout_run(TextCache *cache, Renderer *r, TextLayout *layout, const char *text, u32 length, u64 now) {
+    const Vec2 pixel = cache->pixel;
+    const f32 uv_scale = 1.0f/GLYPH_ATLAS_SIZE;
+
+    layout->is_complete = true;
+    layout->quad_count = 0;
+    layout->bounds_min = VEC2(0.0f, 0.0f);
+    layout->bounds_max = VEC2(0.0f, 0.0f);
+    f32 pen_x = 0.0f;
+    for (u32 i = 0; i < length; ) {
+        u32 codepoint = utf8_decode(text, length, &i);
+        CachedGlyph *glyph = glyph_cache_get(&cache->glyphs, r, codepoint, now);
+        if (!glyph) {
+            layout->is_complete = false;
+            continue;
+        }
+        if (glyph->state != GLYPH_RESIDENT) {
+            continue;
+        }
+
+        if (glyph->width > 0 && glyph->height > 0) {
+            const Vec2 size = VEC2(glyph->width*pixel.x, glyph->height*pixel.y);
+
+            GlyphQuad *quad = &layout->quads[layout->quad_count++];
+            quad->pos = VEC2(pen_x + glyph->offset_x*pixel.x + 0.5f*size.x,
+                             -glyph->offset_y*pixel.y + 0.5f*size.y);
+            quad->scale = size;
+            quad->uv_offset = VEC2(glyph->x*uv_scale, glyph->y*uv_scale);
+            quad->uv_size = VEC2(glyph->width*uv_scale, glyph->height*uv_scale);
+            quad->glyph = (u16) (glyph - cache->glyphs.glyphs);
+            quad->generation = glyph->generation;
+
+            const Vec2 quad_min = v2Sub(quad->pos, v2Scale(0.5f, size));
+            const Vec2 quad_max = v2Add(quad->pos, v2Scale(0.5f, size));
+            if (layout->quad_count == 1) {
+                layout->bounds_min = quad_min;
+                layout->bounds_max = quad_max;
+            } else {
+                layout->bounds_min = VEC2(MIN(layout->bounds_min.x, quad_min.x), MIN(layout->bounds_min.y, quad_min.y));
+                layout->bounds_max = VEC2(MAX(layout->bounds_max.x, quad_max.x), MAX(layout->bounds_max.y, quad_max.y));
+            }
+        }
+        pen_x += glyph->advance*pixel.x;
+    }
+}
+
+/* Marks the glyphs of a cached layout as used, false if one of them was evicted */
+static bool text_layout_touch(TextCache *cache, TextLayout *layout, u64 now) {
+    if (!layout->is_complete) {
+        return false;
+    }
+    for (u32 i = 0; i < layout->quad_count; ++i) {
+        CachedGlyph *glyph = &cache->glyphs.glyphs[layout->quads[i].glyph];
+        if (glyph->generation != layout->quads[i].generation || glyph->state != GLYPH_RESIDENT) {
+            return false;
+        }
+        glyph->last_used = now;
+    }
+    return true;
+}
+
+/* Layouts returned stay valid until the next frame */
+static TextLayout *text_layout(TextCache *cache, Renderer *r, const char *text, u64 length) {
+    const TextureHandle font = cache->glyphs.texture;
+    u64 hash = hash_fnv1a(HASH_FNV1A_SEED, text, length);
+    hash = hash_fnv1a(hash, &font, sizeof(font));
+    const u32 stored_length = MIN(length, TEXT_LAYOUT_MAX_LENGTH);
+
+    const u64 now = r->frame_info->total_frame_count + 1;
+    if (cache->frame_pool_frame != now) {
+        cache->frame_pool_frame = now;
+        cache->frame_pool_count = 0;
+    }
+
+    TextLayout *victim = NULL;
+    for (u32 i = 0; i < TEXT_LAYOUT_PROBE; ++i) {
+        TextLayout *layout = &cache->layouts[(hash + i) % TEXT_LAYOUT_CACHE_SIZE];
+        if (layout->last_used != 0 &&
+            layout->hash == hash &&
+            layout->font == font &&
+            layout->length == length &&
+            memcmp(layout->text, text, stored_length) == 0) {
+            layout->last_used = now;
+            if (text_layout_touch(cache, layout, now)) {
+                cache->hits++;
+                return layout;
+            }
+            /* Stale, redone in place. Used this frame its glyphs can't have been evicted */
+            victim = layout;
+            break;
+        }
+        if (layout->last_used != now && (!victim || layout->last_used < victim->last_used)) {
+            victim = layout;
+        }
+    }
+
+    for (u32 i = 0; !victim && i < cache->frame_pool_count; ++i) {
+        TextLayout *layout = &cache->frame_pool[i];
+        if (layout->hash == hash && layout->font == font && layout->length == length &&
+            memcmp(layout->text, text, stored_length) == 0) {
+            cache->hits++;
+            return layout;
+        }
+    }
+
+    cache->misses++;
+    if (!victim) {
+        if (cache->frame_pool_count == TEXT_LAYOUT_FRAME_POOL) {
+            return &cache->empty;
+        }
+        victim = &cache->frame_pool[cache->frame_pool_count++];
+    }
+    victim->hash = hash;
+    victim->font = font;
+    victim->length = length;
+    memcpy(victim->text, text, stored_length);
+    victim->last_used = now;
+    text_layout_run(cache, r, victim, text, stored_length, now);
+
+    return victim;
+}
+
+/* Scale from the size the atlas was baked at to the size entry is drawn at */
+static f32 text_scale(Renderer *r, RenderEntryText *entry) {
+    const f32 size = (entry->size > 0.0f) ? entry->size : (f32) r->font_size;
+    if (r->font_atlas_size == 0 || size <= 0.0f) {
+        return 1.0f;
+    }
+    return size/(f32) r->font_atlas_size;
+}
@@ -0,0 +1,329 @@
+/*
+ * Upload manager
+ *
+ * Buffer and image uploads are recorded into a batch command buffer on
+ * the transfer queue (the graphics queue if the device has no separate
+ * transfer family). A batch is submitted once per frame, or earlier if
+ * its staging buffer runs full, and signals a fence when done.
+ *
+ * Every upload returns a ticket, batches are retired in submission order
+ * so an upload is complete once completed_ticket has reached its ticket.
+ * Nothing here blocks unless asked to with upload_wait(), or all batches
+ * are in flight when a new one is needed.
+ */
+
+#define UPLOAD_BATCH_COUNT   3
+#define UPLOAD_STAGING_SIZE  (4*1024*1024)
+#define UPLOAD_MAX_DEDICATED 8
+/* Mip levels of an image upload, enough for 32k textures */
+#define UPLOAD_MAX_MIPS      16
+
+typedef struct UploadBatch {
+    VkCommandBuffer command_buffer;
+    VkFence fence;
+
+    VkBuffer staging_buffer;
+    GpuAllocation staging_memory;
+    u64 staging_top;
+
+    /* Staging for uploads larger than UPLOAD_STAGING_SIZE, freed when the batch is retired */
+    u32 dedicated_count;
+    VkBuffer dedicated_buffers[UPLOAD_MAX_DEDICATED];
+    GpuAllocation dedicated_memory[UPLOAD_MAX_DEDICATED];
+
+    u64 ticket;
+    bool is_recording;
+    bool is_submitted;
+} UploadBatch;
+
+typedef struct UploadManager {
+    VkDevice device;
+    VkQueue queue;
+    bool is_graphics_queue;
+    VkCommandPool command_pool;
+
+    UploadBatch batches[UPLOAD_BATCH_COUNT];
+    u32 current_batch;
+
+    u64 next_ticket;
+    u64 completed_ticket;
+} UploadManager;
+
+static void upload_init(UploadManager *upload, VkDevice device, VkQueue queue, u32 family, bool is_graphics_queue) {
+    upload->device = device;
+    upload->queue = queue;
+    upload->is_graphics_queue = is_graphics_queue;
+    upload->command_pool = vkc_create_command_pool(device, family);
+    upload->current_batch = 0;
+    upload->next_ticket = 1;
+    upload->completed_ticket = 0;
+
+    VkCommandBuffer *command_buffers = vkc_create_command_buffers(device, upload->command_pool, UPLOAD_BATCH_COUNT);
+
+    VkFenceCreateInfo fence_info = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+    };
+
+    for (u32 i = 0; i < UPLOAD_BATCH_COUNT; ++i) {
+        UploadBatch *batch = &upload->batches[i];
+        memset(batch, 0, sizeof(UploadBatch));
+        batch->command_buffer = command_buffers[i];
+
+        VKC_CHECK(vkCreateFence(device, &fence_info, NULL, &batch->fence), "failed to create fence");
+
+        create_buffer(device, UPLOAD_STAGING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false, &batch->staging_buffer, &batch->staging_memory);
+    }
+
+    platform.free_memory(command_buffers);
+}
+
+/* Called once a batch's fence has signaled */
+static void upload_retire(UploadManager *upload, UploadBatch *batch) {
+    for (u32 i = 0; i < batch->dedicated_count; ++i) {
+        vkDestroyBuffer(upload->device, batch->dedicated_buffers[i], NULL);
+        gpu_free(context->memory, &batch->dedicated_memory[i]);
+    }
+    batch->dedicated_count = 0;
+    batch->staging_top = 0;
+    batch->is_submitted = false;
+
+    vkResetFences(upload->device, 1, &batch->fence);
+
+    upload->completed_ticket = MAX(upload->completed_ticket, batch->ticket);
+}
+
+static void upload_poll(UploadManager *upload) {
+    for (u32 i = 0; i < UPLOAD_BATCH_COUNT; ++i) {
+        UploadBatch *batch = &upload->batches[i];
+        if (batch->is_submitted && vkGetFenceStatus(upload->device, batch->fence) == VK_SUCCESS) {
+            upload_retire(upload, batch);
+        }
+    }
+}
+
+/* Submits the batch currently being recorded, if any */
+static void upload_flush(UploadManager *upload) {
+    UploadBatch *batch = &upload->batches[upload->current_batch];
+    if (!batch->is_recording) {
+        return;
+    }
+
+    VKC_CHECK(vkEndCommandBuffer(batch->command_buffer), "failed to end recording upload command buffer");
+
+    VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &batch->command_buffer,
+    };
+    VKC_CHECK(vkQueueSubmit(upload->queue, 1, &submit_info, batch->fence), "failed to submit upload command buffer");
+
+    batch->is_recording = false;
+    batch->is_submitted = true;
+    upload->current_batch = (upload->current_batch + 1) % UPLOAD_BATCH_COUNT;
+}
+
+static inline bool upload_is_complete(UploadManager *upload, u64 ticket) {
+    if (ticket <= upload->completed_ticket) {
+        return true;
+    }
+    upload_poll(upload);
+    return ticket <= upload->completed_ticket;
+}
+
+/* Blocks until the upload with the given ticket is complete, for resources needed right away */
+static void upload_wait(UploadManager *upload, u64 ticket) {
+    if (upload_is_complete(upload, ticket)) {
+        return;
+    }
+
+    if (upload->batches[upload->current_batch].is_recording &&
+        upload->batches[upload->current_batch].ticket <= ticket) {
+        upload_flush(upload);
+    }
+
+    for (u32 i = 0; i < UPLOAD_BATCH_COUNT; ++i) {
+        UploadBatch *batch = &upload->batches[i];
+        if (batch->is_submitted && batch->ticket <= ticket) {
+            vkWaitForFences(upload->device, 1, &batch->fence, VK_TRUE, UINT64_MAX);
+            upload_retire(upload, batch);
+        }
+    }
+}
+
+/* Returns a batch ready to record an upload of the given size */
+static UploadBatch *upload_begin(UploadManager *upload, u64 size) {
+    UploadBatch *batch = &upload->batches[upload->current_batch];
+
+    if (batch->is_recording) {
+        const bool is_dedicated = size > UPLOAD_STAGING_SIZE;
+        const bool is_full = (is_dedicated)
+            ? batch->dedicated_count == UPLOAD_MAX_DEDICATED
+            : ((batch->staging_top + 15) & ~15ull) + size > UPLOAD_STAGING_SIZE;
+        if (is_full) {
+            upload_flush(upload);
+            batch = &upload->batches[upload->current_batch];
+        }
+    }
+
+    if (!batch->is_recording) {
+        /* Only blocks when every batch is in flight */
+        if (batch->is_submitted) {
+            vkWaitForFences(upload->device, 1, &batch->fence, VK_TRUE, UINT64_MAX);
+            upload_retire(upload, batch);
+        }
+
+        VkCommandBufferBeginInfo begin_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        };
+        VKC_CHECK(vkBeginCommandBuffer(batch->command_buffer, &begin_info), "failed to start recording upload command buffer");
+
+        batch->ticket = upload->next_ticket++;
+        batch->is_recording = true;
+    }
+
+    return batch;
+}
+
+/* Reserves staging memory in the batch, returns where to write the data */
+static u8 *upload_staging(UploadManager *upload, UploadBatch *batch, u64 size, VkBuffer *buffer, VkDeviceSize *offset) {
+    if (size > UPLOAD_STAGING_SIZE) {
+        u32 i = batch->dedicated_count++;
+        create_buffer(upload->device, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false, &batch->dedicated_buffers[i], &batch->dedicated_memory[i]);
+
+        *buffer = batch->dedicated_buffers[i];
+        *offset = 0;
+        return batch->dedicated_memory[i].mapped;
+    }
+
+    /* Image copies need offsets aligned to the texel size, 16 covers every format we use */
+    *buffer = batch->staging_buffer;
+    *offset = (batch->staging_top + 15) & ~15ull;
+    batch->staging_top = *offset + size;
+    return batch->staging_memory.mapped + *offset;
+}
+
+static u64 upload_buffer(UploadManager *upload, VkBuffer dst, const void *data, u64 size) {
+    UploadBatch *batch = upload_begin(upload, size);
+
+    VkBuffer staging;
+    VkDeviceSize offset;
+    memcpy(upload_staging(upload, batch, size, &staging, &offset), data, size);
+
+    VkBufferCopy copy_region = {
+        .srcOffset = offset,
+        .dstOffset = 0,
+        .size = size,
+    };
+    vkCmdCopyBuffer(batch->command_buffer, staging, dst, 1, &copy_region);
+
+    return batch->ticket;
+}
+
+/* Uploads every mip level of image and leaves dst in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL */
+static u64 upload_image(UploadManager *upload, VkImage dst, Image *image) {
+    const u32 mip_count = MIN(image_mip_count(image), UPLOAD_MAX_MIPS);
+
+    /* Levels are staged 16 byte aligned like separate copies, see upload_staging() */
+    u64 size = 0;
+    for (u32 level = 0; level < mip_count; ++level) {
+        size = ((size + 15) & ~15ull) + image_mip_size(image, level);
+    }
+    UploadBatch *batch = upload_begin(upload, size);
+
+    VkBuffer staging;
+    VkDeviceSize offset;
+    u8 *mapped = upload_staging(upload, batch, size, &staging, &offset);
+
+    VkBufferImageCopy regions[UPLOAD_MAX_MIPS];
+    const u8 *src = image->pixels;
+    u64 level_offset = 0;
+    for (u32 level = 0; level < mip_count; ++level) {
+        const u64 level_size = image_mip_size(image, level);
+        level_offset = (level_offset + 15) & ~15ull;
+        memcpy(mapped + level_offset, src, level_size);
+
+        regions[level] = (VkBufferImageCopy) {
+            .bufferOffset = offset + level_offset,
+            .bufferRowLength = 0,
+            .bufferImageHeight = 0,
+            .imageSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = level,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+            .imageOffset = {0, 0, 0},
+            .imageExtent = {
+                .width = image_mip_extent(image->width, level),
+                .height = image_mip_extent(image->height, level),
+                .depth = 1,
+            },
+        };
+
+        src += level_size;
+        level_offset += level_size;
+    }
+
+    VkImageMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = dst,
+        .subresourceRange = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .baseMipLevel = 0,
+            .levelCount = mip_count,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+        },
+        .srcAccessMask = 0,
+        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    };
+    vkCmdPipelineBarrier(batch->command_buffer,
+                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0,
+                         0, NULL,
+                         0, NULL,
+                         1, &barrier);
+
+    vkCmdCopyBufferToImage(batch->command_buffer, staging, dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mip_count, regions);
+
+    /*
+     * Transfer queues can't wait on the fragment shader stage, there the
+     * graphics queue only samples the image after the batch's fence.
+     */
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = (upload->is_graphics_queue) ? VK_ACCESS_SHADER_READ_BIT : 0;
+    vkCmdPipelineBarrier(batch->command_buffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         (upload->is_graphics_queue) ? VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT : VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                         0,
+                         0, NULL,
+                         0, NULL,
+                         1, &barrier);
+
+    return batch->ticket;
+}
+
+static void upload_shutdown(UploadManager *upload) {
+    upload_flush(upload);
+
+    for (u32 i = 0; i < UPLOAD_BATCH_COUNT; ++i) {
+        UploadBatch *batch = &upload->batches[i];
+        if (batch->is_submitted) {
+            vkWaitForFences(upload->device, 1, &batch->fence, VK_TRUE, UINT64_MAX);
+            upload_retire(upload, batch);
+        }
+
+        vkDestroyBuffer(upload->device, batch->staging_buffer, NULL);
+        gpu_free(context->memory, &batch->staging_memory);
+        vkDestroyFence(upload->device, batch->fence, NULL);
+    }
+
+    vkDestroyCommandPool(upload->device, upload->command_pool, NULL);
+}
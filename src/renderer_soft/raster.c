@@ -0,0 +1,382 @@
+/*
+ * Rasterizer
+ *
+ * Draws render entries into one tile of the framebuffer. The
+ * framebuffer is BGRA8 and holds the same values the Vulkan renderer
+ * writes to a B8G8R8A8_UNORM image (headless, or a UNORM swapchain),
+ * so its output can be compared with a readback:
+ *
+ *   - sRGB textures are decoded to linear when sampled, linear values
+ *     are written as is,
+ *   - pixels are covered if their center is inside a quad, the left
+ *     and top edges are inclusive,
+ *   - quads flipped on one axis face away and are dropped, like back
+ *     face culling does,
+ *   - sampling is nearest from the nearest mip level,
+ *   - blending is src*alpha + dst*(1 - alpha) on every channel,
+ *     rounded to 8 bits.
+ *
+ * Entries are shaded a row at a time into a span of source pixels,
+ * which is then blended into the tile four pixels at a time. Solid
+ * quads are opaque and filled without blending.
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define SOFT_TILE_SIZE 64
+
+/* Mean of |cos| + |sin|, fwidth() of a distance field with a unit gradient in any direction */
+#define SOFT_SDF_FWIDTH 1.27f
+
+typedef struct SoftTile {
+    u32 *pixels;
+    u32 stride;
+    /* Pixels covered by the tile, clipped to the framebuffer */
+    i32 x0;
+    i32 y0;
+    i32 x1;
+    i32 y1;
+} SoftTile;
+
+/* Pixel space extent of a quad and where its texture coordinates start */
+typedef struct SoftQuad {
+    i32 x0;
+    i32 y0;
+    i32 x1;
+    i32 y1;
+    /* Pixel coordinate of texture coordinate 0 and the texture coordinate step per pixel */
+    f32 u_origin;
+    f32 v_origin;
+    f32 du;
+    f32 dv;
+} SoftQuad;
+
+/* One mip level of a texture */
+typedef struct SoftTexture {
+    const u8 *pixels;
+    u32 width;
+    u32 height;
+    u32 channels;
+    bool is_linear;
+} SoftTexture;
+
+static u8 srgb_to_linear[256];
+static f32 srgb_to_linear_f[256];
+
+static void raster_init(void) {
+    for (u32 i = 0; i < 256; ++i) {
+        const f32 c = i/255.0f;
+        const f32 linear = (c <= 0.04045f) ? c/12.92f : powf((c + 0.055f)/1.055f, 2.4f);
+        srgb_to_linear_f[i] = linear;
+        srgb_to_linear[i] = (u8) (linear*255.0f + 0.5f);
+    }
+}
+
+static inline u32 pack_bgra(u32 r, u32 g, u32 b, u32 a) {
+    return b | (g << 8) | (r << 16) | (a << 24);
+}
+
+static inline u32 unorm8(f32 v) {
+    return (u32) (CLAMP(v, 0.0f, 1.0f)*255.0f + 0.5f);
+}
+
+/* Exact round(x/255) for x <= 255*255 */
+static inline u32 div255(u32 x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static void fill_span(u32 *dst, u32 color, u32 count) {
+    u32 i = 0;
+#if defined(__SSE2__)
+    const __m128i c = _mm_set1_epi32((i32) color);
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_si128((__m128i *) (dst + i), c);
+    }
+#endif
+    for (; i < count; ++i) {
+        dst[i] = color;
+    }
+}
+
+static void blend_span(u32 *dst, const u32 *src, u32 count) {
+    u32 i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i half = _mm_set1_epi16(128);
+    for (; i + 4 <= count; i += 4) {
+        const __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+        const __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+
+        /* Two pixels per register, 16 bits per channel, alpha copied to every channel */
+        __m128i result[2];
+        for (u32 half_index = 0; half_index < 2; ++half_index) {
+            const __m128i s16 = (half_index == 0) ? _mm_unpacklo_epi8(s, zero) : _mm_unpackhi_epi8(s, zero);
+            const __m128i d16 = (half_index == 0) ? _mm_unpacklo_epi8(d, zero) : _mm_unpackhi_epi8(d, zero);
+            __m128i a = _mm_shufflelo_epi16(s16, _MM_SHUFFLE(3, 3, 3, 3));
+            a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+
+            __m128i x = _mm_add_epi16(_mm_mullo_epi16(s16, a), _mm_mullo_epi16(d16, _mm_sub_epi16(max, a)));
+            x = _mm_add_epi16(x, half);
+            result[half_index] = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+        }
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(result[0], result[1]));
+    }
+#endif
+    for (; i < count; ++i) {
+        const u32 s = src[i];
+        const u32 d = dst[i];
+        const u32 a = s >> 24;
+        u32 out = 0;
+        for (u32 shift = 0; shift < 32; shift += 8) {
+            out |= div255(((s >> shift) & 0xff)*a + ((d >> shift) & 0xff)*(255 - a)) << shift;
+        }
+        dst[i] = out;
+    }
+}
+
+/*
+ * Pixel extent of a quad in a width x height framebuffer, false if it
+ * covers no pixel centers or faces away.
+ */
+static bool raster_quad(Vec2 pos, Vec2 scale, u32 width, u32 height, SoftQuad *quad) {
+    if (scale.x == 0.0f || scale.y == 0.0f || (scale.x < 0.0f) != (scale.y < 0.0f)) {
+        return false;
+    }
+
+    /* Texture coordinate 0 is at the vertex at -0.5, which is the right or bottom edge when flipped */
+    const f32 a_x = (pos.x - 0.5f*scale.x + 1.0f)*0.5f*width;
+    const f32 b_x = (pos.x + 0.5f*scale.x + 1.0f)*0.5f*width;
+    const f32 a_y = (pos.y - 0.5f*scale.y + 1.0f)*0.5f*height;
+    const f32 b_y = (pos.y + 0.5f*scale.y + 1.0f)*0.5f*height;
+
+    quad->x0 = (i32) ceilf(MIN(a_x, b_x) - 0.5f);
+    quad->x1 = (i32) ceilf(MAX(a_x, b_x) - 0.5f);
+    quad->y0 = (i32) ceilf(MIN(a_y, b_y) - 0.5f);
+    quad->y1 = (i32) ceilf(MAX(a_y, b_y) - 0.5f);
+    quad->u_origin = a_x;
+    quad->v_origin = a_y;
+    quad->du = 1.0f/(b_x - a_x);
+    quad->dv = 1.0f/(b_y - a_y);
+    return quad->x0 < quad->x1 && quad->y0 < quad->y1;
+}
+
+/* Clips a quad to a tile, false if nothing is left */
+static inline bool raster_clip(SoftQuad *quad, SoftTile *tile) {
+    quad->x0 = MAX(quad->x0, tile->x0);
+    quad->y0 = MAX(quad->y0, tile->y0);
+    quad->x1 = MIN(quad->x1, tile->x1);
+    quad->y1 = MIN(quad->y1, tile->y1);
+    return quad->x0 < quad->x1 && quad->y0 < quad->y1;
+}
+
+/* The white 1x1 default texture, drawn for missing or released handles like in the Vulkan renderer */
+static const u8 raster_white[4] = {0xff, 0xff, 0xff, 0xff};
+
+/* The mip level closest to texels_per_pixel of texture 0 */
+static SoftTexture raster_texture(Renderer *r, TextureHandle handle, f32 texels_per_pixel) {
+    TextureSlot *slot = (r->textures) ? textureLookup(r->textures, handle) : NULL;
+    if (!slot || !slot->image.pixels || (slot->image.channels != 1 && slot->image.channels != 4)) {
+        return (SoftTexture) {raster_white, 1, 1, 4, true};
+    }
+
+    Image *image = &slot->image;
+    u32 level = 0;
+    if (texels_per_pixel > 1.0f) {
+        level = (u32) MIN(floorf(log2f(texels_per_pixel) + 0.5f), (f32) (image_mip_count(image) - 1));
+    }
+
+    const u8 *pixels = image->pixels;
+    for (u32 i = 0; i < level; ++i) {
+        pixels += image_mip_size(image, i);
+    }
+    return (SoftTexture) {
+        .pixels = pixels,
+        .width = image_mip_extent(image->width, level),
+        .height = image_mip_extent(image->height, level),
+        .channels = image->channels,
+        .is_linear = image->is_linear,
+    };
+}
+
+/* Texel under texture coordinate (u, v), repeating outside [0, 1) */
+static inline const u8 *raster_texel(const SoftTexture *texture, f32 u, f32 v) {
+    i32 x = (i32) floorf(u*texture->width) % (i32) texture->width;
+    i32 y = (i32) floorf(v*texture->height) % (i32) texture->height;
+    x += (x < 0) ? texture->width : 0;
+    y += (y < 0) ? texture->height : 0;
+    return texture->pixels + ((u64) y*texture->width + x)*texture->channels;
+}
+
+/* Texel as the shader would see it, RGBA with sRGB decoded */
+static inline void raster_sample(const SoftTexture *texture, f32 u, f32 v, u32 rgba[4]) {
+    const u8 *texel = raster_texel(texture, u, v);
+    const u8 *decode = (texture->is_linear) ? NULL : srgb_to_linear;
+    if (texture->channels == 1) {
+        rgba[0] = (decode) ? decode[texel[0]] : texel[0];
+        rgba[1] = 0;
+        rgba[2] = 0;
+        rgba[3] = 255;
+    } else {
+        for (u32 c = 0; c < 3; ++c) {
+            rgba[c] = (decode) ? decode[texel[c]] : texel[c];
+        }
+        rgba[3] = texel[3];
+    }
+}
+
+static void raster_solid(SoftTile *tile, SoftQuad *quad, ColorRGB col) {
+    const u32 color = pack_bgra(unorm8(col.r), unorm8(col.g), unorm8(col.b), 255);
+    for (i32 y = quad->y0; y < quad->y1; ++y) {
+        fill_span(tile->pixels + (u64) y*tile->stride + quad->x0, color, quad->x1 - quad->x0);
+    }
+}
+
+/* texture.frag, the texel as is */
+static void raster_textured(SoftTile *tile, SoftQuad *quad, const SoftTexture *texture) {
+    u32 span[SOFT_TILE_SIZE];
+    for (i32 y = quad->y0; y < quad->y1; ++y) {
+        const f32 v = (y + 0.5f - quad->v_origin)*quad->dv;
+        for (i32 x = quad->x0; x < quad->x1; ++x) {
+            u32 rgba[4];
+            raster_sample(texture, (x + 0.5f - quad->u_origin)*quad->du, v, rgba);
+            span[x - quad->x0] = pack_bgra(rgba[0], rgba[1], rgba[2], rgba[3]);
+        }
+        blend_span(tile->pixels + (u64) y*tile->stride + quad->x0, span, quad->x1 - quad->x0);
+    }
+}
+
+/*
+ * atlas.frag, texture coordinates are mapped into the rect at offset of
+ * size first. RGBA sprites are tinted, anything else is coverage or a
+ * distance field in the red channel.
+ */
+static void raster_atlas(SoftTile *tile, SoftQuad *quad, const SoftTexture *texture, Vec2 offset, Vec2 size, ColorRGB col, u32 flags, f32 sdf_spread) {
+    const f32 col_f[3] = {col.r, col.g, col.b};
+
+    /* The distance changes by 1/(2*spread) per texel of the distance field */
+    const f32 texels_per_pixel = MAX(fabsf(quad->du*size.x)*texture->width, fabsf(quad->dv*size.y)*texture->height);
+    const f32 w = MAX(0.5f*SOFT_SDF_FWIDTH*texels_per_pixel/(2.0f*MAX(sdf_spread, 1.0f)), 1e-4f);
+
+    u32 span[SOFT_TILE_SIZE];
+    for (i32 y = quad->y0; y < quad->y1; ++y) {
+        const f32 v = offset.y + size.y*(y + 0.5f - quad->v_origin)*quad->dv;
+        for (i32 x = quad->x0; x < quad->x1; ++x) {
+            const f32 u = offset.x + size.x*(x + 0.5f - quad->u_origin)*quad->du;
+            u32 rgba[4];
+            raster_sample(texture, u, v, rgba);
+
+            u32 out[4];
+            if (flags & ATLAS_FLAG_RGBA) {
+                for (u32 c = 0; c < 3; ++c) {
+                    out[c] = unorm8(rgba[c]/255.0f*col_f[c]);
+                }
+                out[3] = rgba[3];
+            } else {
+                const u8 raw = raster_texel(texture, u, v)[0];
+                f32 s = (texture->is_linear) ? raw/255.0f : srgb_to_linear_f[raw];
+                if (flags & ATLAS_FLAG_SDF) {
+                    const f32 t = CLAMP((s - (0.5f - w))/(2.0f*w), 0.0f, 1.0f);
+                    s = t*t*(3.0f - 2.0f*t);
+                }
+                for (u32 c = 0; c < 3; ++c) {
+                    out[c] = unorm8(s*col_f[c]);
+                }
+                out[3] = unorm8(s);
+            }
+            span[x - quad->x0] = pack_bgra(out[0], out[1], out[2], out[3]);
+        }
+        blend_span(tile->pixels + (u64) y*tile->stride + quad->x0, span, quad->x1 - quad->x0);
+    }
+}
+
+/*
+ * Draws the part of an entry inside tile, moved by offset. layout is
+ * the entry's for text and NULL otherwise.
+ */
+static void raster_entry(Renderer *r, TextCache *text, SoftTile *tile, u32 width, u32 height, RenderEntryHeader *header, TextLayout *layout, Vec2 offset) {
+    SoftQuad quad;
+    switch (header->type) {
+    case ENTRY_TYPE_RenderEntryQuad: {
+        RenderEntryQuad *entry = (RenderEntryQuad *) header;
+        if (raster_quad(v2Add(offset, entry->pos), entry->scale, width, height, &quad) && raster_clip(&quad, tile)) {
+            raster_solid(tile, &quad, entry->col);
+        }
+        break;
+    }
+    case ENTRY_TYPE_RenderEntryTexturedQuad: {
+        RenderEntryTexturedQuad *entry = (RenderEntryTexturedQuad *) header;
+        if (raster_quad(v2Add(offset, entry->pos), entry->scale, width, height, &quad)) {
+            SoftTexture texture = raster_texture(r, entry->texture, 0.0f);
+            texture = raster_texture(r, entry->texture, MAX(fabsf(quad.du)*texture.width, fabsf(quad.dv)*texture.height));
+            if (raster_clip(&quad, tile)) {
+                raster_textured(tile, &quad, &texture);
+            }
+        }
+        break;
+    }
+    case ENTRY_TYPE_RenderEntryAtlasQuad: {
+        RenderEntryAtlasQuad *entry = (RenderEntryAtlasQuad *) header;
+        if (raster_quad(v2Add(offset, entry->pos), entry->scale, width, height, &quad)) {
+            SoftTexture texture = raster_texture(r, entry->texture, 0.0f);
+            texture = raster_texture(r, entry->texture, MAX(fabsf(quad.du*entry->size.x)*texture.width, fabsf(quad.dv*entry->size.y)*texture.height));
+            if (raster_clip(&quad, tile)) {
+                raster_atlas(tile, &quad, &texture, entry->offset, entry->size, entry->col, 0, 0.0f);
+            }
+        }
+        break;
+    }
+    case ENTRY_TYPE_RenderEntrySprite: {
+        RenderEntrySprite *entry = (RenderEntrySprite *) header;
+        if (raster_quad(v2Add(offset, entry->pos), entry->scale, width, height, &quad)) {
+            SoftTexture texture = raster_texture(r, entry->texture, 0.0f);
+            texture = raster_texture(r, entry->texture, MAX(fabsf(quad.du*entry->size.x)*texture.width, fabsf(quad.dv*entry->size.y)*texture.height));
+            if (raster_clip(&quad, tile)) {
+                raster_atlas(tile, &quad, &texture, entry->offset, entry->size, entry->tint, ATLAS_FLAG_RGBA, 0.0f);
+            }
+        }
+        break;
+    }
+    case ENTRY_TYPE_RenderEntryText: {
+        RenderEntryText *entry = (RenderEntryText *) header;
+        const f32 scale = text_scale(r, entry);
+        const u32 flags = (r->font_sdf_spread > 0) ? ATLAS_FLAG_SDF : 0;
+        /* Glyphs used this frame stay where they are in the atlas until it's drawn */
+        const SoftTexture texture = {text->glyphs.atlas.pixels, GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE, 1, true};
+        for (u32 i = 0; i < layout->quad_count; ++i) {
+            GlyphQuad *glyph_quad = &layout->quads[i];
+            if (raster_quad(v2Add(v2Add(offset, entry->pos), v2Scale(scale, glyph_quad->pos)), v2Scale(scale, glyph_quad->scale), width, height, &quad) &&
+                raster_clip(&quad, tile)) {
+                raster_atlas(tile, &quad, &texture, glyph_quad->uv_offset, glyph_quad->uv_size, entry->col, flags, (f32) r->font_sdf_spread);
+            }
+        }
+        break;
+    }
+    case ENTRY_TYPE_RenderEntryLayer: {
+        /* Drawn entry by entry in submission order, layers only hold quads */
+        RenderEntryLayer *entry = (RenderEntryLayer *) header;
+        LayerSlot *slot = layerLookup(r->layers, entry->layer);
+        if (!slot) {
+            break;
+        }
+        RenderCommands *cmds = &slot->commands;
+        u8 *end = cmds->memory_base + cmds->memory_top;
+        for (u8 *p = cmds->memory_base; p < end;) {
+            RenderEntryHeader *layer_header = (RenderEntryHeader *) p;
+            const u32 size = render_entry_size_checked(layer_header, end);
+            if (size == 0) {
+                platform.log(LOG_ERROR, "Soft: bad entry of type %u in layer %u, dropping the rest of it", layer_header->type, entry->layer);
+                break;
+            }
+            if (layer_header->type != ENTRY_TYPE_RenderEntryText && layer_header->type != ENTRY_TYPE_RenderEntryLayer) {
+                raster_entry(r, text, tile, width, height, layer_header, NULL, v2Add(offset, entry->offset));
+            }
+            p += size;
+        }
+        break;
+    }
+    }
+}
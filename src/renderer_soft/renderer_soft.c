@@ -0,0 +1,456 @@
+/* X11 has a Time of its own, renamed so it doesn't clash with ours */
+#define Time XTime
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#undef Time
+
+#include <shared/api.h>
+PlatformFunctionTable platform;
+
+#include <GLFW/glfw3.h>
+#define GLFW_EXPOSE_NATIVE_X11
+#include <GLFW/glfw3native.h>
+
+#include <shared/png.h>
+#include <shared/atlas_flags.h>
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+/*
+ * Software renderer
+ *
+ * Draws the same RenderCommands as the Vulkan renderer on the CPU, for
+ * machines without Vulkan and as a reference to compare against.
+ *
+ * Entries are gathered and culled with the Vulkan renderer's draw list
+ * (../renderer/cull.c), then binned into 64x64 tiles back to front.
+ * Text is laid out with its text cache (../renderer/text.c). Tiles are
+ * drawn by the platform's worker pool, every thread takes the next tile
+ * until none are left, see raster.c. Every tile is only touched by one
+ * thread, so no locking is needed while drawing.
+ *
+ * The result goes to the window with XPutImage, or to readback files
+ * when headless. There is no depth buffer, depth only orders entries.
+ */
+
+#include "../renderer/text.c"
+#include "../renderer/capture.c"
+#include "../renderer/cull.c"
+#include "raster.c"
+
+/* An entry binned to tiles, with the pixels it may touch */
+typedef struct SoftItem {
+    RenderEntryHeader *header;
+    /* Of text entries, NULL otherwise */
+    TextLayout *layout;
+    i32 x0;
+    i32 y0;
+    i32 x1;
+    i32 y1;
+} SoftItem;
+
+struct RenderContext {
+    bool headless;
+
+    /* BGRA8, width*height pixels */
+    u32 *pixels;
+    u32 width;
+    u32 height;
+
+    TextCache *text;
+    DrawList *draws;
+
+    u32 item_count;
+    SoftItem items[DRAW_LIST_MAX_ITEMS];
+
+    /* Items of tile i are tile_items[tile_offsets[i], tile_offsets[i + 1]), back to front */
+    u32 tiles_x;
+    u32 tiles_y;
+    u32 *tile_offsets;
+    u32 *tile_items;
+    u32 tile_items_capacity;
+    atomic_uint next_tile;
+
+    Renderer *renderer;
+
+    /* Window presentation, display is NULL if the window isn't an X11 one */
+    Display *display;
+    Window window;
+    GC gc;
+    XImage *image;
+
+    /* Headless readback */
+    u8 *readback_pixels;
+    u8 *readback_encoded;
+};
+
+static RenderContext *context;
+
+static inline void setup_globals(Renderer *r) {
+    platform = r->platform;
+    context = r->context;
+}
+
+static inline u64 time_to_ns(Time t) {
+    return t.seconds*1000000000ull + t.nanoseconds;
+}
+
+static void destroy_image(void) {
+    if (context->image) {
+        /* The pixels are ours, XDestroyImage would free them */
+        context->image->data = NULL;
+        XDestroyImage(context->image);
+        context->image = NULL;
+    }
+}
+
+/* Resizes the framebuffer and everything sized by it, false if there is nothing to draw to */
+static bool resize_framebuffer(Renderer *r) {
+    u32 width = r->headless.width;
+    u32 height = r->headless.height;
+    if (!context->headless) {
+        i32 w = 0;
+        i32 h = 0;
+        glfwGetFramebufferSize(r->window, &w, &h);
+        width = (u32) MAX(w, 0);
+        height = (u32) MAX(h, 0);
+    }
+    if (width == 0 || height == 0) {
+        return false;
+    }
+    if (width == context->width && height == context->height) {
+        return true;
+    }
+
+    destroy_image();
+    if (context->pixels) {
+        platform.free_memory(context->pixels);
+        platform.free_memory(context->tile_offsets);
+    }
+    if (context->readback_pixels) {
+        platform.free_memory(context->readback_pixels);
+        platform.free_memory(context->readback_encoded);
+        context->readback_pixels = NULL;
+    }
+
+    context->width = width;
+    context->height = height;
+    context->pixels = platform.allocate_memory((u64) width*height*4);
+    context->tiles_x = (width + SOFT_TILE_SIZE - 1)/SOFT_TILE_SIZE;
+    context->tiles_y = (height + SOFT_TILE_SIZE - 1)/SOFT_TILE_SIZE;
+    context->tile_offsets = platform.allocate_memory(sizeof(u32)*(context->tiles_x*context->tiles_y + 1));
+    text_resize(context->text, width, height);
+
+    if (context->headless && r->headless.readback_format != READBACK_NONE) {
+        context->readback_pixels = platform.allocate_memory((u64) width*height*4);
+        context->readback_encoded = platform.allocate_memory(png_encoded_size(width, height, 4));
+    }
+
+    if (context->display) {
+        Visual *visual = DefaultVisual(context->display, DefaultScreen(context->display));
+        context->image = XCreateImage(context->display, visual, DefaultDepth(context->display, DefaultScreen(context->display)),
+                                      ZPixmap, 0, (char *) context->pixels, width, height, 32, width*4);
+        if (!context->image) {
+            platform.log(LOG_ERROR, "Soft: failed to create a %ux%u XImage", width, height);
+        }
+    }
+
+    platform.log(LOG_INFO, "Soft: %ux%u framebuffer, %ux%u tiles", width, height, context->tiles_x, context->tiles_y);
+    return true;
+}
+
+/* Textures and layers are read straight from their registries, nothing to upload */
+static void update_textures(Renderer *r) {
+    if (r->textures) {
+        for (u32 i = 1; i < MAX_TEXTURES; ++i) {
+            TextureSlot *slot = &r->textures->slots[i];
+            if (slot->state == TEXTURE_PENDING) {
+                slot->state = TEXTURE_RESIDENT;
+            } else if (slot->state == TEXTURE_RELEASED) {
+                slot->state = TEXTURE_FREE;
+            }
+        }
+    }
+    if (r->layers) {
+        for (u32 i = 1; i < MAX_LAYERS; ++i) {
+            LayerSlot *slot = &r->layers->slots[i];
+            if (slot->state == TEXTURE_PENDING) {
+                slot->state = TEXTURE_RESIDENT;
+            } else if (slot->state == TEXTURE_RELEASED) {
+                slot->state = TEXTURE_FREE;
+            }
+        }
+    }
+}
+
+/* Pixels an entry can touch, from its draw list bounds, false if none */
+static bool item_bounds(DrawList *draws, u32 item, SoftItem *out) {
+    const f32 half_width = 0.5f*context->width;
+    const f32 half_height = 0.5f*context->height;
+    const f32 x0 = (draws->center_x[item] - draws->half_width[item] + 1.0f)*half_width;
+    const f32 x1 = (draws->center_x[item] + draws->half_width[item] + 1.0f)*half_width;
+    const f32 y0 = (draws->center_y[item] - draws->half_height[item] + 1.0f)*half_height;
+    const f32 y1 = (draws->center_y[item] + draws->half_height[item] + 1.0f)*half_height;
+
+    out->x0 = (i32) MAX(floorf(x0), 0.0f);
+    out->y0 = (i32) MAX(floorf(y0), 0.0f);
+    out->x1 = (i32) MIN(ceilf(x1), (f32) context->width);
+    out->y1 = (i32) MIN(ceilf(y1), (f32) context->height);
+    return out->x0 < out->x1 && out->y0 < out->y1;
+}
+
+/* Gathers the visible entries back to front and bins them into tiles */
+static void bin_entries(Renderer *r, RenderCommands *cmds) {
+    DrawList *draws = context->draws;
+    const u32 tile_count = context->tiles_x*context->tiles_y;
+    u32 *offsets = context->tile_offsets;
+    memset(offsets, 0, sizeof(u32)*(tile_count + 1));
+
+    context->item_count = 0;
+    for (u32 i = draws->visible_count; i-- > 0;) {
+        const u32 item = draws->order[i];
+        SoftItem *soft_item = &context->items[context->item_count];
+        if (!item_bounds(draws, item, soft_item)) {
+            continue;
+        }
+        soft_item->header = (RenderEntryHeader *) (cmds->memory_base + draws->offsets[item]);
+        soft_item->layout = NULL;
+        if (soft_item->header->type == ENTRY_TYPE_RenderEntryText) {
+            RenderEntryText *entry = (RenderEntryText *) soft_item->header;
+            soft_item->layout = text_layout(context->text, r, entry->text, entry->length);
+        }
+        context->item_count++;
+
+        for (i32 ty = soft_item->y0/SOFT_TILE_SIZE; ty <= (soft_item->y1 - 1)/SOFT_TILE_SIZE; ++ty) {
+            for (i32 tx = soft_item->x0/SOFT_TILE_SIZE; tx <= (soft_item->x1 - 1)/SOFT_TILE_SIZE; ++tx) {
+                offsets[ty*context->tiles_x + tx + 1]++;
+            }
+        }
+    }
+
+    for (u32 i = 0; i < tile_count; ++i) {
+        offsets[i + 1] += offsets[i];
+    }
+    const u32 total = offsets[tile_count];
+    if (total > context->tile_items_capacity) {
+        if (context->tile_items) {
+            platform.free_memory(context->tile_items);
+        }
+        context->tile_items_capacity = MAX(total, 2*context->tile_items_capacity);
+        context->tile_items = platform.allocate_memory(sizeof(u32)*context->tile_items_capacity);
+    }
+
+    /* Filled from the end, offsets[i + 1] ends up at the start of tile i and is shifted back after */
+    for (u32 i = context->item_count; i-- > 0;) {
+        SoftItem *soft_item = &context->items[i];
+        for (i32 ty = soft_item->y0/SOFT_TILE_SIZE; ty <= (soft_item->y1 - 1)/SOFT_TILE_SIZE; ++ty) {
+            for (i32 tx = soft_item->x0/SOFT_TILE_SIZE; tx <= (soft_item->x1 - 1)/SOFT_TILE_SIZE; ++tx) {
+                context->tile_items[--offsets[ty*context->tiles_x + tx + 1]] = i;
+            }
+        }
+    }
+    for (u32 i = 0; i < tile_count; ++i) {
+        offsets[i] = offsets[i + 1];
+    }
+    offsets[tile_count] = total;
+}
+
+static void draw_tile(RenderContext *ctx, u32 tile_index) {
+    const u32 tx = tile_index % ctx->tiles_x;
+    const u32 ty = tile_index / ctx->tiles_x;
+    SoftTile tile = {
+        .pixels = ctx->pixels,
+        .stride = ctx->width,
+        .x0 = tx*SOFT_TILE_SIZE,
+        .y0 = ty*SOFT_TILE_SIZE,
+        .x1 = MIN((tx + 1)*SOFT_TILE_SIZE, ctx->width),
+        .y1 = MIN((ty + 1)*SOFT_TILE_SIZE, ctx->height),
+    };
+
+    /* Cleared to white like the Vulkan render pass */
+    for (i32 y = tile.y0; y < tile.y1; ++y) {
+        fill_span(tile.pixels + (u64) y*tile.stride + tile.x0, 0xffffffff, tile.x1 - tile.x0);
+    }
+
+    for (u32 i = ctx->tile_offsets[tile_index]; i < ctx->tile_offsets[tile_index + 1]; ++i) {
+        SoftItem *item = &ctx->items[ctx->tile_items[i]];
+        raster_entry(ctx->renderer, ctx->text, &tile, ctx->width, ctx->height, item->header, item->layout, VEC2(0.0f, 0.0f));
+    }
+}
+
+static void draw_tiles(void *arg) {
+    RenderContext *ctx = arg;
+    const u32 tile_count = ctx->tiles_x*ctx->tiles_y;
+    for (u32 tile = atomic_fetch_add(&ctx->next_tile, 1); tile < tile_count; tile = atomic_fetch_add(&ctx->next_tile, 1)) {
+        draw_tile(ctx, tile);
+    }
+}
+
+/*
+ * The worker threads belong to the platform layer and only run code of
+ * this library until run_workers() returns, so it can be reloaded
+ * between frames. Without a pool the main thread draws every tile.
+ */
+static void draw_frame(Renderer *r) {
+    context->renderer = r;
+    atomic_store(&context->next_tile, 0);
+
+    if (platform.run_workers) {
+        platform.run_workers(draw_tiles, context);
+    } else {
+        draw_tiles(context);
+    }
+}
+
+static void write_readback(Renderer *r) {
+    if (!context->readback_pixels) {
+        return;
+    }
+
+    const bool png = (r->headless.readback_format == READBACK_PNG);
+    char path[256];
+    snprintf(path, sizeof(path), "%s%llu.%s", r->headless.readback_prefix, (unsigned long long) r->frame_info->total_frame_count, (png) ? "png" : "bgra");
+
+    File file = platform.file_open(path, "w");
+    if (!file.fd) {
+        platform.log(LOG_ERROR, "Readback: failed to open %s", path);
+        return;
+    }
+
+    const u8 *bgra = (const u8 *) context->pixels;
+    const u64 pixel_count = (u64) context->width*context->height;
+    if (png) {
+        u8 *rgba = context->readback_pixels;
+        for (u64 i = 0; i < pixel_count; ++i) {
+            rgba[4*i + 0] = bgra[4*i + 2];
+            rgba[4*i + 1] = bgra[4*i + 1];
+            rgba[4*i + 2] = bgra[4*i + 0];
+            rgba[4*i + 3] = bgra[4*i + 3];
+        }
+        u64 size = png_encode(context->readback_encoded, rgba, context->width, context->height, 4);
+        platform.file_write(file, context->readback_encoded, size, 1);
+    } else {
+        platform.file_write(file, (void *) bgra, pixel_count*4, 1);
+    }
+
+    platform.file_close(file);
+}
+
+static void present(void) {
+    if (!context->image) {
+        return;
+    }
+    XPutImage(context->display, context->window, context->gc, context->image, 0, 0, 0, 0, context->width, context->height);
+    XFlush(context->display);
+}
+
+/* Interface to loader */
+
+void startup(Renderer *r) {
+    r->context = r->platform.allocate_memory(sizeof(RenderContext));
+    memset(r->context, 0, sizeof(RenderContext));
+    setup_globals(r);
+
+    raster_init();
+
+    context->headless = r->headless.enabled;
+    context->text = platform.allocate_memory(sizeof(TextCache));
+    text_init(context->text, r);
+    context->draws = platform.allocate_memory(sizeof(DrawList));
+
+    if (!context->headless) {
+        context->display = glfwGetX11Display();
+        context->window = (context->display) ? glfwGetX11Window(r->window) : None;
+        if (!context->display || context->window == None) {
+            platform.log(LOG_WARNING, "Soft: not an X11 window, frames are drawn but not presented");
+            context->display = NULL;
+        } else {
+            context->gc = XCreateGC(context->display, context->window, 0, NULL);
+        }
+    }
+
+    if (r->settings && r->settings->depth_buffer) {
+        platform.log(LOG_INFO, "Soft: no depth buffer, entries are drawn back to front");
+    }
+    platform.log(LOG_INFO, "Soft: %u threads", (platform.worker_count) ? platform.worker_count() + 1 : 1);
+}
+
+void shutdown(Renderer *r) {
+    setup_globals(r);
+
+    capture_end(&r->capture);
+
+    text_shutdown(context->text, r);
+    platform.free_memory(context->text);
+    platform.free_memory(context->draws);
+
+    destroy_image();
+    if (context->display) {
+        XFreeGC(context->display, context->gc);
+    }
+    if (context->pixels) {
+        platform.free_memory(context->pixels);
+        platform.free_memory(context->tile_offsets);
+    }
+    if (context->tile_items) {
+        platform.free_memory(context->tile_items);
+    }
+    if (context->readback_pixels) {
+        platform.free_memory(context->readback_pixels);
+        platform.free_memory(context->readback_encoded);
+    }
+
+    platform.free_memory(context);
+    r->context = NULL;
+}
+
+RenderCommands *begin_frame(Renderer *r) {
+    setup_globals(r);
+    r->cmds.memory_base = &r->memory[0];
+    r->cmds.memory_top  = 0;
+    r->cmds.memory_size = RENDERER_MEMORY_SIZE;
+    r->cmds.text_size   = 0.0f;
+    r->cmds.cull_min    = VEC2(-1.0f, -1.0f);
+    r->cmds.cull_max    = VEC2( 1.0f,  1.0f);
+    r->cmds.depth       = 0;
+    return &r->cmds;
+}
+
+void end_frame(Renderer *r, RenderCommands *cmds) {
+    capture_frame(r, cmds);
+    update_textures(r);
+
+    if (!resize_framebuffer(r)) {
+        return;
+    }
+
+    DrawList *draws = context->draws;
+    draw_list_build(draws, context->text, r, cmds);
+    draw_list_cull(draws,
+                   VEC2(MAX(cmds->cull_min.x, -1.0f), MAX(cmds->cull_min.y, -1.0f)),
+                   VEC2(MIN(cmds->cull_max.x,  1.0f), MIN(cmds->cull_max.y,  1.0f)));
+    draw_list_sort(draws);
+
+    bin_entries(r, cmds);
+    draw_frame(r);
+
+    if (context->headless) {
+        write_readback(r);
+    } else {
+        present();
+    }
+
+    if (r->profile) {
+        FrameProfile *profile = r->profile;
+        profile->drawn_count = draws->visible_count;
+        profile->culled_count = draws->count - draws->visible_count;
+        profile->cpu_wait_ns = 0;
+        profile->gpu_available = false;
+
+        /* Drawn and presented by now, nothing is in flight */
+        const u64 latency = time_to_ns(platform.time_current()) - time_to_ns(r->frame_info->start_time);
+        profile->latency_ns = latency;
+        profile->latency_average_ns = (profile->latency_average_ns == 0) ? latency : (15*profile->latency_average_ns + latency)/16;
+    }
+}
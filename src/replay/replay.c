@@ -0,0 +1,385 @@
+/* external */
+#include <GLFW/glfw3.h>
+
+/* shared */
+#include <shared/types.h>
+#include <shared/api.h>
+#include <shared/render_capture.h>
+
+#include "../loader/platform/platform.h"
+
+/* libc */
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Replays a render capture written by the loader (--capture) through
+ * the renderer's begin_frame/end_frame in a tight loop, without the
+ * game or debug modules, and reports the time spent per frame.
+ * With --headless no window is created, so it also runs on machines
+ * without a display (e.g. on lavapipe). --soft replays through the
+ * software renderer instead of the Vulkan one.
+ *
+ * --compare replays every frame once through both renderers headless,
+ * with raw readback to <prefix>vulkan_<frame>.bgra and
+ * <prefix>soft_<frame>.bgra, and compares them pixel by pixel. Pixels
+ * with a channel more than the tolerance apart are counted, any of them
+ * fails the comparison. This is what keeps the software renderer a
+ * reference for the Vulkan one.
+ */
+
+#define REPLAY_COMPARE_TOLERANCE 2
+
+typedef void RendererStartupFunc(Renderer *);
+typedef void RendererShutdownFunc(Renderer *);
+typedef RenderCommands *RendererBeginFrameFunc(Renderer *);
+typedef void RendererEndFrameFunc(Renderer *, RenderCommands *);
+
+typedef struct CapturedFrame {
+    RenderCaptureFrame header;
+    u8 *commands;
+    u8 *textures;
+} CapturedFrame;
+
+typedef struct Replay {
+    RenderCaptureHeader *header;
+    Image font_atlas;
+    PackRect *font_map;
+    FontInfo *font_info;
+
+    CapturedFrame *frames;
+    u64 frame_count;
+} Replay;
+
+/* Replays every frame loops times through the renderer library at renderer_path, false if it doesn't load */
+static bool replay_run(Replay *replay, const char *renderer_path, RenderHeadless headless, u64 loops) {
+    void *renderer_handle = platformDynamicLibOpen(renderer_path);
+    if (!renderer_handle) {
+        return false;
+    }
+
+    RendererStartupFunc    *renderer_startup     = NULL;
+    RendererShutdownFunc   *renderer_shutdown    = NULL;
+    RendererBeginFrameFunc *renderer_begin_frame = NULL;
+    RendererEndFrameFunc   *renderer_end_frame   = NULL;
+    platformDynamicLibLookup((void **) &renderer_startup,     renderer_handle, "startup");
+    platformDynamicLibLookup((void **) &renderer_shutdown,    renderer_handle, "shutdown");
+    platformDynamicLibLookup((void **) &renderer_begin_frame, renderer_handle, "begin_frame");
+    platformDynamicLibLookup((void **) &renderer_end_frame,   renderer_handle, "end_frame");
+    if (!renderer_startup || !renderer_shutdown || !renderer_begin_frame || !renderer_end_frame) {
+        platformDynamicLibClose(renderer_handle);
+        return false;
+    }
+
+    PlatformFunctionTable platform_functions = {
+        .log = platformLog,
+
+        .allocate_memory = platformMemoryAllocate,
+        .free_memory = platformMemoryFree,
+
+        .file_open = platformFileOpen,
+        .file_close = platformFileClose,
+        .file_size = platformFileSize,
+        .read_file_to_buffer = platformFileReadToBuffer,
+        .file_write = platformFileWrite,
+        .file_read = platformFileRead,
+        .file_map = platformFileMap,
+        .file_unmap = platformFileUnmap,
+
+        .time_current = platformTimeCurrent,
+
+        .run_workers = platformWorkersRun,
+        .worker_count = platformWorkerCount,
+
+        .abort = platformAbort,
+    };
+
+    FrameInfo frame_info = {0};
+    RenderCaptureHeader *header = replay->header;
+    CapturedFrame *frames = replay->frames;
+
+    /* Textures are registered under their captured handles */
+    TextureRegistry *textures = platformMemoryAllocate(sizeof(TextureRegistry));
+    memset(textures, 0, sizeof(TextureRegistry));
+    if (TEXTURE_HANDLE_SLOT(header->font_atlas_texture) < MAX_TEXTURES) {
+        TextureSlot *slot = &textures->slots[TEXTURE_HANDLE_SLOT(header->font_atlas_texture)];
+        slot->image = replay->font_atlas;
+        slot->generation = TEXTURE_HANDLE_GENERATION(header->font_atlas_texture);
+        slot->state = TEXTURE_PENDING;
+    }
+
+    Renderer renderer = {
+        .platform = platform_functions,
+        .frame_info = &frame_info,
+        .textures = textures,
+        .font_atlas = &replay->font_atlas,
+        .font_atlas_texture = header->font_atlas_texture,
+        .font_size = header->font_size,
+        .font_atlas_size = header->font_atlas_size,
+        .font_sdf_spread = header->font_sdf_spread,
+        .font_map = replay->font_map,
+        .font_info = replay->font_info,
+        .headless = headless,
+    };
+
+    if (!headless.enabled) {
+        glfwInit();
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+        renderer.window = glfwCreateWindow(800, 600, "spel replay", 0, 0);
+    }
+
+    renderer_startup(&renderer);
+
+    /* Replay */
+    u64 min_ns = UINT64_MAX;
+    u64 max_ns = 0;
+    u64 total_ns = 0;
+    u64 total_frames = 0;
+    for (u64 loop = 0; loop < loops && (headless.enabled || !glfwWindowShouldClose(renderer.window)); ++loop) {
+        for (u64 i = 0; i < replay->frame_count; ++i) {
+            if (!headless.enabled) {
+                glfwPollEvents();
+            }
+
+            Time start = platformTimeCurrent();
+
+            render_capture_register_textures(textures, frames[i].textures, frames[i].header.texture_count);
+
+            RenderCommands *cmds = renderer_begin_frame(&renderer);
+            memcpy(cmds->memory_base, frames[i].commands, frames[i].header.commands_size);
+            cmds->memory_top = frames[i].header.commands_size;
+            renderer_end_frame(&renderer, cmds);
+
+            u64 ns = platformTimeToNanoseconds(platformTimeSubtract(platformTimeCurrent(), start));
+            min_ns = MIN(min_ns, ns);
+            max_ns = MAX(max_ns, ns);
+            total_ns += ns;
+            total_frames++;
+
+            frame_info.total_frame_count++;
+        }
+    }
+
+    if (total_frames > 0) {
+        platformLog(LOG_INFO, "%llu frames, avg %.3f ms, min %.3f ms, max %.3f ms",
+                    total_frames,
+                    (f64) total_ns/(f64) total_frames/1e6,
+                    (f64) min_ns/1e6,
+                    (f64) max_ns/1e6);
+    }
+
+    /* Writes the readbacks still in flight */
+    renderer_shutdown(&renderer);
+
+    if (!headless.enabled) {
+        glfwDestroyWindow(renderer.window);
+        glfwTerminate();
+    }
+
+    platformDynamicLibClose(renderer_handle);
+    platformMemoryFree(textures);
+
+    return true;
+}
+
+/* Compares the raw readbacks of frame_count frames, false if any pixel is more than tolerance apart */
+static bool replay_compare(const char *prefix_a, const char *prefix_b, u64 frame_count, u32 width, u32 height, u32 tolerance) {
+    const u64 size = (u64) width*height*4;
+    bool matches = true;
+    for (u64 i = 0; i < frame_count; ++i) {
+        sds path_a = sdscatprintf(sdsempty(), "%s%llu.bgra", prefix_a, (unsigned long long) i);
+        sds path_b = sdscatprintf(sdsempty(), "%s%llu.bgra", prefix_b, (unsigned long long) i);
+        u64 a_size = 0;
+        u64 b_size = 0;
+        const u8 *a = platformFileMap(path_a, &a_size);
+        const u8 *b = platformFileMap(path_b, &b_size);
+        if (!a || !b || a_size != size || b_size != size) {
+            platformLog(LOG_ERROR, "Compare: frame %llu, missing or wrongly sized readback (%s, %s)", (unsigned long long) i, path_a, path_b);
+            matches = false;
+        } else {
+            u64 differing = 0;
+            u32 max_difference = 0;
+            for (u64 p = 0; p < size; p += 4) {
+                u32 difference = 0;
+                for (u32 c = 0; c < 4; ++c) {
+                    const u32 d = (a[p + c] > b[p + c]) ? a[p + c] - b[p + c] : b[p + c] - a[p + c];
+                    difference = MAX(difference, d);
+                }
+                differing += (difference > tolerance);
+                max_difference = MAX(max_difference, difference);
+            }
+            platformLog((differing > 0) ? LOG_ERROR : LOG_INFO, "Compare: frame %llu, %llu of %llu pixels differ by more than %u, max difference %u",
+                        (unsigned long long) i, (unsigned long long) differing, (unsigned long long) (size/4), tolerance, max_difference);
+            matches = matches && (differing == 0);
+        }
+        if (a) {
+            platformFileUnmap((void *) a, a_size);
+        }
+        if (b) {
+            platformFileUnmap((void *) b, b_size);
+        }
+        sdsfree(path_a);
+        sdsfree(path_b);
+    }
+    return matches;
+}
+
+int main(int argc, char **argv) {
+    const char *capture_path = NULL;
+    u64 loops = 100;
+    RenderHeadless headless = {0};
+    bool soft = false;
+    const char *compare_prefix = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--headless") == 0 && i + 2 < argc) {
+            headless.enabled = true;
+            headless.width = strtoul(argv[i+1], NULL, 10);
+            headless.height = strtoul(argv[i+2], NULL, 10);
+            i += 2;
+        } else if (strcmp(argv[i], "--readback") == 0 && i + 2 < argc &&
+                   (strcmp(argv[i+1], "png") == 0 || strcmp(argv[i+1], "raw") == 0)) {
+            headless.readback_format = (strcmp(argv[i+1], "png") == 0) ? READBACK_PNG : READBACK_RAW;
+            headless.readback_prefix = argv[i+2];
+            i += 2;
+        } else if (strcmp(argv[i], "--soft") == 0) {
+            soft = true;
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            compare_prefix = argv[i+1];
+            i += 1;
+        } else if (argv[i][0] != '-' && !capture_path) {
+            capture_path = argv[i];
+        } else if (argv[i][0] != '-') {
+            loops = strtoull(argv[i], NULL, 10);
+        } else {
+            capture_path = NULL;
+            break;
+        }
+    }
+    if (!capture_path ||
+        (headless.enabled && (headless.width == 0 || headless.height == 0)) ||
+        (headless.readback_format != READBACK_NONE && !headless.enabled) ||
+        (compare_prefix && (!headless.enabled || headless.readback_format != READBACK_NONE || soft))) {
+        platformLog(LOG_ERROR, "usage: %s <capture file> [loops] [--soft] [--headless <width> <height> [--readback png|raw <prefix> | --compare <prefix>]]", argv[0]);
+        return 1;
+    }
+
+    /* Paths are relative to the build directory, like in the loader */
+    sds dir = sdsnew(argv[0]);
+    {
+        size_t i = sdslen(dir);
+        for (; i > 0; --i) {
+            if (dir[i] == '/') {
+                break;
+            }
+        }
+        dir[i] = 0;
+    }
+    sdsupdatelen(dir);
+    platformFileSetSearchDir(dir);
+
+    sds renderer_path = sdscat(sdsnew(dir), "/librenderer");
+    sds soft_renderer_path = sdscat(sdsnew(dir), "/librenderer_soft");
+
+    /* Load and index the capture */
+    u8 *capture = NULL;
+    u64 capture_size = 0;
+    platformFileReadToBuffer(capture_path, &capture, &capture_size);
+    if (!capture || capture_size < sizeof(RenderCaptureHeader)) {
+        platformLog(LOG_ERROR, "Failed to read capture %s", capture_path);
+        return 1;
+    }
+
+    RenderCaptureHeader *header = (RenderCaptureHeader *) capture;
+    if (header->magic != RENDER_CAPTURE_MAGIC || header->version != RENDER_CAPTURE_VERSION) {
+        platformLog(LOG_ERROR, "%s is not a version %u render capture", capture_path, RENDER_CAPTURE_VERSION);
+        return 1;
+    }
+
+    u8 *p = capture + sizeof(RenderCaptureHeader);
+
+    Image font_atlas = {
+        .pixels = p,
+        .width = header->font_atlas_width,
+        .height = header->font_atlas_height,
+        .channels = 1,
+        .is_linear = true,
+        .is_filtered = true,
+    };
+    p += font_atlas.width*font_atlas.height;
+    PackRect *font_map = (PackRect *) p;
+    p += header->num_chars*sizeof(PackRect);
+    FontInfo *font_info = (FontInfo *) p;
+    p += header->num_chars*sizeof(FontInfo);
+
+    u64 frame_count = 0;
+    for (u8 *q = p; q + sizeof(RenderCaptureFrame) <= capture + capture_size; ) {
+        RenderCaptureFrame *frame = (RenderCaptureFrame *) q;
+        q += sizeof(RenderCaptureFrame) + frame->commands_size + frame->textures_size;
+        frame_count++;
+    }
+    if (frame_count == 0) {
+        platformLog(LOG_ERROR, "%s contains no frames", capture_path);
+        return 1;
+    }
+
+    CapturedFrame *frames = platformMemoryAllocate(frame_count*sizeof(CapturedFrame));
+    for (u64 i = 0; i < frame_count; ++i) {
+        memcpy(&frames[i].header, p, sizeof(RenderCaptureFrame));
+        frames[i].commands = p + sizeof(RenderCaptureFrame);
+        frames[i].textures = frames[i].commands + frames[i].header.commands_size;
+        p = frames[i].textures + frames[i].header.textures_size;
+
+        if (frames[i].header.commands_size > RENDERER_MEMORY_SIZE ||
+            p > capture + capture_size ||
+            !render_capture_validate_commands(frames[i].commands, frames[i].header.commands_size) ||
+            !render_capture_validate_textures(frames[i].textures, frames[i].header.texture_count, frames[i].header.textures_size)) {
+            platformLog(LOG_ERROR, "Captured frame %llu is corrupt", frames[i].header.frame_index);
+            return 1;
+        }
+    }
+
+    Replay replay = {
+        .header = header,
+        .font_atlas = font_atlas,
+        .font_map = font_map,
+        .font_info = font_info,
+        .frames = frames,
+        .frame_count = frame_count,
+    };
+
+    /* The calling thread is the last worker */
+    platformWorkersStart(platformProcessorCount() - 1);
+
+    int result = 0;
+    if (compare_prefix) {
+        platformLog(LOG_INFO, "Comparing %llu frames (%llu-%llu) between the Vulkan and software renderers",
+                    frame_count, frames[0].header.frame_index, frames[frame_count-1].header.frame_index);
+
+        sds vulkan_prefix = sdscatprintf(sdsempty(), "%svulkan_", compare_prefix);
+        sds soft_prefix = sdscatprintf(sdsempty(), "%ssoft_", compare_prefix);
+        headless.readback_format = READBACK_RAW;
+        headless.readback_prefix = vulkan_prefix;
+        bool ran = replay_run(&replay, renderer_path, headless, 1);
+        headless.readback_prefix = soft_prefix;
+        ran = ran && replay_run(&replay, soft_renderer_path, headless, 1);
+        if (!ran || !replay_compare(vulkan_prefix, soft_prefix, frame_count, headless.width, headless.height, REPLAY_COMPARE_TOLERANCE)) {
+            result = 1;
+        }
+        sdsfree(vulkan_prefix);
+        sdsfree(soft_prefix);
+    } else {
+        platformLog(LOG_INFO, "Replaying %llu frames (%llu-%llu) %llu times",
+                    frame_count, frames[0].header.frame_index, frames[frame_count-1].header.frame_index, loops);
+        if (!replay_run(&replay, (soft) ? soft_renderer_path : renderer_path, headless, loops)) {
+            result = 1;
+        }
+    }
+
+    platformWorkersStop();
+
+    sdsfree(renderer_path);
+    sdsfree(soft_renderer_path);
+    sdsfree(dir);
+
+    return result;
+}